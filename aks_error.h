@@ -17,6 +17,8 @@
 #define AKS_ERROR_IO						(0xC0000004)
 #define AKS_ERROR_NOT_IMPLEMENTED			(0xC0000005)
 #define AKS_ERROR_FULL						(0xC0000006)
+#define AKS_ERROR_TIMEOUT					(0xC0000007)
+#define AKS_ERROR_CANCELED					(0xC0000008)
 
 #define AKS_ERROR_BT_INVALID_UUID			(0xC0010001)
 #define AKS_ERROR_BT_INCORRECT_PDU_SIZE		(0xC0010002)
@@ -27,6 +29,7 @@
 #define AKS_ERROR_BT_IMCOMPATIBLE_UUID		(0xC0010007)
 #define AKS_ERROR_BT_UNEXPECTED_RESPONSE	(0xC0010008)
 #define AKS_ERROR_BT_IMCOMPLETED_WRITE		(0xC0010009)
+#define AKS_ERROR_BT_INVALID_SIGNATURE		(0xC001000A)
 
 #define AKS_ERROR_BT_ATT_ERROR				(0xC0010100)
 
@@ -0,0 +1,156 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J btAdParse() が 1秒に解析できる Report の数を、よくある Advertising Data ごとに計る
+ *J
+ *J usage: ad_parse [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_ad.h"
+
+#define BENCH_DEFAULT_ITERATIONS					(1000000)
+
+struct BenchPayload
+{
+	const char    *name;
+	const uint8_t *data;
+	uint8_t        len;
+};
+
+//J Flags + Complete Local Name + 16bit UUID のリスト (Legacy の 31 バイトに収まる典型)
+static const uint8_t s_legacy[] = {
+	0x02, BtAdType::cFlags, 0x06,
+	0x09, BtAdType::cCompleteLocalName, 'S', 'e', 'n', 's', 'o', 'r', '-', '1',
+	0x05, BtAdType::cCompleteUuid16, 0x0F, 0x18, 0x0A, 0x18,
+	0x02, BtAdType::cTxPowerLevel, 0xF4,
+	0x03, BtAdType::cAppearance, 0x40, 0x03,
+};
+
+//J iBeacon (Manufacturer Specific Data)
+static const uint8_t s_ibeacon[] = {
+	0x02, BtAdType::cFlags, 0x06,
+	0x1A, BtAdType::cManufacturerSpecificData, 0x4C, 0x00, 0x02, 0x15,
+	0xE2, 0xC5, 0x6D, 0xB5, 0xDF, 0xFB, 0x48, 0xD2, 0xB0, 0x60, 0xD0, 0xF5, 0xA7, 0x10, 0x96, 0xE0,
+	0x00, 0x01, 0x00, 0x02, 0xC5,
+};
+
+//J Eddystone-URL (Service Data)
+static const uint8_t s_eddystone[] = {
+	0x02, BtAdType::cFlags, 0x06,
+	0x03, BtAdType::cCompleteUuid16, 0xAA, 0xFE,
+	0x0E, BtAdType::cServiceData16, 0xAA, 0xFE, 0x10, 0xF4, 0x03, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x07,
+};
+
+//J 途中で長さが壊れている (そこで止まるのを計る)
+static const uint8_t s_truncated[] = {
+	0x02, BtAdType::cFlags, 0x06,
+	0x09, BtAdType::cManufacturerSpecificData, 0x01,
+};
+
+static uint8_t s_extended[BT_AD_MAX_DATA_SIZE];
+
+
+/*---------------------------------------------------------------------------*/
+//J Extended Advertising の大きな Report (128bit UUID と名前と Manufacturer Data で埋める)
+/*---------------------------------------------------------------------------*/
+static uint8_t _bench_build_extended(uint8_t *buf, const size_t buf_size)
+{
+	size_t len = 0;
+	buf[len++] = 0x02;
+	buf[len++] = BtAdType::cFlags;
+	buf[len++] = 0x06;
+
+	buf[len++] = 1 + 16 * 3;
+	buf[len++] = BtAdType::cCompleteUuid128;
+	for (int i=0 ; i<16 * 3 ; ++i) {
+		buf[len++] = (uint8_t)i;
+	}
+
+	const char *name = "Extended advertising sensor";
+	buf[len++] = (uint8_t)(1 + strlen(name));
+	buf[len++] = BtAdType::cCompleteLocalName;
+	memcpy(&buf[len], name, strlen(name));
+	len += strlen(name);
+
+	//J 残りは Manufacturer Specific Data
+	size_t rest = buf_size - len - 2;
+	buf[len++] = (uint8_t)(1 + rest);
+	buf[len++] = BtAdType::cManufacturerSpecificData;
+	for (size_t i=0 ; i<rest ; ++i) {
+		buf[len++] = (uint8_t)i;
+	}
+
+	return (uint8_t)len;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J payloads を iterations 回解析して reports/s を返す
+/*---------------------------------------------------------------------------*/
+static double _bench_parse_rate(const BenchPayload *payloads, const size_t num_payloads, const uint32_t iterations)
+{
+	//J 最適化で消されないよう結果を畳み込む
+	volatile uint32_t sink = 0;
+	BtAdSummary summary;
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	for (uint32_t i=0 ; i<iterations ; ++i) {
+		for (size_t j=0 ; j<num_payloads ; ++j) {
+			(void)btAdParse(payloads[j].data, payloads[j].len, &summary);
+			sink += summary.present + summary.name_len;
+		}
+	}
+	uint64_t elapsed_ns = btUtilGetMonotonicTimeNs() - start_ns;
+	(void)sink;
+
+	if (elapsed_ns == 0) {
+		elapsed_ns = 1;
+	}
+	return (double)num_payloads * iterations * 1e9 / (double)elapsed_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	uint32_t iterations = BENCH_DEFAULT_ITERATIONS;
+	if (argc > 1) {
+		iterations = (uint32_t)atoi(argv[1]);
+	}
+	if (iterations == 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	BenchPayload payloads[] = {
+		{ "legacy",		s_legacy,		sizeof(s_legacy) },
+		{ "ibeacon",	s_ibeacon,		sizeof(s_ibeacon) },
+		{ "eddystone",	s_eddystone,	sizeof(s_eddystone) },
+		{ "truncated",	s_truncated,	sizeof(s_truncated) },
+		{ "extended",	s_extended,		0 },
+	};
+	const size_t num_payloads = sizeof(payloads) / sizeof(payloads[0]);
+	payloads[num_payloads - 1].len = _bench_build_extended(s_extended, sizeof(s_extended));
+
+	printf("%-12s %6s %14s\n", "payload", "bytes", "reports/s");
+	for (size_t i=0 ; i<num_payloads ; ++i) {
+		printf("%-12s %6u %14.0f\n", payloads[i].name, payloads[i].len, _bench_parse_rate(&payloads[i], 1, iterations));
+	}
+	printf("%-12s %6s %14.0f\n", "mixed", "-", _bench_parse_rate(payloads, num_payloads, iterations / num_payloads + 1));
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J ATT の署名が 1秒にいくつ作れるかを、使える Backend (Portable / AES-NI / ARMv8) ごとに計る
+ *J
+ *J - sign: 前もって btCryptoSignKeyInit() した鍵で btCryptoSignAtt() する (Value の長さごと)
+ *J - pdu+key: btAttBuildPduSignedWriteCommand() のように、毎回 CSRK から鍵を作って署名する
+ *J
+ *J usage: crypto_sign [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_crypto.h"
+
+#define BENCH_DEFAULT_ITERATIONS					(200000)
+#define BENCH_HANDLE								(0x002A)
+
+static const size_t s_value_sizes[] = { 4, 20, 64, 244, 509 };
+
+
+/*---------------------------------------------------------------------------*/
+static double _bench_rate(const uint32_t iterations, const uint64_t start_ns)
+{
+	uint64_t elapsed_ns = btUtilGetMonotonicTimeNs() - start_ns;
+	if (elapsed_ns == 0) {
+		elapsed_ns = 1;
+	}
+	return (double)iterations * 1e9 / (double)elapsed_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Signed Write Command と同じ Opcode + Handle + Value に署名する
+/*---------------------------------------------------------------------------*/
+static double _bench_sign(const struct bt_crypto *crypto, const BtCryptoCmacKey *key, const size_t value_size, const uint32_t iterations)
+{
+	uint8_t data[BT_CRYPTO_MAX_SIGN_MESSAGE];
+	size_t size = 3 + value_size;
+	for (size_t i=0 ; i<size ; ++i) {
+		data[i] = (uint8_t)i;
+	}
+
+	//J 最適化で消されないよう結果を畳み込む
+	volatile uint8_t sink = 0;
+	uint8_t signature[BT_CRYPTO_SIGNATURE_SIZE];
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	for (uint32_t i=0 ; i<iterations ; ++i) {
+		(void)btCryptoSignAtt(crypto, key, data, size, i, signature);
+		sink ^= signature[BT_CRYPTO_SIGNATURE_SIZE - 1];
+	}
+	(void)sink;
+
+	return _bench_rate(iterations, start_ns);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static double _bench_pdu(const struct bt_crypto *crypto, const uint8_t csrk[BT_CRYPTO_KEY_SIZE], const uint32_t iterations)
+{
+	uint8_t value[20];
+	memset(value, 0x5A, sizeof(value));
+
+	volatile uint8_t sink = 0;
+	uint8_t pdu[64];
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	for (uint32_t i=0 ; i<iterations ; ++i) {
+		int len = btAttBuildPduSignedWriteCommand(pdu, sizeof(pdu), BENCH_HANDLE, sizeof(value), value, crypto, csrk, i);
+		sink ^= pdu[len - 1];
+	}
+	(void)sink;
+
+	return _bench_rate(iterations, start_ns);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	uint32_t iterations = BENCH_DEFAULT_ITERATIONS;
+	if (argc > 1) {
+		iterations = (uint32_t)atoi(argv[1]);
+	}
+	if (iterations == 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	static const uint8_t backends[] = {
+		BtCryptoBackend::cPortable,
+		BtCryptoBackend::cAesNi,
+		BtCryptoBackend::cArmv8,
+	};
+	const uint8_t csrk[BT_CRYPTO_KEY_SIZE] = {
+		0x3c, 0x4f, 0xcf, 0x09, 0x88, 0x15, 0xf7, 0xab, 0xa6, 0xd2, 0xae, 0x28, 0x16, 0x15, 0x7e, 0x2b,
+	};
+
+	printf("%-10s %-10s %8s %14s\n", "backend", "mode", "value", "signatures/s");
+	for (size_t b=0 ; b<sizeof(backends) / sizeof(backends[0]) ; ++b) {
+		struct bt_crypto crypto;
+		if (btCryptoInitWithBackend(&crypto, backends[b]) != AKS_OK) {
+			printf("%-10s (not supported)\n", btCryptoBackendToString(backends[b]));
+			continue;
+		}
+
+		BtCryptoCmacKey key;
+		(void)btCryptoSignKeyInit(&crypto, csrk, &key);
+		for (size_t i=0 ; i<sizeof(s_value_sizes) / sizeof(s_value_sizes[0]) ; ++i) {
+			printf("%-10s %-10s %8zu %14.0f\n",
+					btCryptoBackendToString(backends[b]), "sign", s_value_sizes[i],
+					_bench_sign(&crypto, &key, s_value_sizes[i], iterations));
+		}
+		printf("%-10s %-10s %8u %14.0f\n",
+				btCryptoBackendToString(backends[b]), "pdu+key", 20,
+				_bench_pdu(&crypto, csrk, iterations));
+	}
+
+	return 0;
+}
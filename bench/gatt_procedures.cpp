@@ -0,0 +1,296 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_gatt の各 Procedure を bt_le_emulator に対して実行し、
+ *J Procedure ごとに往復回数、経過時間、Goodput を表示する
+ *J
+ *J Connection Interval (7.5 / 30 / 50 ms) と ATT_MTU (23 / 247 / 512) の組み合わせを順に試す。
+ *J
+ *J usage: gatt_procedures [iterations] [packets_per_event]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+
+#define BENCH_DEFAULT_ITERATIONS					(3)
+#define BENCH_DEFAULT_PACKETS_PER_EVENT				(4)
+#define BENCH_PREPARE_QUEUE_SIZE					(BT_LE_EMULATOR_MAX_PREPARE_QUEUE)	//J MTU 23 でも 512 バイトの Write Long が収まる
+#define BENCH_SMALL_SIZE							(20)
+#define BENCH_LONG_SIZE								(BT_LE_EMULATOR_MAX_VALUE_SIZE)
+#define BENCH_RELIABLE_SIZE							(200)
+#define BENCH_MAX_SERVICES							(8)
+#define BENCH_MAX_CHARACTERISTICS					(8)
+
+struct BenchTarget
+{
+	BtLeEmulatorContext emu;
+	BtGattDeviceContext dev;
+
+	BtAttHandle small;
+	BtAttHandle large;
+	BtAttHandle reliable[2];
+};
+
+typedef int (*BenchProcedureFunc)(BenchTarget *target, size_t &payload);
+
+struct BenchProcedure
+{
+	const char        *name;
+	BenchProcedureFunc func;
+};
+
+static uint8_t s_value[BENCH_LONG_SIZE];
+static uint8_t s_buf[BENCH_LONG_SIZE];
+
+
+/*---------------------------------------------------------------------------*/
+//J Primary Service を全て見つけ、それぞれの Characteristic を全て見つける
+/*---------------------------------------------------------------------------*/
+static int _bench_discovery(BenchTarget *target, size_t &payload)
+{
+	BtAttHandleRangeUuid16Pair services[BENCH_MAX_SERVICES];
+	uint32_t num_services = 0;
+	int ret = BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
+								target->dev, services, BENCH_MAX_SERVICES, num_services);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	if (num_services > BENCH_MAX_SERVICES) {
+		num_services = BENCH_MAX_SERVICES;
+	}
+
+	for (uint32_t i=0 ; i<num_services ; ++i) {
+		BtGattCharacteristic chars[BENCH_MAX_CHARACTERISTICS];
+		uint32_t num_chars = 0;
+		ret = BtGattCharacteristicDiscovery::btGattDiscoverAllCharactaristicOfAService(
+								target->dev, services[i].handles, chars, BENCH_MAX_CHARACTERISTICS, num_chars);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	payload = 0;
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_read(BenchTarget *target, size_t &payload)
+{
+	return BtGattCharacteristicValueRead::btGattReadCharacteristicValue(
+								target->dev, target->small, s_buf, sizeof(s_buf), payload);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_read_long(BenchTarget *target, size_t &payload)
+{
+	return BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues(
+								target->dev, target->large, s_buf, sizeof(s_buf), payload);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_write(BenchTarget *target, size_t &payload)
+{
+	payload = BENCH_SMALL_SIZE;
+	return BtGattCharacteristicValueWrite::btGattWriteCharacteristicValue(
+								target->dev, target->small, s_value, BENCH_SMALL_SIZE);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_write_long(BenchTarget *target, size_t &payload)
+{
+	payload = BENCH_LONG_SIZE;
+	return BtGattCharacteristicValueWrite::btGattWriteLongCharacteristicValues(
+								target->dev, target->large, s_value, BENCH_LONG_SIZE);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_reliable_writes(BenchTarget *target, size_t &payload)
+{
+	BtGattHandleValueSet set[2];
+	for (int i=0 ; i<2 ; ++i) {
+		set[i].handle = target->reliable[i];
+		set[i].value  = s_value;
+		set[i].size   = BENCH_RELIABLE_SIZE;
+	}
+
+	payload = BENCH_RELIABLE_SIZE * 2;
+	return BtGattCharacteristicValueWrite::btGattWriteCharacteristicValueReliableWrites(
+								target->dev, set, 2);
+}
+
+
+static const BenchProcedure s_procedures[] = {
+	{ "discovery",			_bench_discovery },
+	{ "read",				_bench_read },
+	{ "read-long",			_bench_read_long },
+	{ "write",				_bench_write },
+	{ "write-long",			_bench_write_long },
+	{ "reliable-writes",	_bench_reliable_writes },
+};
+
+
+/*---------------------------------------------------------------------------*/
+//J 属性テーブルを作ってエミュレータを動かし、Central 側の ctx を繋ぐ
+/*---------------------------------------------------------------------------*/
+static int _bench_open(BenchTarget *target, const BtLeEmulatorLinkParameters *link)
+{
+	int ret = btLeEmulatorCreate(&target->emu, link);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	const uint8_t rw = BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cWrite;
+	BtAttHandle service;
+	BtAttHandle handle;
+	(void)btLeEmulatorAddPrimaryService(&target->emu, 0x1800, service);
+	(void)btLeEmulatorAddCharacteristic(&target->emu, 0x2A00, rw, s_value, BENCH_SMALL_SIZE, target->small);
+	(void)btLeEmulatorAddCharacteristic(&target->emu, 0x2A01, BtAttCharacteristicProperties::cRead, s_value, 2, handle);
+	(void)btLeEmulatorAddPrimaryService(&target->emu, 0x180A, service);
+	(void)btLeEmulatorAddCharacteristic(&target->emu, 0x2A29, rw, s_value, BENCH_LONG_SIZE, target->large);
+	(void)btLeEmulatorAddPrimaryService(&target->emu, 0x180F, service);
+	(void)btLeEmulatorAddCharacteristic(&target->emu, 0x2A19, BtAttCharacteristicProperties::cRead, s_value, 1, handle);
+	(void)btLeEmulatorAddPrimaryService(&target->emu, 0xFFF0, service);
+	(void)btLeEmulatorAddCharacteristic(&target->emu, 0xFFF1, rw, s_value, BENCH_RELIABLE_SIZE, target->reliable[0]);
+	ret = btLeEmulatorAddCharacteristic(&target->emu, 0xFFF2, rw, s_value, BENCH_RELIABLE_SIZE, target->reliable[1]);
+	if (ret == AKS_OK) {
+		ret = btLeEmulatorStart(&target->emu);
+	}
+	if (ret != AKS_OK) {
+		(void)btLeEmulatorDestroy(&target->emu);
+		return ret;
+	}
+
+	BtLeDeviceOptions options;
+	(void)btLeDeviceInitOptions(&options);
+	options.mtu             = (link->mtu > BT_ATT_MIN_LE_MTU) ? link->mtu : 0;
+	options.client_features = 0;
+	ret = btLeDeviceCreateWithSocket(&target->dev, btLeEmulatorGetCentralSocket(&target->emu), &options);
+	if (ret != AKS_OK) {
+		(void)btLeEmulatorDestroy(&target->emu);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_close(BenchTarget *target)
+{
+	int ret = btLeDeviceDestroy(&target->dev);
+	(void)btLeEmulatorDestroy(&target->emu);
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _bench_run(BenchTarget *target, const BenchProcedure *procedure, const uint32_t iterations)
+{
+	BtLeDeviceStatistics before;
+	BtLeDeviceStatistics after;
+	(void)btLeDeviceGetStatistics(&target->dev, &before);
+
+	size_t total = 0;
+	int ret = AKS_OK;
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	for (uint32_t i=0 ; (i<iterations) && (ret == AKS_OK) ; ++i) {
+		size_t payload = 0;
+		ret = procedure->func(target, payload);
+		total += payload;
+	}
+	uint64_t elapsed_ns = btUtilGetMonotonicTimeNs() - start_ns;
+	(void)btLeDeviceGetStatistics(&target->dev, &after);
+
+	if (ret != AKS_OK) {
+		printf("  %-16s failed (0x%08x)\n", procedure->name, (unsigned int)ret);
+		return;
+	}
+
+	double round_trips = (double)(after.round_trips - before.round_trips) / iterations;
+	double wall_ms     = (double)elapsed_ns / 1e6 / iterations;
+	if (total == 0) {
+		printf("  %-16s %11.1f %11.2f %13s\n", procedure->name, round_trips, wall_ms, "-");
+	}
+	else {
+		printf("  %-16s %11.1f %11.2f %13.0f\n", procedure->name, round_trips, wall_ms, (double)total * 1e9 / (double)elapsed_ns);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	uint32_t iterations = BENCH_DEFAULT_ITERATIONS;
+	uint16_t packets_per_event = BENCH_DEFAULT_PACKETS_PER_EVENT;
+	if (argc > 1) {
+		iterations = (uint32_t)atoi(argv[1]);
+	}
+	if (argc > 2) {
+		packets_per_event = (uint16_t)atoi(argv[2]);
+	}
+	if ((iterations == 0) || (packets_per_event == 0)) {
+		fprintf(stderr, "usage: %s [iterations] [packets_per_event]\n", argv[0]);
+		return 1;
+	}
+
+	for (size_t i=0 ; i<sizeof(s_value) ; ++i) {
+		s_value[i] = (uint8_t)i;
+	}
+
+	static const uint32_t intervals_us[] = { 7500, 30000, 50000 };
+	static const uint16_t mtus[] = { BT_ATT_MIN_LE_MTU, 247, BT_ATT_MAX_LE_MTU };
+	static BenchTarget target;
+
+	int result = 0;
+	for (size_t i=0 ; i<sizeof(intervals_us) / sizeof(intervals_us[0]) ; ++i) {
+		for (size_t j=0 ; j<sizeof(mtus) / sizeof(mtus[0]) ; ++j) {
+			BtLeEmulatorLinkParameters link;
+			link.connection_interval_us = intervals_us[i];
+			link.packets_per_event      = packets_per_event;
+			link.ll_payload_size        = (mtus[j] > BT_ATT_MIN_LE_MTU) ? BT_LE_EMULATOR_LL_PAYLOAD_DLE : BT_LE_EMULATOR_LL_PAYLOAD_DEFAULT;
+			link.mtu                    = mtus[j];
+			link.prepare_queue_size     = BENCH_PREPARE_QUEUE_SIZE;
+
+			printf("interval %.1f ms, %u packets/event, LL payload %u, MTU %u\n",
+					intervals_us[i] / 1000.0, packets_per_event, link.ll_payload_size, link.mtu);
+
+			memset(&target, 0x00, sizeof(target));
+			int ret = _bench_open(&target, &link);
+			if (ret != AKS_OK) {
+				printf("  open failed (0x%08x)\n", (unsigned int)ret);
+				result = 1;
+				continue;
+			}
+
+			printf("  %-16s %11s %11s %13s\n", "procedure", "round trips", "wall ms", "goodput B/s");
+			for (size_t k=0 ; k<sizeof(s_procedures) / sizeof(s_procedures[0]) ; ++k) {
+				_bench_run(&target, &s_procedures[k], iterations);
+			}
+
+			ret = _bench_close(&target);
+			if (ret != AKS_OK) {
+				printf("  close failed (0x%08x)\n", (unsigned int)ret);
+				result = 1;
+			}
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,248 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J N 台の bt_le_emulator から一定レートで Notification を受け、
+ *J 台数ごとに Notification の遅延 (p50 / p99 / p99.9)、取りこぼし、CPU 使用率、RSS を表示する
+ *J
+ *J 遅延は Emulator が Notification の先頭に埋めた BtLeEmulatorNotificationStamp から
+ *J Callback が呼ばれるまでの時間。N は 10, 50, 100, 200, 500, 1000 を max_devices まで順に試す。
+ *J 1台につき受信スレッドと Emulator のスレッドが1つずつ要るので、ulimit -u に気を付ける。
+ *J
+ *J usage: load_sweep [max_devices] [rate_hz] [value_size] [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+
+#define BENCH_MAX_DEVICES							(1000)
+#define BENCH_DEFAULT_RATE_HZ						(100)
+#define BENCH_DEFAULT_VALUE_SIZE					(20)
+#define BENCH_DEFAULT_SECONDS						(2)
+#define BENCH_MTU									(247)
+#define BENCH_MAX_VALUE_SIZE						(BENCH_MTU - 3)		//J Handle Value Notification 1つに収まる大きさ
+#define BENCH_WARMUP_US								(500 * 1000)
+
+struct BenchTarget
+{
+	BtLeEmulatorContext emu;
+	BtGattDeviceContext dev;
+	BtAttHandle         handle;
+};
+
+static BenchTarget     s_targets[BENCH_MAX_DEVICES];
+static BtUtilHistogram s_histogram;
+static volatile bool   s_recording;
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_notification(void *arg, BtAttHandle handle, uint8_t *value, size_t len)
+{
+	(void)arg;
+	(void)handle;
+
+	if (!s_recording || (len < sizeof(BtLeEmulatorNotificationStamp))) {
+		return AKS_OK;
+	}
+
+	BtLeEmulatorNotificationStamp stamp;
+	memcpy(&stamp, value, sizeof(stamp));
+	uint64_t now_ns = btUtilGetMonotonicTimeNs();
+	(void)btUtilHistogramRecord(&s_histogram, (now_ns > stamp.timestamp_ns) ? (now_ns - stamp.timestamp_ns) : 0);
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_open(BenchTarget *target, const BtLeEmulatorLinkParameters *link)
+{
+	int ret = btLeEmulatorCreate(&target->emu, link);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	BtAttHandle service;
+	(void)btLeEmulatorAddPrimaryService(&target->emu, 0x180D, service);
+	ret = btLeEmulatorAddCharacteristic(&target->emu, 0x2A37, BtAttCharacteristicProperties::cNotify, NULL, 0, target->handle);
+	if (ret == AKS_OK) {
+		ret = btLeEmulatorStart(&target->emu);
+	}
+	if (ret != AKS_OK) {
+		(void)btLeEmulatorDestroy(&target->emu);
+		return ret;
+	}
+
+	ret = btLeDeviceCreateWithSocket(&target->dev, btLeEmulatorGetCentralSocket(&target->emu), NULL);
+	if (ret != AKS_OK) {
+		(void)btLeEmulatorDestroy(&target->emu);
+		return ret;
+	}
+
+	//J CCCD は Characteristic Value の次の Handle
+	ret = btLeDeviceRegistNotificationCallbackWithArg(&target->dev, target->handle + 1, target->handle, _bench_notification, target);
+	if (ret != AKS_OK) {
+		(void)btLeDeviceDestroy(&target->dev);
+		(void)btLeEmulatorDestroy(&target->emu);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_close(BenchTarget *target)
+{
+	(void)btLeEmulatorStopNotification(&target->emu);
+	int ret = btLeDeviceDestroy(&target->dev);
+	(void)btLeEmulatorDestroy(&target->emu);
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bench_run(const uint32_t num_devices, const uint32_t rate_hz, const uint16_t value_size, const uint32_t seconds)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 4;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = BENCH_MTU;
+	link.prepare_queue_size     = 0;
+
+	s_recording = false;
+	uint32_t opened = 0;
+	int ret = AKS_OK;
+	for ( ; opened<num_devices ; ++opened) {
+		memset(&s_targets[opened], 0x00, sizeof(s_targets[opened]));
+		ret = _bench_open(&s_targets[opened], &link);
+		if (ret != AKS_OK) {
+			break;
+		}
+	}
+
+	if (ret == AKS_OK) {
+		for (uint32_t i=0 ; (i<opened) && (ret == AKS_OK) ; ++i) {
+			ret = btLeEmulatorStartNotification(&s_targets[i].emu, s_targets[i].handle, rate_hz, value_size);
+		}
+	}
+
+	if (ret != AKS_OK) {
+		printf("%8u  failed after %u devices (0x%08x)\n", num_devices, opened, (unsigned int)ret);
+	}
+	else {
+		usleep(BENCH_WARMUP_US);
+
+		BtLeDeviceStatistics stats;
+		uint64_t notifications = 0;
+		uint64_t dropped_pdus  = 0;
+		uint64_t emu_dropped   = 0;
+		for (uint32_t i=0 ; i<opened ; ++i) {
+			(void)btLeDeviceGetStatistics(&s_targets[i].dev, &stats);
+			notifications -= stats.notifications;
+			dropped_pdus  -= stats.dropped_pdus;
+			emu_dropped   -= s_targets[i].emu.num_notifications_dropped;
+		}
+
+		BtUtilProcessUsage begin;
+		BtUtilProcessUsage end;
+		(void)btUtilHistogramReset(&s_histogram);
+		(void)btUtilGetProcessUsage(&begin);
+		s_recording = true;
+		sleep(seconds);
+		s_recording = false;
+		(void)btUtilGetProcessUsage(&end);
+
+		for (uint32_t i=0 ; i<opened ; ++i) {
+			(void)btLeDeviceGetStatistics(&s_targets[i].dev, &stats);
+			notifications += stats.notifications;
+			dropped_pdus  += stats.dropped_pdus;
+			emu_dropped   += s_targets[i].emu.num_notifications_dropped;
+		}
+
+		printf("%8u %10llu %10llu %8llu %8llu %9.1f %9.1f %9.1f %7.1f %9llu\n",
+				num_devices,
+				(unsigned long long)((uint64_t)num_devices * rate_hz * seconds),
+				(unsigned long long)notifications,
+				(unsigned long long)dropped_pdus,
+				(unsigned long long)emu_dropped,
+				btUtilHistogramPercentile(&s_histogram, 50.0) / 1000.0,
+				btUtilHistogramPercentile(&s_histogram, 99.0) / 1000.0,
+				btUtilHistogramPercentile(&s_histogram, 99.9) / 1000.0,
+				btUtilProcessCpuPercent(&begin, &end),
+				(unsigned long long)(end.rss_bytes / 1024));
+	}
+
+	for (uint32_t i=0 ; i<opened ; ++i) {
+		int close_ret = _bench_close(&s_targets[i]);
+		if (close_ret != AKS_OK) {
+			printf("%8u  close failed at %u (0x%08x)\n", num_devices, i, (unsigned int)close_ret);
+			if (ret == AKS_OK) {
+				ret = close_ret;
+			}
+		}
+	}
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	uint32_t max_devices = BENCH_MAX_DEVICES;
+	uint32_t rate_hz     = BENCH_DEFAULT_RATE_HZ;
+	uint32_t value_size  = BENCH_DEFAULT_VALUE_SIZE;
+	uint32_t seconds     = BENCH_DEFAULT_SECONDS;
+	if (argc > 1) {
+		max_devices = (uint32_t)atoi(argv[1]);
+	}
+	if (argc > 2) {
+		rate_hz = (uint32_t)atoi(argv[2]);
+	}
+	if (argc > 3) {
+		value_size = (uint32_t)atoi(argv[3]);
+	}
+	if (argc > 4) {
+		seconds = (uint32_t)atoi(argv[4]);
+	}
+	if ((max_devices == 0) || (max_devices > BENCH_MAX_DEVICES) || (rate_hz == 0) || (seconds == 0) ||
+		(value_size < sizeof(BtLeEmulatorNotificationStamp)) || (value_size > BENCH_MAX_VALUE_SIZE)) {
+		fprintf(stderr, "usage: %s [max_devices (<= %u)] [rate_hz] [value_size (%u - %u)] [seconds]\n",
+				argv[0], BENCH_MAX_DEVICES, (unsigned int)sizeof(BtLeEmulatorNotificationStamp), BENCH_MAX_VALUE_SIZE);
+		return 1;
+	}
+
+	printf("%u Hz, %u bytes, %u s per step\n", rate_hz, value_size, seconds);
+	printf("%8s %10s %10s %8s %8s %9s %9s %9s %7s %9s\n",
+			"devices", "expected", "delivered", "dev drop", "emu drop", "p50 us", "p99 us", "p99.9 us", "cpu %", "rss kB");
+
+	static const uint32_t steps[] = { 10, 50, 100, 200, 500, 1000 };
+	int result = 0;
+	for (size_t i=0 ; i<sizeof(steps) / sizeof(steps[0]) ; ++i) {
+		uint32_t num_devices = steps[i];
+		if (num_devices > max_devices) {
+			num_devices = max_devices;
+		}
+		if (_bench_run(num_devices, rate_hz, (uint16_t)value_size, seconds) != AKS_OK) {
+			result = 1;
+		}
+		if (num_devices == max_devices) {
+			break;
+		}
+	}
+
+	return result;
+}
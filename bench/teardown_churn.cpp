@@ -0,0 +1,137 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J btLeDeviceCreateWithSocket() / btLeDeviceDestroy() を同じ BtGattDeviceContext で
+ *J 繰り返し、1秒あたりの回数と、その間の RSS、スレッド数、fd の数の推移を表示する
+ *J
+ *J 相手は socketpair() の反対側で、Exchange MTU などの往復はしない。
+ *J 受信スレッドの join や fd の close が漏れていれば、スレッド数か fd の数が
+ *J 始めと合わなくなり、終了コードが 1 になる。RSS は最初の表示 (cycles の 1/10 を
+ *J 回した後) を基準にし、最後に BENCH_RSS_LIMIT_KB より増えていても 1 になる。
+ *J
+ *J usage: teardown_churn [cycles]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/socket.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+
+#define BENCH_DEFAULT_CYCLES						(100000)
+#define BENCH_SAMPLES								(10)		//J RSS を表示する回数
+#define BENCH_RSS_LIMIT_KB							(256)		//J 最初の表示から最後までに増えてよい RSS
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _bench_count_dir(const char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return 0;
+	}
+
+	uint32_t count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			count++;
+		}
+	}
+	closedir(dir);
+
+	//J opendir() の分を除く
+	return (strcmp(path, "/proc/self/fd") == 0) ? count - 1 : count;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	uint32_t cycles = BENCH_DEFAULT_CYCLES;
+	if (argc > 1) {
+		cycles = (uint32_t)atoi(argv[1]);
+	}
+	if (cycles < BENCH_SAMPLES) {
+		fprintf(stderr, "usage: %s [cycles (>= %u)]\n", argv[0], BENCH_SAMPLES);
+		return 1;
+	}
+
+	BtLeDeviceOptions options;
+	(void)btLeDeviceInitOptions(&options);
+	options.mtu             = 0;
+	options.client_features = 0;
+
+	static BtGattDeviceContext ctx;
+	uint32_t threads_before = _bench_count_dir("/proc/self/task");
+	uint32_t fds_before     = _bench_count_dir("/proc/self/fd");
+
+	printf("%10s %12s %10s\n", "cycles", "cycles/s", "rss kB");
+
+	BtUtilProcessUsage usage;
+	uint64_t start_ns  = btUtilGetMonotonicTimeNs();
+	uint64_t sample_ns = start_ns;
+	uint32_t sample_cycles = 0;
+	uint64_t rss_warm_kb = 0;			//J 最初の表示の RSS (malloc のアリーナなどが落ち着いた後)
+	uint64_t rss_kb = 0;
+	for (uint32_t i=1 ; i<=cycles ; ++i) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+
+		int ret = btLeDeviceCreateWithSocket(&ctx, fds[0], &options);
+		if (ret != AKS_OK) {
+			printf("create failed at %u (0x%08x)\n", i, (unsigned int)ret);
+			return 1;
+		}
+		ret = btLeDeviceDestroy(&ctx);
+		if (ret != AKS_OK) {
+			printf("destroy failed at %u (0x%08x)\n", i, (unsigned int)ret);
+			return 1;
+		}
+		close(fds[1]);
+
+		if ((i % (cycles / BENCH_SAMPLES)) == 0) {
+			uint64_t now_ns = btUtilGetMonotonicTimeNs();
+			(void)btUtilGetProcessUsage(&usage);
+			rss_kb = usage.rss_bytes / 1024;
+			if (sample_cycles == 0) {
+				rss_warm_kb = rss_kb;
+			}
+			printf("%10u %12.0f %10llu\n",
+					i,
+					(double)(i - sample_cycles) * 1e9 / (double)(now_ns - sample_ns),
+					(unsigned long long)rss_kb);
+			sample_ns     = now_ns;
+			sample_cycles = i;
+		}
+	}
+	uint64_t elapsed_ns = btUtilGetMonotonicTimeNs() - start_ns;
+
+	uint32_t threads_after = _bench_count_dir("/proc/self/task");
+	uint32_t fds_after     = _bench_count_dir("/proc/self/fd");
+	int64_t rss_delta_kb = (int64_t)rss_kb - (int64_t)rss_warm_kb;
+	printf("%u cycles in %.2f s (%.0f cycles/s), threads %u -> %u, fds %u -> %u, rss %+lld kB (limit %d kB)\n",
+			cycles,
+			(double)elapsed_ns / 1e9,
+			(double)cycles * 1e9 / (double)elapsed_ns,
+			threads_before, threads_after,
+			fds_before, fds_after,
+			(long long)rss_delta_kb, BENCH_RSS_LIMIT_KB);
+
+	return ((threads_after == threads_before) && (fds_after == fds_before) && (rss_delta_kb <= BENCH_RSS_LIMIT_KB)) ? 0 : 1;
+}
@@ -0,0 +1,405 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_ad.h"
+
+
+//J Bluetooth Base UUID (00000000-0000-1000-8000-00805F9B34FB) を LE のバイト順で
+static const uint8_t s_base_uuid[16] = {
+	0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80,
+	0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+
+/*---------------------------------------------------------------------------*/
+static uint16_t _ad_le16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 16/32/128bit の UUID を BtUuid にする (32bit は Base UUID で 128bit に広げる)
+/*---------------------------------------------------------------------------*/
+static void _ad_uuid(const uint8_t *p, size_t size, BtUuid &uuid)
+{
+	memset(&uuid, 0, sizeof(uuid));
+	if (size == 2) {
+		uuid.format       = BtUuid::cBtUuid16;
+		uuid.value.uuid16 = _ad_le16(p);
+	}
+	else {
+		uuid.format = BtUuid::cBtUuid128;
+		if (size == 4) {
+			memcpy(uuid.value.uuid128.data, s_base_uuid, sizeof(s_base_uuid));
+			memcpy(&uuid.value.uuid128.data[12], p, 4);
+		}
+		else {
+			memcpy(uuid.value.uuid128.data, p, 16);
+		}
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdIteratorInit(BtAdIterator *it, const uint8_t *data, const size_t len)
+{
+	if (it == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((data == NULL) && (len != 0)) {
+		return AKS_ERROR_NULL;
+	}
+
+	it->p     = data;
+	it->end   = data + len;
+	it->error = false;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 次の AD Structure を返す。終わりか壊れていれば false (壊れていれば it->error)
+/*---------------------------------------------------------------------------*/
+bool btAdIteratorNext(BtAdIterator *it, BtAdStructure *ad)
+{
+	if ((it == NULL) || (ad == NULL) || (it->p == NULL)) {
+		return false;
+	}
+
+	if (it->p >= it->end) {
+		return false;
+	}
+
+	//J Length 0 は残りが詰め物であることを表す
+	uint8_t length = it->p[0];
+	if (length == 0) {
+		it->p = it->end;
+		return false;
+	}
+	if ((size_t)(it->end - it->p) < (size_t)length + 1) {
+		it->error = true;
+		it->p = it->end;
+		return false;
+	}
+
+	ad->type = it->p[1];
+	ad->len  = (uint8_t)(length - 1);
+	ad->data = it->p + 2;
+	it->p += (size_t)length + 1;
+
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdFind(const uint8_t *data, const size_t len, const uint8_t type, BtAdStructure *ad)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	BtAdIterator it;
+	int ret = btAdIteratorInit(&it, data, len);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	while (btAdIteratorNext(&it, ad)) {
+		if (ad->type == type) {
+			return AKS_OK;
+		}
+	}
+
+	return it.error ? AKS_ERROR_BT_INVALUD_FORMAT : AKS_ERROR_INVALID;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdDecodeFlags(const BtAdStructure *ad, uint8_t &flags)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type != BtAdType::cFlags) || (ad->len < 1)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	flags = ad->data[0];
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J name は入力を指し、NUL 終端しない
+/*---------------------------------------------------------------------------*/
+int btAdDecodeLocalName(const BtAdStructure *ad, const char *&name, size_t &name_len)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type != BtAdType::cShortenedLocalName) && (ad->type != BtAdType::cCompleteLocalName)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	name     = (const char *)ad->data;
+	name_len = ad->len;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdDecodeTxPowerLevel(const BtAdStructure *ad, int8_t &tx_power)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type != BtAdType::cTxPowerLevel) || (ad->len != 1)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	tx_power = (int8_t)ad->data[0];
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdDecodeAppearance(const BtAdStructure *ad, uint16_t &appearance)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type != BtAdType::cAppearance) || (ad->len != 2)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	appearance = _ad_le16(ad->data);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static size_t _ad_uuid_size(uint8_t type)
+{
+	switch (type) {
+	case BtAdType::cIncompleteUuid16:
+	case BtAdType::cCompleteUuid16:
+	case BtAdType::cServiceData16:
+		return 2;
+	case BtAdType::cIncompleteUuid32:
+	case BtAdType::cCompleteUuid32:
+	case BtAdType::cServiceData32:
+		return 4;
+	case BtAdType::cIncompleteUuid128:
+	case BtAdType::cCompleteUuid128:
+	case BtAdType::cServiceData128:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Service UUID の一覧を取り出す。uuids が足りなければ入る分だけ入れて NOBUF
+/*---------------------------------------------------------------------------*/
+int btAdDecodeUuidList(
+								const BtAdStructure *ad,
+								BtUuid *uuids,
+								const size_t uuids_size,
+								size_t &num_uuids)
+{
+	num_uuids = 0;
+
+	if ((ad == NULL) || (uuids == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type < BtAdType::cIncompleteUuid16) || (ad->type > BtAdType::cCompleteUuid128)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	size_t size = _ad_uuid_size(ad->type);
+	if ((ad->len % size) != 0) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	size_t num = ad->len / size;
+	for (size_t i=0 ; i<num ; ++i) {
+		if (num_uuids >= uuids_size) {
+			return AKS_ERROR_NOBUF;
+		}
+		_ad_uuid(&ad->data[i * size], size, uuids[num_uuids]);
+		num_uuids++;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdDecodeServiceData(
+								const BtAdStructure *ad,
+								BtUuid &uuid,
+								const uint8_t *&data,
+								size_t &data_len)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type != BtAdType::cServiceData16) &&
+		(ad->type != BtAdType::cServiceData32) &&
+		(ad->type != BtAdType::cServiceData128)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	size_t size = _ad_uuid_size(ad->type);
+	if (ad->len < size) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	_ad_uuid(ad->data, size, uuid);
+	data     = ad->data + size;
+	data_len = ad->len - size;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAdDecodeManufacturerData(
+								const BtAdStructure *ad,
+								uint16_t &company_id,
+								const uint8_t *&data,
+								size_t &data_len)
+{
+	if (ad == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((ad->type != BtAdType::cManufacturerSpecificData) || (ad->len < 2)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	company_id = _ad_le16(ad->data);
+	data       = ad->data + 2;
+	data_len   = ad->len - 2;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 1回の走査で代表的な AD Type をまとめて取り出す
+//J 同じ種類が複数あれば最初のものを使う。壊れた AD Structure の手前までは有効
+/*---------------------------------------------------------------------------*/
+int btAdParse(const uint8_t *data, const size_t len, BtAdSummary *summary)
+{
+	if (summary == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(summary, 0, sizeof(BtAdSummary));
+
+	BtAdIterator it;
+	int ret = btAdIteratorInit(&it, data, len);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	BtAdStructure ad;
+	while (btAdIteratorNext(&it, &ad)) {
+		summary->num_structures++;
+
+		switch (ad.type) {
+		case BtAdType::cFlags:
+			if ((ad.len >= 1) && !(summary->present & BtAdPresent::cFlags)) {
+				summary->flags = ad.data[0];
+				summary->present |= BtAdPresent::cFlags;
+			}
+			break;
+		case BtAdType::cShortenedLocalName:
+		case BtAdType::cCompleteLocalName:
+			//J Complete があればそちらを優先する
+			if (!(summary->present & BtAdPresent::cName) || !summary->name_complete) {
+				summary->name          = (const char *)ad.data;
+				summary->name_len      = ad.len;
+				summary->name_complete = (ad.type == BtAdType::cCompleteLocalName);
+				summary->present |= BtAdPresent::cName;
+			}
+			break;
+		case BtAdType::cTxPowerLevel:
+			if ((ad.len == 1) && !(summary->present & BtAdPresent::cTxPowerLevel)) {
+				summary->tx_power = (int8_t)ad.data[0];
+				summary->present |= BtAdPresent::cTxPowerLevel;
+			}
+			break;
+		case BtAdType::cAppearance:
+			if ((ad.len == 2) && !(summary->present & BtAdPresent::cAppearance)) {
+				summary->appearance = _ad_le16(ad.data);
+				summary->present |= BtAdPresent::cAppearance;
+			}
+			break;
+		case BtAdType::cIncompleteUuid16:
+		case BtAdType::cCompleteUuid16:
+			if (((ad.len % 2) == 0) && !(summary->present & BtAdPresent::cUuid16)) {
+				summary->uuids16 = ad;
+				summary->present |= BtAdPresent::cUuid16;
+			}
+			break;
+		case BtAdType::cIncompleteUuid32:
+		case BtAdType::cCompleteUuid32:
+			if (((ad.len % 4) == 0) && !(summary->present & BtAdPresent::cUuid32)) {
+				summary->uuids32 = ad;
+				summary->present |= BtAdPresent::cUuid32;
+			}
+			break;
+		case BtAdType::cIncompleteUuid128:
+		case BtAdType::cCompleteUuid128:
+			if (((ad.len % 16) == 0) && !(summary->present & BtAdPresent::cUuid128)) {
+				summary->uuids128 = ad;
+				summary->present |= BtAdPresent::cUuid128;
+			}
+			break;
+		case BtAdType::cServiceData16:
+		case BtAdType::cServiceData32:
+		case BtAdType::cServiceData128:
+			if ((ad.len >= _ad_uuid_size(ad.type)) && !(summary->present & BtAdPresent::cServiceData)) {
+				summary->service_data = ad;
+				summary->present |= BtAdPresent::cServiceData;
+			}
+			break;
+		case BtAdType::cManufacturerSpecificData:
+			if ((ad.len >= 2) && !(summary->present & BtAdPresent::cManufacturerData)) {
+				summary->manufacturer = ad;
+				summary->company_id   = _ad_le16(ad.data);
+				summary->present |= BtAdPresent::cManufacturerData;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	summary->error = it.error;
+
+	return it.error ? AKS_ERROR_BT_INVALUD_FORMAT : AKS_OK;
+}
@@ -0,0 +1,125 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_AD_H_
+#define BT_AD_H_
+
+/*
+ *J Advertising Data / Scan Response Data の AD Structure を読む
+ *J (Core Spec Supplement Part A)
+ *J
+ *J どの関数も入力のバイト列を指したまま返し、コピーもメモリ確保もしない。
+ *J 長さが壊れた AD Structure の手前で止まり、それより後ろは読まない。
+ */
+
+#define BT_AD_MAX_DATA_SIZE							(254)	//J Extended Advertising の 1 Report 分 (Legacy は 31)
+
+//J AD Type (Assigned Numbers 2.3)
+struct BtAdType {
+	static const uint8_t cFlags						= 0x01;
+	static const uint8_t cIncompleteUuid16			= 0x02;
+	static const uint8_t cCompleteUuid16			= 0x03;
+	static const uint8_t cIncompleteUuid32			= 0x04;
+	static const uint8_t cCompleteUuid32			= 0x05;
+	static const uint8_t cIncompleteUuid128			= 0x06;
+	static const uint8_t cCompleteUuid128			= 0x07;
+	static const uint8_t cShortenedLocalName		= 0x08;
+	static const uint8_t cCompleteLocalName			= 0x09;
+	static const uint8_t cTxPowerLevel				= 0x0A;
+	static const uint8_t cServiceData16				= 0x16;
+	static const uint8_t cAppearance				= 0x19;
+	static const uint8_t cServiceData32				= 0x20;
+	static const uint8_t cServiceData128			= 0x21;
+	static const uint8_t cManufacturerSpecificData	= 0xFF;
+};
+
+//J Flags の各ビット
+struct BtAdFlags {
+	static const uint8_t cLeLimitedDiscoverable		= 0x01;
+	static const uint8_t cLeGeneralDiscoverable		= 0x02;
+	static const uint8_t cBrEdrNotSupported			= 0x04;
+	static const uint8_t cLeBrEdrController			= 0x08;
+	static const uint8_t cLeBrEdrHost				= 0x10;
+};
+
+//J AD Structure 1つ分 (data は入力を指す)
+struct BtAdStructure
+{
+	uint8_t        type;
+	uint8_t        len;				//J AD Data の長さ (Length - 1)
+	const uint8_t *data;
+};
+
+struct BtAdIterator
+{
+	const uint8_t *p;
+	const uint8_t *end;
+	bool           error;			//J 長さが壊れた AD Structure で止まった
+};
+
+//J 1回の走査で取り出した代表的な値 (present のビットは AD Type ごと)
+struct BtAdSummary
+{
+	uint32_t present;
+	uint8_t  flags;
+	int8_t   tx_power;
+	uint16_t appearance;
+
+	const char *name;				//J NUL 終端しない
+	uint8_t     name_len;
+	bool        name_complete;
+
+	BtAdStructure uuids16;			//J 最初に見つかった Service UUID の一覧
+	BtAdStructure uuids32;
+	BtAdStructure uuids128;
+	BtAdStructure service_data;		//J 最初に見つかった Service Data
+	BtAdStructure manufacturer;		//J 最初に見つかった Manufacturer Specific Data
+	uint16_t      company_id;
+
+	uint8_t num_structures;
+	bool    error;
+};
+
+//J BtAdSummary::present のビット
+struct BtAdPresent {
+	static const uint32_t cFlags					= 0x0001;
+	static const uint32_t cName						= 0x0002;
+	static const uint32_t cTxPowerLevel				= 0x0004;
+	static const uint32_t cAppearance				= 0x0008;
+	static const uint32_t cUuid16					= 0x0010;
+	static const uint32_t cUuid32					= 0x0020;
+	static const uint32_t cUuid128					= 0x0040;
+	static const uint32_t cServiceData				= 0x0080;
+	static const uint32_t cManufacturerData			= 0x0100;
+};
+
+int btAdIteratorInit(BtAdIterator *it, const uint8_t *data, const size_t len);
+bool btAdIteratorNext(BtAdIterator *it, BtAdStructure *ad);
+int btAdFind(const uint8_t *data, const size_t len, const uint8_t type, BtAdStructure *ad);
+
+int btAdDecodeFlags(const BtAdStructure *ad, uint8_t &flags);
+int btAdDecodeLocalName(const BtAdStructure *ad, const char *&name, size_t &name_len);
+int btAdDecodeTxPowerLevel(const BtAdStructure *ad, int8_t &tx_power);
+int btAdDecodeAppearance(const BtAdStructure *ad, uint16_t &appearance);
+int btAdDecodeUuidList(
+								const BtAdStructure *ad,
+								BtUuid *uuids,
+								const size_t uuids_size,
+								size_t &num_uuids);
+int btAdDecodeServiceData(
+								const BtAdStructure *ad,
+								BtUuid &uuid,
+								const uint8_t *&data,
+								size_t &data_len);
+int btAdDecodeManufacturerData(
+								const BtAdStructure *ad,
+								uint16_t &company_id,
+								const uint8_t *&data,
+								size_t &data_len);
+
+int btAdParse(const uint8_t *data, const size_t len, BtAdSummary *summary);
+
+#endif/*BT_AD_H_*/
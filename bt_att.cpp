@@ -16,6 +16,7 @@
 #include "aks_error.h"
 #include "bt_att.h"
 #include "bt_util.h"
+#include "bt_crypto.h"
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -438,7 +439,8 @@ int btAttBuildPduReadBlobResponse(
 	if (pdu == NULL) {
 		return AKS_ERROR_NULL;
 	}
-	if ((value == NULL) || (value_len == 0)){
+	//J Offset が値の長さと等しい場合は空の Response を返すことがある
+	if ((value == NULL) && (value_len != 0)){
 		return AKS_ERROR_NULL;
 	}
 
@@ -452,7 +454,9 @@ int btAttBuildPduReadBlobResponse(
 	BtAttPdu *_pdu = (BtAttPdu *)pdu;
 
 	_pdu->pdu.opcode = BtAttPduOpcode::cAttOpcodeReadBlobResponse;
-	memcpy(_pdu->pdu.args.readResponse.value, value, value_len);
+	if (value_len != 0) {
+		memcpy(_pdu->pdu.args.readBlobResponse.value, value, value_len);
+	}
 
 	return pdu_size;
 }
@@ -517,6 +521,91 @@ int btAttBuildPduReadMultipleResponse(
 	return pdu_size;
 }
 
+/*---------------------------------------------------------------------------*/
+int btAttBuildPduReadMultipleVariableRequest(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttHandle *handles,
+								const size_t num_handles)
+{
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((handles == NULL) || (num_handles < 2)){
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
+				 + sizeof(BtAttPdu::Pdu::Args::ReadMultipleVariableRequest)
+				 + sizeof(BtAttHandle) * num_handles;
+	if (pdu_size > len) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+
+	_pdu->pdu.opcode = BtAttPduOpcode::cAttOpcodeReadMultipleVariableRequest;
+	memcpy(_pdu->pdu.args.readMultipleVariableRequest.handles, handles, sizeof(BtAttHandle)*num_handles);
+
+	return pdu_size;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Length Value Tuple を詰められるだけ詰める。収まらない Value は切り詰めてそこで終わる
+int btAttBuildPduReadMultipleVariableResponse(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttValueSpan *values,
+								const size_t num_values)
+{
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((values == NULL) && (num_values != 0)){
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
+				 + sizeof(BtAttPdu::Pdu::Args::ReadMultipleVariableResponse);
+	if (pdu_size > len) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+
+	_pdu->pdu.opcode = BtAttPduOpcode::cAttOpcodeReadMultipleVariableResponse;
+
+	for (size_t i=0 ; i<num_values ; ++i) {
+		if ((values[i].value == NULL) && (values[i].value_len != 0)) {
+			return AKS_ERROR_NULL;
+		}
+		if (pdu_size + sizeof(uint16_t) > len) {
+			break;
+		}
+
+		uint16_t length = values[i].value_len;
+		memcpy(&pdu[pdu_size], &length, sizeof(length));
+		pdu_size += sizeof(length);
+
+		size_t copy_len = values[i].value_len;
+		if (copy_len > len - pdu_size) {
+			copy_len = len - pdu_size;
+		}
+		if (copy_len != 0) {
+			memcpy(&pdu[pdu_size], values[i].value, copy_len);
+		}
+		pdu_size += copy_len;
+
+		if (copy_len != values[i].value_len) {
+			break;
+		}
+	}
+
+	return pdu_size;
+}
+
+
 
 /*---------------------------------------------------------------------------*/
 int btAttBuildPduReadByGroupTypeRequest(
@@ -582,7 +671,7 @@ int btAttBuildPduReadByGroupTypeResponse(
 	_pdu->pdu.opcode = BtAttPduOpcode::cAttOpcodeReadByGroupTypeResponse;
 	_pdu->pdu.args.readByGroupTypeResponse.len = item_len;
 
-	if (num_items * item_len) {
+	if ((num_items * item_len) != 0) {
 		memcpy(_pdu->pdu.args.readByGroupTypeResponse.list, item_list, num_items * item_len);
 	}
 
@@ -631,8 +720,8 @@ int btAttBuildPduWriteResponse(
 		return AKS_ERROR_NULL;
 	}
 
-	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
-				 + sizeof(BtAttPdu::Pdu::Args::WriteResponse);
+	//J Parameter の無い PDU。空の struct の sizeof は 1 なので足さない
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode);
 	if (pdu_size > len) {
 		return AKS_ERROR_NOBUF;
 	}
@@ -782,8 +871,8 @@ int btAttBuildPduExecuteWriteResponse(
 		return AKS_ERROR_NULL;
 	}
 
-	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
-				 + sizeof(BtAttPdu::Pdu::Args::ExecuteWriteResponse);
+	//J Parameter の無い PDU。空の struct の sizeof は 1 なので足さない
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode);
 	if (pdu_size > len) {
 		return AKS_ERROR_NOBUF;
 	}
@@ -871,8 +960,8 @@ int btAttBuildPduHandleValueConfirmation(
 		return AKS_ERROR_NULL;
 	}
 
-	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
-				 + sizeof(BtAttPdu::Pdu::Args::HandleValueConfirmation);
+	//J Parameter の無い PDU。空の struct の sizeof は 1 なので足さない
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode);
 	if (pdu_size > len) {
 		return AKS_ERROR_NOBUF;
 	}
@@ -884,6 +973,54 @@ int btAttBuildPduHandleValueConfirmation(
 	return pdu_size;
 }
 
+/*---------------------------------------------------------------------------*/
+//J Value を切り詰めることは出来ないので、全ての Tuple が収まらなければエラー
+int btAttBuildPduMultipleHandleValueNotification(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttValueSpan *values,
+								const size_t num_values)
+{
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((values == NULL) || (num_values < 2)){
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
+				 + sizeof(BtAttPdu::Pdu::Args::MultipleHandleValueNotification);
+	for (size_t i=0 ; i<num_values ; ++i) {
+		if ((values[i].value == NULL) && (values[i].value_len != 0)) {
+			return AKS_ERROR_NULL;
+		}
+		pdu_size += sizeof(BtAttHandle) + sizeof(uint16_t) + values[i].value_len;
+	}
+	if (pdu_size > len) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+
+	_pdu->pdu.opcode = BtAttPduOpcode::cAttOpcodeMultipleHandleValueNotification;
+
+	size_t pos = sizeof(BtAttPdu::Pdu::opcode);
+	for (size_t i=0 ; i<num_values ; ++i) {
+		uint16_t length = values[i].value_len;
+		memcpy(&pdu[pos], &values[i].handle, sizeof(BtAttHandle));
+		pos += sizeof(BtAttHandle);
+		memcpy(&pdu[pos], &length, sizeof(length));
+		pos += sizeof(length);
+		if (length != 0) {
+			memcpy(&pdu[pos], values[i].value, length);
+		}
+		pos += length;
+	}
+
+	return pdu_size;
+}
+
+
 /*---------------------------------------------------------------------------*/
 int btAttBuildPduSignedWriteCommand(
 								uint8_t *pdu,
@@ -891,14 +1028,47 @@ int btAttBuildPduSignedWriteCommand(
 								const BtAttHandle handle,
 								const uint16_t value_len,
 								const uint8_t *value,
-								struct bt_crypto *crypto,
-								uint8_t csrk[16],
+								const struct bt_crypto *crypto,
+								const uint8_t csrk[16],
+								const uint32_t sign_count)
+{
+	if ((crypto == NULL) || (csrk == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	BtCryptoCmacKey key;
+	int ret = btCryptoSignKeyInit(crypto, csrk, &key);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	return btAttBuildPduSignedWriteCommandWithKey(
+								pdu,
+								len,
+								handle,
+								value_len,
+								value,
+								crypto,
+								&key,
+								sign_count);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btAttBuildPduSignedWriteCommandWithKey(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttHandle handle,
+								const uint16_t value_len,
+								const uint8_t *value,
+								const struct bt_crypto *crypto,
+								const struct BtCryptoCmacKey *key,
 								const uint32_t sign_count)
 {
 	if (pdu == NULL) {
 		return AKS_ERROR_NULL;
 	}
-	if (crypto == NULL) {
+	if ((crypto == NULL) || (key == NULL)) {
 		return AKS_ERROR_NULL;
 	}
 	if ((value == NULL) && (value_len != 0)){
@@ -921,18 +1091,19 @@ int btAttBuildPduSignedWriteCommand(
 		memcpy(_pdu->pdu.args.signedWriteCommand.value, value, value_len);
 	}
 
-	//J 真面目に作らないとダメな感じ
-	uint8_t signature[BT_ATT_SIGNATURE_SIZE];
-	pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
-				+ sizeof(BtAttPdu::Pdu::Args::SignedWriteCommand)
-				+ value_len;
-	int ret = btUtilCryptoSignAtt(crypto, csrk, pdu, pdu_size, sign_count, signature);
+	//J Opcode から Value までに署名する
+	size_t signed_size = pdu_size - BT_ATT_SIGNATURE_SIZE;
+	int ret = btCryptoSignAtt(
+								crypto,
+								key,
+								pdu,
+								signed_size,
+								sign_count,
+								&(_pdu->pdu.args.signedWriteCommand.value[value_len]));
 	if (ret != AKS_OK) {
 		return ret;
 	}
 
-	memcpy(&(_pdu->pdu.args.signedWriteCommand.value[value_len]), signature, sizeof(signature));
-
 	return pdu_size;
 }
 
@@ -1502,6 +1673,103 @@ int btAttParsePduReadMultipleResponse(
 	return AKS_OK;
 }
 
+/*---------------------------------------------------------------------------*/
+int btAttParsePduReadMultipleVariableRequest(
+								const uint8_t *pdu,
+								const size_t len,
+								BtAttHandle *handles,
+								const size_t handles_size,
+								size_t &num_handles)
+{
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
+				 + sizeof(BtAttPdu::Pdu::Args::ReadMultipleVariableRequest);
+	if (pdu_size > len) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+
+	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+	if (_pdu->pdu.opcode != BtAttPduOpcode::cAttOpcodeReadMultipleVariableRequest) {
+		return AKS_ERROR_BT_INVALID_OPCODE;
+	}
+
+	int ret = AKS_OK;
+	num_handles = (len - pdu_size) / sizeof(BtAttHandle);
+	if ( ((len - pdu_size) % sizeof(BtAttHandle)) != 0) {
+		ret = AKS_ERROR_BT_INCLUDE_FRAGMENTS;
+	}
+	if (handles == NULL) {
+		return ret;
+	}
+	else if (handles_size < num_handles * sizeof(BtAttHandle)) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	memcpy(handles, _pdu->pdu.args.readMultipleVariableRequest.handles, num_handles * sizeof(BtAttHandle));
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 各 Value は PDU の中を指す。value_len < length なら MTU で切り詰められている
+int btAttParsePduReadMultipleVariableResponse(
+								const uint8_t *pdu,
+								const size_t len,
+								BtAttValueSpan *values,
+								const size_t values_size,
+								size_t &num_values)
+{
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
+				 + sizeof(BtAttPdu::Pdu::Args::ReadMultipleVariableResponse);
+	if (pdu_size > len) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+
+	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+	if (_pdu->pdu.opcode != BtAttPduOpcode::cAttOpcodeReadMultipleVariableResponse) {
+		return AKS_ERROR_BT_INVALID_OPCODE;
+	}
+
+	num_values = 0;
+	size_t pos = pdu_size;
+	while (pos < len) {
+		if (len - pos < sizeof(uint16_t)) {
+			return AKS_ERROR_BT_INCLUDE_FRAGMENTS;
+		}
+		if (num_values >= values_size) {
+			return AKS_ERROR_NOBUF;
+		}
+
+		uint16_t length = 0;
+		memcpy(&length, &pdu[pos], sizeof(length));
+		pos += sizeof(length);
+
+		size_t value_len = length;
+		if (value_len > len - pos) {
+			value_len = len - pos;
+		}
+
+		BtAttValueSpan *value = &values[num_values++];
+		value->handle    = 0;
+		value->value     = &pdu[pos];
+		value->value_len = (uint16_t)value_len;
+		value->length    = length;
+
+		pos += value_len;
+	}
+
+	return AKS_OK;
+}
+
+
 
 /*---------------------------------------------------------------------------*/
 int btAttParsePduReadByGroupTypeRequest(
@@ -1947,6 +2215,65 @@ int btAttParsePduHandleValueConfirmation(
 	return AKS_OK;
 }
 
+/*---------------------------------------------------------------------------*/
+//J 各 Value は PDU の中を指す。途中で壊れていた場合もそこまでの num_values は有効
+int btAttParsePduMultipleHandleValueNotification(
+								const uint8_t *pdu,
+								const size_t len,
+								BtAttValueSpan *values,
+								const size_t values_size,
+								size_t &num_values)
+{
+	num_values = 0;
+
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode) 
+				 + sizeof(BtAttPdu::Pdu::Args::MultipleHandleValueNotification);
+	if (pdu_size > len) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+
+	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+	if (_pdu->pdu.opcode != BtAttPduOpcode::cAttOpcodeMultipleHandleValueNotification) {
+		return AKS_ERROR_BT_INVALID_OPCODE;
+	}
+
+	size_t pos = pdu_size;
+	while (pos < len) {
+		if (len - pos < sizeof(BtAttHandle) + sizeof(uint16_t)) {
+			return AKS_ERROR_BT_INCLUDE_FRAGMENTS;
+		}
+		if (num_values >= values_size) {
+			return AKS_ERROR_NOBUF;
+		}
+
+		BtAttHandle handle = 0;
+		uint16_t    length = 0;
+		memcpy(&handle, &pdu[pos], sizeof(handle));
+		pos += sizeof(handle);
+		memcpy(&length, &pdu[pos], sizeof(length));
+		pos += sizeof(length);
+
+		if (length > len - pos) {
+			return AKS_ERROR_BT_INCLUDE_FRAGMENTS;
+		}
+
+		BtAttValueSpan *value = &values[num_values++];
+		value->handle    = handle;
+		value->value     = &pdu[pos];
+		value->value_len = length;
+		value->length    = length;
+
+		pos += length;
+	}
+
+	return AKS_OK;
+}
+
+
 /*---------------------------------------------------------------------------*/
 int btAttParsePduSignedWriteCommand(
 								const uint8_t *pdu,
@@ -1987,9 +2314,41 @@ int btAttParsePduSignedWriteCommand(
 
 	memcpy (value, _pdu->pdu.args.signedWriteCommand.value, value_len);
 
-	//J Signの検証をどうするか？
+	//J 署名の検証は btAttVerifyPduSignedWriteCommand() で行う
 
 	return AKS_OK;
 }
 
 
+/*---------------------------------------------------------------------------*/
+int btAttVerifyPduSignedWriteCommand(
+								const uint8_t *pdu,
+								const size_t len,
+								const struct bt_crypto *crypto,
+								const struct BtCryptoCmacKey *key,
+								uint32_t &sign_count)
+{
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	size_t pdu_size = sizeof(BtAttPdu::Pdu::opcode)
+				 + sizeof(BtAttPdu::Pdu::Args::SignedWriteCommand)
+				 + BT_ATT_SIGNATURE_SIZE;
+	if (len < pdu_size) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+	if (pdu[0] != BtAttPduOpcode::cAttOpcodeSignedWriteCommand) {
+		return AKS_ERROR_BT_INVALID_OPCODE;
+	}
+
+	return btCryptoVerifyAtt(
+								crypto,
+								key,
+								pdu,
+								len - BT_ATT_SIGNATURE_SIZE,
+								&pdu[len - BT_ATT_SIGNATURE_SIZE],
+								sign_count);
+}
+
+
@@ -43,6 +43,9 @@ public:
 	static const uint8_t cAttOpcodeHandleValueNotification	= 0x1B;
 	static const uint8_t cAttOpcodeHandleValueIndication	= 0x1D;
 	static const uint8_t cAttOpcodeHandleValueConfirmation	= 0x1E;
+	static const uint8_t cAttOpcodeReadMultipleVariableRequest	= 0x20;
+	static const uint8_t cAttOpcodeReadMultipleVariableResponse	= 0x21;
+	static const uint8_t cAttOpcodeMultipleHandleValueNotification	= 0x23;
 	static const uint8_t cAttOpcodeSignedWriteCommand		= 0xD2;
 };
 
@@ -109,6 +112,9 @@ struct BtAttExecuteWriteFlag {
 #define BT_ATT_MIN_LE_MTU								(23)
 #define BT_ATT_MAX_LE_MTU								(512)
 
+//J 受信側で扱う PDU の最大サイズ
+#define BT_ATT_MAX_PDU_SIZE								(BT_ATT_MAX_LE_MTU)
+
 
 #define BT_ATT_L2CAP_CID								(0x0004)	// 5.2.2 LE Channel Requirements
 #define BT_ATT_L2CAP_PSM								(0x001F)	// 5.1 BR/EDR L2CAP INTEROPERABILITY REQUIREMENTS
@@ -222,6 +228,15 @@ union BtAttPdu
 			struct ReadMultipleResponse{
 				uint8_t values[0];
 			} readMultipleResponse;
+			struct ReadMultipleVariableRequest{
+				BtAttHandle handles[0];
+			} readMultipleVariableRequest;
+			struct ReadMultipleVariableResponse{
+				uint8_t length_value_tuples[0];
+			} readMultipleVariableResponse;
+			struct MultipleHandleValueNotification{
+				uint8_t handle_length_value_tuples[0];
+			} multipleHandleValueNotification;
 			struct ReadByGroupTypeRequest{
 				BtAttHandleRange range;
 				uint8_t uuid[0];
@@ -312,6 +327,15 @@ struct BtAttAttributeDataReadByTypeResponse
 
 #pragma pack()
 
+//J PDU の中の Value を指す (Read Multiple Variable Length / Multiple Handle Value Notification)
+struct BtAttValueSpan
+{
+	BtAttHandle    handle;
+	const uint8_t *value;
+	uint16_t       value_len;		//J PDU に入っているバイト数
+	uint16_t       length;			//J Attribute Value の本来の長さ
+};
+
 /*
  * Attribute関係のUtils
  */
@@ -392,6 +416,16 @@ int btAttBuildPduReadMultipleResponse(
 								const size_t len,
 								const void *values,
 								const size_t values_len);
+int btAttBuildPduReadMultipleVariableRequest(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttHandle *handles,
+								const size_t num_handles);
+int btAttBuildPduReadMultipleVariableResponse(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttValueSpan *values,
+								const size_t num_values);
 int btAttBuildPduReadByGroupTypeRequest(
 								uint8_t *pdu,
 								const size_t len,
@@ -454,6 +488,11 @@ int btAttBuildPduHandleValueIndication(
 int btAttBuildPduHandleValueConfirmation(
 								uint8_t *pdu,
 								const size_t len);
+int btAttBuildPduMultipleHandleValueNotification(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttValueSpan *values,
+								const size_t num_values);
 int btAttBuildPduSignedWriteCommand(
 								uint8_t *pdu,
 								const size_t len,
@@ -463,6 +502,15 @@ int btAttBuildPduSignedWriteCommand(
 								const struct bt_crypto *crypto,
 								const uint8_t csrk[16],
 								const uint32_t sign_count);
+int btAttBuildPduSignedWriteCommandWithKey(
+								uint8_t *pdu,
+								const size_t len,
+								const BtAttHandle handle,
+								const uint16_t value_len,
+								const uint8_t *value,
+								const struct bt_crypto *crypto,
+								const struct BtCryptoCmacKey *key,
+								const uint32_t sign_count);
 
 /*
  *J ATT PDU の解析系
@@ -528,7 +576,7 @@ int btAttParsePduReadResponse(
 								void *value,
 								const uint16_t value_buf_size,
 								uint16_t &value_len);
-int btAttParsePduReadBlobReques(
+int btAttParsePduReadBlobRequest(
 								const uint8_t *pdu,
 								const size_t len,
 								uint16_t &handle,
@@ -551,6 +599,18 @@ int btAttParsePduReadMultipleResponse(
 								void *values,
 								const size_t values_buf_size,
 								size_t *values_len);
+int btAttParsePduReadMultipleVariableRequest(
+								const uint8_t *pdu,
+								const size_t len,
+								BtAttHandle *handles,
+								const size_t handles_size,
+								size_t &num_handles);
+int btAttParsePduReadMultipleVariableResponse(
+								const uint8_t *pdu,
+								const size_t len,
+								BtAttValueSpan *values,
+								const size_t values_size,
+								size_t &num_values);
 int btAttParsePduReadByGroupTypeRequest(
 								const uint8_t *pdu,
 								const size_t len,
@@ -620,6 +680,12 @@ int btAttParsePduHandleValueIndication(
 int btAttParsePduHandleValueConfirmation(
 							const uint8_t *pdu,
 							const size_t len);
+int btAttParsePduMultipleHandleValueNotification(
+								const uint8_t *pdu,
+								const size_t len,
+								BtAttValueSpan *values,
+								const size_t values_size,
+								size_t &num_values);
 int btAttParsePduSignedWriteCommand(
 								const uint8_t *pdu,
 								const size_t len,
@@ -627,5 +693,11 @@ int btAttParsePduSignedWriteCommand(
 								uint16_t &value_len,
 								uint8_t *value,
 								const uint16_t value_buf_size);
+int btAttVerifyPduSignedWriteCommand(
+								const uint8_t *pdu,
+								const size_t len,
+								const struct bt_crypto *crypto,
+								const struct BtCryptoCmacKey *key,
+								uint32_t &sign_count);
 
 #endif/*BT_ATT_H_*/
@@ -0,0 +1,578 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_gatt.h"
+#include "bt_util.h"
+#include "bt_le_device.h"
+#include "bt_bulk_transfer.h"
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static void _bulk_update_ack(BtBulkTransferContext *xfer, uint32_t ack, bool sync)
+{
+	pthread_mutex_lock(&xfer->mutex);
+
+	//J 通常は前進のみ受け付ける。接続直後の同期では Peripheral の値を正とする
+	if ((uint64_t)ack <= xfer->size) {
+		if (sync || ((uint64_t)ack > xfer->acked_offset)) {
+			xfer->acked_offset = ack;
+			if (sync || (xfer->sent_offset < xfer->acked_offset)) {
+				xfer->sent_offset = xfer->acked_offset;
+			}
+			pthread_cond_broadcast(&xfer->ackCv);
+		}
+	}
+
+	pthread_mutex_unlock(&xfer->mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bulk_ack_notification(void *arg, BtAttHandle handle, uint8_t *value, size_t value_len)
+{
+	(void)handle;
+
+	BtBulkTransferContext *xfer = (BtBulkTransferContext *)arg;
+	if (value_len < sizeof(uint32_t)) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+
+	uint32_t ack = 0;
+	memcpy(&ack, value, sizeof(ack));
+	_bulk_update_ack(xfer, ack, false);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bulk_read_ack(BtBulkTransferContext *xfer, BtGattDeviceContext *ctx, bool sync)
+{
+	uint32_t ack = 0;
+	size_t read_size = 0;
+
+	int ret = BtGattCharacteristicValueRead::btGattReadCharacteristicValue(
+								*ctx,
+								xfer->params.ack_handle,
+								&ack,
+								sizeof(ack),
+								read_size);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	if (read_size < sizeof(ack)) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+
+	_bulk_update_ack(xfer, ack, sync);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bulk_read_source(BtBulkTransferContext *xfer, uint64_t offset, uint8_t *dst, size_t len)
+{
+	if (xfer->buf != NULL) {
+		memcpy(dst, &xfer->buf[offset], len);
+		return AKS_OK;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = pread(xfer->fd, &dst[done], len - done, (off_t)(offset + done));
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return AKS_ERROR_IO;
+		}
+		if (ret == 0) {
+			//J 転送中にファイルが短くなった
+			return AKS_ERROR_IO;
+		}
+		done += (size_t)ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _bulk_fill_progress(BtBulkTransferContext *xfer, uint64_t now, BtBulkTransferProgress *progress)
+{
+	progress->acked               = xfer->acked_offset;
+	progress->total               = xfer->size;
+	progress->elapsed_ns          = now - xfer->start_ns;
+	progress->retransmitted_bytes = xfer->retransmitted_bytes;
+	progress->stalls              = xfer->stalls;
+
+	progress->bytes_per_sec = 0;
+	if (progress->elapsed_ns != 0) {
+		progress->bytes_per_sec = (xfer->acked_offset - xfer->start_offset) * 1000000000ull / progress->elapsed_ns;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bulk_report_progress(BtBulkTransferContext *xfer, bool force)
+{
+	if (xfer->params.progress == NULL) {
+		return AKS_OK;
+	}
+
+	uint64_t now = btUtilGetMonotonicTimeNs();
+	if (!force && ((now - xfer->last_progress_ns) < (uint64_t)xfer->params.progress_interval_ms * 1000000ull)) {
+		return AKS_OK;
+	}
+	xfer->last_progress_ns = now;
+
+	BtBulkTransferProgress progress;
+	pthread_mutex_lock(&xfer->mutex);
+	_bulk_fill_progress(xfer, now, &progress);
+	pthread_mutex_unlock(&xfer->mutex);
+
+	if (xfer->params.progress(xfer->params.progress_arg, &progress) != 0) {
+		return AKS_ERROR_CANCELED;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J sent から最大 burst_pdus 個の Write Command を作って送る。送った後の位置を返す
+static int _bulk_send_burst(
+								BtBulkTransferContext *xfer,
+								BtGattDeviceContext *ctx,
+								size_t payload_max,
+								uint64_t sent,
+								uint64_t limit,
+								uint64_t &next)
+{
+	BtLeDevicePdu pdus[BT_BULK_TRANSFER_MAX_BURST];
+	size_t num = 0;
+
+	while ((num < xfer->params.burst_pdus) && (sent < limit)) {
+		size_t payload = payload_max;
+		if ((uint64_t)payload > (limit - sent)) {
+			payload = (size_t)(limit - sent);
+		}
+
+		BtAttPdu *pdu = (BtAttPdu *)xfer->burst[num];
+		pdu->pdu.opcode = BtAttPduOpcode::cAttOpcodeWriteCommand;
+		pdu->pdu.args.writeCommand.handle = xfer->params.data_handle;
+
+		uint8_t *value = pdu->pdu.args.writeCommand.value;
+		size_t header = 0;
+		if (xfer->params.framed) {
+			uint32_t offset = (uint32_t)sent;
+			memcpy(value, &offset, sizeof(offset));
+			header = BT_BULK_TRANSFER_FRAME_HEADER_SIZE;
+		}
+
+		int ret = _bulk_read_source(xfer, sent, &value[header], payload);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+
+		pdus[num].pdu = xfer->burst[num];
+		pdus[num].len = sizeof(BtAttPdu::Pdu::opcode)
+					  + sizeof(BtAttPdu::Pdu::Args::WriteCommand)
+					  + header + payload;
+		num++;
+
+		sent += payload;
+	}
+
+	int ret = btLeDeviceSendAttPduBurst(ctx, pdus, num);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	next = sent;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J ACK が進むかタイムアウトまで待つ
+static int _bulk_wait_for_ack(
+								BtBulkTransferContext *xfer,
+								BtGattDeviceContext *ctx,
+								bool use_notification,
+								uint64_t acked,
+								uint64_t deadline_ns)
+{
+	if (!use_notification) {
+		int ret = _bulk_read_ack(xfer, ctx, false);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+
+		//J 進んでいなければ次の Read まで間をあける (続けて Read するとデータ送信と帯域を取り合う)
+		uint64_t poll_ns = btUtilGetMonotonicTimeNs() + (uint64_t)xfer->params.ack_poll_interval_ms * 1000000ull;
+		if (poll_ns < deadline_ns) {
+			deadline_ns = poll_ns;
+		}
+	}
+
+	struct timespec deadline;
+	deadline.tv_sec  = (time_t)(deadline_ns / 1000000000ull);
+	deadline.tv_nsec = (long)(deadline_ns % 1000000000ull);
+
+	pthread_mutex_lock(&xfer->mutex);
+	while (xfer->acked_offset == acked) {
+		int ret = pthread_cond_timedwait(&xfer->ackCv, &xfer->mutex, &deadline);
+		if (ret == ETIMEDOUT) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&xfer->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bulk_create(BtBulkTransferContext *xfer, const BtBulkTransferParameters *params)
+{
+	if ((params->burst_pdus == 0) || (params->burst_pdus > BT_BULK_TRANSFER_MAX_BURST)) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((params->window_size == 0) || (params->ack_handle == 0) || (params->data_handle == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(xfer, 0x00, sizeof(BtBulkTransferContext));
+	xfer->params = *params;
+	xfer->fd = -1;
+
+	//J ACK 待ちの期限は CLOCK_MONOTONIC で計算する
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	int ret = pthread_cond_init(&xfer->ackCv, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret != 0) {
+		return AKS_ERROR_IO;
+	}
+
+	ret = pthread_mutex_init(&xfer->mutex, NULL);
+	if (ret != 0) {
+		pthread_cond_destroy(&xfer->ackCv);
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _bulk_run(
+								BtBulkTransferContext *xfer,
+								BtGattDeviceContext *ctx,
+								size_t payload_max,
+								bool use_notification)
+{
+	//J 再開時は Peripheral が持っている受信済みバイト数に合わせる
+	int ret = _bulk_read_ack(xfer, ctx, true);
+	if ((ret != AKS_OK) && !use_notification) {
+		return ret;
+	}
+
+	uint64_t now = btUtilGetMonotonicTimeNs();
+	pthread_mutex_lock(&xfer->mutex);
+	xfer->sent_offset      = xfer->acked_offset;
+	xfer->start_offset     = xfer->acked_offset;
+	xfer->start_ns         = now;
+	pthread_mutex_unlock(&xfer->mutex);
+	xfer->last_progress_ns = now;
+
+	uint64_t last_ack    = xfer->start_offset;
+	uint64_t last_ack_ns = now;
+	uint32_t retries     = 0;
+
+	while (true) {
+		pthread_mutex_lock(&xfer->mutex);
+		uint64_t acked = xfer->acked_offset;
+		uint64_t sent  = xfer->sent_offset;
+		pthread_mutex_unlock(&xfer->mutex);
+
+		if (acked >= xfer->size) {
+			break;
+		}
+
+		now = btUtilGetMonotonicTimeNs();
+		if (acked != last_ack) {
+			last_ack    = acked;
+			last_ack_ns = now;
+			retries     = 0;
+		}
+
+		uint64_t limit = acked + xfer->params.window_size;
+		if (limit > xfer->size) {
+			limit = xfer->size;
+		}
+
+		if (sent < limit) {
+			uint64_t next = sent;
+			ret = _bulk_send_burst(xfer, ctx, payload_max, sent, limit, next);
+			if (ret != AKS_OK) {
+				return ret;
+			}
+
+			pthread_mutex_lock(&xfer->mutex);
+			if (xfer->sent_offset == sent) {
+				xfer->sent_offset = next;
+			}
+			pthread_mutex_unlock(&xfer->mutex);
+		}
+		else {
+			//J ウィンドウが埋まった
+			xfer->stalls++;
+
+			uint64_t deadline_ns = last_ack_ns + (uint64_t)xfer->params.ack_timeout_ms * 1000000ull;
+			ret = _bulk_wait_for_ack(xfer, ctx, use_notification, acked, deadline_ns);
+			if (ret != AKS_OK) {
+				return ret;
+			}
+
+			pthread_mutex_lock(&xfer->mutex);
+			bool progressed = (xfer->acked_offset != acked);
+			pthread_mutex_unlock(&xfer->mutex);
+
+			if (!progressed && (btUtilGetMonotonicTimeNs() >= deadline_ns)) {
+				retries++;
+				if (retries > xfer->params.max_retries) {
+					return AKS_ERROR_TIMEOUT;
+				}
+
+				if (xfer->params.framed) {
+					//J ACK 済みの位置から送り直す
+					pthread_mutex_lock(&xfer->mutex);
+					xfer->retransmitted_bytes += xfer->sent_offset - xfer->acked_offset;
+					xfer->sent_offset = xfer->acked_offset;
+					pthread_mutex_unlock(&xfer->mutex);
+				}
+				last_ack_ns = btUtilGetMonotonicTimeNs();
+			}
+		}
+
+		ret = _bulk_report_progress(xfer, false);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	return _bulk_report_progress(xfer, true);
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+int btBulkTransferInitParameters(BtBulkTransferParameters *params)
+{
+	if (params == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(params, 0x00, sizeof(BtBulkTransferParameters));
+	params->framed               = true;
+	params->window_size          = BT_BULK_TRANSFER_DEFAULT_WINDOW;
+	params->burst_pdus           = BT_BULK_TRANSFER_DEFAULT_BURST;
+	params->ack_timeout_ms       = BT_BULK_TRANSFER_DEFAULT_ACK_TIMEOUT_MS;
+	params->ack_poll_interval_ms = BT_BULK_TRANSFER_DEFAULT_ACK_POLL_MS;
+	params->max_retries          = BT_BULK_TRANSFER_DEFAULT_MAX_RETRIES;
+	params->progress_interval_ms = BT_BULK_TRANSFER_DEFAULT_PROGRESS_MS;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btBulkTransferCreate(
+								BtBulkTransferContext *xfer,
+								const BtBulkTransferParameters *params,
+								const void *buf,
+								const size_t size)
+{
+	if ((xfer == NULL) || (params == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((buf == NULL) || (size == 0)) {
+		return AKS_ERROR_NOBUF;
+	}
+	//J ACK は uint32
+	if ((uint64_t)size > 0xffffffffull) {
+		return AKS_ERROR_INVALID;
+	}
+
+	int ret = _bulk_create(xfer, params);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	xfer->buf  = (const uint8_t *)buf;
+	xfer->size = size;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btBulkTransferCreateWithFile(
+								BtBulkTransferContext *xfer,
+								const BtBulkTransferParameters *params,
+								int fd)
+{
+	if ((xfer == NULL) || (params == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return AKS_ERROR_IO;
+	}
+	if ((st.st_size <= 0) || ((uint64_t)st.st_size > 0xffffffffull)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	int ret = _bulk_create(xfer, params);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	xfer->fd   = fd;
+	xfer->size = (uint64_t)st.st_size;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btBulkTransferDestroy(BtBulkTransferContext *xfer)
+{
+	if (xfer == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_cond_destroy(&xfer->ackCv);
+	pthread_mutex_destroy(&xfer->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btBulkTransferRun(BtBulkTransferContext *xfer, BtGattDeviceContext *ctx)
+{
+	if ((xfer == NULL) || (ctx == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	size_t header = sizeof(BtAttPdu::Pdu::opcode) + sizeof(BtAttPdu::Pdu::Args::WriteCommand);
+	if (xfer->params.framed) {
+		header += BT_BULK_TRANSFER_FRAME_HEADER_SIZE;
+	}
+	uint16_t mtu = btLeDeviceGetMtu(ctx);
+	if (mtu <= header) {
+		return AKS_ERROR_INVALID;
+	}
+	size_t payload_max = mtu - header;
+
+	bool use_notification = (xfer->params.ack_config_handle != 0);
+	if (use_notification) {
+		int ret = btLeDeviceRegistNotificationCallbackWithArg(
+								ctx,
+								xfer->params.ack_config_handle,
+								xfer->params.ack_handle,
+								_bulk_ack_notification,
+								xfer);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	int ret = _bulk_run(xfer, ctx, payload_max, use_notification);
+
+	//J Destroy した後で受信スレッドが xfer を触らないように外す
+	if (use_notification) {
+		(void)btLeDeviceUnregistNotificationCallbackWithArg(
+								ctx,
+								xfer->params.ack_handle,
+								_bulk_ack_notification,
+								xfer);
+	}
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+uint64_t btBulkTransferGetCheckpoint(BtBulkTransferContext *xfer)
+{
+	if (xfer == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&xfer->mutex);
+	uint64_t offset = xfer->acked_offset;
+	pthread_mutex_unlock(&xfer->mutex);
+
+	return offset;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btBulkTransferSetCheckpoint(BtBulkTransferContext *xfer, const uint64_t offset)
+{
+	if (xfer == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (offset > xfer->size) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&xfer->mutex);
+	xfer->acked_offset = offset;
+	xfer->sent_offset  = offset;
+	pthread_mutex_unlock(&xfer->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btBulkTransferGetProgress(BtBulkTransferContext *xfer, BtBulkTransferProgress *progress)
+{
+	if ((xfer == NULL) || (progress == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&xfer->mutex);
+	_bulk_fill_progress(xfer, btUtilGetMonotonicTimeNs(), progress);
+	pthread_mutex_unlock(&xfer->mutex);
+
+	return AKS_OK;
+}
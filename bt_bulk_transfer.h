@@ -0,0 +1,107 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_BULK_TRANSFER_H_
+#define BT_BULK_TRANSFER_H_
+
+/*
+ *J Write Without Response の連続送信による大容量転送
+ *J
+ *J Peripheral は受信済みの連続したバイト数を uint32 (LE) で ack_handle に置き、
+ *J Notification するか Read に応答する。Central は ACK 済みの位置から
+ *J window_size バイトまでを ACK 無しで送り続ける。
+ *J
+ *J framed の場合は各 PDU の値の先頭に uint32 (LE) の転送オフセットを付ける。
+ *J Peripheral はオフセットが受信済みバイト数と一致しない PDU を捨てる。
+ *J ACK がタイムアウトした時は ACK 済みの位置まで巻き戻して再送する (Go-Back-N)。
+ *J framed で無い場合は LL の再送に任せ、巻き戻しはしない。
+ *J
+ *J ACK 済みの位置がチェックポイントになる。切断後は新しい接続で
+ *J btBulkTransferRun() を呼び直せばチェックポイントから再開する。
+ */
+
+#define BT_BULK_TRANSFER_MAX_BURST					(BT_LE_DEVICE_MAX_BURST)
+#define BT_BULK_TRANSFER_FRAME_HEADER_SIZE			(4)
+
+#define BT_BULK_TRANSFER_DEFAULT_WINDOW				(4096)
+#define BT_BULK_TRANSFER_DEFAULT_BURST				(8)
+#define BT_BULK_TRANSFER_DEFAULT_ACK_TIMEOUT_MS		(2000)
+#define BT_BULK_TRANSFER_DEFAULT_MAX_RETRIES		(3)
+#define BT_BULK_TRANSFER_DEFAULT_PROGRESS_MS		(250)
+#define BT_BULK_TRANSFER_DEFAULT_ACK_POLL_MS		(30)	//J Connection Interval 程度
+
+struct BtBulkTransferProgress
+{
+	uint64_t acked;					//J チェックポイント
+	uint64_t total;
+	uint64_t elapsed_ns;			//J この btBulkTransferRun() を開始してからの時間
+	uint64_t bytes_per_sec;			//J この btBulkTransferRun() で ACK されたバイトのスループット
+	uint64_t retransmitted_bytes;
+	uint64_t stalls;				//J ACK 待ちでウィンドウが詰まった回数
+};
+
+//J 0 以外を返すと転送を中断する
+typedef int (*BtBulkTransferProgressCb)(void *arg, const BtBulkTransferProgress *progress);
+
+struct BtBulkTransferParameters
+{
+	BtAttHandle data_handle;		//J Write Without Response の書き込み先
+	BtAttHandle ack_handle;			//J 受信済みバイト数 (uint32 LE)
+	BtAttHandle ack_config_handle;	//J ack_handle の CCCD (0 なら ack_handle を定期的に Read する)
+	bool        framed;				//J 各 PDU にオフセットを付ける
+	uint32_t    window_size;		//J ACK 無しで送ってよいバイト数
+	uint32_t    burst_pdus;			//J 1回の sendmmsg() で送る PDU 数
+	uint32_t    ack_timeout_ms;
+	uint32_t    ack_poll_interval_ms;	//J ack_handle を Read する時、ウィンドウが埋まっている間の Read の間隔
+	uint32_t    max_retries;		//J ACK が進まないタイムアウトの許容回数
+	uint32_t    progress_interval_ms;
+	BtBulkTransferProgressCb progress;
+	void       *progress_arg;
+};
+
+struct BtBulkTransferContext
+{
+	BtBulkTransferParameters params;
+
+	//J 転送元 (buf か fd のどちらか)
+	const uint8_t *buf;
+	int            fd;
+	uint64_t       size;
+
+	uint64_t sent_offset;			//J 次に送るバイト位置
+	uint64_t acked_offset;			//J ACK 済みの位置 (チェックポイント)
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  ackCv;
+
+	uint64_t start_ns;
+	uint64_t start_offset;
+	uint64_t last_progress_ns;
+	uint64_t retransmitted_bytes;
+	uint64_t stalls;
+
+	uint8_t burst[BT_BULK_TRANSFER_MAX_BURST][BT_ATT_MAX_LE_MTU];
+};
+
+int btBulkTransferInitParameters(BtBulkTransferParameters *params);
+int btBulkTransferCreate(
+								BtBulkTransferContext *xfer,
+								const BtBulkTransferParameters *params,
+								const void *buf,
+								const size_t size);
+int btBulkTransferCreateWithFile(
+								BtBulkTransferContext *xfer,
+								const BtBulkTransferParameters *params,
+								int fd);
+int btBulkTransferDestroy(BtBulkTransferContext *xfer);
+
+int btBulkTransferRun(BtBulkTransferContext *xfer, BtGattDeviceContext *ctx);
+
+uint64_t btBulkTransferGetCheckpoint(BtBulkTransferContext *xfer);
+int btBulkTransferSetCheckpoint(BtBulkTransferContext *xfer, const uint64_t offset);
+int btBulkTransferGetProgress(BtBulkTransferContext *xfer, BtBulkTransferProgress *progress);
+
+#endif/*BT_BULK_TRANSFER_H_*/
@@ -0,0 +1,499 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define BT_CRYPTO_HAVE_AESNI
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define BT_CRYPTO_HAVE_ARMV8
+#endif
+
+#include "aks_error.h"
+#include "bt_crypto.h"
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static const uint8_t _aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t _aes_rcon[BT_CRYPTO_AES128_ROUNDS] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36,
+};
+
+/*---------------------------------------------------------------------------*/
+static inline uint8_t _aes_xtime(uint8_t x)
+{
+	return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
+
+/*---------------------------------------------------------------------------*/
+static void _aes_encrypt_portable(const BtCryptoAesKey *aes, const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t s[16];
+	for (int i=0 ; i<16 ; ++i) {
+		s[i] = in[i] ^ aes->round_keys[0][i];
+	}
+
+	for (int round=1 ; round<=BT_CRYPTO_AES128_ROUNDS ; ++round) {
+		//J SubBytes + ShiftRows (列優先の並び)
+		uint8_t t[16];
+		for (int c=0 ; c<4 ; ++c) {
+			for (int r=0 ; r<4 ; ++r) {
+				t[c * 4 + r] = _aes_sbox[s[((c + r) & 3) * 4 + r]];
+			}
+		}
+
+		if (round != BT_CRYPTO_AES128_ROUNDS) {
+			//J MixColumns
+			for (int c=0 ; c<4 ; ++c) {
+				uint8_t *col = &t[c * 4];
+				uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+				uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+				col[0] = a0 ^ all ^ _aes_xtime(a0 ^ a1);
+				col[1] = a1 ^ all ^ _aes_xtime(a1 ^ a2);
+				col[2] = a2 ^ all ^ _aes_xtime(a2 ^ a3);
+				col[3] = a3 ^ all ^ _aes_xtime(a3 ^ a0);
+			}
+		}
+
+		for (int i=0 ; i<16 ; ++i) {
+			s[i] = t[i] ^ aes->round_keys[round][i];
+		}
+	}
+
+	memcpy(out, s, 16);
+}
+
+/*---------------------------------------------------------------------------*/
+//J state = E(K, state ^ block) をブロック数だけ繰り返す
+static void _aes_cbc_mac_portable(const BtCryptoAesKey *aes, uint8_t state[16], const uint8_t *blocks, size_t num_blocks)
+{
+	for (size_t b=0 ; b<num_blocks ; ++b) {
+		for (int i=0 ; i<16 ; ++i) {
+			state[i] ^= blocks[b * 16 + i];
+		}
+		_aes_encrypt_portable(aes, state, state);
+	}
+}
+
+#ifdef BT_CRYPTO_HAVE_AESNI
+/*---------------------------------------------------------------------------*/
+__attribute__((target("aes,sse2")))
+static inline __m128i _aes_block_aesni(const __m128i *rk, __m128i s)
+{
+	s = _mm_xor_si128(s, rk[0]);
+	for (int round=1 ; round<BT_CRYPTO_AES128_ROUNDS ; ++round) {
+		s = _mm_aesenc_si128(s, rk[round]);
+	}
+	return _mm_aesenclast_si128(s, rk[BT_CRYPTO_AES128_ROUNDS]);
+}
+
+/*---------------------------------------------------------------------------*/
+__attribute__((target("aes,sse2")))
+static void _aes_cbc_mac_aesni(const BtCryptoAesKey *aes, uint8_t state[16], const uint8_t *blocks, size_t num_blocks)
+{
+	__m128i rk[BT_CRYPTO_AES128_ROUNDS + 1];
+	for (int i=0 ; i<=BT_CRYPTO_AES128_ROUNDS ; ++i) {
+		rk[i] = _mm_loadu_si128((const __m128i *)aes->round_keys[i]);
+	}
+
+	__m128i s = _mm_loadu_si128((const __m128i *)state);
+	for (size_t b=0 ; b<num_blocks ; ++b) {
+		s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *)&blocks[b * 16]));
+		s = _aes_block_aesni(rk, s);
+	}
+	_mm_storeu_si128((__m128i *)state, s);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool _aesni_supported(void)
+{
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) {
+		return false;
+	}
+	return (ecx & bit_AES) != 0;
+}
+#endif
+
+#ifdef BT_CRYPTO_HAVE_ARMV8
+/*---------------------------------------------------------------------------*/
+static void _aes_cbc_mac_armv8(const BtCryptoAesKey *aes, uint8_t state[16], const uint8_t *blocks, size_t num_blocks)
+{
+	uint8x16_t rk[BT_CRYPTO_AES128_ROUNDS + 1];
+	for (int i=0 ; i<=BT_CRYPTO_AES128_ROUNDS ; ++i) {
+		rk[i] = vld1q_u8(aes->round_keys[i]);
+	}
+
+	uint8x16_t s = vld1q_u8(state);
+	for (size_t b=0 ; b<num_blocks ; ++b) {
+		s = veorq_u8(s, vld1q_u8(&blocks[b * 16]));
+		//J AESE は AddRoundKey + SubBytes + ShiftRows
+		for (int round=0 ; round<BT_CRYPTO_AES128_ROUNDS - 1 ; ++round) {
+			s = vaesmcq_u8(vaeseq_u8(s, rk[round]));
+		}
+		s = vaeseq_u8(s, rk[BT_CRYPTO_AES128_ROUNDS - 1]);
+		s = veorq_u8(s, rk[BT_CRYPTO_AES128_ROUNDS]);
+	}
+	vst1q_u8(state, s);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool _armv8_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+static void _aes_cbc_mac(const struct bt_crypto *crypto, const BtCryptoAesKey *aes, uint8_t state[16], const uint8_t *blocks, size_t num_blocks)
+{
+	switch (crypto->backend) {
+#ifdef BT_CRYPTO_HAVE_AESNI
+	case BtCryptoBackend::cAesNi:
+		_aes_cbc_mac_aesni(aes, state, blocks, num_blocks);
+		break;
+#endif
+#ifdef BT_CRYPTO_HAVE_ARMV8
+	case BtCryptoBackend::cArmv8:
+		_aes_cbc_mac_armv8(aes, state, blocks, num_blocks);
+		break;
+#endif
+	default:
+		_aes_cbc_mac_portable(aes, state, blocks, num_blocks);
+		break;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+//J GF(2^128) 上で 2倍する (RFC 4493 2.3)
+static void _cmac_double(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t carry = (in[0] & 0x80) ? 0x87 : 0x00;
+	for (int i=0 ; i<15 ; ++i) {
+		out[i] = (uint8_t)((in[i] << 1) | (in[i + 1] >> 7));
+	}
+	out[15] = (uint8_t)((in[15] << 1) ^ carry);
+}
+
+/*---------------------------------------------------------------------------*/
+static void _swap_buf(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	for (size_t i=0 ; i<len ; ++i) {
+		dst[len - 1 - i] = src[i];
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+bool btCryptoIsBackendSupported(const uint8_t backend)
+{
+	switch (backend) {
+	case BtCryptoBackend::cPortable:
+		return true;
+#ifdef BT_CRYPTO_HAVE_AESNI
+	case BtCryptoBackend::cAesNi:
+		return _aesni_supported();
+#endif
+#ifdef BT_CRYPTO_HAVE_ARMV8
+	case BtCryptoBackend::cArmv8:
+		return _armv8_supported();
+#endif
+	default:
+		return false;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoInit(struct bt_crypto *crypto)
+{
+	if (crypto == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	crypto->backend = BtCryptoBackend::cPortable;
+	if (btCryptoIsBackendSupported(BtCryptoBackend::cAesNi)) {
+		crypto->backend = BtCryptoBackend::cAesNi;
+	}
+	else if (btCryptoIsBackendSupported(BtCryptoBackend::cArmv8)) {
+		crypto->backend = BtCryptoBackend::cArmv8;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoInitWithBackend(struct bt_crypto *crypto, const uint8_t backend)
+{
+	if (crypto == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!btCryptoIsBackendSupported(backend)) {
+		return AKS_ERROR_NOT_IMPLEMENTED;
+	}
+
+	crypto->backend = backend;
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+const char *btCryptoBackendToString(const uint8_t backend)
+{
+	switch (backend) {
+	case BtCryptoBackend::cPortable:
+		return "portable";
+	case BtCryptoBackend::cAesNi:
+		return "aes-ni";
+	case BtCryptoBackend::cArmv8:
+		return "armv8-ce";
+	default:
+		return "unknown";
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoAesExpandKey(const uint8_t key[BT_CRYPTO_KEY_SIZE], BtCryptoAesKey *aes)
+{
+	if ((key == NULL) || (aes == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	memcpy(aes->round_keys[0], key, BT_CRYPTO_KEY_SIZE);
+
+	for (int round=1 ; round<=BT_CRYPTO_AES128_ROUNDS ; ++round) {
+		const uint8_t *prev = aes->round_keys[round - 1];
+		uint8_t *rk = aes->round_keys[round];
+
+		//J RotWord + SubWord + Rcon
+		rk[0] = prev[0] ^ _aes_sbox[prev[13]] ^ _aes_rcon[round - 1];
+		rk[1] = prev[1] ^ _aes_sbox[prev[14]];
+		rk[2] = prev[2] ^ _aes_sbox[prev[15]];
+		rk[3] = prev[3] ^ _aes_sbox[prev[12]];
+		for (int i=4 ; i<16 ; ++i) {
+			rk[i] = prev[i] ^ rk[i - 4];
+		}
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoAesEncrypt(
+								const struct bt_crypto *crypto,
+								const BtCryptoAesKey *aes,
+								const uint8_t in[BT_CRYPTO_BLOCK_SIZE],
+								uint8_t out[BT_CRYPTO_BLOCK_SIZE])
+{
+	if ((crypto == NULL) || (aes == NULL) || (in == NULL) || (out == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint8_t state[BT_CRYPTO_BLOCK_SIZE];
+	memset(state, 0x00, sizeof(state));
+	_aes_cbc_mac(crypto, aes, state, in, 1);
+	memcpy(out, state, sizeof(state));
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoCmacInit(
+								const struct bt_crypto *crypto,
+								const uint8_t key[BT_CRYPTO_KEY_SIZE],
+								BtCryptoCmacKey *cmac)
+{
+	if ((crypto == NULL) || (key == NULL) || (cmac == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	btCryptoAesExpandKey(key, &cmac->aes);
+
+	uint8_t zero[BT_CRYPTO_BLOCK_SIZE];
+	uint8_t l[BT_CRYPTO_BLOCK_SIZE];
+	memset(zero, 0x00, sizeof(zero));
+	btCryptoAesEncrypt(crypto, &cmac->aes, zero, l);
+
+	_cmac_double(l, cmac->k1);
+	_cmac_double(cmac->k1, cmac->k2);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoCmac(
+								const struct bt_crypto *crypto,
+								const BtCryptoCmacKey *cmac,
+								const uint8_t *msg,
+								const size_t len,
+								uint8_t mac[BT_CRYPTO_BLOCK_SIZE])
+{
+	if ((crypto == NULL) || (cmac == NULL) || (mac == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((msg == NULL) && (len != 0)) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J 最後のブロックは K1 (揃っている) か K2 (パディング) と混ぜる
+	size_t num_blocks = (len + BT_CRYPTO_BLOCK_SIZE - 1) / BT_CRYPTO_BLOCK_SIZE;
+	bool complete = (num_blocks != 0) && ((len % BT_CRYPTO_BLOCK_SIZE) == 0);
+	if (num_blocks == 0) {
+		num_blocks = 1;
+	}
+
+	uint8_t state[BT_CRYPTO_BLOCK_SIZE];
+	memset(state, 0x00, sizeof(state));
+	_aes_cbc_mac(crypto, &cmac->aes, state, msg, num_blocks - 1);
+
+	uint8_t last[BT_CRYPTO_BLOCK_SIZE];
+	size_t last_offset = (num_blocks - 1) * BT_CRYPTO_BLOCK_SIZE;
+	size_t last_len = len - last_offset;
+	if (complete) {
+		for (int i=0 ; i<BT_CRYPTO_BLOCK_SIZE ; ++i) {
+			last[i] = msg[last_offset + i] ^ cmac->k1[i];
+		}
+	}
+	else {
+		memset(last, 0x00, sizeof(last));
+		if (last_len != 0) {
+			memcpy(last, &msg[last_offset], last_len);
+		}
+		last[last_len] = 0x80;
+		for (int i=0 ; i<BT_CRYPTO_BLOCK_SIZE ; ++i) {
+			last[i] ^= cmac->k2[i];
+		}
+	}
+
+	_aes_cbc_mac(crypto, &cmac->aes, state, last, 1);
+	memcpy(mac, state, BT_CRYPTO_BLOCK_SIZE);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoSignKeyInit(
+								const struct bt_crypto *crypto,
+								const uint8_t csrk[BT_CRYPTO_KEY_SIZE],
+								BtCryptoCmacKey *cmac)
+{
+	if (csrk == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J AES の鍵は先頭が最上位バイト
+	uint8_t key[BT_CRYPTO_KEY_SIZE];
+	_swap_buf(csrk, key, sizeof(key));
+
+	return btCryptoCmacInit(crypto, key, cmac);
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoSignAtt(
+								const struct bt_crypto *crypto,
+								const BtCryptoCmacKey *cmac,
+								const uint8_t *data,
+								const size_t size,
+								const uint32_t sign_count,
+								uint8_t signature[BT_CRYPTO_SIGNATURE_SIZE])
+{
+	if ((crypto == NULL) || (cmac == NULL) || (signature == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((data == NULL) && (size != 0)) {
+		return AKS_ERROR_NULL;
+	}
+	if (size + sizeof(uint32_t) > BT_CRYPTO_MAX_SIGN_MESSAGE) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	//J M = data || SignCounter (LE) を最上位バイトが先頭になるように反転して CMAC を取る
+	uint8_t msg[BT_CRYPTO_MAX_SIGN_MESSAGE];
+	size_t msg_len = size + sizeof(uint32_t);
+	msg[0] = (uint8_t)(sign_count >> 24);
+	msg[1] = (uint8_t)(sign_count >> 16);
+	msg[2] = (uint8_t)(sign_count >> 8);
+	msg[3] = (uint8_t)(sign_count);
+	_swap_buf(data, &msg[sizeof(uint32_t)], size);
+
+	uint8_t mac[BT_CRYPTO_BLOCK_SIZE];
+	btCryptoCmac(crypto, cmac, msg, msg_len, mac);
+
+	//J 署名は SignCounter (LE) と MAC の上位 64bit (LE)
+	signature[0] = (uint8_t)(sign_count);
+	signature[1] = (uint8_t)(sign_count >> 8);
+	signature[2] = (uint8_t)(sign_count >> 16);
+	signature[3] = (uint8_t)(sign_count >> 24);
+	_swap_buf(mac, &signature[sizeof(uint32_t)], 8);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btCryptoVerifyAtt(
+								const struct bt_crypto *crypto,
+								const BtCryptoCmacKey *cmac,
+								const uint8_t *data,
+								const size_t size,
+								const uint8_t signature[BT_CRYPTO_SIGNATURE_SIZE],
+								uint32_t &sign_count)
+{
+	if (signature == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	sign_count = (uint32_t)signature[0]
+			   | ((uint32_t)signature[1] << 8)
+			   | ((uint32_t)signature[2] << 16)
+			   | ((uint32_t)signature[3] << 24);
+
+	uint8_t expected[BT_CRYPTO_SIGNATURE_SIZE];
+	int ret = btCryptoSignAtt(crypto, cmac, data, size, sign_count, expected);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	//J 比較にかかる時間を一致したバイト数に依存させない
+	uint8_t diff = 0;
+	for (int i=0 ; i<BT_CRYPTO_SIGNATURE_SIZE ; ++i) {
+		diff |= expected[i] ^ signature[i];
+	}
+	if (diff != 0) {
+		return AKS_ERROR_BT_INVALID_SIGNATURE;
+	}
+
+	return AKS_OK;
+}
@@ -0,0 +1,89 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_CRYPTO_H_
+#define BT_CRYPTO_H_
+
+/*
+ *J AES-128 と AES-CMAC (RFC 4493)
+ *J CPU に AES 命令 (x86 AES-NI, ARMv8 Crypto Extension) があれば使い、
+ *J 無ければバイト単位の実装で計算する。
+ */
+
+#define BT_CRYPTO_KEY_SIZE							(16)
+#define BT_CRYPTO_BLOCK_SIZE						(16)
+#define BT_CRYPTO_AES128_ROUNDS						(10)
+#define BT_CRYPTO_SIGNATURE_SIZE					(12)	//J SignCounter (4) + MAC (8)
+#define BT_CRYPTO_MAX_SIGN_MESSAGE					(1024)
+
+struct BtCryptoBackend {
+	static const uint8_t cPortable					= 0;
+	static const uint8_t cAesNi						= 1;
+	static const uint8_t cArmv8						= 2;
+};
+
+struct bt_crypto
+{
+	uint8_t backend;
+};
+
+struct BtCryptoAesKey
+{
+	uint8_t round_keys[BT_CRYPTO_AES128_ROUNDS + 1][BT_CRYPTO_BLOCK_SIZE];
+};
+
+//J 鍵ごとに一度だけ計算しておく CMAC の鍵
+struct BtCryptoCmacKey
+{
+	BtCryptoAesKey aes;
+	uint8_t k1[BT_CRYPTO_BLOCK_SIZE];
+	uint8_t k2[BT_CRYPTO_BLOCK_SIZE];
+};
+
+int btCryptoInit(struct bt_crypto *crypto);
+int btCryptoInitWithBackend(struct bt_crypto *crypto, const uint8_t backend);
+bool btCryptoIsBackendSupported(const uint8_t backend);
+const char *btCryptoBackendToString(const uint8_t backend);
+
+int btCryptoAesExpandKey(const uint8_t key[BT_CRYPTO_KEY_SIZE], BtCryptoAesKey *aes);
+int btCryptoAesEncrypt(
+								const struct bt_crypto *crypto,
+								const BtCryptoAesKey *aes,
+								const uint8_t in[BT_CRYPTO_BLOCK_SIZE],
+								uint8_t out[BT_CRYPTO_BLOCK_SIZE]);
+
+int btCryptoCmacInit(
+								const struct bt_crypto *crypto,
+								const uint8_t key[BT_CRYPTO_KEY_SIZE],
+								BtCryptoCmacKey *cmac);
+int btCryptoCmac(
+								const struct bt_crypto *crypto,
+								const BtCryptoCmacKey *cmac,
+								const uint8_t *msg,
+								const size_t len,
+								uint8_t mac[BT_CRYPTO_BLOCK_SIZE]);
+
+//J ATT の署名 (Core Spec Vol 3 Part H 2.4.5)。CSRK と署名は LE のバイト順
+int btCryptoSignKeyInit(
+								const struct bt_crypto *crypto,
+								const uint8_t csrk[BT_CRYPTO_KEY_SIZE],
+								BtCryptoCmacKey *cmac);
+int btCryptoSignAtt(
+								const struct bt_crypto *crypto,
+								const BtCryptoCmacKey *cmac,
+								const uint8_t *data,
+								const size_t size,
+								const uint32_t sign_count,
+								uint8_t signature[BT_CRYPTO_SIGNATURE_SIZE]);
+int btCryptoVerifyAtt(
+								const struct bt_crypto *crypto,
+								const BtCryptoCmacKey *cmac,
+								const uint8_t *data,
+								const size_t size,
+								const uint8_t signature[BT_CRYPTO_SIGNATURE_SIZE],
+								uint32_t &sign_count);
+
+#endif/*BT_CRYPTO_H_*/
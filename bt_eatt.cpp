@@ -0,0 +1,413 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_gatt.h"
+#include "bt_util.h"
+#include "bt_le_device.h"
+#include "bt_eatt.h"
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static void _eatt_process(BtGattDeviceContext *bearer, BtEattRequest *request)
+{
+	request->rsp_len = 0;
+
+	if ((request->pdu == NULL) || (request->len == 0)) {
+		request->result = AKS_ERROR_NULL;
+		return;
+	}
+	if (request->len > btLeDeviceGetMtu(bearer)) {
+		request->result = AKS_ERROR_NOBUF;
+		return;
+	}
+
+	if (request->expected_opcode == 0) {
+		request->result = btLeDeviceSendAttPdu(bearer, request->pdu, request->len);
+		return;
+	}
+
+	int ret = btLeDeviceSendAttPduAndWaitForResponse(
+								bearer,
+								request->pdu,
+								request->len,
+								request->expected_opcode,
+								0);
+	if (ret != AKS_OK) {
+		request->result = ret;
+		return;
+	}
+	if (bearer->read_error != AKS_OK) {
+		request->result = bearer->read_error;
+		return;
+	}
+
+	if ((request->rsp != NULL) && (request->rsp_size != 0)) {
+		if ((size_t)bearer->read_size > request->rsp_size) {
+			request->result = AKS_ERROR_NOBUF;
+			return;
+		}
+		memcpy(request->rsp, bearer->read_buf, (size_t)bearer->read_size);
+	}
+	request->rsp_len = (size_t)bearer->read_size;
+	request->result  = AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 自分の Bearer が空いている間、共有キューから次の Request を取って処理する
+static void *_eatt_worker_func(void *arg)
+{
+	BtEattWorker  *worker = (BtEattWorker *)arg;
+	BtEattContext *eatt   = worker->eatt;
+	uint32_t       index  = worker->index;
+	BtGattDeviceContext *bearer = &eatt->bearers[index];
+
+	pthread_mutex_lock(&eatt->mutex);
+	while (eatt->running) {
+		if ((eatt->next >= eatt->num_requests) || worker->acquired) {
+			pthread_cond_wait(&eatt->workCv, &eatt->mutex);
+			continue;
+		}
+
+		BtEattRequest *request = &eatt->requests[eatt->next++];
+		worker->busy = true;
+		pthread_mutex_unlock(&eatt->mutex);
+
+		uint64_t start_ns = btUtilGetMonotonicTimeNs();
+		_eatt_process(bearer, request);
+		request->bearer = (uint8_t)index;
+
+		__atomic_fetch_add(&eatt->stats.requests, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&eatt->stats.bearer_requests[index], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&eatt->stats.bearer_busy_ns[index], btUtilGetMonotonicTimeNs() - start_ns, __ATOMIC_RELAXED);
+		if (request->result != AKS_OK) {
+			__atomic_fetch_add(&eatt->stats.errors, 1, __ATOMIC_RELAXED);
+		}
+
+		pthread_mutex_lock(&eatt->mutex);
+		worker->busy = false;
+		eatt->finished++;
+		if (eatt->finished == eatt->num_requests) {
+			pthread_cond_broadcast(&eatt->doneCv);
+		}
+		pthread_cond_broadcast(&eatt->freeCv);
+	}
+	pthread_mutex_unlock(&eatt->mutex);
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J options は Bearer を張る Adapter / address_type / connect_timeout_ms (NULL なら既定値)。
+//J 固定 CID の Bearer と同じ BtLeDeviceOptions を渡せば同じ Controller から同じ相手に張る
+/*---------------------------------------------------------------------------*/
+int btEattCreate(
+								BtEattContext *eatt,
+								const char *btaddr,
+								const uint32_t num_bearers,
+								const uint16_t mtu,
+								const BtLeDeviceOptions *options)
+{
+	if ((eatt == NULL) || (btaddr == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((num_bearers == 0) || (num_bearers > BT_EATT_MAX_BEARERS)) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((mtu < BT_EATT_MIN_MTU) || (mtu > BT_ATT_MAX_LE_MTU)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	BtLeDeviceOptions channel_options;
+	if (options != NULL) {
+		channel_options = *options;
+	}
+	else {
+		(void)btLeDeviceInitOptions(&channel_options);
+	}
+
+	//J EATT は暗号化された Link の上でしか張れない
+	if (channel_options.security_level < BtLeDeviceSecurityLevel::cMedium) {
+		channel_options.security_level = BtLeDeviceSecurityLevel::cMedium;
+	}
+
+	int socks[BT_EATT_MAX_BEARERS];
+	for (uint32_t i=0 ; i<num_bearers ; ++i) {
+		socks[i] = btLeDeviceOpenL2capChannel(
+								btaddr,
+								BT_EATT_PSM,
+								BtLeDeviceL2capMode::cExtendedFlowControl,
+								mtu,
+								&channel_options);
+		if (socks[i] < 0) {
+			int ret = socks[i];
+			for (uint32_t j=0 ; j<i ; ++j) {
+				close(socks[j]);
+			}
+			return ret;
+		}
+	}
+
+	return btEattCreateWithSockets(eatt, socks, num_bearers, mtu);
+}
+
+/*---------------------------------------------------------------------------*/
+//J socks は EATT の Bearer として張り終えた Socket (テストでは socketpair の片側)。
+//J 失敗した場合も含めて全ての Socket は btEattDestroy() で閉じられる
+int btEattCreateWithSockets(
+								BtEattContext *eatt,
+								const int *socks,
+								const uint32_t num_bearers,
+								const uint16_t mtu)
+{
+	if ((eatt == NULL) || (socks == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((num_bearers == 0) || (num_bearers > BT_EATT_MAX_BEARERS)) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((mtu < BT_EATT_MIN_MTU) || (mtu > BT_ATT_MAX_LE_MTU)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(eatt, 0x00, sizeof(BtEattContext));
+
+	pthread_mutex_init(&eatt->mutex, NULL);
+	pthread_mutex_init(&eatt->submitMutex, NULL);
+	pthread_cond_init(&eatt->workCv, NULL);
+	pthread_cond_init(&eatt->doneCv, NULL);
+	pthread_cond_init(&eatt->freeCv, NULL);
+
+	eatt->running = true;
+
+	//J Exchange MTU も Client Supported Features の書き込みも EATT の Bearer ではしない
+	BtLeDeviceOptions options;
+	btLeDeviceInitOptions(&options);
+	options.mtu             = 0;
+	options.client_features = 0;
+
+	int ret = AKS_OK;
+	uint32_t i = 0;
+	for ( ; i<num_bearers ; ++i) {
+		BtGattDeviceContext *bearer = &eatt->bearers[i];
+		ret = btLeDeviceCreateWithSocket(bearer, socks[i], &options);
+		if (ret != AKS_OK) {
+			break;
+		}
+
+		//J ATT_MTU は L2CAP の MTU。Socket から取れない場合 (socketpair) は mtu を使う
+		bearer->client.mtu = (bearer->l2cap.rcvmtu < mtu) ? bearer->l2cap.rcvmtu : mtu;
+		bearer->server.mtu = (bearer->l2cap.sndmtu < mtu) ? bearer->l2cap.sndmtu : mtu;
+
+		BtEattWorker *worker = &eatt->workers[i];
+		worker->eatt  = eatt;
+		worker->index = i;
+		ret = pthread_create(&worker->thread, NULL, _eatt_worker_func, (void *)worker);
+		eatt->num_bearers++;
+		if (ret != 0) {
+			//J Worker の無い Bearer も btEattDestroy() で壊す
+			i++;
+			break;
+		}
+		worker->started = true;
+	}
+
+	if (ret != AKS_OK) {
+		for ( ; i<num_bearers ; ++i) {
+			close(socks[i]);
+		}
+		btEattDestroy(eatt);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J Bearer の受信スレッドの Callback が戻らず壊せない Bearer があれば、それと同期オブジェクトを
+//J 残して AKS_ERROR_TIMEOUT を返す。その場合はもう一度呼ぶ
+/*---------------------------------------------------------------------------*/
+int btEattDestroy(BtEattContext *eatt)
+{
+	if (eatt == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&eatt->mutex);
+	eatt->running = false;
+	pthread_cond_broadcast(&eatt->workCv);
+	pthread_cond_broadcast(&eatt->freeCv);
+	pthread_mutex_unlock(&eatt->mutex);
+
+	//J Response を待ったままの Worker がいると join が終わらないので、先に全ての Bearer を起こす
+	for (uint32_t i=0 ; i<eatt->num_bearers ; ++i) {
+		(void)btLeDeviceShutdown(&eatt->bearers[i]);
+	}
+	for (uint32_t i=0 ; i<eatt->num_bearers ; ++i) {
+		if (eatt->workers[i].started) {
+			pthread_join(eatt->workers[i].thread, NULL);
+			eatt->workers[i].started = false;
+		}
+	}
+
+	int ret = AKS_OK;
+	for (uint32_t i=0 ; i<eatt->num_bearers ; ++i) {
+		if (btLeDeviceDestroy(&eatt->bearers[i]) != AKS_OK) {
+			ret = AKS_ERROR_TIMEOUT;
+		}
+	}
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	eatt->num_bearers = 0;
+
+	pthread_cond_destroy(&eatt->freeCv);
+	pthread_cond_destroy(&eatt->doneCv);
+	pthread_cond_destroy(&eatt->workCv);
+	pthread_mutex_destroy(&eatt->submitMutex);
+	pthread_mutex_destroy(&eatt->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 全ての Request が終わるまで戻らない。Request 同士の順序は保証しない
+int btEattSubmit(
+								BtEattContext *eatt,
+								BtEattRequest *requests,
+								const size_t num_requests)
+{
+	if ((eatt == NULL) || (requests == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (num_requests == 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	for (size_t i=0 ; i<num_requests ; ++i) {
+		requests[i].result  = AKS_OK;
+		requests[i].rsp_len = 0;
+		requests[i].bearer  = 0;
+	}
+
+	pthread_mutex_lock(&eatt->submitMutex);
+
+	pthread_mutex_lock(&eatt->mutex);
+	eatt->requests     = requests;
+	eatt->num_requests = num_requests;
+	eatt->next         = 0;
+	eatt->finished     = 0;
+	pthread_cond_broadcast(&eatt->workCv);
+
+	while (eatt->running && (eatt->finished != num_requests)) {
+		pthread_cond_wait(&eatt->doneCv, &eatt->mutex);
+	}
+	bool completed = (eatt->finished == num_requests);
+
+	eatt->requests     = NULL;
+	eatt->num_requests = 0;
+	eatt->next         = 0;
+	pthread_mutex_unlock(&eatt->mutex);
+
+	pthread_mutex_unlock(&eatt->submitMutex);
+
+	if (!completed) {
+		return AKS_ERROR_CANCELED;
+	}
+
+	for (size_t i=0 ; i<num_requests ; ++i) {
+		if (requests[i].result != AKS_OK) {
+			return requests[i].result;
+		}
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 空いている Bearer を 1つ借りる。返すまでワーカーはその Bearer を使わない
+BtGattDeviceContext *btEattAcquireBearer(BtEattContext *eatt)
+{
+	if (eatt == NULL) {
+		return NULL;
+	}
+
+	BtGattDeviceContext *bearer = NULL;
+
+	pthread_mutex_lock(&eatt->mutex);
+	while (eatt->running && (bearer == NULL)) {
+		for (uint32_t i=0 ; i<eatt->num_bearers ; ++i) {
+			BtEattWorker *worker = &eatt->workers[i];
+			if (!worker->busy && !worker->acquired) {
+				worker->acquired = true;
+				bearer = &eatt->bearers[i];
+				break;
+			}
+		}
+		if (bearer == NULL) {
+			pthread_cond_wait(&eatt->freeCv, &eatt->mutex);
+		}
+	}
+	pthread_mutex_unlock(&eatt->mutex);
+
+	return bearer;
+}
+
+/*---------------------------------------------------------------------------*/
+int btEattReleaseBearer(BtEattContext *eatt, BtGattDeviceContext *bearer)
+{
+	if ((eatt == NULL) || (bearer == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((bearer < &eatt->bearers[0]) || (bearer >= &eatt->bearers[eatt->num_bearers])) {
+		return AKS_ERROR_INVALID;
+	}
+
+	uint32_t index = (uint32_t)(bearer - &eatt->bearers[0]);
+
+	pthread_mutex_lock(&eatt->mutex);
+	if (!eatt->workers[index].acquired) {
+		pthread_mutex_unlock(&eatt->mutex);
+		return AKS_ERROR_INVALID;
+	}
+	eatt->workers[index].acquired = false;
+	pthread_cond_broadcast(&eatt->workCv);
+	pthread_cond_broadcast(&eatt->freeCv);
+	pthread_mutex_unlock(&eatt->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btEattGetStatistics(BtEattContext *eatt, BtEattStatistics *stats)
+{
+	if ((eatt == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	stats->requests = __atomic_load_n(&eatt->stats.requests, __ATOMIC_RELAXED);
+	stats->errors   = __atomic_load_n(&eatt->stats.errors, __ATOMIC_RELAXED);
+	for (uint32_t i=0 ; i<BT_EATT_MAX_BEARERS ; ++i) {
+		stats->bearer_requests[i] = __atomic_load_n(&eatt->stats.bearer_requests[i], __ATOMIC_RELAXED);
+		stats->bearer_busy_ns[i]  = __atomic_load_n(&eatt->stats.bearer_busy_ns[i], __ATOMIC_RELAXED);
+	}
+
+	return AKS_OK;
+}
@@ -0,0 +1,108 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_EATT_H_
+#define BT_EATT_H_
+
+/*
+ *J Enhanced ATT (EATT) の Bearer をまとめて扱う
+ *J
+ *J 固定 CID の ATT Bearer は同時に 1つしか Request を出せないが、EATT の Bearer
+ *J (PSM 0x0027 の Enhanced Credit Based Flow Control Channel) はそれぞれが
+ *J 1つずつ Request を出せる。Bearer ごとにワーカースレッドを置き、
+ *J btEattSubmit() の Request を空いた Bearer から順に取らせる。
+ *J
+ *J ATT_MTU は L2CAP の MTU で決まるので Exchange MTU はしない。
+ *J Peer が EATT を受け付けるには、固定 CID の Bearer で Client Supported Features の
+ *J BtGattClientSupportedFeatures::cEnhancedAtt を書いておく必要がある。
+ */
+
+#define BT_EATT_PSM									(0x0027)
+#define BT_EATT_MIN_MTU								(64)
+#define BT_EATT_MAX_BEARERS							(8)
+
+struct BtEattRequest
+{
+	const uint8_t *pdu;
+	size_t         len;
+	uint8_t        expected_opcode;	//J 0 なら Command (Response を待たない)
+	uint8_t       *rsp;				//J Response の PDU をコピーする先
+	size_t         rsp_size;
+
+	int            result;			//J 結果 (ATT の Error Response は AKS_ERROR_BT_ATT_ERROR | Error Code)
+	size_t         rsp_len;
+	uint8_t        bearer;			//J 処理した Bearer の番号
+};
+
+struct BtEattStatistics
+{
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t bearer_requests[BT_EATT_MAX_BEARERS];
+	uint64_t bearer_busy_ns[BT_EATT_MAX_BEARERS];	//J Bearer が Request を処理していた時間
+};
+
+struct BtEattContext;
+
+//J Bearer ごとのワーカースレッド
+struct BtEattWorker
+{
+	BtEattContext *eatt;
+	uint32_t       index;
+	pthread_t      thread;
+	bool           started;			//J スレッドを作った (btEattDestroy() で join する)
+	bool           busy;			//J Request を処理中
+	bool           acquired;		//J btEattAcquireBearer() で貸し出し中
+};
+
+struct BtEattContext
+{
+	bool running;
+
+	uint32_t            num_bearers;
+	BtGattDeviceContext bearers[BT_EATT_MAX_BEARERS];
+	BtEattWorker        workers[BT_EATT_MAX_BEARERS];
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  workCv;
+	pthread_cond_t  doneCv;
+	pthread_cond_t  freeCv;			//J Bearer が空いた
+	pthread_mutex_t submitMutex;	//J Submit は 1つずつ
+
+	//J 実行中の Request
+	BtEattRequest *requests;
+	size_t         num_requests;
+	size_t         next;
+	size_t         finished;
+
+	BtEattStatistics stats;
+};
+
+int btEattCreate(
+								BtEattContext *eatt,
+								const char *btaddr,
+								const uint32_t num_bearers,
+								const uint16_t mtu,
+								const BtLeDeviceOptions *options);
+int btEattCreateWithSockets(
+								BtEattContext *eatt,
+								const int *socks,
+								const uint32_t num_bearers,
+								const uint16_t mtu);
+int btEattDestroy(BtEattContext *eatt);
+
+int btEattSubmit(
+								BtEattContext *eatt,
+								BtEattRequest *requests,
+								const size_t num_requests);
+
+//J Discovery など複数の Request が続く GATT の手続きは、Bearer を借りて btGatt*() に渡す
+BtGattDeviceContext *btEattAcquireBearer(BtEattContext *eatt);
+int btEattReleaseBearer(BtEattContext *eatt, BtGattDeviceContext *bearer);
+
+int btEattGetStatistics(BtEattContext *eatt, BtEattStatistics *stats);
+
+#endif/*BT_EATT_H_*/
@@ -0,0 +1,1060 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_gatt.h"
+#include "bt_util.h"
+#include "bt_le_device.h"
+#include "bt_gateway.h"
+
+
+//J Linux 5.1 より前のヘッダには無い
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE							(0x0010)
+#endif
+
+
+static void *_gateway_thread_func(void *arg);
+static int _gateway_notification(void *arg, BtAttHandle handle, uint8_t *value, size_t value_len);
+
+
+/*---------------------------------------------------------------------------*/
+static size_t _gateway_record_size(size_t value_len)
+{
+	size_t size = sizeof(BtGatewayRecord) + value_len;
+	return (size + BT_GATEWAY_RECORD_ALIGN - 1) & ~((size_t)BT_GATEWAY_RECORD_ALIGN - 1);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 大きさを固定し (クライアントが縮めるとデーモンが SIGBUS になる)、
+//J read_only なら以降は書き込み可能に map できないようにする
+/*---------------------------------------------------------------------------*/
+static int _gateway_seal(int fd, bool read_only)
+{
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+	if (read_only) {
+		seals |= F_SEAL_FUTURE_WRITE;
+	}
+	if (fcntl(fd, F_ADD_SEALS, seals | F_SEAL_SEAL) < 0) {
+		return AKS_ERROR_IO;
+	}
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _gateway_unix_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return AKS_ERROR_INVALID;
+	}
+	strcpy(addr->sun_path, path);
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayCreate(BtGatewayContext *gw, const char *path, const size_t ring_size)
+{
+	if ((gw == NULL) || (path == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(gw, 0, sizeof(BtGatewayContext));
+	gw->sock    = -1;
+	gw->wake_fd = -1;
+
+	//J 最大のレコードが必ず入る大きさにする
+	gw->ring_size = (ring_size == 0) ? BT_GATEWAY_DEFAULT_RING_SIZE : ring_size;
+	gw->ring_size &= ~((size_t)BT_GATEWAY_RECORD_ALIGN - 1);
+	if (gw->ring_size < 2 * _gateway_record_size(BT_GATEWAY_MAX_VALUE_SIZE)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	struct sockaddr_un addr;
+	int ret = _gateway_unix_address(path, &addr);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	strcpy(gw->path, path);
+
+	gw->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (gw->sock < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	//J 前回のデーモンが残した Socket ファイルは消す
+	(void)unlink(path);
+	if ((bind(gw->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+		(listen(gw->sock, BT_GATEWAY_MAX_CLIENTS) < 0)) {
+		close(gw->sock);
+		gw->sock = -1;
+		return AKS_ERROR_IO;
+	}
+
+	gw->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (gw->wake_fd < 0) {
+		close(gw->sock);
+		gw->sock = -1;
+		(void)unlink(path);
+		return AKS_ERROR_IO;
+	}
+
+	for (int i=0 ; i<BT_GATEWAY_MAX_CLIENTS ; ++i) {
+		gw->clients[i].sock     = -1;
+		gw->clients[i].ring_fd  = -1;
+		gw->clients[i].tail_fd  = -1;
+		gw->clients[i].event_fd = -1;
+	}
+
+	pthread_mutex_init(&gw->mutex, NULL);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _gateway_drop_client(BtGatewayContext *gw, BtGatewayClient *client)
+{
+	//J Notification のスレッドがリングに書いている最中には外さない
+	pthread_mutex_lock(&gw->mutex);
+	client->connected         = false;
+	client->faulted           = false;
+	client->num_subscriptions = 0;
+	pthread_mutex_unlock(&gw->mutex);
+
+	if (client->ring != NULL) {
+		munmap(client->ring, sizeof(BtGatewayRing) + gw->ring_size);
+		client->ring = NULL;
+	}
+	if (client->tail != NULL) {
+		munmap((void *)client->tail, sizeof(BtGatewayRingTail));
+		client->tail = NULL;
+	}
+	if (client->ring_fd >= 0) {
+		close(client->ring_fd);
+		client->ring_fd = -1;
+	}
+	if (client->tail_fd >= 0) {
+		close(client->tail_fd);
+		client->tail_fd = -1;
+	}
+	if (client->event_fd >= 0) {
+		close(client->event_fd);
+		client->event_fd = -1;
+	}
+	if (client->sock >= 0) {
+		close(client->sock);
+		client->sock = -1;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayDestroy(BtGatewayContext *gw)
+{
+	if (gw == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	if (gw->running) {
+		uint64_t one = 1;
+		gw->running = false;
+		(void)write(gw->wake_fd, &one, sizeof(one));
+		pthread_join(gw->thread, NULL);
+	}
+
+	for (int i=0 ; i<BT_GATEWAY_MAX_CLIENTS ; ++i) {
+		if (gw->clients[i].sock >= 0) {
+			_gateway_drop_client(gw, &gw->clients[i]);
+		}
+	}
+
+	//J 受信スレッドが gw->mutex を取るので、ロックを持たずに外す (呼び出し中の Callback は待つ)
+	for (uint32_t i=0 ; i<gw->num_devices ; ++i) {
+		BtGatewayDevice *dev = &gw->devices[i];
+		for (uint32_t j=0 ; j<dev->num_registrations ; ++j) {
+			(void)btLeDeviceUnregistNotificationCallbackWithArg(dev->ctx, dev->registrations[j], _gateway_notification, dev);
+		}
+		dev->num_registrations = 0;
+	}
+
+	pthread_mutex_lock(&gw->mutex);
+	gw->num_devices = 0;
+	pthread_mutex_unlock(&gw->mutex);
+
+	if (gw->sock >= 0) {
+		close(gw->sock);
+		gw->sock = -1;
+		(void)unlink(gw->path);
+	}
+	if (gw->wake_fd >= 0) {
+		close(gw->wake_fd);
+		gw->wake_fd = -1;
+	}
+
+	pthread_mutex_destroy(&gw->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J btGatewayStart() の前に呼ぶ。以降 ctx はゲートウェイのスレッドだけが使う
+/*---------------------------------------------------------------------------*/
+int btGatewayAddDevice(BtGatewayContext *gw, BtGattDeviceContext *ctx, uint8_t &device)
+{
+	if ((gw == NULL) || (ctx == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (gw->running) {
+		return AKS_ERROR_INVALID;
+	}
+	if (gw->num_devices >= BT_GATEWAY_MAX_DEVICES) {
+		return AKS_ERROR_FULL;
+	}
+
+	BtGatewayDevice *dev = &gw->devices[gw->num_devices];
+	dev->gw  = gw;
+	dev->ctx = ctx;
+	dev->id  = (uint8_t)gw->num_devices;
+
+	device = dev->id;
+	gw->num_devices++;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayStart(BtGatewayContext *gw)
+{
+	if (gw == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((gw->running) || (gw->sock < 0)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	gw->running = true;
+	if (pthread_create(&gw->thread, NULL, _gateway_thread_func, gw) != 0) {
+		gw->running = false;
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayGetStatistics(BtGatewayContext *gw, BtGatewayStatistics *stats)
+{
+	if ((gw == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&gw->mutex);
+	*stats = gw->stats;
+	pthread_mutex_unlock(&gw->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J リングに 1レコード書く (gw->mutex を持って呼ぶので Producer は常に1つ)
+//J 共有メモリから読むのは tail だけで、位置は自分の head と gw->ring_size で決める
+/*---------------------------------------------------------------------------*/
+static int _gateway_ring_push(
+								BtGatewayContext *gw,
+								BtGatewayClient *client,
+								uint8_t device,
+								BtAttHandle handle,
+								const uint8_t *value,
+								size_t value_len,
+								uint64_t timestamp_ns)
+{
+	BtGatewayRing *ring = client->ring;
+	size_t ring_size = gw->ring_size;
+	size_t rec_size = _gateway_record_size(value_len);
+
+	uint64_t head = client->head;
+	uint64_t tail = __atomic_load_n(&client->tail->tail, __ATOMIC_ACQUIRE);
+
+	//J 書いた所より先や、リング 1周より前を読み終えたことにはできない
+	if ((tail > head) || (head - tail > ring_size)) {
+		client->connected = false;
+		client->faulted   = true;
+		uint64_t one = 1;
+		(void)write(gw->wake_fd, &one, sizeof(one));
+		return AKS_ERROR_INVALID;
+	}
+
+	size_t pos = (size_t)(head % ring_size);
+	size_t contiguous = ring_size - pos;
+
+	//J 末尾に収まらなければ詰め物をして先頭から書く
+	size_t need = rec_size + ((contiguous < rec_size) ? contiguous : 0);
+	if (ring_size - (size_t)(head - tail) < need) {
+		client->dropped++;
+		__atomic_store_n(&ring->dropped, client->dropped, __ATOMIC_RELAXED);
+		gw->stats.dropped++;
+		return AKS_ERROR_FULL;
+	}
+
+	uint64_t start = head;
+	if (contiguous < rec_size) {
+		BtGatewayRecord *pad = (BtGatewayRecord *)&ring->data[pos];
+		memset(pad, 0, sizeof(BtGatewayRecord));
+		pad->len   = (uint16_t)(contiguous - sizeof(BtGatewayRecord));
+		pad->flags = BtGatewayRecordFlags::cPad;
+		head += contiguous;
+		pos = 0;
+	}
+
+	BtGatewayRecord *rec = (BtGatewayRecord *)&ring->data[pos];
+	rec->len          = (uint16_t)value_len;
+	rec->device       = device;
+	rec->flags        = 0;
+	rec->handle       = handle;
+	rec->reserved     = 0;
+	rec->timestamp_ns = timestamp_ns;
+	memcpy(rec->value, value, value_len);
+	head += rec_size;
+
+	client->head = head;
+	__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+	gw->stats.published++;
+
+	//J 書く前に空だった (クライアントが寝ているかもしれない) 時だけ起こす
+	if (__atomic_load_n(&client->tail->tail, __ATOMIC_SEQ_CST) == start) {
+		uint64_t one = 1;
+		(void)write(client->event_fd, &one, sizeof(one));
+		gw->stats.wakeups++;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J デバイスの受信スレッドから呼ばれ、購読している全クライアントのリングに書く
+/*---------------------------------------------------------------------------*/
+static int _gateway_notification(void *arg, BtAttHandle handle, uint8_t *value, size_t value_len)
+{
+	BtGatewayDevice *dev = (BtGatewayDevice *)arg;
+	BtGatewayContext *gw = dev->gw;
+	uint64_t now_ns = btUtilGetMonotonicTimeNs();
+
+	if (value_len > BT_GATEWAY_MAX_VALUE_SIZE) {
+		value_len = BT_GATEWAY_MAX_VALUE_SIZE;
+	}
+
+	pthread_mutex_lock(&gw->mutex);
+	if (dev->id >= gw->num_devices) {
+		pthread_mutex_unlock(&gw->mutex);
+		return AKS_OK;
+	}
+	gw->stats.notifications++;
+	for (int i=0 ; i<BT_GATEWAY_MAX_CLIENTS ; ++i) {
+		BtGatewayClient *client = &gw->clients[i];
+		if (!client->connected) {
+			continue;
+		}
+		for (uint32_t j=0 ; j<client->num_subscriptions ; ++j) {
+			if ((client->subscriptions[j].device == dev->id) && (client->subscriptions[j].handle == handle)) {
+				(void)_gateway_ring_push(gw, client, dev->id, handle, value, value_len, now_ns);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&gw->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 接続を受け付け、リングと eventfd を作って cHello と一緒に渡す
+/*---------------------------------------------------------------------------*/
+static void _gateway_accept(BtGatewayContext *gw)
+{
+	int sock = accept4(gw->sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		return;
+	}
+
+	BtGatewayClient *client = NULL;
+	for (int i=0 ; i<BT_GATEWAY_MAX_CLIENTS ; ++i) {
+		if ((!gw->clients[i].connected) && (gw->clients[i].sock < 0)) {
+			client = &gw->clients[i];
+			break;
+		}
+	}
+	if (client == NULL) {
+		close(sock);
+		return;
+	}
+
+	size_t map_size = sizeof(BtGatewayRing) + gw->ring_size;
+	client->sock     = sock;
+	client->ring_fd  = memfd_create("bt_gateway_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	client->tail_fd  = memfd_create("bt_gateway_tail", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	client->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((client->ring_fd < 0) || (client->tail_fd < 0) || (client->event_fd < 0) ||
+		(ftruncate(client->ring_fd, (off_t)map_size) < 0) ||
+		(ftruncate(client->tail_fd, (off_t)sizeof(BtGatewayRingTail)) < 0)) {
+		_gateway_drop_client(gw, client);
+		return;
+	}
+
+	//J 書き込み可能な map は封じる前に作る
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, client->ring_fd, 0);
+	if (map == MAP_FAILED) {
+		_gateway_drop_client(gw, client);
+		return;
+	}
+	client->ring = (BtGatewayRing *)map;
+	client->ring->magic = BT_GATEWAY_RING_MAGIC;
+	client->ring->size  = (uint32_t)gw->ring_size;
+	client->head    = 0;
+	client->dropped = 0;
+
+	map = mmap(NULL, sizeof(BtGatewayRingTail), PROT_READ, MAP_SHARED, client->tail_fd, 0);
+	if (map == MAP_FAILED) {
+		_gateway_drop_client(gw, client);
+		return;
+	}
+	client->tail = (const BtGatewayRingTail *)map;
+
+	if ((_gateway_seal(client->ring_fd, true) != AKS_OK) ||
+		(_gateway_seal(client->tail_fd, false) != AKS_OK)) {
+		_gateway_drop_client(gw, client);
+		return;
+	}
+
+	BtGatewayMessage hello;
+	memset(&hello, 0, BT_GATEWAY_MESSAGE_HEADER_SIZE + 1);
+	hello.type     = BtGatewayMessageType::cHello;
+	hello.len      = 1;
+	hello.value[0] = (uint8_t)gw->num_devices;
+
+	struct iovec iov;
+	iov.iov_base = &hello;
+	iov.iov_len  = BT_GATEWAY_MESSAGE_HEADER_SIZE + hello.len;
+
+	union {
+		struct cmsghdr align;
+		uint8_t        buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(3 * sizeof(int));
+	int fds[3] = { client->ring_fd, client->tail_fd, client->event_fd };
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		_gateway_drop_client(gw, client);
+		return;
+	}
+
+	pthread_mutex_lock(&gw->mutex);
+	client->num_subscriptions = 0;
+	client->connected = true;
+	gw->stats.clients++;
+	pthread_mutex_unlock(&gw->mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _gateway_subscribe(BtGatewayContext *gw, BtGatewayClient *client, BtGatewayDevice *dev, BtAttHandle config_handle, BtAttHandle value_handle)
+{
+	pthread_mutex_lock(&gw->mutex);
+	for (uint32_t i=0 ; i<client->num_subscriptions ; ++i) {
+		if ((client->subscriptions[i].device == dev->id) && (client->subscriptions[i].handle == value_handle)) {
+			pthread_mutex_unlock(&gw->mutex);
+			return AKS_OK;
+		}
+	}
+	bool full = (client->num_subscriptions >= BT_GATEWAY_MAX_SUBSCRIPTIONS);
+	pthread_mutex_unlock(&gw->mutex);
+	if (full) {
+		return AKS_ERROR_FULL;
+	}
+
+	//J デバイスへの登録は全クライアントで共有する (同じ登録は CCCD を書き直すだけ)
+	//J 受信スレッドが gw->mutex を取るので、ロックを持ったまま呼ばない
+	int ret = btLeDeviceRegistNotificationCallbackWithArg(dev->ctx, config_handle, value_handle, _gateway_notification, dev);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	bool registered = false;
+	for (uint32_t i=0 ; i<dev->num_registrations ; ++i) {
+		if (dev->registrations[i] == value_handle) {
+			registered = true;
+			break;
+		}
+	}
+	if (!registered && (dev->num_registrations < BT_LE_DEVICE_MAX_NOTIFICATION)) {
+		dev->registrations[dev->num_registrations++] = value_handle;
+	}
+
+	pthread_mutex_lock(&gw->mutex);
+	client->subscriptions[client->num_subscriptions].device = dev->id;
+	client->subscriptions[client->num_subscriptions].handle = value_handle;
+	client->num_subscriptions++;
+	pthread_mutex_unlock(&gw->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _gateway_unsubscribe(BtGatewayContext *gw, BtGatewayClient *client, BtGatewayDevice *dev, BtAttHandle value_handle)
+{
+	//J CCCD は他のクライアントが使っているかもしれないのでそのままにする
+	pthread_mutex_lock(&gw->mutex);
+	for (uint32_t i=0 ; i<client->num_subscriptions ; ++i) {
+		if ((client->subscriptions[i].device == dev->id) && (client->subscriptions[i].handle == value_handle)) {
+			client->subscriptions[i] = client->subscriptions[client->num_subscriptions - 1];
+			client->num_subscriptions--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gw->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J クライアントの Request を 1つ処理して Response を返す
+/*---------------------------------------------------------------------------*/
+static int _gateway_serve(BtGatewayContext *gw, BtGatewayClient *client)
+{
+	BtGatewayMessage msg;
+	ssize_t size = recv(client->sock, &msg, sizeof(msg), 0);
+	if (size <= 0) {
+		return AKS_ERROR_IO;
+	}
+
+	pthread_mutex_lock(&gw->mutex);
+	gw->stats.requests++;
+	pthread_mutex_unlock(&gw->mutex);
+
+	int ret = AKS_OK;
+	size_t len = 0;
+	BtGatewayDevice *dev = NULL;
+	if (((size_t)size < BT_GATEWAY_MESSAGE_HEADER_SIZE) || ((size_t)size != BT_GATEWAY_MESSAGE_HEADER_SIZE + msg.len)) {
+		ret = AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+	else if (msg.device >= gw->num_devices) {
+		ret = AKS_ERROR_INVALID;
+	}
+	else {
+		dev = &gw->devices[msg.device];
+	}
+
+	if (dev != NULL) {
+		switch (msg.type) {
+		case BtGatewayMessageType::cRead:
+			ret = BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues(*dev->ctx, msg.handle, msg.value, sizeof(msg.value), len);
+			break;
+		case BtGatewayMessageType::cWrite:
+			if ((size_t)msg.len + 3 <= btLeDeviceGetMtu(dev->ctx)) {
+				ret = BtGattCharacteristicValueWrite::btGattWriteCharacteristicValue(*dev->ctx, msg.handle, msg.value, msg.len);
+			}
+			else {
+				ret = BtGattCharacteristicValueWrite::btGattWriteLongCharacteristicValues(*dev->ctx, msg.handle, msg.value, msg.len);
+			}
+			break;
+		case BtGatewayMessageType::cWriteCommand:
+			ret = BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(*dev->ctx, msg.handle, msg.value, msg.len);
+			break;
+		case BtGatewayMessageType::cSubscribe:
+			ret = _gateway_subscribe(gw, client, dev, msg.config_handle, msg.handle);
+			break;
+		case BtGatewayMessageType::cUnsubscribe:
+			ret = _gateway_unsubscribe(gw, client, dev, msg.handle);
+			break;
+		default:
+			ret = AKS_ERROR_INVALID;
+			break;
+		}
+	}
+
+	if (ret != AKS_OK) {
+		len = 0;
+	}
+	msg.len    = (uint16_t)len;
+	msg.result = ret;
+	if (send(client->sock, &msg, BT_GATEWAY_MESSAGE_HEADER_SIZE + len, MSG_NOSIGNAL) < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void *_gateway_thread_func(void *arg)
+{
+	BtGatewayContext *gw = (BtGatewayContext *)arg;
+
+	struct pollfd pfds[2 + BT_GATEWAY_MAX_CLIENTS];
+	BtGatewayClient *owners[2 + BT_GATEWAY_MAX_CLIENTS];
+
+	while (gw->running) {
+		nfds_t num = 0;
+		pfds[num].fd = gw->wake_fd;
+		pfds[num].events = POLLIN;
+		owners[num++] = NULL;
+		pfds[num].fd = gw->sock;
+		pfds[num].events = POLLIN;
+		owners[num++] = NULL;
+		for (int i=0 ; i<BT_GATEWAY_MAX_CLIENTS ; ++i) {
+			if (gw->clients[i].connected) {
+				pfds[num].fd = gw->clients[i].sock;
+				pfds[num].events = POLLIN;
+				owners[num++] = &gw->clients[i];
+			}
+		}
+		for (nfds_t i=0 ; i<num ; ++i) {
+			pfds[i].revents = 0;
+		}
+
+		int ret = poll(pfds, num, -1);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pfds[0].revents != 0) {
+			uint64_t count;
+			(void)read(gw->wake_fd, &count, sizeof(count));
+			if (!gw->running) {
+				break;
+			}
+
+			//J tail が壊れていたクライアントを切る
+			for (int i=0 ; i<BT_GATEWAY_MAX_CLIENTS ; ++i) {
+				if (gw->clients[i].faulted) {
+					_gateway_drop_client(gw, &gw->clients[i]);
+				}
+			}
+			continue;
+		}
+
+		for (nfds_t i=2 ; i<num ; ++i) {
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+			if ((pfds[i].revents & POLLIN) == 0) {
+				_gateway_drop_client(gw, owners[i]);
+				continue;
+			}
+			if (_gateway_serve(gw, owners[i]) != AKS_OK) {
+				_gateway_drop_client(gw, owners[i]);
+			}
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			_gateway_accept(gw);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+int btGatewayClientConnect(BtGatewayClientContext *client, const char *path)
+{
+	if ((client == NULL) || (path == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(client, 0, sizeof(BtGatewayClientContext));
+	client->sock     = -1;
+	client->ring_fd  = -1;
+	client->tail_fd  = -1;
+	client->event_fd = -1;
+
+	struct sockaddr_un addr;
+	int ret = _gateway_unix_address(path, &addr);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	client->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (client->sock < 0) {
+		return AKS_ERROR_IO;
+	}
+	if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_IO;
+	}
+
+	//J cHello と一緒にリング、tail と eventfd を受け取る
+	struct iovec iov;
+	iov.iov_base = &client->message;
+	iov.iov_len  = sizeof(client->message);
+
+	union {
+		struct cmsghdr align;
+		uint8_t        buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t size = recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg = (size > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+	if ((cmsg == NULL) ||
+		(cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+		(cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_IO;
+	}
+	int fds[3];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	client->ring_fd  = fds[0];
+	client->tail_fd  = fds[1];
+	client->event_fd = fds[2];
+
+	if (((size_t)size < BT_GATEWAY_MESSAGE_HEADER_SIZE + 1) ||
+		(client->message.type != BtGatewayMessageType::cHello)) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_BT_UNEXPECTED_RESPONSE;
+	}
+	client->num_devices = client->message.value[0];
+
+	struct stat st;
+	if ((fstat(client->ring_fd, &st) < 0) || ((size_t)st.st_size <= sizeof(BtGatewayRing))) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_IO;
+	}
+	//J リングはデーモンだけが書く
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, client->ring_fd, 0);
+	if (map == MAP_FAILED) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_IO;
+	}
+	client->ring     = (const BtGatewayRing *)map;
+	client->map_size = (size_t)st.st_size;
+	if ((client->ring->magic != BT_GATEWAY_RING_MAGIC) ||
+		(sizeof(BtGatewayRing) + client->ring->size != client->map_size)) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	if ((fstat(client->tail_fd, &st) < 0) || ((size_t)st.st_size < sizeof(BtGatewayRingTail))) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_IO;
+	}
+	map = mmap(NULL, sizeof(BtGatewayRingTail), PROT_READ | PROT_WRITE, MAP_SHARED, client->tail_fd, 0);
+	if (map == MAP_FAILED) {
+		btGatewayClientDisconnect(client);
+		return AKS_ERROR_IO;
+	}
+	client->tail = (BtGatewayRingTail *)map;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayClientDisconnect(BtGatewayClientContext *client)
+{
+	if (client == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	if (client->ring != NULL) {
+		munmap((void *)client->ring, client->map_size);
+		client->ring = NULL;
+	}
+	if (client->tail != NULL) {
+		munmap(client->tail, sizeof(BtGatewayRingTail));
+		client->tail = NULL;
+	}
+	if (client->ring_fd >= 0) {
+		close(client->ring_fd);
+		client->ring_fd = -1;
+	}
+	if (client->tail_fd >= 0) {
+		close(client->tail_fd);
+		client->tail_fd = -1;
+	}
+	if (client->event_fd >= 0) {
+		close(client->event_fd);
+		client->event_fd = -1;
+	}
+	if (client->sock >= 0) {
+		close(client->sock);
+		client->sock = -1;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J client->message を送って同じ type の Response を client->message に受ける
+/*---------------------------------------------------------------------------*/
+static int _gateway_client_transact(BtGatewayClientContext *client)
+{
+	if (client->sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	uint8_t type = client->message.type;
+	if (send(client->sock, &client->message, BT_GATEWAY_MESSAGE_HEADER_SIZE + client->message.len, MSG_NOSIGNAL) < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	ssize_t size;
+	do {
+		size = recv(client->sock, &client->message, sizeof(client->message), 0);
+	} while ((size < 0) && (errno == EINTR));
+	if (size <= 0) {
+		return AKS_ERROR_IO;
+	}
+	if (((size_t)size < BT_GATEWAY_MESSAGE_HEADER_SIZE) ||
+		((size_t)size != BT_GATEWAY_MESSAGE_HEADER_SIZE + client->message.len) ||
+		(client->message.type != type)) {
+		return AKS_ERROR_BT_UNEXPECTED_RESPONSE;
+	}
+
+	return client->message.result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _gateway_client_message(BtGatewayClientContext *client, uint8_t type, uint8_t device, BtAttHandle handle)
+{
+	memset(&client->message, 0, BT_GATEWAY_MESSAGE_HEADER_SIZE);
+	client->message.type   = type;
+	client->message.device = device;
+	client->message.handle = handle;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayClientRead(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle handle,
+								void *buf,
+								const size_t buf_size,
+								size_t &read_size)
+{
+	read_size = 0;
+
+	if ((client == NULL) || (buf == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	_gateway_client_message(client, BtGatewayMessageType::cRead, device, handle);
+	int ret = _gateway_client_transact(client);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	if (client->message.len > buf_size) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	memcpy(buf, client->message.value, client->message.len);
+	read_size = client->message.len;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayClientWrite(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle handle,
+								const void *buf,
+								const size_t len,
+								const bool with_response)
+{
+	if ((client == NULL) || (buf == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (len > BT_GATEWAY_MAX_VALUE_SIZE) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	_gateway_client_message(
+						client,
+						with_response ? BtGatewayMessageType::cWrite : BtGatewayMessageType::cWriteCommand,
+						device,
+						handle);
+	client->message.len = (uint16_t)len;
+	memcpy(client->message.value, buf, len);
+
+	return _gateway_client_transact(client);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayClientSubscribe(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle config_handle,
+								const BtAttHandle value_handle)
+{
+	if (client == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	_gateway_client_message(client, BtGatewayMessageType::cSubscribe, device, value_handle);
+	client->message.config_handle = config_handle;
+
+	return _gateway_client_transact(client);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayClientUnsubscribe(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle value_handle)
+{
+	if (client == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	_gateway_client_message(client, BtGatewayMessageType::cUnsubscribe, device, value_handle);
+
+	return _gateway_client_transact(client);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J リング上の次のレコードをコピーせずに返す (btGatewayClientRelease() まで有効)
+/*---------------------------------------------------------------------------*/
+int btGatewayClientReceive(
+								BtGatewayClientContext *client,
+								const BtGatewayRecord **record,
+								const int timeout_ms)
+{
+	if ((client == NULL) || (record == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((client->ring == NULL) || (client->tail == NULL)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	const BtGatewayRing *ring = client->ring;
+	while (1) {
+		uint64_t tail = client->tail->tail;
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		while (tail != head) {
+			const BtGatewayRecord *rec = (const BtGatewayRecord *)&ring->data[tail % ring->size];
+			if (rec->flags & BtGatewayRecordFlags::cPad) {
+				tail += sizeof(BtGatewayRecord) + rec->len;
+				__atomic_store_n(&client->tail->tail, tail, __ATOMIC_SEQ_CST);
+				continue;
+			}
+
+			*record = rec;
+			client->held_tail = tail + _gateway_record_size(rec->len);
+			return AKS_OK;
+		}
+
+		//J 空なので eventfd で起こされるのを待つ
+		struct pollfd pfd;
+		pfd.fd      = client->event_fd;
+		pfd.events  = POLLIN;
+		pfd.revents = 0;
+
+		int ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return AKS_ERROR_IO;
+		}
+		if (ret == 0) {
+			return AKS_ERROR_TIMEOUT;
+		}
+
+		uint64_t count;
+		(void)read(client->event_fd, &count, sizeof(count));
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btGatewayClientRelease(BtGatewayClientContext *client)
+{
+	if (client == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((client->tail == NULL) || (client->held_tail == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	__atomic_store_n(&client->tail->tail, client->held_tail, __ATOMIC_SEQ_CST);
+	client->held_tail = 0;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+uint64_t btGatewayClientGetDropped(BtGatewayClientContext *client)
+{
+	if ((client == NULL) || (client->ring == NULL)) {
+		return 0;
+	}
+
+	return __atomic_load_n(&client->ring->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,216 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_GATEWAY_H_
+#define BT_GATEWAY_H_
+
+/*
+ *J 複数のプロセスで同じ Peripheral を使うためのゲートウェイ
+ *J
+ *J デーモン側 (btGateway*) が全ての BtGattDeviceContext を持ち、ローカルの
+ *J クライアント (btGatewayClient*) に Unix Domain Socket (SOCK_SEQPACKET) で
+ *J GATT の Read / Write / Subscribe を提供する。
+ *J
+ *J Notification はクライアントごとの共有メモリのリングに書き込む。
+ *J リング (memfd)、tail (memfd) と到着通知用の eventfd は接続時に SCM_RIGHTS で渡すので、
+ *J 購読するクライアントが増えても無線のトラフィックは増えず、
+ *J クライアントはリング上の値をコピーせずに読める。
+ *J
+ *J リングは 1 Producer (デーモン) / 1 Consumer (クライアント)。
+ *J クライアントが読まずにリングが溢れた Notification は捨てて dropped に数える。
+ *J クライアントが書けるのは tail だけで、デーモンはおかしな tail を見たらそのクライアントを切る。
+ *J
+ *J btGatewayDestroy() はデバイスに登録した Callback を外してから戻るので、
+ *J その後は BtGatewayContext を解放してよい。
+ */
+
+#define BT_GATEWAY_MAX_DEVICES						(8)
+#define BT_GATEWAY_MAX_CLIENTS						(16)
+#define BT_GATEWAY_MAX_SUBSCRIPTIONS				(16)	//J クライアントごと
+#define BT_GATEWAY_MAX_VALUE_SIZE					(512)	//J ATT の Attribute Value 最大長
+#define BT_GATEWAY_DEFAULT_RING_SIZE				(64 * 1024)
+#define BT_GATEWAY_RING_MAGIC						(0x42475752)	//J "RWGB"
+#define BT_GATEWAY_RECORD_ALIGN						(16)
+
+struct BtGatewayMessageType {
+	static const uint8_t cHello					= 0x01;	//J 接続直後にデーモンから送る (リングの fd 付き)
+	static const uint8_t cRead					= 0x02;
+	static const uint8_t cWrite					= 0x03;	//J Write Request
+	static const uint8_t cWriteCommand			= 0x04;	//J Write Command
+	static const uint8_t cSubscribe				= 0x05;
+	static const uint8_t cUnsubscribe			= 0x06;
+};
+
+//J クライアントとデーモンの間のメッセージ (Response は Request と同じ type で返す)
+#pragma pack(1)
+struct BtGatewayMessage
+{
+	uint8_t  type;
+	uint8_t  device;
+	uint16_t handle;				//J Value Handle
+	uint16_t config_handle;			//J cSubscribe / cUnsubscribe の CCCD
+	uint16_t len;
+	int32_t  result;				//J Response の AKS_*
+	uint8_t  value[BT_GATEWAY_MAX_VALUE_SIZE];
+};
+#pragma pack()
+
+#define BT_GATEWAY_MESSAGE_HEADER_SIZE				(offsetof(BtGatewayMessage, value))
+
+struct BtGatewayRecordFlags {
+	static const uint8_t cPad					= 0x01;	//J リング末尾の詰め物 (読み飛ばす)
+};
+
+//J リング上の Notification 1つ分 (BT_GATEWAY_RECORD_ALIGN 単位で並ぶ)
+struct BtGatewayRecord
+{
+	uint16_t len;
+	uint8_t  device;
+	uint8_t  flags;
+	uint16_t handle;
+	uint16_t reserved;
+	uint64_t timestamp_ns;			//J CLOCK_MONOTONIC で受信した時刻
+	uint8_t  value[0];
+};
+
+//J リングの共有メモリの先頭。デーモンだけが書き、クライアントは読み込み専用で map する
+//J (memfd を F_SEAL_FUTURE_WRITE で封じるので書き込み可能には map できない)
+struct BtGatewayRing
+{
+	uint32_t magic;
+	uint32_t size;					//J data の大きさ
+	uint8_t  reserved0[56];
+	uint64_t head;					//J 書き込んだ累積バイト数
+	uint8_t  reserved1[56];
+	uint64_t dropped;				//J 溢れて捨てた Notification の数
+	uint8_t  reserved2[56];
+	uint8_t  data[0];
+};
+
+//J クライアントが書く共有メモリ (リングとは別の memfd)。
+//J デーモンは head と size を自分で持ち、ここの tail だけを読んで確かめてから使う
+struct BtGatewayRingTail
+{
+	uint64_t tail;					//J 読み終えた累積バイト数
+	uint8_t  reserved[56];
+};
+
+struct BtGatewayStatistics
+{
+	uint64_t clients;				//J 受け付けた接続の数
+	uint64_t requests;
+	uint64_t notifications;			//J デバイスから受けた Notification の数
+	uint64_t published;				//J リングに書いたレコードの数
+	uint64_t dropped;				//J リングが溢れて捨てたレコードの数
+	uint64_t wakeups;				//J eventfd を鳴らした回数
+};
+
+struct BtGatewayContext;
+
+struct BtGatewayDevice
+{
+	BtGatewayContext    *gw;
+	BtGattDeviceContext *ctx;
+	uint8_t              id;
+
+	//J btGatewayDestroy() で外すために、デバイスに登録した Value Handle を覚えておく
+	uint32_t    num_registrations;
+	BtAttHandle registrations[BT_LE_DEVICE_MAX_NOTIFICATION];
+};
+
+struct BtGatewayClient
+{
+	bool           connected;
+	bool           faulted;			//J tail が壊れていた。デーモンのスレッドが切る
+	int            sock;
+	int            ring_fd;
+	int            tail_fd;
+	int            event_fd;
+	BtGatewayRing *ring;
+	const BtGatewayRingTail *tail;
+	uint64_t       head;			//J 共有メモリの head は読まない
+	uint64_t       dropped;
+
+	uint32_t num_subscriptions;
+	struct {
+		uint8_t     device;
+		BtAttHandle handle;
+	} subscriptions[BT_GATEWAY_MAX_SUBSCRIPTIONS];
+};
+
+struct BtGatewayContext
+{
+	bool running;
+
+	int       sock;					//J listen している Socket
+	int       wake_fd;				//J btGatewayDestroy() でスレッドを起こす eventfd
+	char      path[108];			//J sun_path
+	size_t    ring_size;
+	pthread_t thread;
+	pthread_mutex_t mutex;			//J clients を Notification のスレッドと共有する
+
+	uint32_t num_devices;
+	BtGatewayDevice devices[BT_GATEWAY_MAX_DEVICES];
+
+	BtGatewayClient clients[BT_GATEWAY_MAX_CLIENTS];
+
+	BtGatewayStatistics stats;
+};
+
+//J クライアント側
+struct BtGatewayClientContext
+{
+	int            sock;
+	int            ring_fd;
+	int            tail_fd;
+	int            event_fd;
+	const BtGatewayRing *ring;
+	BtGatewayRingTail *tail;
+	size_t         map_size;
+	uint8_t        num_devices;
+	uint64_t       held_tail;		//J btGatewayClientReceive() で渡したレコードの次の位置
+	BtGatewayMessage message;		//J 送受信用
+};
+
+int btGatewayCreate(BtGatewayContext *gw, const char *path, const size_t ring_size);
+int btGatewayDestroy(BtGatewayContext *gw);
+int btGatewayAddDevice(BtGatewayContext *gw, BtGattDeviceContext *ctx, uint8_t &device);
+int btGatewayStart(BtGatewayContext *gw);
+int btGatewayGetStatistics(BtGatewayContext *gw, BtGatewayStatistics *stats);
+
+int btGatewayClientConnect(BtGatewayClientContext *client, const char *path);
+int btGatewayClientDisconnect(BtGatewayClientContext *client);
+int btGatewayClientRead(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle handle,
+								void *buf,
+								const size_t buf_size,
+								size_t &read_size);
+int btGatewayClientWrite(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle handle,
+								const void *buf,
+								const size_t len,
+								const bool with_response);
+int btGatewayClientSubscribe(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle config_handle,
+								const BtAttHandle value_handle);
+int btGatewayClientUnsubscribe(
+								BtGatewayClientContext *client,
+								const uint8_t device,
+								const BtAttHandle value_handle);
+int btGatewayClientReceive(
+								BtGatewayClientContext *client,
+								const BtGatewayRecord **record,
+								const int timeout_ms);
+int btGatewayClientRelease(BtGatewayClientContext *client);
+uint64_t btGatewayClientGetDropped(BtGatewayClientContext *client);
+
+#endif/*BT_GATEWAY_H_*/
@@ -20,6 +20,122 @@
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
+//J ネゴシエーション済みの ATT_MTU を PDU の上限にする
+static size_t _gatt_pdu_size(BtGattDeviceContext &ctx, size_t buf_size)
+{
+	size_t mtu = (size_t)btLeDeviceGetMtu(&ctx);
+	return (mtu < buf_size) ? mtu : buf_size;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 複数の Request からなる Procedure は ctx.procedure_timeout_ms でまとめて打ち切り、
+//J btLeDeviceCancel() で残りの Request も取り消せるようにする。
+//J 呼び出し元が btLeDeviceBeginProcedure() していればその期限が使われる
+static int _gatt_begin_procedure(BtGattDeviceContext &ctx)
+{
+	return btLeDeviceBeginProcedure(&ctx, ctx.procedure_timeout_ms);
+}
+
+static void _gatt_end_procedure(BtGattDeviceContext &ctx)
+{
+	(void)btLeDeviceEndProcedure(&ctx);
+}
+
+/*---------------------------------------------------------------------------*/
+//J Prepare Write を 1つ送り、返ってきた値を受信バッファ上でそのまま照合する
+static int _gatt_prepare_write(
+								BtGattDeviceContext	&ctx,
+								const BtAttHandle	handle,
+								const uint16_t		offset,
+								const uint8_t		*value,
+								const uint16_t		value_len)
+{
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+
+	int ret = btAttBuildPduPrepareWriteRequest(
+								pdu,
+								_gatt_pdu_size(ctx, sizeof(pdu)),
+								handle,
+								offset,
+								value_len,
+								value);
+	if (ret < AKS_OK) {
+		return ret;
+	}
+	size_t pdu_size = (size_t)ret;
+
+	ret = btLeDeviceSendAttPduAndWaitForResponse(
+								&ctx,
+								pdu,
+								pdu_size,
+								BtAttPduOpcode::cAttOpcodePrepareWriteResponse,
+								0);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	if (ctx.read_error != AKS_OK) {
+		return ctx.read_error;
+	}
+
+	BtAttHandle response_handle = 0;
+	uint16_t response_offset = 0;
+	uint16_t response_value_len = 0;
+	ret = btAttParsePduPrepareWriteResponse(
+								ctx.read_buf,
+								(size_t)ctx.read_size,
+								response_handle,
+								response_offset,
+								response_value_len,
+								NULL,
+								0);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	const uint8_t *response_value = ((BtAttPdu *)ctx.read_buf)->pdu.args.prepareWriteResponse.value;
+	if ((response_handle != handle) ||
+		(response_offset != offset) ||
+		(response_value_len != value_len) ||
+		((value_len != 0) && (0 != memcmp(response_value, value, value_len))))
+	{
+		return AKS_ERROR_BT_IMCOMPLETED_WRITE;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+static int _gatt_execute_write(BtGattDeviceContext &ctx, const uint8_t flags)
+{
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+
+	int ret = btAttBuildPduExecuteWriteRequest(
+								pdu,
+								_gatt_pdu_size(ctx, sizeof(pdu)),
+								flags);
+	if (ret < AKS_OK) {
+		return ret;
+	}
+	size_t pdu_size = (size_t)ret;
+
+	ret = btLeDeviceSendAttPduAndWaitForResponse(
+								&ctx,
+								pdu,
+								pdu_size,
+								BtAttPduOpcode::cAttOpcodeExecuteWriteResponse,
+								0);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	if (ctx.read_error != AKS_OK) {
+		return ctx.read_error;
+	}
+
+	return btAttParsePduExecuteWriteResponse(
+								ctx.read_buf,
+								(size_t)ctx.read_size);
+}
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -50,15 +166,68 @@ int BtGattServerConfiguration::btGattExchangeMtu(
 								(size_t)ctx.read_size,
 								mtu);
 	if( ret == AKS_OK) {
-		ctx.server.mtu = mtu;
+		ctx.server.mtu = (mtu < BT_ATT_MIN_LE_MTU) ? BT_ATT_MIN_LE_MTU : mtu;
+	}
+
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+//J Client Supported Features はビットを落とせないので、今の値に features を足して書く
+static int _gatt_write_client_supported_features(
+								BtGattDeviceContext &ctx,
+								const uint8_t features)
+{
+	BtUuid uuid;
+	uuid.format             = BtUuid::cBtUuid16;
+	uuid.value.uuid16       = GattCharacteristicTypeUuid::cClientSupportedFeatures;
+
+	BtAttHandle handle = 0;
+	uint8_t value[BT_ATT_MAX_LE_MTU];
+	size_t value_len = 0;
+	int ret = BtGattCharacteristicValueRead::btGattReadUsingCharacteristicUuid(
+								ctx,
+								uuid,
+								handle,
+								value,
+								sizeof(value),
+								value_len);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	if (value_len == 0) {
+		value[0] = 0;
+		value_len = 1;
+	}
+
+	if ((value[0] & features) == features) {
+		return AKS_OK;
+	}
+	value[0] |= features;
+
+	return BtGattCharacteristicValueWrite::btGattWriteCharacteristicValue(ctx, handle, value, value_len);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int BtGattServerConfiguration::btGattWriteClientSupportedFeatures(
+								BtGattDeviceContext &ctx,
+								const uint8_t features)
+{
+	int ret = _gatt_begin_procedure(ctx);
+	if (ret != AKS_OK) {
+		return ret;
 	}
 
+	ret = _gatt_write_client_supported_features(ctx, features);
+	_gatt_end_procedure(ctx);
+
 	return ret;
 }
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-int BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
+static int _gatt_discover_all_primary_services(
 								BtGattDeviceContext &ctx, 
 								BtAttHandleRangeUuid16Pair *handleUuids,
 								uint32_t pair_size,
@@ -77,7 +246,7 @@ int BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
 	do {
 		int ret = btAttBuildPduReadByGroupTypeRequest(
 								pdu,
-								sizeof(pdu),
+								_gatt_pdu_size(ctx, sizeof(pdu)),
 								range, uuid);
 		if (ret < 0) {
 			return ret;
@@ -111,6 +280,7 @@ int BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
 			}
 
 			BtAttAttributeData *attributeData = (BtAttAttributeData *)(buf);
+			BtAttHandle lastEndGroupHandle = range.end;
 			for (int i=0 ; i<item_cnt ; ++i) {
 				if ((handleUuids != NULL) && (pair_cnt < pair_size) ) {
 					handleUuids[pair_cnt].handles.start
@@ -122,11 +292,16 @@ int BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
 					handleUuids[pair_cnt].uuid = value16;
 				}
 				pair_cnt++;
+				lastEndGroupHandle = attributeData->endGroupHandle;
 				attributeData
 						= btAttNextAttributeData(attributeData, item_len);
 			}
 
-			range.start = attributeData->endGroupHandle + 1;
+			//J 最後の要素の次を指しているので、保存しておいたハンドルから再開する
+			if ((item_cnt == 0) || (lastEndGroupHandle == 0xffff)) {
+				break;
+			}
+			range.start = lastEndGroupHandle + 1;
 		}
 		else {
 		}
@@ -135,6 +310,25 @@ int BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
 	return AKS_OK;
 }
 
+
+/*---------------------------------------------------------------------------*/
+int BtGattPrimaryServiceDiscovery::btGattDiscoverAllPrimaryServices(
+								BtGattDeviceContext &ctx,
+								BtAttHandleRangeUuid16Pair *handleUuids,
+								uint32_t pair_size,
+								uint32_t &pair_cnt)
+{
+	int ret = _gatt_begin_procedure(ctx);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	ret = _gatt_discover_all_primary_services(ctx, handleUuids, pair_size, pair_cnt);
+	_gatt_end_procedure(ctx);
+
+	return ret;
+}
+
 /*---------------------------------------------------------------------------*/
 int BtGattPrimaryServiceDiscovery::btGattDiscoverPrimaryServicesByServiceUuid(
 								BtGattDeviceContext &ctx,
@@ -149,7 +343,7 @@ int BtGattPrimaryServiceDiscovery::btGattDiscoverPrimaryServicesByServiceUuid(
 
 	int ret = btAttBuildPduFindByTypeValueRequest(
 								pdu,
-								sizeof(pdu),
+								_gatt_pdu_size(ctx, sizeof(pdu)),
 								range,
 								GattAttributeTypeUuid::cPrimaryService,
 								(uint8_t *)&uuid.value.uuid16,
@@ -204,7 +398,7 @@ int BtGattRelationshipDiscovery::btGattFindIncludedService(
 	uuid.format = BtUuid::cBtUuid16;
 	uuid.value.uuid16 = GattAttributeTypeUuid::cInclude;
 
-	int ret = btAttBuildPduReadByTypeRequest(pdu, sizeof(pdu), range, uuid);
+	int ret = btAttBuildPduReadByTypeRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), range, uuid);
 	if (ret < AKS_OK) {
 		return ret;
 	}
@@ -246,7 +440,7 @@ int BtGattRelationshipDiscovery::btGattFindIncludedService(
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-int BtGattCharacteristicDiscovery::btGattDiscoverAllCharactaristicOfAService(
+static int _gatt_discover_all_characteristics(
 								BtGattDeviceContext &ctx,
 								BtAttHandleRange range,
 								BtGattCharacteristic *chars,
@@ -263,7 +457,7 @@ int BtGattCharacteristicDiscovery::btGattDiscoverAllCharactaristicOfAService(
 	uint32_t list_count = 0;
 
 	do {
-		int ret = btAttBuildPduReadByTypeRequest(pdu, sizeof(pdu), range, uuid);
+		int ret = btAttBuildPduReadByTypeRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), range, uuid);
 		if (ret < AKS_OK) {
 			return ret;
 		}
@@ -334,7 +528,27 @@ int BtGattCharacteristicDiscovery::btGattDiscoverAllCharactaristicOfAService(
 
 
 /*---------------------------------------------------------------------------*/
-int BtGattCharacteristicDiscovery::btGattDiscoverCharacteristicByUuid(
+int BtGattCharacteristicDiscovery::btGattDiscoverAllCharactaristicOfAService(
+								BtGattDeviceContext &ctx,
+								BtAttHandleRange range,
+								BtGattCharacteristic *chars,
+								uint32_t char_len,
+								uint32_t &char_cnt)
+{
+	int ret = _gatt_begin_procedure(ctx);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	ret = _gatt_discover_all_characteristics(ctx, range, chars, char_len, char_cnt);
+	_gatt_end_procedure(ctx);
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _gatt_discover_characteristic_by_uuid(
 								BtGattDeviceContext	&ctx,
 								BtAttHandleRange	range,
 								BtUuid 				charUuid,
@@ -348,7 +562,7 @@ int BtGattCharacteristicDiscovery::btGattDiscoverCharacteristicByUuid(
 	uuid.value.uuid16 = GattAttributeTypeUuid::cCharacteristic;
 
 	do {
-		int ret = btAttBuildPduReadByTypeRequest(pdu, sizeof(pdu), range, uuid);
+		int ret = btAttBuildPduReadByTypeRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), range, uuid);
 		if (ret < AKS_OK) {
 			return ret;
 		}
@@ -427,9 +641,28 @@ int BtGattCharacteristicDiscovery::btGattDiscoverCharacteristicByUuid(
 }
 
 
+/*---------------------------------------------------------------------------*/
+int BtGattCharacteristicDiscovery::btGattDiscoverCharacteristicByUuid(
+								BtGattDeviceContext	&ctx,
+								BtAttHandleRange	range,
+								BtUuid 				charUuid,
+								BtGattCharacteristic &characteristic)
+{
+	int ret = _gatt_begin_procedure(ctx);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	ret = _gatt_discover_characteristic_by_uuid(ctx, range, charUuid, characteristic);
+	_gatt_end_procedure(ctx);
+
+	return ret;
+}
+
+
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-int BtGattCharacteristicDescriptorDiscovery::btGattDiscoverAllCharacteristicDescriptors(
+static int _gatt_discover_all_descriptors(
 								BtGattDeviceContext	&ctx,
 								BtAttHandleRange	range,
 								BtAttHandleUuidPair *pairs,
@@ -441,7 +674,7 @@ int BtGattCharacteristicDescriptorDiscovery::btGattDiscoverAllCharacteristicDesc
 
 	pair_count = 0;
 	while (1) {
-		ret = btAttBuildPduFindInformationRequest(pdu, sizeof(pdu), range);
+		ret = btAttBuildPduFindInformationRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), range);
 		if (ret < AKS_OK) {
 			return ret;
 		}
@@ -521,6 +754,26 @@ int BtGattCharacteristicDescriptorDiscovery::btGattDiscoverAllCharacteristicDesc
 }
 
 
+/*---------------------------------------------------------------------------*/
+int BtGattCharacteristicDescriptorDiscovery::btGattDiscoverAllCharacteristicDescriptors(
+								BtGattDeviceContext	&ctx,
+								BtAttHandleRange	range,
+								BtAttHandleUuidPair *pairs,
+								uint32_t            pair_size,
+								uint32_t            &pair_count)
+{
+	int ret = _gatt_begin_procedure(ctx);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	ret = _gatt_discover_all_descriptors(ctx, range, pairs, pair_size, pair_count);
+	_gatt_end_procedure(ctx);
+
+	return ret;
+}
+
+
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 int BtGattCharacteristicValueRead::btGattReadCharacteristicValue(
@@ -536,7 +789,7 @@ int BtGattCharacteristicValueRead::btGattReadCharacteristicValue(
 
 	uint8_t pdu[BT_ATT_MAX_LE_MTU];
 
-	int ret = btAttBuildPduReadRequest(pdu, sizeof(pdu), handle);
+	int ret = btAttBuildPduReadRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), handle);
 	if (ret < AKS_OK) {
 		return ret;
 	}
@@ -589,7 +842,7 @@ int BtGattCharacteristicValueRead::btGattReadUsingCharacteristicUuid(
 	range.start = 0x0001;
 	range.end   = 0xffff;
 
-	int ret = btAttBuildPduReadByTypeRequest(pdu, sizeof(pdu), range, uuid);
+	int ret = btAttBuildPduReadByTypeRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), range, uuid);
 	if (ret < AKS_OK) {
 		return ret;
 	}
@@ -638,6 +891,25 @@ int BtGattCharacteristicValueRead::btGattReadUsingCharacteristicUuid(
 }
 
 
+/*---------------------------------------------------------------------------*/
+struct _GattReadBuffer
+{
+	uint8_t *buf;
+	size_t   buf_size;
+};
+
+static int _gatt_read_buffer_sink(void *arg, size_t offset, const uint8_t *chunk, size_t chunk_len)
+{
+	_GattReadBuffer *buffer = (_GattReadBuffer *)arg;
+	if (offset + chunk_len > buffer->buf_size) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	memcpy(&buffer->buf[offset], chunk, chunk_len);
+
+	return AKS_OK;
+}
+
 /*---------------------------------------------------------------------------*/
 int BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues (
 								BtGattDeviceContext	&ctx,
@@ -650,83 +922,115 @@ int BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues (
 		return AKS_ERROR_NOBUF;
 	}
 
+	_GattReadBuffer buffer;
+	buffer.buf      = (uint8_t *)buf;
+	buffer.buf_size = buf_size;
+
+	return btGattReadLongCharacteristicValuesToSink(ctx, handle, _gatt_read_buffer_sink, &buffer, read_size);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _gatt_read_long_to_sink(
+								BtGattDeviceContext	&ctx,
+								BtAttHandle			handle,
+								BtGattReadSink		sink,
+								void				*arg,
+								size_t				&read_size)
+{
+	if (sink == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
 	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+	size_t  full_chunk = _gatt_pdu_size(ctx, sizeof(pdu)) - 1;
+	size_t  header_size = sizeof(BtAttPdu::Pdu::opcode);
+
+	read_size = 0;
 
-	int ret = btAttBuildPduReadRequest(pdu, sizeof(pdu), handle);
+	int ret = btAttBuildPduReadRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), handle);
 	if (ret < AKS_OK) {
 		return ret;
 	}
 	size_t pdu_size = (size_t)ret;
 
-	ret = btLeDeviceSendAttPduAndWaitForResponse(
+	uint8_t expected = BtAttPduOpcode::cAttOpcodeReadResponse;
+	while (1) {
+		ret = btLeDeviceSendAttPduAndWaitForResponse(
 								&ctx,
 								pdu,
 								pdu_size,
-								BtAttPduOpcode::cAttOpcodeReadResponse,
+								expected,
 								0);
-	if (ret != AKS_OK) {
-		return ret;
-	}
+		if (ret != AKS_OK) {
+			return ret;
+		}
 
-	if (ctx.read_error != AKS_OK) {
-		return ctx.read_error;
-	}
+		if (ctx.read_error != AKS_OK) {
+			//J 値がちょうど MTU-1 の倍数だった場合、次の Blob が拒否されることで終端が分かる
+			if ((read_size != 0) &&
+				((ctx.read_error == (int)(AKS_ERROR_BT_ATT_ERROR | BtAttErrorCode::cAttErrorCodeAttributeNotLong)) ||
+				 (ctx.read_error == (int)(AKS_ERROR_BT_ATT_ERROR | BtAttErrorCode::cAttErrorCodeInvalidOffset)))) {
+				return AKS_OK;
+			}
+			return ctx.read_error;
+		}
+		if ((size_t)ctx.read_size < header_size) {
+			return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+		}
 
-	uint8_t *ptr = (uint8_t *)buf;
-	uint16_t read_size16 = 0;
-	ret = btAttParsePduReadResponse(
-								ctx.read_buf,
-								(size_t)ctx.read_size,
-								ptr,
-								buf_size,
-								read_size16);
-	if (ret != AKS_OK) {
-		return ret;
-	}
+		//J 受信バッファを直接 Sink に渡す (次の Request を出すまで有効)
+		const uint8_t *chunk = &ctx.read_buf[header_size];
+		size_t chunk_len = (size_t)ctx.read_size - header_size;
+		if (chunk_len != 0) {
+			ret = sink(arg, read_size, chunk, chunk_len);
+			if (ret != AKS_OK) {
+				return ret;
+			}
+			read_size += chunk_len;
+		}
 
-	ptr += read_size16;
-	read_size = (size_t)read_size16;
+		//J MTU-1 に満たない Blob が来たらそれが最後
+		if (chunk_len < full_chunk) {
+			break;
+		}
+		if (read_size > 0xFFFF) {
+			return AKS_ERROR_BT_INVALUD_FORMAT;
+		}
 
-	while ((ret == AKS_OK) && (read_size16 != 0)) {
-		ret = btAttBuildPduReadBlobRequest (
+		ret = btAttBuildPduReadBlobRequest(
 								pdu,
-								sizeof(pdu),
+								_gatt_pdu_size(ctx, sizeof(pdu)),
 								handle,
 								(uint16_t)read_size);
 		if (ret < AKS_OK) {
 			return ret;
 		}
-
 		pdu_size = (size_t)ret;
-		ret = btLeDeviceSendAttPduAndWaitForResponse(
-								&ctx,
-								pdu,
-								pdu_size,
-								BtAttPduOpcode::cAttOpcodeReadBlobResponse,
-									0);
-		if (ret != AKS_OK) {
-			return ret;
-		}
+		expected = BtAttPduOpcode::cAttOpcodeReadBlobResponse;
+	}
 
-		if (ctx.read_error != AKS_OK) {
-			return ctx.read_error;
-		}
+	return AKS_OK;
+}
 
-		ret = btAttParsePduReadBlobResponse(
-								ctx.read_buf,
-								(size_t)ctx.read_size,
-								ptr,
-								buf_size - read_size,
-								read_size16);
-		if (ret != AKS_OK) {
-			return ret;;
-		}
 
-		ptr       += read_size16;
-		read_size += (size_t)read_size16;
+/*---------------------------------------------------------------------------*/
+int BtGattCharacteristicValueRead::btGattReadLongCharacteristicValuesToSink(
+								BtGattDeviceContext	&ctx,
+								BtAttHandle			handle,
+								BtGattReadSink		sink,
+								void				*arg,
+								size_t				&read_size)
+{
+	int ret = _gatt_begin_procedure(ctx);
+	if (ret != AKS_OK) {
+		return ret;
 	}
 
-	return AKS_OK;
+	ret = _gatt_read_long_to_sink(ctx, handle, sink, arg, read_size);
+	_gatt_end_procedure(ctx);
+
+	return ret;
 }
 
 
@@ -749,7 +1053,7 @@ int BtGattCharacteristicValueRead::btGattMultipleCharacteristicValues(
 
 	uint8_t pdu[BT_ATT_MAX_LE_MTU];
 
-	int ret = btAttBuildPduReadMultipleRequest(pdu, sizeof(pdu), handles, num_handles);
+	int ret = btAttBuildPduReadMultipleRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), handles, num_handles);
 	if (ret < AKS_OK) {
 		return ret;
 	}
@@ -782,6 +1086,66 @@ int BtGattCharacteristicValueRead::btGattMultipleCharacteristicValues(
 	return AKS_OK;
 }
 
+/*---------------------------------------------------------------------------*/
+//J values は ctx.read_buf を指すので、次の Request を送るまでに読むこと
+int BtGattCharacteristicValueRead::btGattMultipleVariableCharacteristicValues(
+								BtGattDeviceContext	&ctx,
+								const BtAttHandle	*handles,
+								size_t				num_handles,
+								BtAttValueSpan		*values,
+								size_t				values_size,
+								size_t				&num_values)
+{
+	if (handles == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((values == NULL) || (values_size < num_handles)) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+
+	int ret = btAttBuildPduReadMultipleVariableRequest(pdu, _gatt_pdu_size(ctx, sizeof(pdu)), handles, num_handles);
+	if (ret < AKS_OK) {
+		return ret;
+	}
+	size_t pdu_size = (size_t)ret;
+
+	ret = btLeDeviceSendAttPduAndWaitForResponse(
+								&ctx,
+								pdu,
+								pdu_size,
+								BtAttPduOpcode::cAttOpcodeReadMultipleVariableResponse,
+								0);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	if (ctx.read_error != AKS_OK) {
+		return ctx.read_error;
+	}
+
+	ret = btAttParsePduReadMultipleVariableResponse(
+								ctx.read_buf,
+								(size_t)ctx.read_size,
+								values,
+								values_size,
+								num_values);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	//J MTU で途切れた場合は後ろの Handle が欠けるので、呼び出し側は num_values を見る
+	if (num_values > num_handles) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+	for (size_t i=0 ; i<num_values ; ++i) {
+		values[i].handle = handles[i];
+	}
+
+	return AKS_OK;
+}
+
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 int BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(
@@ -798,7 +1162,7 @@ int BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(
 
 	int ret = btAttBuildPduWriteCommand(
 								pdu,
-								sizeof(pdu),
+								_gatt_pdu_size(ctx, sizeof(pdu)),
 								handle,
 								(uint16_t)buf_size,
 								(const uint8_t *)buf);
@@ -820,18 +1184,46 @@ int BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(
 
 
 /*---------------------------------------------------------------------------*/
-int BtGattCharacteristicValueWrite:: btGattSignedWriteWithoutResponse(
+int BtGattCharacteristicValueWrite::btGattSignedWriteWithoutResponse(
 								BtGattDeviceContext	&ctx,
 								const BtAttHandle	handle,
 								const void			*buf,
 								const size_t		buf_size)
 {
-	(void)ctx;
-	(void)handle;
-	(void)buf;
-	(void)buf_size;
+	if ((buf == NULL) && (buf_size != 0)) {
+		return AKS_ERROR_NOBUF;
+	}
+	if (!ctx.csrk.valid) {
+		return AKS_ERROR_INVALID;
+	}
+
+	//J SignCounter は使い捨て。送信に失敗しても戻さない
+	uint32_t sign_counter = 0;
+	int ret = btLeDeviceReserveSignCounters(&ctx, 1, sign_counter);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+
+	ret = btAttBuildPduSignedWriteCommandWithKey(
+								pdu,
+								_gatt_pdu_size(ctx, sizeof(pdu)),
+								handle,
+								(uint16_t)buf_size,
+								(const uint8_t *)buf,
+								&ctx.crypto,
+								&ctx.csrk.key,
+								sign_counter);
+	if (ret < AKS_OK) {
+		return ret;
+	}
+	size_t pdu_size = (size_t)ret;
 
-	return AKS_ERROR_NOT_IMPLEMENTED;
+	return btLeDeviceSendAttPdu(
+								&ctx,
+								pdu,
+								pdu_size);
 }
 
 
@@ -849,7 +1241,7 @@ int BtGattCharacteristicValueWrite::btGattWriteCharacteristicValue(
 	uint8_t pdu[BT_ATT_MAX_LE_MTU];
 	int ret = btAttBuildPduWriteRequest(
 								pdu,
-								sizeof(pdu),
+								_gatt_pdu_size(ctx, sizeof(pdu)),
 								handle,
 								(uint16_t)buf_size,
 								(const uint8_t *)buf);
@@ -884,13 +1276,12 @@ int BtGattCharacteristicValueWrite::btGattWriteCharacteristicValue(
 
 
 /*---------------------------------------------------------------------------*/
-int BtGattCharacteristicValueWrite::btGattWriteLongCharacteristicValues(
+static int _gatt_write_long(
 								BtGattDeviceContext	&ctx,
 								const BtAttHandle	handle,
 								const void			*buf,
 								const size_t		buf_size)
 {
-	uint8_t pdu[BT_ATT_MAX_LE_MTU];
 	uint16_t offset = 0;
 	uint16_t write_size = 0;
 	size_t remaining_size = buf_size;
@@ -898,95 +1289,52 @@ int BtGattCharacteristicValueWrite::btGattWriteLongCharacteristicValues(
 	if ((buf == NULL) || (buf_size == 0)) {
 		return AKS_ERROR_NOBUF;
 	}
+	if (buf_size > 0xffff) {
+		return AKS_ERROR_INVALID;
+	}
 
-	while (remaining_size) {
-		write_size = ((size_t)(ctx.server.mtu-5) < remaining_size) ? (ctx.server.mtu-5) : remaining_size;
-		int ret = btAttBuildPduPrepareWriteRequest(
-								pdu,
-								sizeof(pdu),
-								handle, offset,
-								write_size,
-								&(((const uint8_t *)buf)[offset]));
-		if (ret < AKS_OK) {
-			return ret;
-		}
-		size_t pdu_size = (size_t)ret;
+	//J Prepare Write Request のヘッダ (Opcode + Handle + Offset) を除いた分ずつ送る
+	size_t chunk_size = _gatt_pdu_size(ctx, BT_ATT_MAX_LE_MTU) - 5;
 
-		ret = btLeDeviceSendAttPduAndWaitForResponse(
-								&ctx,
-								pdu,
-								pdu_size,
-								BtAttPduOpcode::cAttOpcodePrepareWriteResponse,
-								0);
-		if (ctx.read_error != AKS_OK) {
-			return ctx.read_error;
-		}
 
-		BtAttHandle response_handle = 0;
-		uint16_t response_value_len = 0;
-		uint16_t response_offset = 0;
-		uint8_t response_value[BT_ATT_MAX_LE_MTU];
-		ret = btAttParsePduPrepareWriteResponse(
-								ctx.read_buf,
-								(size_t)ctx.read_size,
-								response_handle,
-								response_offset,
-								response_value_len,
-								response_value,
-								sizeof(response_value));
+	while (remaining_size) {
+		write_size = (chunk_size < remaining_size) ? (uint16_t)chunk_size : (uint16_t)remaining_size;
+		int ret = _gatt_prepare_write(
+								ctx,
+								handle,
+								offset,
+								&(((const uint8_t *)buf)[offset]),
+								write_size);
 		if (ret != AKS_OK) {
+			//J Server に残ったキューを捨てる
+			_gatt_execute_write(ctx, BtAttExecuteWriteFlag::cCancelAllPreparedWrites);
 			return ret;
 		}
 
-		if ((response_handle != handle) ||
-			(response_offset != offset) ||
-			(response_value_len != write_size))
-		{
-			return AKS_ERROR_BT_IMCOMPLETED_WRITE;
-		}
-		else if (0 != memcmp(
-								response_value,
-								&(((const uint8_t *)buf)[offset]),
-								write_size) )
-		{
-			return AKS_ERROR_BT_IMCOMPLETED_WRITE;
-		}
-
 		remaining_size -= write_size;
 		offset += write_size;
 	}
 
-	int ret = btAttBuildPduExecuteWriteRequest(
-								pdu,
-								sizeof(pdu),
-								BtAttExecuteWriteFlag::cImmediatelyWriteAllPendingPreparedValues);
-	if (ret < AKS_OK) {
-		return ret;
-	}
-	size_t pdu_size = (size_t)ret;
-
-	ret = btLeDeviceSendAttPduAndWaitForResponse(
-								&ctx,
-								pdu,
-								pdu_size,
-								BtAttPduOpcode::cAttOpcodeExecuteWriteResponse,
-								0);
-	if (ret != AKS_OK) {
-		return ret;
-	}
+	return _gatt_execute_write(ctx, BtAttExecuteWriteFlag::cImmediatelyWriteAllPendingPreparedValues);
+}
 
-	if (ctx.read_error != AKS_OK) {
-		return ctx.read_error;
-	}
 
-	ret = btAttParsePduExecuteWriteResponse(
-								ctx.read_buf,
-								(size_t)ctx.read_size);
+/*---------------------------------------------------------------------------*/
+int BtGattCharacteristicValueWrite::btGattWriteLongCharacteristicValues(
+								BtGattDeviceContext	&ctx,
+								const BtAttHandle	handle,
+								const void			*buf,
+								const size_t		buf_size)
+{
+	int ret = _gatt_begin_procedure(ctx);
 	if (ret != AKS_OK) {
 		return ret;
 	}
 
-	return AKS_OK;
+	ret = _gatt_write_long(ctx, handle, buf, buf_size);
+	_gatt_end_procedure(ctx);
+
+	return ret;
 }
 
 
@@ -996,93 +1344,196 @@ int BtGattCharacteristicValueWrite::btGattWriteCharacteristicValueReliableWrites
 								BtGattHandleValueSet	*handleValueSet,
 								size_t					set_len)
 {
-	if (handleValueSet == NULL) {
-		return AKS_ERROR_NULL;
+	BtGattReliableWritePolicy policy;
+	btGattInitReliableWritePolicy(policy);
+
+	size_t committed = 0;
+	return btGattWriteCharacteristicValueReliableWritesWithPolicy(
+								ctx,
+								handleValueSet,
+								set_len,
+								policy,
+								committed);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int BtGattCharacteristicValueWrite::btGattInitReliableWritePolicy(
+								BtGattReliableWritePolicy	&policy)
+{
+	policy.split      = BtGattReliableWriteSplit::cNever;
+	policy.queue_size = 0;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Value を chunk_size ごとに分けた時の Prepare Write の数
+static size_t _gatt_reliable_fragments(size_t size, size_t chunk_size)
+{
+	if (size == 0) {
+		return 1;
 	}
+	return (size + chunk_size - 1) / chunk_size;
+}
 
-	int ret = 0;
-	uint8_t pdu[BT_ATT_MAX_LE_MTU];
-	for (size_t i=0 ; i<set_len ; ++i) {
-		ret = btAttBuildPduPrepareWriteRequest(
-								pdu,
-								sizeof(pdu),
-								handleValueSet[i].handle,
-								0x0000,
-								handleValueSet[i].size,
-								handleValueSet[i].value);
-		if (ret < AKS_OK) {
-			return ret;
+/*---------------------------------------------------------------------------*/
+//J ポリシーの下で from 以降の Value が書けるか
+static int _gatt_reliable_check(
+								BtGattHandleValueSet	*handleValueSet,
+								size_t					from,
+								size_t					set_len,
+								size_t					chunk_size,
+								const BtGattReliableWritePolicy &policy)
+{
+	if (policy.queue_size == 0) {
+		return AKS_OK;
+	}
+
+	size_t total = 0;
+	for (size_t i=from ; i<set_len ; ++i) {
+		size_t fragments = _gatt_reliable_fragments(handleValueSet[i].size, chunk_size);
+		if ((policy.split == BtGattReliableWriteSplit::cValueBoundary) && (fragments > policy.queue_size)) {
+			return AKS_ERROR_FULL;
 		}
-		size_t pdu_size = (size_t)ret;
+		total += fragments;
+	}
 
-		ret = btLeDeviceSendAttPduAndWaitForResponse(
-								&ctx,
-								pdu,
-								pdu_size,
-								BtAttPduOpcode::cAttOpcodePrepareWriteResponse,
-								0);
+	if ((policy.split == BtGattReliableWriteSplit::cNever) && (total > policy.queue_size)) {
+		return AKS_ERROR_FULL;
+	}
 
-		if (ctx.read_error != AKS_OK) {
-			return ctx.read_error;
-		}
+	return AKS_OK;
+}
 
-		BtAttHandle response_handle = 0;
-		uint16_t response_value_len = 0;
-		uint16_t response_offset = 0;
-		uint8_t response_value[BT_ATT_MAX_LE_MTU];
-		ret = btAttParsePduPrepareWriteResponse(
-								ctx.read_buf,
-								(size_t)ctx.read_size,
-								response_handle,
-								response_offset,
-								response_value_len,
-								response_value,
-								sizeof(response_value));
-		if (ret != AKS_OK) {
-			return ret;
-		}
+/*---------------------------------------------------------------------------*/
+static int _gatt_reliable_writes(
+								BtGattDeviceContext			&ctx,
+								BtGattHandleValueSet		*handleValueSet,
+								size_t						set_len,
+								BtGattReliableWritePolicy	&policy,
+								size_t						&committed)
+{
+	committed = 0;
 
-		if ((response_handle != handleValueSet[i].handle) || 
-			(response_value_len != handleValueSet[i].size)) {
-			return AKS_ERROR_BT_IMCOMPLETED_WRITE;
-		}
-		else if (0 != memcmp(
-								response_value,
-								handleValueSet[i].value,
-								handleValueSet[i].size) )
+	if (handleValueSet == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (policy.split > BtGattReliableWriteSplit::cAnywhere) {
+		return AKS_ERROR_INVALID;
+	}
+	for (size_t i=0 ; i<set_len ; ++i) {
+		if (((handleValueSet[i].value == NULL) && (handleValueSet[i].size != 0)) ||
+			(handleValueSet[i].size > 0xffff))
 		{
-			return AKS_ERROR_BT_IMCOMPLETED_WRITE;
+			return AKS_ERROR_INVALID;
 		}
 	}
-	ret = btAttBuildPduExecuteWriteRequest(
-								pdu,
-								sizeof(pdu),
-								BtAttExecuteWriteFlag::cImmediatelyWriteAllPendingPreparedValues);
-	if (ret < AKS_OK) {
-		return ret;
-	}
-	size_t pdu_size = (size_t)ret;
 
-	ret = btLeDeviceSendAttPduAndWaitForResponse(
-								&ctx,
-								pdu,
-								pdu_size,
-								BtAttPduOpcode::cAttOpcodeExecuteWriteResponse,
-								0);
+	//J Prepare Write Request のヘッダ (Opcode + Handle + Offset) を除いた分ずつ送る
+	size_t chunk_size = _gatt_pdu_size(ctx, BT_ATT_MAX_LE_MTU) - 5;
+
+	int ret = _gatt_reliable_check(handleValueSet, 0, set_len, chunk_size, policy);
 	if (ret != AKS_OK) {
 		return ret;
 	}
 
-	if (ctx.read_error != AKS_OK) {
-		return ctx.read_error;
+	size_t index  = 0;		//J 次に送る Value
+	size_t offset = 0;		//J その Value の中の位置
+	while (index < set_len) {
+		size_t batch_index  = index;
+		size_t batch_offset = offset;
+		size_t queued = 0;
+
+		while (index < set_len) {
+			const BtGattHandleValueSet *entry = &handleValueSet[index];
+
+			if ((policy.queue_size != 0) && (policy.split != BtGattReliableWriteSplit::cNever)) {
+				if (queued >= policy.queue_size) {
+					break;
+				}
+				//J Value の先頭で、残りのキューに収まらなければ次の Execute Write に回す
+				if ((policy.split == BtGattReliableWriteSplit::cValueBoundary) &&
+					(offset == 0) &&
+					(queued + _gatt_reliable_fragments(entry->size, chunk_size) > policy.queue_size))
+				{
+					break;
+				}
+			}
+
+			size_t write_size = entry->size - offset;
+			if (write_size > chunk_size) {
+				write_size = chunk_size;
+			}
+
+			ret = _gatt_prepare_write(
+								ctx,
+								entry->handle,
+								(uint16_t)offset,
+								(entry->value != NULL) ? &entry->value[offset] : NULL,
+								(uint16_t)write_size);
+			if (ret != AKS_OK) {
+				//J Server に残ったキューを捨てる
+				_gatt_execute_write(ctx, BtAttExecuteWriteFlag::cCancelAllPreparedWrites);
+
+				bool queue_full = (ret == (int)(AKS_ERROR_BT_ATT_ERROR | BtAttErrorCode::cAttErrorCodePrepareQueueFull));
+				if (!queue_full || (queued == 0) || (policy.split == BtGattReliableWriteSplit::cNever)) {
+					if (queue_full && (queued != 0)) {
+						policy.queue_size = (uint16_t)queued;
+					}
+					return ret;
+				}
+
+				//J 受け付けられた数をキューの大きさとして、このバッチをやり直す
+				policy.queue_size = (uint16_t)queued;
+				ret = _gatt_reliable_check(handleValueSet, batch_index, set_len, chunk_size, policy);
+				if (ret != AKS_OK) {
+					return ret;
+				}
+
+				index  = batch_index;
+				offset = batch_offset;
+				queued = 0;
+				continue;
+			}
+
+			queued++;
+			offset += write_size;
+			if (offset >= entry->size) {
+				index++;
+				offset = 0;
+			}
+		}
+
+		ret = _gatt_execute_write(ctx, BtAttExecuteWriteFlag::cImmediatelyWriteAllPendingPreparedValues);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+
+		//J 最後まで書き込まれた Value の数
+		committed = index;
 	}
 
-	ret = btAttParsePduExecuteWriteResponse(
-								ctx.read_buf,
-								(size_t)ctx.read_size);
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int BtGattCharacteristicValueWrite::btGattWriteCharacteristicValueReliableWritesWithPolicy(
+								BtGattDeviceContext			&ctx,
+								BtGattHandleValueSet		*handleValueSet,
+								size_t						set_len,
+								BtGattReliableWritePolicy	&policy,
+								size_t						&committed)
+{
+	int ret = _gatt_begin_procedure(ctx);
 	if (ret != AKS_OK) {
 		return ret;
 	}
 
-	return AKS_OK;
+	ret = _gatt_reliable_writes(ctx, handleValueSet, set_len, policy, committed);
+	_gatt_end_procedure(ctx);
+
+	return ret;
 }
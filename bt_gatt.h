@@ -23,6 +23,21 @@ struct GattAttributeTypeUuid{
 	static const uint16_t cCharacteristicAgreegateFormat			= 0x2905;
 };
 
+/* Gatt characteristic types (Generic Attribute service) */
+struct GattCharacteristicTypeUuid{
+	static const uint16_t cServiceChanged							= 0x2A05;
+	static const uint16_t cClientSupportedFeatures					= 0x2B29;
+	static const uint16_t cDatabaseHash								= 0x2B2A;
+	static const uint16_t cServerSupportedFeatures					= 0x2B3A;
+};
+
+/* Client Supported Features の各ビット */
+struct BtGattClientSupportedFeatures{
+	static const uint8_t cRobustCaching							= 0x01;
+	static const uint8_t cEnhancedAtt							= 0x02;
+	static const uint8_t cMultipleHandleValueNotifications		= 0x04;
+};
+
 struct BtGattCharacteristic
 {
 	BtAttHandle	handle;
@@ -32,6 +47,9 @@ struct BtGattCharacteristic
 };
 
 
+//J Read Long の各 Blob を受け取る。AKS_OK 以外を返すと読み出しを中断する
+typedef int (*BtGattReadSink)(void *arg, size_t offset, const uint8_t *chunk, size_t chunk_len);
+
 struct BtGattHandleValueSet
 {
 	BtAttHandle handle;
@@ -39,9 +57,23 @@ struct BtGattHandleValueSet
 	size_t		size;
 };
 
+//J Reliable Writes を複数の Execute Write に分けてよい単位
+struct BtGattReliableWriteSplit {
+	static const uint8_t cNever				= 0;	//J 全体を 1回の Execute Write で書く
+	static const uint8_t cValueBoundary		= 1;	//J 各 Value は 1回の Execute Write に収める
+	static const uint8_t cAnywhere			= 2;	//J Value の途中でも分ける
+};
+
+struct BtGattReliableWritePolicy
+{
+	uint8_t  split;
+	uint16_t queue_size;	//J Server の Prepare Queue のエントリ数 (0 なら不明。Prepare Queue Full を受けると学習して書き戻す)
+};
+
 namespace BtGattServerConfiguration
 {
 	int btGattExchangeMtu(BtGattDeviceContext &ctx);
+	int btGattWriteClientSupportedFeatures(BtGattDeviceContext &ctx, const uint8_t features);
 }
 
 namespace BtGattPrimaryServiceDiscovery
@@ -108,6 +140,12 @@ namespace BtGattCharacteristicValueRead
 								void				*buf,
 								size_t				buf_size,
 								size_t				&read_size);
+	int btGattReadLongCharacteristicValuesToSink(
+								BtGattDeviceContext	&ctx,
+								BtAttHandle			handle,
+								BtGattReadSink		sink,
+								void				*arg,
+								size_t				&read_size);
 	int btGattMultipleCharacteristicValues(
 								BtGattDeviceContext	&ctx,
 								BtAttHandle			*handles,
@@ -115,6 +153,13 @@ namespace BtGattCharacteristicValueRead
 								void				*buf,
 								size_t				buf_size,
 								size_t				&read_size);
+	int btGattMultipleVariableCharacteristicValues(
+								BtGattDeviceContext	&ctx,
+								const BtAttHandle	*handles,
+								size_t				num_handles,
+								BtAttValueSpan		*values,
+								size_t				values_size,
+								size_t				&num_values);
 }
 
 namespace BtGattCharacteristicValueWrite
@@ -143,6 +188,14 @@ namespace BtGattCharacteristicValueWrite
 								BtGattDeviceContext		&ctx,
 								BtGattHandleValueSet	*handleValueSet,
 								size_t					set_len);
+	int btGattInitReliableWritePolicy(
+								BtGattReliableWritePolicy	&policy);
+	int btGattWriteCharacteristicValueReliableWritesWithPolicy(
+								BtGattDeviceContext			&ctx,
+								BtGattHandleValueSet		*handleValueSet,
+								size_t						set_len,
+								BtGattReliableWritePolicy	&policy,
+								size_t						&committed);
 }
 
 namespace BtGattCharacteristicDescriptorValueRead
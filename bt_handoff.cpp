@@ -0,0 +1,437 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_le_device.h"
+#include "bt_handoff.h"
+
+//J 状態の memfd に必要な Seal (受け取った側が読んでいる間に書き換えられない)
+#define BT_HANDOFF_STATE_SEALS						(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+
+/*---------------------------------------------------------------------------*/
+static int _handoff_unix_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return AKS_ERROR_INVALID;
+	}
+	strcpy(addr->sun_path, path);
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 状態を memfd に書いて封じる
+/*---------------------------------------------------------------------------*/
+static int _handoff_create_state_fd(const BtLeDeviceHandoffState *state)
+{
+	int fd = memfd_create("bt_handoff_state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	ssize_t size;
+	do {
+		size = pwrite(fd, state, sizeof(BtLeDeviceHandoffState), 0);
+	} while ((size < 0) && (errno == EINTR));
+
+	if ((size != (ssize_t)sizeof(BtLeDeviceHandoffState)) ||
+		(fcntl(fd, F_ADD_SEALS, BT_HANDOFF_STATE_SEALS | F_SEAL_SEAL) < 0)) {
+		close(fd);
+		return AKS_ERROR_IO;
+	}
+
+	return fd;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 封じられていない memfd は送った側がまだ書き換えられるので受け取らない
+/*---------------------------------------------------------------------------*/
+static int _handoff_read_state_fd(int fd, BtLeDeviceHandoffState *state)
+{
+	int seals = fcntl(fd, F_GET_SEALS);
+	if ((seals < 0) || ((seals & BT_HANDOFF_STATE_SEALS) != BT_HANDOFF_STATE_SEALS)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || (st.st_size != (off_t)sizeof(BtLeDeviceHandoffState))) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	ssize_t size;
+	do {
+		size = pread(fd, state, sizeof(BtLeDeviceHandoffState), 0);
+	} while ((size < 0) && (errno == EINTR));
+	if (size != (ssize_t)sizeof(BtLeDeviceHandoffState)) {
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _handoff_send_device(int sock, uint32_t index, const BtLeDeviceHandoffState *state, int fd)
+{
+	int state_fd = _handoff_create_state_fd(state);
+	if (state_fd < 0) {
+		return state_fd;
+	}
+
+	BtHandoffMessage message;
+	message.magic      = BT_HANDOFF_MAGIC;
+	message.index      = index;
+	message.state_size = sizeof(BtLeDeviceHandoffState);
+
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len  = sizeof(message);
+
+	int fds[2] = { fd, state_fd };
+	union {
+		struct cmsghdr align;
+		uint8_t        buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	close(state_fd);
+	if (sent != (ssize_t)sizeof(message)) {
+		return AKS_ERROR_IO;
+	}
+
+	BtHandoffAck ack;
+	ssize_t size;
+	do {
+		size = recv(sock, &ack, sizeof(ack), 0);
+	} while ((size < 0) && (errno == EINTR));
+	if ((size != (ssize_t)sizeof(ack)) || (ack.index != index)) {
+		return AKS_ERROR_IO;
+	}
+
+	return ack.result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 新しいプロセスにデバイスを順に引き渡す
+//J 引き渡せたデバイスの Socket は閉じ、ctx は切断状態になる。
+//J 失敗したデバイス以降はこのプロセスで受信を再開して num_sent を返す
+/*---------------------------------------------------------------------------*/
+int btHandoffSend(
+								const char *path,
+								BtGattDeviceContext **ctxs,
+								const size_t num_ctxs,
+								size_t &num_sent)
+{
+	num_sent = 0;
+
+	if ((path == NULL) || (ctxs == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	struct sockaddr_un addr;
+	int ret = _handoff_unix_address(path, &addr);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return AKS_ERROR_IO;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return AKS_ERROR_IO;
+	}
+
+	ret = btHandoffSendWithSocket(sock, ctxs, num_ctxs, num_sent);
+
+	close(sock);
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 繋がった Socket で btHandoffSend() する (sock は閉じない)
+/*---------------------------------------------------------------------------*/
+int btHandoffSendWithSocket(
+								int sock,
+								BtGattDeviceContext **ctxs,
+								const size_t num_ctxs,
+								size_t &num_sent)
+{
+	num_sent = 0;
+
+	if (ctxs == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	int ret = AKS_OK;
+	for (size_t i=0 ; i<num_ctxs ; ++i) {
+		BtGattDeviceContext *ctx = ctxs[i];
+
+		BtLeDeviceHandoffState state;
+		int fd = -1;
+		ret = btLeDeviceDetach(ctx, &state, fd);
+		if (ret != AKS_OK) {
+			break;
+		}
+
+		ret = _handoff_send_device(sock, (uint32_t)i, &state, fd);
+		if (ret != AKS_OK) {
+			//J 受け取ってもらえなかったので元に戻す (Callback は ctx に残っていない)
+			BtGattDeviceContext saved = *ctx;
+			if (btLeDeviceAttach(ctx, fd, &state) == AKS_OK) {
+				for (int j=0 ; j<ctx->num_notification ; ++j) {
+					ctx->notification_list[j] = saved.notification_list[j];
+				}
+				(void)btLeDeviceResume(ctx);
+			}
+			break;
+		}
+
+		close(fd);
+		num_sent++;
+	}
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _handoff_accept(const char *path, const int timeout_ms)
+{
+	struct sockaddr_un addr;
+	int ret = _handoff_unix_address(path, &addr);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	int listen_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_sock < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	(void)unlink(path);
+	if ((bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+		(listen(listen_sock, 1) < 0)) {
+		close(listen_sock);
+		return AKS_ERROR_IO;
+	}
+
+	struct pollfd pfd;
+	pfd.fd      = listen_sock;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while ((ret < 0) && (errno == EINTR));
+
+	int sock = -1;
+	if (ret > 0) {
+		sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+	}
+
+	close(listen_sock);
+	(void)unlink(path);
+
+	if (ret == 0) {
+		return AKS_ERROR_TIMEOUT;
+	}
+	if (sock < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	return sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 古いプロセスからデバイスを受け取る (受信スレッドは止まったまま)
+//J 受け取った ctxs[0 .. num_received) に Callback を Bind して btLeDeviceResume() すること
+/*---------------------------------------------------------------------------*/
+int btHandoffReceive(
+								const char *path,
+								BtGattDeviceContext *ctxs,
+								const size_t ctxs_size,
+								size_t &num_received,
+								const int timeout_ms)
+{
+	num_received = 0;
+
+	if ((path == NULL) || (ctxs == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	int sock = _handoff_accept(path, timeout_ms);
+	if (sock < 0) {
+		return sock;
+	}
+
+	int ret = btHandoffReceiveWithSocket(sock, ctxs, ctxs_size, num_received);
+
+	close(sock);
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 繋がった Socket で btHandoffReceive() する。送り手が閉じるまで受け取る (sock は閉じない)
+/*---------------------------------------------------------------------------*/
+int btHandoffReceiveWithSocket(
+								int sock,
+								BtGattDeviceContext *ctxs,
+								const size_t ctxs_size,
+								size_t &num_received)
+{
+	num_received = 0;
+
+	if (ctxs == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	int ret = AKS_OK;
+	while (1) {
+		BtHandoffMessage message;
+		struct iovec iov;
+		iov.iov_base = &message;
+		iov.iov_len  = sizeof(message);
+
+		union {
+			struct cmsghdr align;
+			uint8_t        buf[CMSG_SPACE(2 * sizeof(int))];
+		} control;
+		memset(&control, 0, sizeof(control));
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (size < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = AKS_ERROR_IO;
+			break;
+		}
+		//J 送り終えて閉じられた
+		if (size == 0) {
+			break;
+		}
+
+		//J 足りなくても多くても、届いた fd は全て受け取ってから調べる
+		int fds[2] = { -1, -1 };
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+				continue;
+			}
+			size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i=0 ; i<num_fds ; ++i) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if ((i < 2) && (fds[i] < 0)) {
+					fds[i] = fd;
+				}
+				else {
+					close(fd);
+				}
+			}
+		}
+
+		BtHandoffAck ack;
+		ack.index  = message.index;
+		ack.result = AKS_OK;
+		BtLeDeviceHandoffState state;
+		if ((fds[0] < 0) || (fds[1] < 0) || (size != (ssize_t)sizeof(message)) ||
+			(message.magic != BT_HANDOFF_MAGIC) || (message.state_size != sizeof(BtLeDeviceHandoffState))) {
+			ack.result = AKS_ERROR_BT_INVALUD_FORMAT;
+		}
+		else if (num_received >= ctxs_size) {
+			ack.result = AKS_ERROR_FULL;
+		}
+		else {
+			ack.result = _handoff_read_state_fd(fds[1], &state);
+			if (ack.result == AKS_OK) {
+				ack.result = btLeDeviceAttach(&ctxs[num_received], fds[0], &state);
+			}
+		}
+
+		if (fds[1] >= 0) {
+			close(fds[1]);
+		}
+		if (ack.result == AKS_OK) {
+			num_received++;
+		}
+		else if (fds[0] >= 0) {
+			close(fds[0]);
+		}
+
+		if (send(sock, &ack, sizeof(ack), MSG_NOSIGNAL) < 0) {
+			//J Ack が届かなければ送り手は引き渡せなかったとみなして使い続ける
+			if (ack.result == AKS_OK) {
+				num_received--;
+				BtLeDeviceHandoffState state;
+				int attached = -1;
+				if (btLeDeviceDetach(&ctxs[num_received], &state, attached) == AKS_OK) {
+					close(attached);
+				}
+			}
+			ret = AKS_ERROR_IO;
+			break;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,68 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_HANDOFF_H_
+#define BT_HANDOFF_H_
+
+/*
+ *J プロセスを入れ替える時に LE の接続を切らずに引き継ぐ
+ *J
+ *J 1. 新しいプロセスが btHandoffReceive() で Unix Domain Socket を listen する
+ *J 2. 古いプロセスが btHandoffSend() で接続し、デバイスごとに
+ *J    btLeDeviceDetach() した状態と L2CAP Socket (SCM_RIGHTS) を送る。
+ *J    状態は書き込みを封じた memfd に入れて Socket と一緒に渡す
+ *J 3. 新しいプロセスは封じられていることを確かめてから状態を読み、
+ *J    btLeDeviceAttach() して Ack を返す。
+ *J    Callback を btLeDeviceBindNotificationCallback() してから btLeDeviceResume() する
+ *J
+ *J 引き継ぎ中に届いた PDU は Socket に溜まっているので失われない。
+ *J 新しいプロセスが受け取れなかったデバイスは、古いプロセスがそのまま使い続ける。
+ *J
+ *J 既に繋がった Unix Domain Socket (SOCK_SEQPACKET) があれば
+ *J btHandoffSendWithSocket() / btHandoffReceiveWithSocket() を使う。
+ */
+
+#define BT_HANDOFF_MAGIC							(0x42544844)	//J "DHTB"
+
+#pragma pack(1)
+//J SCM_RIGHTS で L2CAP Socket と状態の memfd をこの順に付ける
+struct BtHandoffMessage
+{
+	uint32_t magic;
+	uint32_t index;
+	uint32_t state_size;			//J memfd の大きさ (sizeof(BtLeDeviceHandoffState))
+};
+
+struct BtHandoffAck
+{
+	uint32_t index;
+	int32_t  result;
+};
+#pragma pack()
+
+int btHandoffSend(
+								const char *path,
+								BtGattDeviceContext **ctxs,
+								const size_t num_ctxs,
+								size_t &num_sent);
+int btHandoffSendWithSocket(
+								int sock,
+								BtGattDeviceContext **ctxs,
+								const size_t num_ctxs,
+								size_t &num_sent);
+int btHandoffReceive(
+								const char *path,
+								BtGattDeviceContext *ctxs,
+								const size_t ctxs_size,
+								size_t &num_received,
+								const int timeout_ms);
+int btHandoffReceiveWithSocket(
+								int sock,
+								BtGattDeviceContext *ctxs,
+								const size_t ctxs_size,
+								size_t &num_received);
+
+#endif/*BT_HANDOFF_H_*/
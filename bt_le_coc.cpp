@@ -0,0 +1,597 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_le_device.h"
+#include "bt_le_coc.h"
+
+
+/*---------------------------------------------------------------------------*/
+//J SDU を運ぶのに必要な K-frame (= Credit) の数
+/*---------------------------------------------------------------------------*/
+static uint64_t _coc_credits(const BtLeCocContext *coc, const size_t sdu_len)
+{
+	size_t frame_len = sdu_len + BT_LE_COC_SDU_LENGTH_SIZE;
+	return (uint64_t)((frame_len + coc->mps - 1) / coc->mps);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint16_t _coc_socket_mtu(int sock, int optname, uint16_t fallback)
+{
+	//J L2CAP 以外の Socket (socketpair 等) では取れないので fallback を使う
+	uint16_t mtu = 0;
+	socklen_t len = sizeof(mtu);
+	if ((getsockopt(sock, SOL_BLUETOOTH, optname, &mtu, &len) == 0) && (mtu != 0)) {
+		return mtu;
+	}
+	return fallback;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeCocInitOptions(BtLeCocOptions *options)
+{
+	if (options == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(options, 0, sizeof(BtLeCocOptions));
+	options->mtu            = BT_LE_COC_DEFAULT_MTU;
+	options->mps            = BT_LE_COC_DEFAULT_MPS;
+	options->security_level = BtLeDeviceSecurityLevel::cLow;
+	options->credit_timeout_ms = BT_LE_COC_DEFAULT_CREDIT_TIMEOUT_MS;
+	options->address_type   = BtLeDeviceAddressType::cRandom;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeCocOpen(
+								BtLeCocContext *coc,
+								const char *btaddr,
+								const uint16_t psm,
+								const BtLeCocOptions *options,
+								uint8_t *rx_buf,
+								const size_t rx_buf_size)
+{
+	if ((coc == NULL) || (btaddr == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	BtLeCocOptions default_options;
+	if (options == NULL) {
+		btLeCocInitOptions(&default_options);
+		options = &default_options;
+	}
+
+	BtLeDeviceOptions channel_options;
+	(void)btLeDeviceInitOptions(&channel_options);
+	channel_options.adapter            = options->adapter;
+	channel_options.address_type       = options->address_type;
+	channel_options.security_level     = options->security_level;
+	channel_options.connect_timeout_ms = options->connect_timeout_ms;
+
+	int sock = btLeDeviceOpenL2capChannel(
+										btaddr,
+										psm,
+										BtLeDeviceL2capMode::cLeFlowControl,
+										options->mtu,
+										&channel_options);
+	if (sock < 0) {
+		return sock;
+	}
+
+	int ret = btLeCocOpenWithSocket(coc, sock, options, rx_buf, rx_buf_size);
+	if (ret != AKS_OK) {
+		close(sock);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 接続済みの SOCK_SEQPACKET Socket で開く (成功したら Close で閉じる)
+/*---------------------------------------------------------------------------*/
+int btLeCocOpenWithSocket(
+								BtLeCocContext *coc,
+								int sock,
+								const BtLeCocOptions *options,
+								uint8_t *rx_buf,
+								const size_t rx_buf_size)
+{
+	if ((coc == NULL) || (rx_buf == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	BtLeCocOptions default_options;
+	if (options == NULL) {
+		btLeCocInitOptions(&default_options);
+		options = &default_options;
+	}
+	if ((options->mtu == 0) || (options->mps == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(coc, 0, sizeof(BtLeCocContext));
+	coc->sock   = sock;
+	coc->sndmtu = _coc_socket_mtu(sock, BT_SNDMTU, options->mtu);
+	coc->rcvmtu = _coc_socket_mtu(sock, BT_RCVMTU, options->mtu);
+	coc->mps    = options->mps;
+	coc->credit_timeout_ms = options->credit_timeout_ms;
+
+	//J 1スロットに 1 SDU が必ず収まるようにする
+	coc->rx_buf    = rx_buf;
+	coc->slot_size = coc->rcvmtu;
+	coc->num_slots = (uint32_t)(rx_buf_size / coc->slot_size);
+	if (coc->num_slots == 0) {
+		memset(coc, 0, sizeof(BtLeCocContext));
+		coc->sock = -1;
+		return AKS_ERROR_NOBUF;
+	}
+	if (coc->num_slots > BT_LE_COC_MAX_SLOTS) {
+		coc->num_slots = BT_LE_COC_MAX_SLOTS;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeCocClose(BtLeCocContext *coc)
+{
+	if (coc == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	if (coc->sock >= 0) {
+		close(coc->sock);
+	}
+	coc->sock      = -1;
+	coc->rx_count  = 0;
+	coc->rx_held   = 0;
+	coc->rx_offset = 0;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Credit が戻って Socket に書けるようになるまで待つ (credit_timeout_ms で諦める)
+/*---------------------------------------------------------------------------*/
+static int _coc_wait_for_credits(BtLeCocContext *coc)
+{
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	uint64_t deadline_ns = start_ns + (uint64_t)coc->credit_timeout_ms * 1000000ULL;
+
+	struct pollfd pfd;
+	pfd.fd      = coc->sock;
+	pfd.events  = POLLOUT;
+	pfd.revents = 0;
+
+	int ret;
+	for (;;) {
+		int timeout_ms = -1;
+		if (coc->credit_timeout_ms != 0) {
+			uint64_t now_ns = btUtilGetMonotonicTimeNs();
+			timeout_ms = (now_ns < deadline_ns) ? (int)((deadline_ns - now_ns + 999999ULL) / 1000000ULL) : 0;
+		}
+		ret = poll(&pfd, 1, timeout_ms);
+		if ((ret < 0) && (errno == EINTR)) {
+			continue;
+		}
+		break;
+	}
+
+	__atomic_fetch_add(&coc->stats.credit_stalls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&coc->stats.credit_wait_ns, btUtilGetMonotonicTimeNs() - start_ns, __ATOMIC_RELAXED);
+
+	if (ret == 0) {
+		return AKS_ERROR_TIMEOUT;
+	}
+	if ((ret < 0) || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _coc_record_tx_queue(BtLeCocContext *coc)
+{
+	//J まだ Peer に送れていない (Credit 待ちの) バイト数
+	int queued = 0;
+	if ((ioctl(coc->sock, TIOCOUTQ, &queued) == 0) && (queued > 0) &&
+		((uint64_t)queued > coc->stats.max_tx_queued)) {
+		coc->stats.max_tx_queued = (uint64_t)queued;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 呼び出し元のバッファをそのまま SDU として送る
+/*---------------------------------------------------------------------------*/
+int btLeCocSendSdus(
+								BtLeCocContext *coc,
+								const BtLeCocSdu *sdus,
+								const size_t num_sdus)
+{
+	if ((coc == NULL) || (sdus == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (coc->sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+	for (size_t i=0 ; i<num_sdus ; ++i) {
+		if ((sdus[i].data == NULL) || (sdus[i].len == 0)) {
+			return AKS_ERROR_INVALID;
+		}
+		if (sdus[i].len > coc->sndmtu) {
+			return AKS_ERROR_NOBUF;
+		}
+	}
+
+	struct mmsghdr msgs[BT_LE_COC_MAX_BURST];
+	struct iovec   iov[BT_LE_COC_MAX_BURST];
+
+	size_t sent = 0;
+	while (sent < num_sdus) {
+		size_t batch = num_sdus - sent;
+		if (batch > BT_LE_COC_MAX_BURST) {
+			batch = BT_LE_COC_MAX_BURST;
+		}
+
+		memset(msgs, 0, sizeof(msgs[0]) * batch);
+		for (size_t i=0 ; i<batch ; ++i) {
+			iov[i].iov_base = (void *)sdus[sent + i].data;
+			iov[i].iov_len  = sdus[sent + i].len;
+			msgs[i].msg_hdr.msg_iov    = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		//J Credit 切れを検出するため、ブロックせずに送る
+		int ret = sendmmsg(coc->sock, msgs, (unsigned int)batch, MSG_DONTWAIT);
+		__atomic_fetch_add(&coc->stats.syscalls, 1, __ATOMIC_RELAXED);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				int wait_ret = _coc_wait_for_credits(coc);
+				if (wait_ret != AKS_OK) {
+					return wait_ret;
+				}
+				continue;
+			}
+			return AKS_ERROR_IO;
+		}
+
+		for (int i=0 ; i<ret ; ++i) {
+			if (msgs[i].msg_len != sdus[sent + i].len) {
+				return AKS_ERROR_IO;
+			}
+			__atomic_fetch_add(&coc->stats.tx_bytes, msgs[i].msg_len, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&coc->stats.tx_credits_estimated, _coc_credits(coc, msgs[i].msg_len), __ATOMIC_RELAXED);
+		}
+		__atomic_fetch_add(&coc->stats.tx_sdus, (uint64_t)ret, __ATOMIC_RELAXED);
+		_coc_record_tx_queue(coc);
+
+		sent += (size_t)ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J バイト列を sndmtu ごとの SDU に区切って送る
+/*---------------------------------------------------------------------------*/
+int btLeCocWrite(
+								BtLeCocContext *coc,
+								const void *buf,
+								const size_t len)
+{
+	if ((coc == NULL) || (buf == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (coc->sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	const uint8_t *p = (const uint8_t *)buf;
+	BtLeCocSdu sdus[BT_LE_COC_MAX_BURST];
+
+	size_t offset = 0;
+	while (offset < len) {
+		size_t num = 0;
+		while ((offset < len) && (num < BT_LE_COC_MAX_BURST)) {
+			size_t sdu_len = len - offset;
+			if (sdu_len > coc->sndmtu) {
+				sdu_len = coc->sndmtu;
+			}
+			sdus[num].data = p + offset;
+			sdus[num].len  = sdu_len;
+			offset += sdu_len;
+			num++;
+		}
+
+		int ret = btLeCocSendSdus(coc, sdus, num);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 空いているスロットに recvmmsg() で直接受ける
+/*---------------------------------------------------------------------------*/
+static int _coc_fill(BtLeCocContext *coc, const int timeout_ms)
+{
+	if (coc->rx_count >= coc->num_slots) {
+		return AKS_ERROR_FULL;
+	}
+
+	struct pollfd pfd;
+	pfd.fd      = coc->sock;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+
+	int ret;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0) {
+		return AKS_ERROR_IO;
+	}
+	if (ret == 0) {
+		return AKS_ERROR_TIMEOUT;
+	}
+	if ((pfd.revents & POLLIN) == 0) {
+		return AKS_ERROR_IO;
+	}
+
+	//J リングの末尾で折り返さないよう、連続した空きスロットだけに受ける
+	uint32_t tail = (coc->rx_head + coc->rx_count) % coc->num_slots;
+	uint32_t num  = coc->num_slots - coc->rx_count;
+	if (num > coc->num_slots - tail) {
+		num = coc->num_slots - tail;
+	}
+	if (num > BT_LE_COC_MAX_BURST) {
+		num = BT_LE_COC_MAX_BURST;
+	}
+
+	struct mmsghdr msgs[BT_LE_COC_MAX_BURST];
+	struct iovec   iov[BT_LE_COC_MAX_BURST];
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (uint32_t i=0 ; i<num ; ++i) {
+		iov[i].iov_base = coc->rx_buf + (size_t)(tail + i) * coc->slot_size;
+		iov[i].iov_len  = coc->slot_size;
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		ret = recvmmsg(coc->sock, msgs, num, MSG_DONTWAIT, NULL);
+	} while ((ret < 0) && (errno == EINTR));
+	__atomic_fetch_add(&coc->stats.syscalls, 1, __ATOMIC_RELAXED);
+	if (ret < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			return AKS_ERROR_TIMEOUT;
+		}
+		return AKS_ERROR_IO;
+	}
+
+	uint32_t received = 0;
+	for (int i=0 ; i<ret ; ++i) {
+		//J 長さ 0 は Channel が切断されたことを表す
+		if (msgs[i].msg_len == 0) {
+			break;
+		}
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			__atomic_fetch_add(&coc->stats.rx_truncated, 1, __ATOMIC_RELAXED);
+		}
+		coc->rx_len[tail + received] = msgs[i].msg_len;
+		__atomic_fetch_add(&coc->stats.rx_bytes, msgs[i].msg_len, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&coc->stats.rx_credits_estimated, _coc_credits(coc, msgs[i].msg_len), __ATOMIC_RELAXED);
+		received++;
+	}
+	if (received == 0) {
+		return AKS_ERROR_IO;
+	}
+	__atomic_fetch_add(&coc->stats.rx_sdus, (uint64_t)received, __ATOMIC_RELAXED);
+	coc->rx_count += received;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 受信した SDU をスロットを指したまま返す
+//J 返した SDU は btLeCocRelease() するまで有効で、スロットは再利用されない
+/*---------------------------------------------------------------------------*/
+int btLeCocReceive(
+								BtLeCocContext *coc,
+								BtLeCocSdu *sdus,
+								const size_t sdus_size,
+								size_t &num_sdus,
+								const int timeout_ms)
+{
+	num_sdus = 0;
+
+	if ((coc == NULL) || (sdus == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((coc->sock < 0) || (sdus_size == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+	//J btLeCocRead() で途中まで読んだ SDU は渡せない
+	if (coc->rx_offset != 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	if (coc->rx_count == coc->rx_held) {
+		int ret = _coc_fill(coc, timeout_ms);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	uint32_t available = coc->rx_count - coc->rx_held;
+	while ((num_sdus < sdus_size) && (num_sdus < available)) {
+		uint32_t slot = (coc->rx_head + coc->rx_held + (uint32_t)num_sdus) % coc->num_slots;
+		sdus[num_sdus].data = coc->rx_buf + (size_t)slot * coc->slot_size;
+		sdus[num_sdus].len  = coc->rx_len[slot];
+		num_sdus++;
+	}
+	coc->rx_held += (uint32_t)num_sdus;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J btLeCocReceive() で受け取った SDU を古い順に num_sdus 個返却する
+/*---------------------------------------------------------------------------*/
+int btLeCocRelease(BtLeCocContext *coc, const size_t num_sdus)
+{
+	if (coc == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (num_sdus > coc->rx_held) {
+		return AKS_ERROR_INVALID;
+	}
+
+	coc->rx_head   = (coc->rx_head + (uint32_t)num_sdus) % coc->num_slots;
+	coc->rx_count -= (uint32_t)num_sdus;
+	coc->rx_held  -= (uint32_t)num_sdus;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J SDU の区切りを無視してバイト列として読む (read(2) と同じく1バイト以上読めたら戻る)
+/*---------------------------------------------------------------------------*/
+int btLeCocRead(
+								BtLeCocContext *coc,
+								void *buf,
+								const size_t buf_size,
+								size_t &read_size,
+								const int timeout_ms)
+{
+	read_size = 0;
+
+	if ((coc == NULL) || (buf == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((coc->sock < 0) || (buf_size == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+	if (coc->rx_held != 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	if (coc->rx_count == 0) {
+		int ret = _coc_fill(coc, timeout_ms);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	uint8_t *p = (uint8_t *)buf;
+	while ((read_size < buf_size) && (coc->rx_count > 0)) {
+		const uint8_t *slot = coc->rx_buf + (size_t)coc->rx_head * coc->slot_size;
+		size_t remain = coc->rx_len[coc->rx_head] - coc->rx_offset;
+		size_t copy_size = buf_size - read_size;
+		if (copy_size > remain) {
+			copy_size = remain;
+		}
+		memcpy(p + read_size, slot + coc->rx_offset, copy_size);
+		read_size      += copy_size;
+		coc->rx_offset += copy_size;
+
+		if (coc->rx_offset == coc->rx_len[coc->rx_head]) {
+			coc->rx_head   = (coc->rx_head + 1) % coc->num_slots;
+			coc->rx_count -= 1;
+			coc->rx_offset = 0;
+		}
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeCocGetStatistics(BtLeCocContext *coc, BtLeCocStatistics *stats)
+{
+	if ((coc == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	stats->tx_sdus              = __atomic_load_n(&coc->stats.tx_sdus, __ATOMIC_RELAXED);
+	stats->tx_bytes             = __atomic_load_n(&coc->stats.tx_bytes, __ATOMIC_RELAXED);
+	stats->tx_credits_estimated = __atomic_load_n(&coc->stats.tx_credits_estimated, __ATOMIC_RELAXED);
+	stats->rx_sdus              = __atomic_load_n(&coc->stats.rx_sdus, __ATOMIC_RELAXED);
+	stats->rx_bytes             = __atomic_load_n(&coc->stats.rx_bytes, __ATOMIC_RELAXED);
+	stats->rx_credits_estimated = __atomic_load_n(&coc->stats.rx_credits_estimated, __ATOMIC_RELAXED);
+	stats->rx_truncated         = __atomic_load_n(&coc->stats.rx_truncated, __ATOMIC_RELAXED);
+	stats->credit_stalls        = __atomic_load_n(&coc->stats.credit_stalls, __ATOMIC_RELAXED);
+	stats->credit_wait_ns       = __atomic_load_n(&coc->stats.credit_wait_ns, __ATOMIC_RELAXED);
+	stats->max_tx_queued        = __atomic_load_n(&coc->stats.max_tx_queued, __ATOMIC_RELAXED);
+	stats->syscalls             = __atomic_load_n(&coc->stats.syscalls, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeCocResetStatistics(BtLeCocContext *coc)
+{
+	if (coc == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	__atomic_store_n(&coc->stats.tx_sdus, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.tx_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.tx_credits_estimated, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.rx_sdus, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.rx_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.rx_credits_estimated, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.rx_truncated, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.credit_stalls, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.credit_wait_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.max_tx_queued, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&coc->stats.syscalls, 0, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
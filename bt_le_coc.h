@@ -0,0 +1,130 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_LE_COC_H_
+#define BT_LE_COC_H_
+
+/*
+ *J LE Credit Based Flow Control の L2CAP Channel (CoC) をストリームとして扱う
+ *J
+ *J ATT を通さず、Peripheral が listen している PSM に大きな SDU で直接送受信する。
+ *J
+ *J 受信は呼び出し元が渡したバッファを SDU 単位のスロットに分け、recvmmsg() で
+ *J スロットに直接受ける。btLeCocReceive() はスロットを指すだけなのでコピーしない。
+ *J 送信は呼び出し元のバッファを iovec で指して sendmmsg() に渡す。
+ *J
+ *J Credit が尽きると Socket に書けなくなるので、その回数と待ち時間を数える。
+ *J Credit が credit_timeout_ms の間戻らなければ AKS_ERROR_TIMEOUT で返る。
+ *J
+ *J カーネルは Credit 数も Peer と決めた MPS も見せないので、消費した Credit (K-frame 数) は
+ *J options の MPS から見積もるだけで、実際の値とは一致しないことがある (*_credits_estimated)。
+ */
+
+#define BT_LE_COC_MAX_SLOTS							(64)
+#define BT_LE_COC_MAX_BURST							(32)
+#define BT_LE_COC_SDU_LENGTH_SIZE					(2)		//J 最初の K-frame に付く SDU Length
+#define BT_LE_COC_DEFAULT_MTU						(2048)
+#define BT_LE_COC_DEFAULT_MPS						(247)	//J Data Length Extension 有りの LL に 1 K-frame が収まる大きさ
+#define BT_LE_COC_DEFAULT_CREDIT_TIMEOUT_MS			(30 * 1000)
+
+struct BtLeCocOptions
+{
+	uint16_t mtu;					//J 受信する SDU の最大長 (BT_RCVMTU)
+	uint16_t mps;					//J Credit の見積もりに使う MPS (Peer と決めた値ではない)
+	uint8_t  security_level;		//J BtLeDeviceSecurityLevel
+	uint32_t credit_timeout_ms;		//J Credit を待つ最大時間 (0 なら待ち続ける)
+	int      adapter;				//J Channel を張る Controller の dev_id (hci0 なら 0)
+	uint8_t  address_type;			//J 接続先の BtLeDeviceAddressType
+	uint32_t connect_timeout_ms;	//J Channel が張れるのを待つ期限 (0 なら待ち続ける)
+};
+
+struct BtLeCocStatistics
+{
+	uint64_t tx_sdus;
+	uint64_t tx_bytes;
+	uint64_t tx_credits_estimated;	//J 送信で消費した Credit の見積もり (options の MPS から)
+	uint64_t rx_sdus;
+	uint64_t rx_bytes;
+	uint64_t rx_credits_estimated;	//J Peer に返すことになる Credit の見積もり (options の MPS から)
+	uint64_t rx_truncated;			//J スロットに収まらず切り詰められた SDU
+	uint64_t credit_stalls;			//J Credit 切れで送信が止まった回数
+	uint64_t credit_wait_ns;		//J Credit を待った時間の合計
+	uint64_t max_tx_queued;			//J 送信キューに残っていたバイト数の最大
+	uint64_t syscalls;
+};
+
+//J 1つの SDU (送信する側は呼び出し元のバッファ、受信した側はスロットを指す)
+struct BtLeCocSdu
+{
+	const uint8_t *data;
+	size_t         len;
+};
+
+struct BtLeCocContext
+{
+	int      sock;
+	uint16_t sndmtu;				//J Peer が受けられる SDU の最大長
+	uint16_t rcvmtu;
+	uint16_t mps;					//J 見積もり用 (options->mps)
+	uint32_t credit_timeout_ms;
+
+	//J 受信スロット (rx_head から rx_count 個が受信済み)
+	uint8_t *rx_buf;
+	size_t   slot_size;
+	uint32_t num_slots;
+	uint32_t rx_head;
+	uint32_t rx_count;
+	uint32_t rx_held;				//J btLeCocReceive() で渡して btLeCocRelease() されていない数
+	size_t   rx_offset;				//J btLeCocRead() が先頭の SDU を読んだ位置
+	size_t   rx_len[BT_LE_COC_MAX_SLOTS];
+
+	BtLeCocStatistics stats;
+};
+
+int btLeCocInitOptions(BtLeCocOptions *options);
+
+int btLeCocOpen(
+								BtLeCocContext *coc,
+								const char *btaddr,
+								const uint16_t psm,
+								const BtLeCocOptions *options,
+								uint8_t *rx_buf,
+								const size_t rx_buf_size);
+int btLeCocOpenWithSocket(
+								BtLeCocContext *coc,
+								int sock,
+								const BtLeCocOptions *options,
+								uint8_t *rx_buf,
+								const size_t rx_buf_size);
+int btLeCocClose(BtLeCocContext *coc);
+
+int btLeCocSendSdus(
+								BtLeCocContext *coc,
+								const BtLeCocSdu *sdus,
+								const size_t num_sdus);
+int btLeCocWrite(
+								BtLeCocContext *coc,
+								const void *buf,
+								const size_t len);
+
+int btLeCocReceive(
+								BtLeCocContext *coc,
+								BtLeCocSdu *sdus,
+								const size_t sdus_size,
+								size_t &num_sdus,
+								const int timeout_ms);
+int btLeCocRelease(BtLeCocContext *coc, const size_t num_sdus);
+int btLeCocRead(
+								BtLeCocContext *coc,
+								void *buf,
+								const size_t buf_size,
+								size_t &read_size,
+								const int timeout_ms);
+
+int btLeCocGetStatistics(BtLeCocContext *coc, BtLeCocStatistics *stats);
+int btLeCocResetStatistics(BtLeCocContext *coc);
+
+#endif/*BT_LE_COC_H_*/
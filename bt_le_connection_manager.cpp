@@ -0,0 +1,1037 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_le_device.h"
+#include "bt_util.h"
+#include "bt_le_connection_manager.h"
+
+#define BT_LE_CONNECTION_MANAGER_MAX_EVENTS			(64)
+#define BT_LE_CONNECTION_MANAGER_BUSY_RETRY_MS		(100)	//J EBUSY の後で connect() を試し直すまで
+#define BT_LE_CONNECTION_MANAGER_ADAPTER_FAILURES	(3)		//J 続けてこの回数失敗した Adapter は落とす
+#define BT_LE_CONNECTION_MANAGER_ADAPTER_RETRY_MS	(5000)	//J 落とした Adapter を試し直すまで
+#define BT_LE_CONNECTION_MANAGER_AIRTIME_PERIOD_MS	(1000)	//J Airtime を見積もる間隔
+#define BT_LE_CONNECTION_MANAGER_CLOSE_RETRY_MS		(100)	//J 壊せなかった切れた接続を壊し直すまで
+#define BT_LE_CONNECTION_MANAGER_SETUP_EVENT		(UINT32_MAX)	//J setup_fd の epoll_event.data.u32 (Entry の添字と区別する)
+
+//J Airtime の見積もり (LE 1M PHY): 1 バイト 8us、PDU ごとに Header / MIC / CRC と
+//J 空の PDU の往復、T_IFS 2回でおよそ 500us
+#define BT_LE_CONNECTION_MANAGER_BYTE_AIRTIME_US	(8)
+#define BT_LE_CONNECTION_MANAGER_PDU_AIRTIME_US		(500)
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static void *_manager_setup_func(void *arg);
+static void _manager_collect_setups(BtLeConnectionManager *mgr);
+
+
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerInitOptions(BtLeConnectionManagerOptions *options)
+{
+	if (options == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(options, 0x00, sizeof(BtLeConnectionManagerOptions));
+	options->max_pending        = BT_LE_CONNECTION_MANAGER_DEFAULT_PENDING;
+	options->attempt_timeout_ms = BT_LE_CONNECTION_MANAGER_DEFAULT_TIMEOUT_MS;
+	options->max_attempts       = BT_LE_CONNECTION_MANAGER_DEFAULT_ATTEMPTS;
+
+	int ret = btLeDeviceInitOptions(&options->device);
+	options->device.setup_timeout_ms = BT_LE_CONNECTION_MANAGER_SETUP_TIMEOUT_MS;
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerCreate(BtLeConnectionManager *mgr, const BtLeConnectionManagerOptions *options)
+{
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(mgr, 0x00, sizeof(BtLeConnectionManager));
+	mgr->epoll_fd = -1;
+	mgr->setup_fd = -1;
+	if (options != NULL) {
+		mgr->options = *options;
+	}
+	else {
+		(void)btLeConnectionManagerInitOptions(&mgr->options);
+	}
+	if ((mgr->options.max_pending == 0) || (mgr->options.max_attempts == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	mgr->setup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mgr->setup_fd < 0) {
+		return -errno;
+	}
+	pthread_mutex_init(&mgr->setupMutex, NULL);
+	pthread_cond_init(&mgr->setupCv, NULL);
+	mgr->setup_running = true;
+
+	//J 失敗したら Destroy で作った分だけ片付ける
+	int ret = AKS_OK;
+	mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (mgr->epoll_fd < 0) {
+		ret = -errno;
+	}
+	else {
+		struct epoll_event ev;
+		memset(&ev, 0x00, sizeof(ev));
+		ev.events   = EPOLLIN;
+		ev.data.u32 = BT_LE_CONNECTION_MANAGER_SETUP_EVENT;
+		if (epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, mgr->setup_fd, &ev) < 0) {
+			ret = -errno;
+		}
+	}
+	while ((ret == AKS_OK) && (mgr->num_setup_threads < BT_LE_CONNECTION_MANAGER_SETUP_WORKERS)) {
+		int error = pthread_create(&mgr->setup_threads[mgr->num_setup_threads], NULL, _manager_setup_func, (void *)mgr);
+		if (error != 0) {
+			ret = -error;
+			break;
+		}
+		mgr->num_setup_threads++;
+	}
+	if (ret != AKS_OK) {
+		(void)btLeConnectionManagerDestroy(mgr);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 張りかけの Socket は閉じる。接続済みの BtGattDeviceContext はそのまま残す
+//J (ワーカースレッドが準備中の接続は終わるのを待つので、終わったものは接続済みになる)
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerDestroy(BtLeConnectionManager *mgr)
+{
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	if (mgr->setup_fd >= 0) {
+		pthread_mutex_lock(&mgr->setupMutex);
+		mgr->setup_running = false;
+		pthread_cond_broadcast(&mgr->setupCv);
+		pthread_mutex_unlock(&mgr->setupMutex);
+		for (uint32_t i=0 ; i<mgr->num_setup_threads ; ++i) {
+			pthread_join(mgr->setup_threads[i], NULL);
+		}
+		mgr->num_setup_threads = 0;
+
+		_manager_collect_setups(mgr);
+
+		//J ワーカースレッドが取らなかった接続は閉じて待ち行列に戻す
+		for ( ; mgr->setup_count>0 ; mgr->setup_count--) {
+			BtLeConnectionManagerEntry *entry = &mgr->entries[mgr->setup_queue[mgr->setup_head]];
+			mgr->setup_head = (mgr->setup_head + 1) % BT_LE_CONNECTION_MANAGER_MAX_DEVICES;
+			mgr->adapters[entry->adapter].connections--;
+			close(entry->sock);
+			entry->sock    = -1;
+			entry->adapter = -1;
+			entry->state   = BtLeConnectionState::cQueued;
+		}
+
+		pthread_cond_destroy(&mgr->setupCv);
+		pthread_mutex_destroy(&mgr->setupMutex);
+		close(mgr->setup_fd);
+		mgr->setup_fd = -1;
+	}
+
+	//J 切れたまま壊せていない接続は BT_LE_DEVICE_DESTROY_TIMEOUT_MS まで待つ。
+	//J それでも壊せなければ AKS_ERROR_TIMEOUT を返す (その Entry は cClosing のまま)
+	int result = AKS_OK;
+	for (uint32_t i=0 ; i<mgr->num_entries ; ++i) {
+		BtLeConnectionManagerEntry *entry = &mgr->entries[i];
+		if (entry->state == BtLeConnectionState::cConnecting) {
+			close(entry->sock);
+			entry->sock    = -1;
+			entry->adapter = -1;
+			entry->state   = BtLeConnectionState::cQueued;
+		}
+		else if (entry->state == BtLeConnectionState::cClosing) {
+			if (btLeDeviceDestroy(entry->ctx) == AKS_OK) {
+				entry->state = BtLeConnectionState::cQueued;
+			}
+			else {
+				result = AKS_ERROR_TIMEOUT;
+			}
+		}
+	}
+	for (uint32_t i=0 ; i<mgr->num_adapters ; ++i) {
+		mgr->adapters[i].pending = 0;
+	}
+	mgr->num_pending = 0;
+
+	if (mgr->epoll_fd >= 0) {
+		close(mgr->epoll_fd);
+		mgr->epoll_fd = -1;
+	}
+
+	return result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J dev_id の Controller を使えるようにする (hci_devba() が通らない dev_id は
+//J 接続を張る時に Adapter の故障として扱う)
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerAddAdapter(
+								BtLeConnectionManager *mgr,
+								const int dev_id,
+								const uint32_t max_connections,
+								uint32_t &index)
+{
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (dev_id < 0) {
+		return AKS_ERROR_INVALID;
+	}
+	for (uint32_t i=0 ; i<mgr->num_adapters ; ++i) {
+		if (mgr->adapters[i].dev_id == dev_id) {
+			return AKS_ERROR_INVALID;
+		}
+	}
+	if (mgr->num_adapters >= BT_LE_CONNECTION_MANAGER_MAX_ADAPTERS) {
+		return AKS_ERROR_FULL;
+	}
+
+	index = mgr->num_adapters++;
+
+	BtLeConnectionManagerAdapter *adapter = &mgr->adapters[index];
+	memset(adapter, 0x00, sizeof(BtLeConnectionManagerAdapter));
+	adapter->dev_id          = dev_id;
+	adapter->up              = true;
+	adapter->max_connections = (max_connections != 0) ? max_connections : BT_LE_CONNECTION_MANAGER_DEFAULT_MAX_CONNECTIONS;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J HCIGETDEVLIST で UP している Controller を全て加える
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerAddLocalAdapters(
+								BtLeConnectionManager *mgr,
+								const uint32_t max_connections,
+								uint32_t &num_added)
+{
+	num_added = 0;
+
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	int sock = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+	if (sock < 0) {
+		return -errno;
+	}
+
+	uint8_t buf[sizeof(struct hci_dev_list_req) + HCI_MAX_DEV * sizeof(struct hci_dev_req)];
+	struct hci_dev_list_req *list = (struct hci_dev_list_req *)buf;
+	memset(buf, 0x00, sizeof(buf));
+	list->dev_num = HCI_MAX_DEV;
+
+	if (ioctl(sock, HCIGETDEVLIST, (void *)list) < 0) {
+		int ret = -errno;
+		close(sock);
+		return ret;
+	}
+	close(sock);
+
+	//J dev_req[0] は長さ 0 の配列なので、添字はポインタで引く (-Warray-bounds)
+	struct hci_dev_req *dr = list->dev_req;
+	for (uint16_t i=0 ; i<list->dev_num ; ++i) {
+		//J dev_opt には Controller の flags が入る
+		if ((dr[i].dev_opt & (1 << HCI_UP)) == 0) {
+			continue;
+		}
+
+		uint32_t index;
+		int ret = btLeConnectionManagerAddAdapter(mgr, dr[i].dev_id, max_connections, index);
+		if (ret == AKS_OK) {
+			num_added++;
+		}
+		else if (ret == (int)AKS_ERROR_FULL) {
+			break;
+		}
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerAdd(
+								BtLeConnectionManager *mgr,
+								BtGattDeviceContext *ctx,
+								const char *btaddr,
+								uint32_t &index)
+{
+	if ((mgr == NULL) || (ctx == NULL) || (btaddr == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (strlen(btaddr) >= sizeof(mgr->entries[0].btaddr)) {
+		return AKS_ERROR_INVALID;
+	}
+	if (mgr->num_entries >= BT_LE_CONNECTION_MANAGER_MAX_DEVICES) {
+		return AKS_ERROR_FULL;
+	}
+
+	index = mgr->num_entries++;
+
+	BtLeConnectionManagerEntry *entry = &mgr->entries[index];
+	memset(entry, 0x00, sizeof(BtLeConnectionManagerEntry));
+	entry->ctx          = ctx;
+	entry->sock         = -1;
+	entry->adapter      = -1;
+	entry->address_type = mgr->options.device.address_type;
+	entry->state        = BtLeConnectionState::cQueued;
+	strcpy(entry->btaddr, btaddr);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Scan で分かった Address Type を Entry ごとに指定する (次の connect() から使う)
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerSetAddressType(BtLeConnectionManager *mgr, const uint32_t index, const uint8_t address_type)
+{
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((index >= mgr->num_entries) || (address_type > BtLeDeviceAddressType::cRandomIdentity)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	mgr->entries[index].address_type = address_type;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 失敗した接続を待ち行列に戻すか、試行回数を使い切っていれば諦める
+//J Adapter のせいで失敗した時 (count_attempt が false) は試行回数に数えない
+/*---------------------------------------------------------------------------*/
+static void _manager_retry(BtLeConnectionManager *mgr, BtLeConnectionManagerEntry *entry, int result, bool count_attempt)
+{
+	entry->sock    = -1;
+	entry->adapter = -1;
+	entry->result  = result;
+
+	if (!count_attempt) {
+		entry->attempts--;
+	}
+
+	if (entry->attempts >= mgr->options.max_attempts) {
+		entry->state = BtLeConnectionState::cFailed;
+		mgr->num_settled++;
+		mgr->stats.failed++;
+	}
+	else {
+		entry->state = BtLeConnectionState::cQueued;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J cConnecting の Entry を epoll から外す
+/*---------------------------------------------------------------------------*/
+static void _manager_unwatch(BtLeConnectionManager *mgr, BtLeConnectionManagerEntry *entry)
+{
+	(void)epoll_ctl(mgr->epoll_fd, EPOLL_CTL_DEL, entry->sock, NULL);
+	mgr->num_pending--;
+	mgr->adapters[entry->adapter].pending--;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Adapter を使わないようにし、張りかけの接続を待ち行列に戻して別の Adapter に回す
+/*---------------------------------------------------------------------------*/
+static void _manager_adapter_down(BtLeConnectionManager *mgr, int index, uint64_t now_ns)
+{
+	BtLeConnectionManagerAdapter *adapter = &mgr->adapters[index];
+
+	adapter->up       = false;
+	adapter->retry_ns = now_ns + BT_LE_CONNECTION_MANAGER_ADAPTER_RETRY_MS * 1000000ULL;
+	mgr->stats.adapter_failures++;
+
+	for (uint32_t i=0 ; i<mgr->num_entries ; ++i) {
+		BtLeConnectionManagerEntry *entry = &mgr->entries[i];
+		if ((entry->state != BtLeConnectionState::cConnecting) || (entry->adapter != index)) {
+			continue;
+		}
+
+		int sock = entry->sock;
+		_manager_unwatch(mgr, entry);
+		close(sock);
+		mgr->stats.relocations++;
+		_manager_retry(mgr, entry, AKS_ERROR_CANCELED, false);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Controller が無い・止まっている時の結果か
+/*---------------------------------------------------------------------------*/
+static bool _manager_adapter_fault(int result)
+{
+	return (result == -ENODEV) || (result == -ENETDOWN) || (result == -EHOSTDOWN) ||
+		   (result == -EADDRNOTAVAIL) ||
+		   (result == (int)AKS_ERROR_IO);	//J hci_devba() の失敗
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Adapter の失敗を数え、落とすべきなら落とす
+/*---------------------------------------------------------------------------*/
+static void _manager_adapter_failed(BtLeConnectionManager *mgr, int index, int result, uint64_t now_ns)
+{
+	BtLeConnectionManagerAdapter *adapter = &mgr->adapters[index];
+
+	adapter->failures++;
+	adapter->consecutive_failures++;
+	if (adapter->up &&
+		(_manager_adapter_fault(result) ||
+		 (adapter->consecutive_failures >= BT_LE_CONNECTION_MANAGER_ADAPTER_FAILURES))) {
+		_manager_adapter_down(mgr, index, now_ns);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 新しい接続を張る Adapter を選ぶ。接続数の割合 (ppm) と 1秒あたりの Airtime (us、
+//J つまり ppm) の和が一番小さいもの。空きが無ければ -1
+/*---------------------------------------------------------------------------*/
+static int _manager_pick_adapter(BtLeConnectionManager *mgr, uint64_t now_ns)
+{
+	int best = -1;
+	uint64_t best_score = UINT64_MAX;
+
+	for (uint32_t i=0 ; i<mgr->num_adapters ; ++i) {
+		BtLeConnectionManagerAdapter *adapter = &mgr->adapters[i];
+
+		//J 落とした Adapter は期限が来たら戻す。次に失敗すればすぐまた落ちる
+		if ((!adapter->up) && (adapter->retry_ns <= now_ns)) {
+			adapter->up                   = true;
+			adapter->consecutive_failures = BT_LE_CONNECTION_MANAGER_ADAPTER_FAILURES - 1;
+		}
+		if ((!adapter->up) ||
+			(adapter->busy_until_ns > now_ns) ||
+			(adapter->pending >= mgr->options.max_pending) ||
+			(adapter->connections + adapter->pending >= adapter->max_connections)) {
+			continue;
+		}
+
+		uint64_t score = (uint64_t)(adapter->connections + adapter->pending) * 1000000ULL / adapter->max_connections
+					   + adapter->airtime_us;
+		if (score < best_score) {
+			best_score = score;
+			best = (int)i;
+		}
+	}
+
+	return best;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 接続している BtGattDeviceContext の送受信量から Adapter ごとの Airtime を見積もる
+/*---------------------------------------------------------------------------*/
+static void _manager_sample_airtime(BtLeConnectionManager *mgr, uint64_t now_ns)
+{
+	uint64_t elapsed_ns = now_ns - mgr->airtime_sampled_ns;
+	if (elapsed_ns < BT_LE_CONNECTION_MANAGER_AIRTIME_PERIOD_MS * 1000000ULL) {
+		return;
+	}
+
+	uint64_t airtime[BT_LE_CONNECTION_MANAGER_MAX_ADAPTERS];
+	memset(airtime, 0x00, sizeof(airtime));
+
+	for (uint32_t i=0 ; i<mgr->num_entries ; ++i) {
+		BtLeConnectionManagerEntry *entry = &mgr->entries[i];
+		if (entry->state != BtLeConnectionState::cConnected) {
+			continue;
+		}
+
+		BtLeDeviceStatistics stats;
+		if (btLeDeviceGetStatistics(entry->ctx, &stats) != AKS_OK) {
+			continue;
+		}
+		uint64_t bytes = stats.tx_bytes + stats.rx_bytes;
+		uint64_t pdus  = stats.tx_pdus + stats.rx_pdus;
+
+		airtime[entry->adapter] += (bytes - entry->sampled_bytes) * BT_LE_CONNECTION_MANAGER_BYTE_AIRTIME_US
+								 + (pdus - entry->sampled_pdus) * BT_LE_CONNECTION_MANAGER_PDU_AIRTIME_US;
+		entry->sampled_bytes = bytes;
+		entry->sampled_pdus  = pdus;
+	}
+
+	//J 最初の 1回は基準の時刻が無いので平均に入れない
+	if (mgr->airtime_sampled_ns != 0) {
+		for (uint32_t i=0 ; i<mgr->num_adapters ; ++i) {
+			uint64_t per_sec = airtime[i] * 1000000000ULL / elapsed_ns;
+			mgr->adapters[i].airtime_us = (mgr->adapters[i].airtime_us * 3 + per_sec) / 4;
+		}
+	}
+	mgr->airtime_sampled_ns = now_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 切れた接続を見つけて待ち行列に戻す (試行回数も戻す)。
+//J 受信スレッドの Callback が戻らず壊せない接続は cClosing にして epoll のスレッドでは待たず、
+//J BT_LE_CONNECTION_MANAGER_CLOSE_RETRY_MS ごとに壊し直す。その時刻を返す (無ければ UINT64_MAX)
+/*---------------------------------------------------------------------------*/
+static uint64_t _manager_check_links(BtLeConnectionManager *mgr, uint64_t now_ns)
+{
+	uint64_t retry_ns = UINT64_MAX;
+
+	for (uint32_t i=0 ; i<mgr->num_entries ; ++i) {
+		BtLeConnectionManagerEntry *entry = &mgr->entries[i];
+		if (entry->state == BtLeConnectionState::cConnected) {
+			if (btLeDeviceIsConnected(entry->ctx)) {
+				continue;
+			}
+			mgr->adapters[entry->adapter].connections--;
+			entry->result  = entry->ctx->disconnect_reason;
+			entry->adapter = -1;
+			entry->state   = BtLeConnectionState::cClosing;
+			mgr->num_settled--;
+		}
+		else if ((entry->state != BtLeConnectionState::cClosing) || (entry->deadline_ns > now_ns)) {
+			if ((entry->state == BtLeConnectionState::cClosing) && (entry->deadline_ns < retry_ns)) {
+				retry_ns = entry->deadline_ns;
+			}
+			continue;
+		}
+
+		//J 過ぎた期限を渡して、今壊せなければ待たずに戻らせる
+		if (btLeDeviceDestroyUntil(entry->ctx, now_ns) != AKS_OK) {
+			entry->result      = AKS_ERROR_TIMEOUT;
+			entry->deadline_ns = now_ns + BT_LE_CONNECTION_MANAGER_CLOSE_RETRY_MS * 1000000ULL;
+			mgr->stats.close_retries++;
+			if (entry->deadline_ns < retry_ns) {
+				retry_ns = entry->deadline_ns;
+			}
+			continue;
+		}
+
+		entry->attempts = 0;
+		entry->state    = BtLeConnectionState::cQueued;
+		mgr->stats.relocations++;
+	}
+
+	return retry_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J connect() を始める。EBUSY なら false を返し、その Adapter はしばらく使わない
+/*---------------------------------------------------------------------------*/
+static bool _manager_connect(BtLeConnectionManager *mgr, uint32_t index, int adapter_index, uint64_t now_ns)
+{
+	BtLeConnectionManagerEntry *entry = &mgr->entries[index];
+	BtLeConnectionManagerAdapter *adapter = &mgr->adapters[adapter_index];
+
+	BtLeDeviceOptions options = mgr->options.device;
+	options.adapter      = adapter->dev_id;
+	options.address_type = entry->address_type;
+
+	int sock;
+	if (mgr->options.open != NULL) {
+		sock = mgr->options.open(mgr->options.open_arg, entry->btaddr, &options);
+	}
+	else {
+		sock = btLeDeviceOpenAttSocket(entry->btaddr, &options);
+	}
+	if (sock == -EBUSY) {
+		adapter->busy_until_ns = now_ns + BT_LE_CONNECTION_MANAGER_BUSY_RETRY_MS * 1000000ULL;
+		mgr->stats.busy++;
+		return false;
+	}
+
+	entry->attempts++;
+	mgr->stats.attempts++;
+	if (sock < 0) {
+		bool fault = _manager_adapter_fault(sock);
+		_manager_retry(mgr, entry, sock, !fault);
+		_manager_adapter_failed(mgr, adapter_index, sock, now_ns);
+		return true;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events   = EPOLLOUT;
+	ev.data.u32 = index;
+	if (epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		int ret = -errno;
+		close(sock);
+		_manager_retry(mgr, entry, ret, true);
+		return true;
+	}
+
+	entry->sock        = sock;
+	entry->adapter     = adapter_index;
+	entry->state       = BtLeConnectionState::cConnecting;
+	entry->deadline_ns = now_ns + (uint64_t)mgr->options.attempt_timeout_ms * 1000000ULL;
+	adapter->pending++;
+	mgr->num_pending++;
+	if (mgr->num_pending > mgr->stats.max_pending) {
+		mgr->stats.max_pending = mgr->num_pending;
+	}
+
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 空いている Adapter に待ち行列から connect() を始める
+//J Adapter が空かずに待たせた Entry があれば、試し直す時刻を返す (無ければ UINT64_MAX)
+/*---------------------------------------------------------------------------*/
+static uint64_t _manager_start_connects(BtLeConnectionManager *mgr, uint64_t now_ns)
+{
+	uint32_t scanned = 0;
+	while (scanned < mgr->num_entries) {
+		uint32_t index = mgr->next_queued;
+		if (mgr->entries[index].state != BtLeConnectionState::cQueued) {
+			mgr->next_queued = (mgr->next_queued + 1) % mgr->num_entries;
+			scanned++;
+			continue;
+		}
+
+		int adapter_index = _manager_pick_adapter(mgr, now_ns);
+		if (adapter_index < 0) {
+			break;
+		}
+
+		//J EBUSY ならその Adapter を除いて同じ Entry で選び直す
+		if (_manager_connect(mgr, index, adapter_index, now_ns)) {
+			mgr->next_queued = (mgr->next_queued + 1) % mgr->num_entries;
+			scanned++;
+		}
+	}
+	if (scanned >= mgr->num_entries) {
+		return UINT64_MAX;
+	}
+
+	//J EBUSY の期限か、落とした Adapter を戻す時刻で起きる
+	//J (どちらでもなければ接続の完了か期限切れで Adapter が空くのを待つ)
+	uint64_t retry_ns = UINT64_MAX;
+	for (uint32_t i=0 ; i<mgr->num_adapters ; ++i) {
+		BtLeConnectionManagerAdapter *adapter = &mgr->adapters[i];
+		if ((adapter->busy_until_ns > now_ns) && (adapter->busy_until_ns < retry_ns)) {
+			retry_ns = adapter->busy_until_ns;
+		}
+		if ((!adapter->up) && (adapter->retry_ns < retry_ns)) {
+			retry_ns = adapter->retry_ns;
+		}
+	}
+
+	return retry_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J connect() の結果を確かめる。接続できていれば true (まだ ATT の準備はしていない)
+/*---------------------------------------------------------------------------*/
+static bool _manager_link_up(BtLeConnectionManager *mgr, uint32_t index, uint64_t now_ns)
+{
+	if (index >= mgr->num_entries) {
+		return false;
+	}
+
+	BtLeConnectionManagerEntry *entry = &mgr->entries[index];
+	if (entry->state != BtLeConnectionState::cConnecting) {
+		return false;
+	}
+
+	int sock = entry->sock;
+	int adapter_index = entry->adapter;
+	_manager_unwatch(mgr, entry);
+
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *)&error, &len) < 0) {
+		error = errno;
+	}
+	if (error != 0) {
+		close(sock);
+		_manager_retry(mgr, entry, -error, !_manager_adapter_fault(-error));
+		_manager_adapter_failed(mgr, adapter_index, -error, now_ns);
+		return false;
+	}
+
+	//J ATT の準備の間も Adapter の接続数に数えておく
+	mgr->adapters[adapter_index].consecutive_failures = 0;
+	mgr->adapters[adapter_index].connections++;
+
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J ワーカースレッドで呼ぶ。接続できた Socket を BtGattDeviceContext にする (MTU の交換などで往復する)。
+//J 応答しない Peripheral で btLeConnectionManagerDestroy() を長く待たせないよう往復の期限を短くする。
+//J cSetup の Entry は epoll のスレッドが触らないので、ロック無しで読む
+/*---------------------------------------------------------------------------*/
+static int _manager_setup(BtLeConnectionManager *mgr, uint32_t index)
+{
+	BtLeConnectionManagerEntry *entry = &mgr->entries[index];
+	int sock = entry->sock;
+
+	//J BtGattDeviceContext は Blocking の Socket を前提にしている
+	int flags = fcntl(sock, F_GETFL);
+	if ((flags < 0) || (fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+		return -errno;
+	}
+
+	BtLeDeviceOptions options = mgr->options.device;
+	options.adapter      = mgr->adapters[entry->adapter].dev_id;
+	options.address_type = entry->address_type;
+	if ((options.setup_timeout_ms == 0) || (options.setup_timeout_ms > BT_LE_CONNECTION_MANAGER_SETUP_TIMEOUT_MS)) {
+		options.setup_timeout_ms = BT_LE_CONNECTION_MANAGER_SETUP_TIMEOUT_MS;
+	}
+
+	return btLeDeviceCreateWithSocket(entry->ctx, sock, &options);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J setup_queue から Entry を取って準備し、setup_done に入れて setup_fd で epoll のスレッドを起こす
+/*---------------------------------------------------------------------------*/
+static void *_manager_setup_func(void *arg)
+{
+	BtLeConnectionManager *mgr = (BtLeConnectionManager *)arg;
+
+	pthread_mutex_lock(&mgr->setupMutex);
+	while (1) {
+		while (mgr->setup_running && (mgr->setup_count == 0)) {
+			pthread_cond_wait(&mgr->setupCv, &mgr->setupMutex);
+		}
+		//J 残りは btLeConnectionManagerDestroy() が閉じる
+		if (!mgr->setup_running) {
+			break;
+		}
+
+		uint32_t index = mgr->setup_queue[mgr->setup_head];
+		mgr->setup_head = (mgr->setup_head + 1) % BT_LE_CONNECTION_MANAGER_MAX_DEVICES;
+		mgr->setup_count--;
+		pthread_mutex_unlock(&mgr->setupMutex);
+
+		int ret = _manager_setup(mgr, index);
+
+		pthread_mutex_lock(&mgr->setupMutex);
+		mgr->entries[index].result = ret;
+		mgr->setup_done[mgr->num_setup_done++] = index;
+		uint64_t one = 1;
+		(void)write(mgr->setup_fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&mgr->setupMutex);
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 接続できた Entry をワーカースレッドに渡す
+/*---------------------------------------------------------------------------*/
+static void _manager_start_setup(BtLeConnectionManager *mgr, uint32_t index)
+{
+	mgr->entries[index].state = BtLeConnectionState::cSetup;
+
+	pthread_mutex_lock(&mgr->setupMutex);
+	uint32_t tail = (mgr->setup_head + mgr->setup_count) % BT_LE_CONNECTION_MANAGER_MAX_DEVICES;
+	mgr->setup_queue[tail] = index;
+	mgr->setup_count++;
+	pthread_cond_signal(&mgr->setupCv);
+	pthread_mutex_unlock(&mgr->setupMutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 準備の終わった Entry を接続済みにするか、失敗していれば張り直しに回す
+/*---------------------------------------------------------------------------*/
+static void _manager_setup_finished(BtLeConnectionManager *mgr, uint32_t index)
+{
+	BtLeConnectionManagerEntry *entry = &mgr->entries[index];
+	BtLeConnectionManagerAdapter *adapter = &mgr->adapters[entry->adapter];
+
+	if (entry->result != AKS_OK) {
+		adapter->connections--;
+		close(entry->sock);
+		_manager_retry(mgr, entry, entry->result, true);
+		return;
+	}
+
+	BtLeDeviceStatistics stats;
+	memset(&stats, 0x00, sizeof(stats));
+	(void)btLeDeviceGetStatistics(entry->ctx, &stats);
+
+	entry->sock          = -1;
+	entry->state         = BtLeConnectionState::cConnected;
+	entry->result        = AKS_OK;
+	entry->connected_ns  = btUtilGetMonotonicTimeNs() - mgr->start_ns;
+	entry->sampled_bytes = stats.tx_bytes + stats.rx_bytes;
+	entry->sampled_pdus  = stats.tx_pdus + stats.rx_pdus;
+	adapter->connects++;
+	mgr->num_settled++;
+	mgr->stats.connected++;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J setup_fd で起きた時に、ワーカースレッドが準備を終えた Entry を片付ける
+/*---------------------------------------------------------------------------*/
+static void _manager_collect_setups(BtLeConnectionManager *mgr)
+{
+	uint64_t value;
+	(void)read(mgr->setup_fd, &value, sizeof(value));
+
+	uint32_t done[BT_LE_CONNECTION_MANAGER_MAX_DEVICES];
+	pthread_mutex_lock(&mgr->setupMutex);
+	uint32_t num_done = mgr->num_setup_done;
+	memcpy(done, mgr->setup_done, num_done * sizeof(done[0]));
+	mgr->num_setup_done = 0;
+	pthread_mutex_unlock(&mgr->setupMutex);
+
+	for (uint32_t i=0 ; i<num_done ; ++i) {
+		_manager_setup_finished(mgr, done[i]);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 期限を過ぎた connect() を取り消し、一番近い期限を返す (無ければ UINT64_MAX)
+/*---------------------------------------------------------------------------*/
+static uint64_t _manager_expire(BtLeConnectionManager *mgr, uint64_t now_ns)
+{
+	uint64_t next_ns = UINT64_MAX;
+
+	for (uint32_t i=0 ; i<mgr->num_entries ; ++i) {
+		BtLeConnectionManagerEntry *entry = &mgr->entries[i];
+		if (entry->state != BtLeConnectionState::cConnecting) {
+			continue;
+		}
+		if (entry->deadline_ns > now_ns) {
+			if (entry->deadline_ns < next_ns) {
+				next_ns = entry->deadline_ns;
+			}
+			continue;
+		}
+
+		//J epoll_wait() から戻った後で完了した connect() は、epoll で拾うまで取り消さない
+		struct pollfd pfd;
+		pfd.fd      = entry->sock;
+		pfd.events  = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0) {
+			continue;
+		}
+
+		int sock = entry->sock;
+		int adapter_index = entry->adapter;
+		_manager_unwatch(mgr, entry);
+		close(sock);
+		mgr->stats.timeouts++;
+		_manager_retry(mgr, entry, AKS_ERROR_TIMEOUT, true);
+		_manager_adapter_failed(mgr, adapter_index, AKS_ERROR_TIMEOUT, now_ns);
+	}
+
+	return next_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J up が false なら張りかけの接続を他の Adapter に回し、true に戻すまで使わない
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerSetAdapterUp(BtLeConnectionManager *mgr, const uint32_t index, const bool up)
+{
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (index >= mgr->num_adapters) {
+		return AKS_ERROR_INVALID;
+	}
+
+	BtLeConnectionManagerAdapter *adapter = &mgr->adapters[index];
+	if (up) {
+		adapter->up                   = true;
+		adapter->consecutive_failures = 0;
+		adapter->retry_ns             = 0;
+	}
+	else {
+		if (adapter->up) {
+			_manager_adapter_down(mgr, (int)index, btUtilGetMonotonicTimeNs());
+		}
+		adapter->retry_ns = UINT64_MAX;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerGetAdapter(BtLeConnectionManager *mgr, const uint32_t index, const BtLeConnectionManagerAdapter **adapter)
+{
+	if ((mgr == NULL) || (adapter == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (index >= mgr->num_adapters) {
+		return AKS_ERROR_INVALID;
+	}
+
+	*adapter = &mgr->adapters[index];
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 全ての接続が決着する (cConnected か cFailed) か timeout_ms が過ぎるまで進める
+//J 決着すれば AKS_OK、時間切れなら AKS_ERROR_TIMEOUT (続きはもう一度呼べばよい)
+//J 切れた接続は待ち行列に戻すので、定期的に呼べば張り直しもする
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerRun(BtLeConnectionManager *mgr, const uint32_t timeout_ms, uint32_t &num_connected)
+{
+	num_connected = 0;
+
+	if (mgr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (mgr->epoll_fd < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	//J Adapter を登録していなければ hci0 だけを使う (接続数の上限は Controller に任せる)
+	if (mgr->num_adapters == 0) {
+		uint32_t index;
+		(void)btLeConnectionManagerAddAdapter(mgr, 0, BT_LE_CONNECTION_MANAGER_MAX_DEVICES, index);
+	}
+
+	uint64_t now_ns = btUtilGetMonotonicTimeNs();
+	uint64_t run_deadline_ns = now_ns + (uint64_t)timeout_ms * 1000000ULL;
+	if (mgr->start_ns == 0) {
+		mgr->start_ns = now_ns;
+	}
+
+	int result = AKS_OK;
+	while (1) {
+		uint64_t close_ns = _manager_check_links(mgr, now_ns);
+		_manager_sample_airtime(mgr, now_ns);
+
+		uint64_t wake_ns  = _manager_expire(mgr, now_ns);
+		uint64_t retry_ns = _manager_start_connects(mgr, now_ns);
+		if (retry_ns < wake_ns) {
+			wake_ns = retry_ns;
+		}
+		if (close_ns < wake_ns) {
+			wake_ns = close_ns;
+		}
+
+		if (mgr->num_settled >= mgr->num_entries) {
+			mgr->stats.elapsed_ns = now_ns - mgr->start_ns;
+			break;
+		}
+		if (now_ns >= run_deadline_ns) {
+			result = AKS_ERROR_TIMEOUT;
+			break;
+		}
+		if (run_deadline_ns < wake_ns) {
+			wake_ns = run_deadline_ns;
+		}
+
+		//J ms に切り上げて、期限の直前で起きて空回りしないようにする
+		int wait_ms = (int)((wake_ns - now_ns + 999999ULL) / 1000000ULL);
+
+		struct epoll_event events[BT_LE_CONNECTION_MANAGER_MAX_EVENTS];
+		int num = epoll_wait(mgr->epoll_fd, events, BT_LE_CONNECTION_MANAGER_MAX_EVENTS, wait_ms);
+		if ((num < 0) && (errno != EINTR)) {
+			result = -errno;
+			break;
+		}
+
+		//J 往復のかかる ATT の準備はワーカースレッドに回し、ここでは待たない
+		now_ns = btUtilGetMonotonicTimeNs();
+		for (int i=0 ; i<num ; ++i) {
+			if (events[i].data.u32 == BT_LE_CONNECTION_MANAGER_SETUP_EVENT) {
+				_manager_collect_setups(mgr);
+			}
+			else if (_manager_link_up(mgr, events[i].data.u32, now_ns)) {
+				_manager_start_setup(mgr, events[i].data.u32);
+			}
+		}
+
+		now_ns = btUtilGetMonotonicTimeNs();
+	}
+
+	for (uint32_t i=0 ; i<mgr->num_entries ; ++i) {
+		if (mgr->entries[i].state == BtLeConnectionState::cConnected) {
+			num_connected++;
+		}
+	}
+
+	return result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerGetEntry(BtLeConnectionManager *mgr, const uint32_t index, const BtLeConnectionManagerEntry **entry)
+{
+	if ((mgr == NULL) || (entry == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (index >= mgr->num_entries) {
+		return AKS_ERROR_INVALID;
+	}
+
+	*entry = &mgr->entries[index];
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeConnectionManagerGetStatistics(BtLeConnectionManager *mgr, BtLeConnectionManagerStatistics *stats)
+{
+	if ((mgr == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	*stats = mgr->stats;
+
+	return AKS_OK;
+}
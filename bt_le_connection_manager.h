@@ -0,0 +1,167 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_LE_CONNECTION_MANAGER_H_
+#define BT_LE_CONNECTION_MANAGER_H_
+
+/*
+ *J 多数の Peripheral への接続を並行して張る
+ *J
+ *J btLeDeviceOpenAttSocket() で Non-Blocking の connect() を始め、epoll で
+ *J 完了を待つ。同時に張りかけにしておく数は max_pending で抑える
+ *J (Controller / カーネルによっては LE Create Connection を 1つずつしか
+ *J 受け付けず、2つ目の connect() は EBUSY になる。その場合は待ち行列に戻す)。
+ *J 接続ごとに期限があり、過ぎたら Socket を閉じて (カーネルが Create Connection
+ *J を取り消す) max_attempts まで張り直す。
+ *J
+ *J 接続できた Socket は btLeDeviceCreateWithSocket() で登録された
+ *J BtGattDeviceContext にする。その中の往復 (Exchange MTU など) は
+ *J BT_LE_CONNECTION_MANAGER_SETUP_WORKERS 本のワーカースレッドで行い、
+ *J epoll のスレッドは応答の遅い Peripheral を待たずに次の connect() を進める。
+ *J
+ *J Controller (Adapter) が複数あれば、新しい接続は空いている Adapter のうち
+ *J 接続数の割合と推定の送受信時間 (Airtime) の割合の和が一番小さいものに張る。
+ *J max_pending は Adapter ごと。Adapter が無い (ENODEV など) か続けて失敗した
+ *J Adapter は使わず、しばらくしてから 1回だけ試し直す。
+ *J btLeConnectionManagerRun() は切れた接続を見つけると待ち行列に戻すので、
+ *J 壊れた Adapter の接続は別の Adapter に張り直される。
+ */
+
+#define BT_LE_CONNECTION_MANAGER_MAX_DEVICES		(256)
+#define BT_LE_CONNECTION_MANAGER_DEFAULT_PENDING	(1)
+#define BT_LE_CONNECTION_MANAGER_DEFAULT_TIMEOUT_MS	(5000)
+#define BT_LE_CONNECTION_MANAGER_DEFAULT_ATTEMPTS	(3)
+#define BT_LE_CONNECTION_MANAGER_MAX_ADAPTERS		(8)
+#define BT_LE_CONNECTION_MANAGER_DEFAULT_MAX_CONNECTIONS	(10)	//J Controller がよく持っている上限
+#define BT_LE_CONNECTION_MANAGER_SETUP_TIMEOUT_MS	(1000)	//J 接続直後の往復の期限 (btLeConnectionManagerDestroy() はこれだけ待つことがある)
+#define BT_LE_CONNECTION_MANAGER_SETUP_WORKERS		(4)		//J 接続直後の往復をするスレッドの数
+
+struct BtLeConnectionState {
+	static const uint8_t cQueued					= 0x00;	//J connect() を待っている
+	static const uint8_t cConnecting				= 0x01;
+	static const uint8_t cConnected					= 0x02;
+	static const uint8_t cFailed					= 0x03;	//J max_attempts を使い切った
+	static const uint8_t cClosing					= 0x04;	//J 切れた接続の btLeDeviceDestroy() が終わらず、次の見回りで壊し直す
+	static const uint8_t cSetup						= 0x05;	//J 接続した。ワーカースレッドが btLeDeviceCreateWithSocket() している
+};
+
+//J btLeDeviceOpenAttSocket() の代わりに接続を始める。Non-Blocking の Socket か -errno を返す
+//J (options->adapter に選んだ Adapter の dev_id が入っている)
+typedef int (*BtLeConnectionManagerOpenCb)(void *arg, const char *btaddr, const BtLeDeviceOptions *options);
+
+struct BtLeConnectionManagerOptions
+{
+	uint32_t max_pending;			//J Adapter ごとに同時に張りかけにしておく接続の数
+	uint32_t attempt_timeout_ms;	//J 1回の connect() の期限
+	uint32_t max_attempts;
+	BtLeDeviceOptions device;		//J btLeDeviceCreateWithSocket() に渡す (adapter は上書きする。
+									//J setup_timeout_ms は BT_LE_CONNECTION_MANAGER_SETUP_TIMEOUT_MS までに抑える)
+	BtLeConnectionManagerOpenCb open;	//J NULL なら btLeDeviceOpenAttSocket()
+	void    *open_arg;
+};
+
+struct BtLeConnectionManagerAdapter
+{
+	int      dev_id;				//J hciN の N
+	bool     up;
+	uint32_t max_connections;
+	uint32_t connections;			//J 張っている接続の数
+	uint32_t pending;				//J 張りかけの接続の数
+	uint32_t consecutive_failures;
+	uint64_t busy_until_ns;			//J EBUSY の後で connect() を控える期限
+	uint64_t retry_ns;				//J 落とした Adapter を試し直す時刻
+	uint64_t airtime_us;			//J 1秒あたりの推定 Airtime (us) の移動平均
+	uint64_t connects;
+	uint64_t failures;
+};
+
+struct BtLeConnectionManagerEntry
+{
+	BtGattDeviceContext *ctx;
+	char     btaddr[18];
+	uint8_t  address_type;			//J BtLeDeviceAddressType (既定は options.device.address_type)
+	uint8_t  state;					//J BtLeConnectionState
+	int      adapter;				//J 張った (張っている) adapters[] の添字。無ければ -1
+	int      sock;
+	uint32_t attempts;
+	int      result;				//J 最後の失敗の理由 (AKS_* か -errno)
+	uint64_t deadline_ns;			//J 今の connect() の期限 (cClosing では次に壊し直す時刻)
+	uint64_t connected_ns;			//J btLeConnectionManagerRun() を始めてから接続できるまで
+	uint64_t sampled_bytes;			//J Airtime を見積もった時の送受信バイト数
+	uint64_t sampled_pdus;
+};
+
+struct BtLeConnectionManagerStatistics
+{
+	uint64_t attempts;				//J connect() を始めた回数
+	uint64_t connected;
+	uint64_t failed;
+	uint64_t timeouts;				//J 期限切れで閉じた回数
+	uint64_t busy;					//J EBUSY で待ち行列に戻した回数
+	uint32_t max_pending;			//J 実際に同時に張りかけだった最大数 (全 Adapter)
+	uint64_t relocations;			//J 切断や Adapter の故障で張り直しに回した数
+	uint64_t adapter_failures;		//J Adapter を落とした回数
+	uint64_t close_retries;			//J 切れた接続を壊せずに次の見回りに回した回数
+	uint64_t elapsed_ns;			//J 全ての接続が決着するまでの時間
+};
+
+struct BtLeConnectionManager
+{
+	int epoll_fd;
+	BtLeConnectionManagerOptions options;
+
+	uint32_t num_adapters;
+	BtLeConnectionManagerAdapter adapters[BT_LE_CONNECTION_MANAGER_MAX_ADAPTERS];
+	uint64_t airtime_sampled_ns;
+
+	uint32_t num_entries;
+	uint32_t num_pending;			//J cConnecting の数
+	uint32_t num_settled;			//J cConnected か cFailed の数
+	uint32_t next_queued;			//J 次に cQueued を探し始める位置
+	BtLeConnectionManagerEntry entries[BT_LE_CONNECTION_MANAGER_MAX_DEVICES];
+
+	//J cSetup の Entry をワーカースレッドに渡す待ち行列と、終わった Entry の一覧
+	pthread_mutex_t setupMutex;
+	pthread_cond_t  setupCv;
+	pthread_t       setup_threads[BT_LE_CONNECTION_MANAGER_SETUP_WORKERS];
+	uint32_t        num_setup_threads;
+	bool            setup_running;
+	int             setup_fd;		//J 準備が終わるとワーカースレッドが書く eventfd (epoll で待つ)
+	uint32_t        setup_queue[BT_LE_CONNECTION_MANAGER_MAX_DEVICES];
+	uint32_t        setup_head;
+	uint32_t        setup_count;
+	uint32_t        setup_done[BT_LE_CONNECTION_MANAGER_MAX_DEVICES];
+	uint32_t        num_setup_done;
+
+	uint64_t start_ns;
+	BtLeConnectionManagerStatistics stats;
+};
+
+int btLeConnectionManagerInitOptions(BtLeConnectionManagerOptions *options);
+int btLeConnectionManagerCreate(BtLeConnectionManager *mgr, const BtLeConnectionManagerOptions *options);
+int btLeConnectionManagerDestroy(BtLeConnectionManager *mgr);
+int btLeConnectionManagerAddAdapter(
+								BtLeConnectionManager *mgr,
+								const int dev_id,
+								const uint32_t max_connections,
+								uint32_t &index);
+int btLeConnectionManagerAddLocalAdapters(
+								BtLeConnectionManager *mgr,
+								const uint32_t max_connections,
+								uint32_t &num_added);
+int btLeConnectionManagerSetAdapterUp(BtLeConnectionManager *mgr, const uint32_t index, const bool up);
+int btLeConnectionManagerGetAdapter(BtLeConnectionManager *mgr, const uint32_t index, const BtLeConnectionManagerAdapter **adapter);
+int btLeConnectionManagerAdd(
+								BtLeConnectionManager *mgr,
+								BtGattDeviceContext *ctx,
+								const char *btaddr,
+								uint32_t &index);
+int btLeConnectionManagerSetAddressType(BtLeConnectionManager *mgr, const uint32_t index, const uint8_t address_type);
+int btLeConnectionManagerRun(BtLeConnectionManager *mgr, const uint32_t timeout_ms, uint32_t &num_connected);
+int btLeConnectionManagerGetEntry(BtLeConnectionManager *mgr, const uint32_t index, const BtLeConnectionManagerEntry **entry);
+int btLeConnectionManagerGetStatistics(BtLeConnectionManager *mgr, BtLeConnectionManagerStatistics *stats);
+
+#endif/*BT_LE_CONNECTION_MANAGER_H_*/
@@ -13,7 +13,12 @@
 #include <errno.h>
 
 #include <signal.h>
+#include <time.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
@@ -25,6 +30,7 @@
 #include "bt_att.h"
 #include "bt_gatt.h"
 #include "bt_le_device.h"
+#include "bt_util.h"
 
 
 
@@ -33,15 +39,58 @@
 #define BT_SEC_LEVEL_MEDIUM						(2)
 #define BT_SEC_LEVEL_HIGH						(3)
 
+#ifndef BT_MODE
+#define BT_MODE									(15)
+#endif
+
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-static int _create_ble_socket(const char *btaddr);
+static int _create_ble_socket(const char *btaddr, const BtLeDeviceOptions *options, const bool nonblocking);
+static int _close_with_errno(int sock);
+static int _finish_connect(int sock, const uint32_t timeout_ms);
+static uint8_t _bdaddr_type(const uint8_t address_type);
 static void *_ble_receive_thread_func(void *arg);
+static int _init_sync_objects(BtGattDeviceContext *ctx);
+static int _start_receive_thread(BtGattDeviceContext *ctx);
+static int _stop_receive_thread(BtGattDeviceContext *ctx, const uint64_t deadline_ns);
+static void _read_socket_mtu(BtGattDeviceContext *ctx);
+static int _regist_notification(BtGattDeviceContext *ctx, BtAttHandle config_handle, BtAttHandle value_handle, BtGattNotificationCb cb, BtGattNotificationArgCb arg_cb, void *arg, bool indication, uint8_t confirm);
+static int _unregist_notification(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationCb cb, BtGattNotificationArgCb arg_cb, void *arg);
+static bool _dispatch_notification(BtGattDeviceContext *ctx, BtAttHandle handle, uint8_t *value, size_t value_len, bool indication);
+static uint8_t _indication_confirm_mode(BtGattDeviceContext *ctx, BtAttHandle handle);
+static int _send_confirmation(BtGattDeviceContext *ctx);
+static void _link_lost(BtGattDeviceContext *ctx, int reason);
+static int _wait_response(BtGattDeviceContext *ctx, const uint64_t deadline_ns, const uint32_t seq);
 
 /*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+int btLeDeviceInitOptions(BtLeDeviceOptions *options)
+{
+	if (options == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(options, 0x00, sizeof(BtLeDeviceOptions));
+	options->mtu = BT_LE_DEVICE_DEFAULT_MTU;
+	options->client_features = BtGattClientSupportedFeatures::cMultipleHandleValueNotifications;
+	options->address_type = BtLeDeviceAddressType::cRandom;
+	options->security_level = BtLeDeviceSecurityLevel::cLow;
+	options->request_timeout_ms = BT_LE_DEVICE_DEFAULT_REQUEST_TIMEOUT_MS;
+	options->procedure_timeout_ms = BT_LE_DEVICE_DEFAULT_PROCEDURE_TIMEOUT_MS;
+	options->setup_timeout_ms = BT_LE_DEVICE_DEFAULT_SETUP_TIMEOUT_MS;
+
+	return AKS_OK;
+}
+
 /*---------------------------------------------------------------------------*/
 int btLeDeviceCreate(BtGattDeviceContext *ctx, const char *btaddr)
+{
+	return btLeDeviceCreateWithOptions(ctx, btaddr, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceCreateWithOptions(BtGattDeviceContext *ctx, const char *btaddr, const BtLeDeviceOptions *options)
 {
 	if (ctx == NULL) {
 		return AKS_ERROR_NULL;
@@ -50,161 +99,1272 @@ int btLeDeviceCreate(BtGattDeviceContext *ctx, const char *btaddr)
 		return AKS_ERROR_NULL;
 	}
 
-	memset (ctx, 0x00, sizeof(BtGattDeviceContext));
+	BtLeDeviceOptions default_options;
+	if (options == NULL) {
+		(void)btLeDeviceInitOptions(&default_options);
+		options = &default_options;
+	}
 
-	int ret = _create_ble_socket(btaddr);
+	int ret = _create_ble_socket(btaddr, options, false);
 	if (ret < AKS_OK) {
 		return ret;
 	}
 
+	return btLeDeviceCreateWithSocket(ctx, ret, options);
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceCreateWithSocket(BtGattDeviceContext *ctx, int sock, const BtLeDeviceOptions *options)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	else if (sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	BtLeDeviceOptions default_options;
+	if (options == NULL) {
+		(void)btLeDeviceInitOptions(&default_options);
+		options = &default_options;
+	}
+
+	memset (ctx, 0x00, sizeof(BtGattDeviceContext));
+
 	{
-		ctx->btdevice = ret;
+		ctx->btdevice = sock;
 		ctx->client.mtu = BT_ATT_MIN_LE_MTU;
 		ctx->server.mtu = BT_ATT_MIN_LE_MTU;
+		ctx->request_timeout_ms = options->request_timeout_ms;
+		ctx->procedure_timeout_ms = options->procedure_timeout_ms;
+	}
+	_read_socket_mtu(ctx);
+	btCryptoInit(&ctx->crypto);
+
+	int ret = _init_sync_objects(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ctx->connected = true;
+
+	ret = _start_receive_thread(ctx);
+	if (ret != 0) {
+		ctx->connected = false;
+		return ret;
+	}
+
+	//J 応答しない Peer で Create が ATT の Transaction Timeout (30秒) を何度も待たないよう、
+	//J 以下の Request はまとめて setup_timeout_ms で打ち切る
+	(void)btLeDeviceBeginProcedure(ctx, options->setup_timeout_ms);
+
+	//J 接続直後に MTU を広げておく。失敗しても最小 MTU で通信は続けられる
+	if (options->mtu > BT_ATT_MIN_LE_MTU) {
+		uint16_t mtu = options->mtu;
+		if (mtu > ctx->l2cap.rcvmtu) {
+			mtu = ctx->l2cap.rcvmtu;
+		}
+		if (mtu > BT_ATT_MAX_LE_MTU) {
+			mtu = BT_ATT_MAX_LE_MTU;
+		}
+		ctx->client.mtu = mtu;
+
+		ret = BtGattServerConfiguration::btGattExchangeMtu(*ctx);
+		if ((ret != AKS_OK) || (ctx->read_error != AKS_OK)) {
+			ctx->client.mtu = BT_ATT_MIN_LE_MTU;
+			ctx->server.mtu = BT_ATT_MIN_LE_MTU;
+		}
+	}
+
+	//J 受けられる PDU を Server に知らせる。Characteristic が無い Server もあるので失敗は無視する
+	if (options->client_features != 0) {
+		(void)BtGattServerConfiguration::btGattWriteClientSupportedFeatures(*ctx, options->client_features);
+	}
+
+	(void)btLeDeviceEndProcedure(ctx);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 受信スレッドを止めて join し、Response 待ちの呼び出しが抜けてから同期オブジェクトを壊す。
+//J BT_LE_DEVICE_DESTROY_TIMEOUT_MS で終わらなければ AKS_ERROR_TIMEOUT で何も壊さずに戻るので、
+//J もう一度呼ぶ。Destroy した ctx (0 で埋めた ctx も) にもう一度呼んでも何もしない。
+//J Destroy した ctx はそのまま次の接続の Create に使える
+/*---------------------------------------------------------------------------*/
+int btLeDeviceDestroy(BtGattDeviceContext *ctx)
+{
+	return btLeDeviceDestroyUntil(ctx, btUtilGetMonotonicTimeNs() + BT_LE_DEVICE_DESTROY_TIMEOUT_MS * 1000000ULL);
+}
+
+/*---------------------------------------------------------------------------*/
+//J btLeDeviceDestroy() の期限 (CLOCK_MONOTONIC の ns) を指定する版。
+//J 過ぎた期限を渡すと待たずに、今壊せなければ AKS_ERROR_TIMEOUT で戻る
+/*---------------------------------------------------------------------------*/
+int btLeDeviceDestroyUntil(BtGattDeviceContext *ctx, const uint64_t deadline_ns)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->initialized) {
+		return AKS_OK;
+	}
+	//J 受信スレッドの Callback からは自分を join できない
+	if (ctx->thread_running && pthread_equal(pthread_self(), ctx->receiveThread)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	(void)btLeDeviceShutdown(ctx);
+
+	//J 他のスレッドが持っている Mutex は壊せない
+	struct timespec deadline;
+	deadline.tv_sec  = (time_t)(deadline_ns / 1000000000ULL);
+	deadline.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	while (ctx->waiters > 0) {
+		if (pthread_cond_timedwait(&ctx->blockWaitCv, &ctx->blockWaitMutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	bool drained = (ctx->waiters == 0);
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+	if (!drained) {
+		return AKS_ERROR_TIMEOUT;
+	}
+
+	//J Thread終了 (_stop_receive_thread() の 0 は期限無し)
+	int ret = _stop_receive_thread(ctx, (deadline_ns > 0) ? deadline_ns : 1);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	if (ctx->btdevice >= 0) {
+		close (ctx->btdevice);
+		ctx->btdevice = -1;
+	}
+
+	//J 同期オブジェクト破壊
+	pthread_cond_destroy(&ctx->blockWaitCv);
+	pthread_mutex_destroy(&ctx->blockWaitMutex);
+	pthread_mutex_destroy(&ctx->notificationMutex);
+	close (ctx->wake_fd);
+	ctx->wake_fd = -1;
+
+	ctx->initialized = false;
+	ctx->connected = false;
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J Response 待ちの呼び出しを AKS_ERROR_CANCELED で起こし、受信スレッドに終わるよう知らせる。
+//J 以降の Request は受け付けない。別のスレッドが使っている ctx を閉じる前に呼ぶ
+/*---------------------------------------------------------------------------*/
+int btLeDeviceShutdown(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->initialized) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	ctx->closing = true;
+	__atomic_store_n(&ctx->connected, false, __ATOMIC_RELEASE);
+	(void)pthread_cond_broadcast(&ctx->blockWaitCv);
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	uint64_t one = 1;
+	__atomic_store_n(&ctx->parking, true, __ATOMIC_RELEASE);
+	(void)write(ctx->wake_fd, &one, sizeof(one));
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J Create の後で設定する (Create は ctx を初期化する)
+/*---------------------------------------------------------------------------*/
+int btLeDeviceSetDisconnectCallback(BtGattDeviceContext *ctx, BtLeDeviceDisconnectCb cb, void *arg)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	ctx->disconnect_cb  = cb;
+	ctx->disconnect_arg = arg;
+	bool lost = ctx->link_lost;
+	int  reason = ctx->disconnect_reason;
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	//J 設定する前に切れていたら、ここで知らせる
+	if (lost && (cb != NULL)) {
+		cb(arg, ctx, reason);
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+bool btLeDeviceIsConnected(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return false;
+	}
+
+	return __atomic_load_n(&ctx->connected, __ATOMIC_ACQUIRE);
+}
+
+/*---------------------------------------------------------------------------*/
+//J 別プロセスに引き継ぐため、受信スレッドを止めて状態と Socket を取り出す
+//J Socket は閉じないので、止めている間に届いた PDU は引き継いだ側が読む
+/*---------------------------------------------------------------------------*/
+int btLeDeviceDetach(BtGattDeviceContext *ctx, BtLeDeviceHandoffState *state, int &sock)
+{
+	sock = -1;
+
+	if ((ctx == NULL) || (state == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->connected) {
+		return AKS_ERROR_INVALID;
+	}
+
+	//J Response 待ちの Request があると引き継いだ側に届いた Response を受ける者がいない
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	bool waiting = (ctx->expectedResponseOpcode != 0x00) || ctx->orphaned;
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+	if (waiting) {
+		return AKS_ERROR_INVALID;
+	}
+
+	(void)_stop_receive_thread(ctx, 0);
+
+	memset(state, 0, sizeof(BtLeDeviceHandoffState));
+	state->version            = BT_LE_DEVICE_HANDOFF_VERSION;
+	state->client_mtu         = ctx->client.mtu;
+	state->server_mtu         = ctx->server.mtu;
+	state->l2cap_sndmtu       = ctx->l2cap.sndmtu;
+	state->l2cap_rcvmtu       = ctx->l2cap.rcvmtu;
+	state->indication_pending = __atomic_load_n(&ctx->indicationPending, __ATOMIC_ACQUIRE) ? 1 : 0;
+
+	state->num_notification = (uint8_t)ctx->num_notification;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		state->notifications[i].config_handle = ctx->notification_list[i].config_handle;
+		state->notifications[i].value_handle  = ctx->notification_list[i].value_handle;
+		state->notifications[i].indication    = ctx->notification_list[i].indication ? 1 : 0;
+		state->notifications[i].confirm       = ctx->notification_list[i].confirm;
+	}
+
+	if (ctx->csrk.valid) {
+		state->csrk_valid = 1;
+		memcpy(state->csrk, ctx->csrk.raw, sizeof(state->csrk));
+		state->sign_counter = __atomic_load_n(&ctx->csrk.counter, __ATOMIC_RELAXED);
+	}
+
+	state->request_timeout_ms = ctx->request_timeout_ms;
+	state->procedure_timeout_ms = ctx->procedure_timeout_ms;
+	(void)btLeDeviceGetStatistics(ctx, &state->stats);
+
+	sock = ctx->btdevice;
+	ctx->btdevice = -1;
+
+	pthread_cond_destroy(&ctx->blockWaitCv);
+	pthread_mutex_destroy(&ctx->blockWaitMutex);
+	pthread_mutex_destroy(&ctx->notificationMutex);
+	close (ctx->wake_fd);
+	ctx->wake_fd = -1;
+
+	ctx->initialized = false;
+	ctx->connected = false;
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J btLeDeviceDetach() した状態と Socket から復元する
+//J Exchange MTU も CCCD の書き込みもしないので Peer からは何も見えない。
+//J 受信スレッドは止めたままなので、Callback を Bind してから btLeDeviceResume() する
+/*---------------------------------------------------------------------------*/
+int btLeDeviceAttach(BtGattDeviceContext *ctx, int sock, const BtLeDeviceHandoffState *state)
+{
+	if ((ctx == NULL) || (state == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (sock < 0) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((state->version != BT_LE_DEVICE_HANDOFF_VERSION) ||
+		(state->num_notification > BT_LE_DEVICE_MAX_NOTIFICATION)) {
+		return AKS_ERROR_BT_INVALUD_FORMAT;
+	}
+
+	memset (ctx, 0x00, sizeof(BtGattDeviceContext));
+
+	ctx->btdevice     = sock;
+	ctx->client.mtu   = state->client_mtu;
+	ctx->server.mtu   = state->server_mtu;
+	ctx->l2cap.sndmtu = state->l2cap_sndmtu;
+	ctx->l2cap.rcvmtu = state->l2cap_rcvmtu;
+	ctx->indicationPending = (state->indication_pending != 0);
+	ctx->request_timeout_ms = state->request_timeout_ms;
+	ctx->procedure_timeout_ms = state->procedure_timeout_ms;
+
+	ctx->num_notification = state->num_notification;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		ctx->notification_list[i].config_handle = state->notifications[i].config_handle;
+		ctx->notification_list[i].value_handle  = state->notifications[i].value_handle;
+		ctx->notification_list[i].indication    = (state->notifications[i].indication != 0);
+		ctx->notification_list[i].confirm       = state->notifications[i].confirm;
+	}
+
+	ctx->stats = state->stats;
+
+	btCryptoInit(&ctx->crypto);
+	if (state->csrk_valid) {
+		int ret = btLeDeviceSetCsrk(ctx, state->csrk, state->sign_counter);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	int ret = _init_sync_objects(ctx);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ctx->parking   = true;
+	ctx->connected = true;
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J btLeDeviceAttach() の後で受信スレッドを動かす
+/*---------------------------------------------------------------------------*/
+int btLeDeviceResume(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((!ctx->connected) || (!ctx->parking)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	int ret = _start_receive_thread(ctx);
+	if (ret != 0) {
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 受信スレッドが使うので、スレッド起動前に同期オブジェクトを作る
+/*---------------------------------------------------------------------------*/
+static int _init_sync_objects(BtGattDeviceContext *ctx)
+{
+	//J 期限は CLOCK_MONOTONIC で計算する
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	int ret = pthread_cond_init(&ctx->blockWaitCv, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = pthread_mutex_init(&ctx->blockWaitMutex, NULL);
+	if (ret != 0) {
+		pthread_cond_destroy(&ctx->blockWaitCv);
+		return ret;
+	}
+
+	//J Callback の中から登録や解除ができるように再帰 Mutex にする
+	pthread_mutexattr_t mattr;
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	ret = pthread_mutex_init(&ctx->notificationMutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	if (ret != 0) {
+		pthread_mutex_destroy(&ctx->blockWaitMutex);
+		pthread_cond_destroy(&ctx->blockWaitCv);
+		return ret;
+	}
+
+	ctx->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ctx->wake_fd < 0) {
+		ret = errno;
+		pthread_mutex_destroy(&ctx->notificationMutex);
+		pthread_mutex_destroy(&ctx->blockWaitMutex);
+		pthread_cond_destroy(&ctx->blockWaitCv);
+		return ret;
+	}
+
+	ctx->initialized = true;
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int _start_receive_thread(BtGattDeviceContext *ctx)
+{
+	uint64_t count;
+	(void)read(ctx->wake_fd, &count, sizeof(count));
+
+	__atomic_store_n(&ctx->parking, false, __ATOMIC_RELEASE);
+
+	int ret = pthread_create(&ctx->receiveThread, NULL, _ble_receive_thread_func, (void *)ctx);
+	if (ret != 0) {
+		__atomic_store_n(&ctx->parking, true, __ATOMIC_RELEASE);
+		return ret;
+	}
+	ctx->thread_running = true;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 受信スレッドを eventfd で起こして終わらせる (Socket に残った PDU は読まない)
+//J deadline_ns (CLOCK_MONOTONIC、0 なら待ち続ける) までに終わらなければ AKS_ERROR_TIMEOUT
+/*---------------------------------------------------------------------------*/
+static int _stop_receive_thread(BtGattDeviceContext *ctx, const uint64_t deadline_ns)
+{
+	if (!ctx->thread_running) {
+		return AKS_OK;
+	}
+
+	uint64_t one = 1;
+	__atomic_store_n(&ctx->parking, true, __ATOMIC_RELEASE);
+	(void)write(ctx->wake_fd, &one, sizeof(one));
+
+	int ret;
+	if (deadline_ns == 0) {
+		ret = pthread_join(ctx->receiveThread, NULL);
+	}
+	else {
+		//J pthread_timedjoin_np() の期限は CLOCK_REALTIME なので残り時間から作る
+		uint64_t now_ns = btUtilGetMonotonicTimeNs();
+		uint64_t remaining_ns = (deadline_ns > now_ns) ? (deadline_ns - now_ns) : 0;
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		remaining_ns += (uint64_t)deadline.tv_nsec;
+		deadline.tv_sec  += (time_t)(remaining_ns / 1000000000ULL);
+		deadline.tv_nsec  = (long)(remaining_ns % 1000000000ULL);
+
+		ret = pthread_timedjoin_np(ctx->receiveThread, NULL, &deadline);
+	}
+	if (ret == ETIMEDOUT) {
+		return AKS_ERROR_TIMEOUT;
+	}
+
+	ctx->thread_running = false;
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+uint16_t btLeDeviceGetMtu(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return BT_ATT_MIN_LE_MTU;
+	}
+
+	//J 実際に使える ATT_MTU は双方の小さい方、かつ L2CAP の送信 MTU 以下
+	uint16_t mtu = (ctx->client.mtu < ctx->server.mtu) ? ctx->client.mtu : ctx->server.mtu;
+	if (mtu > ctx->l2cap.sndmtu) {
+		mtu = ctx->l2cap.sndmtu;
+	}
+	if (mtu < BT_ATT_MIN_LE_MTU) {
+		mtu = BT_ATT_MIN_LE_MTU;
+	}
+
+	return mtu;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceSendAttPdu(
+								BtGattDeviceContext *ctx,
+								const uint8_t *pdu,
+								const size_t len)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (len == 0) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	//J 切断された Socket への送信で SIGPIPE を受けないようにする
+	ssize_t ret = send (ctx->btdevice, pdu, len, MSG_NOSIGNAL);
+	if ((ret < 0) || ((size_t)ret != len)) {
+		return AKS_ERROR_IO;
+	}
+
+	__atomic_fetch_add(&ctx->stats.tx_pdus, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx->stats.tx_bytes, len, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceSendAttPduBurst(
+								BtGattDeviceContext *ctx,
+								const BtLeDevicePdu *pdus,
+								const size_t num)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((pdus == NULL) || (num == 0)) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	//J 1回のシステムコールで複数の PDU を Socket に積む
+	struct iovec   iov[BT_LE_DEVICE_MAX_BURST];
+	struct mmsghdr msgs[BT_LE_DEVICE_MAX_BURST];
+
+	size_t sent = 0;
+	while (sent < num) {
+		size_t batch = num - sent;
+		if (batch > BT_LE_DEVICE_MAX_BURST) {
+			batch = BT_LE_DEVICE_MAX_BURST;
+		}
+
+		memset(msgs, 0x00, sizeof(struct mmsghdr) * batch);
+		for (size_t i=0 ; i<batch ; ++i) {
+			iov[i].iov_base = (void *)pdus[sent + i].pdu;
+			iov[i].iov_len  = pdus[sent + i].len;
+			msgs[i].msg_hdr.msg_iov    = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int ret = sendmmsg(ctx->btdevice, msgs, (unsigned int)batch, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return AKS_ERROR_IO;
+		}
+
+		for (int i=0 ; i<ret ; ++i) {
+			if (msgs[i].msg_len != pdus[sent + i].len) {
+				return AKS_ERROR_IO;
+			}
+			__atomic_fetch_add(&ctx->stats.tx_bytes, msgs[i].msg_len, __ATOMIC_RELAXED);
+		}
+		__atomic_fetch_add(&ctx->stats.tx_pdus, (uint64_t)ret, __ATOMIC_RELAXED);
+
+		sent += (size_t)ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J timeout_ns は送ってからの相対時間。0 なら ctx の既定の期限 (request_timeout_ms) を使う
+/*---------------------------------------------------------------------------*/
+int btLeDeviceSendAttPduAndWaitForResponse(
+								BtGattDeviceContext *ctx,
+								const uint8_t *pdu,
+								const size_t len,
+								const uint8_t expectedResponse,
+								const uint32_t timeout_ns)
+{
+	uint64_t deadline_ns = 0;
+	if (timeout_ns != 0) {
+		deadline_ns = btUtilGetMonotonicTimeNs() + timeout_ns;
+	}
+
+	return btLeDeviceSendAttPduAndWaitForResponseUntil(ctx, pdu, len, expectedResponse, deadline_ns);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J deadline_ns は CLOCK_MONOTONIC の絶対時刻。0 なら ctx の既定の期限を使う。
+//J Procedure の中ではその期限とも比べて早い方で打ち切る。
+//J 期限切れは AKS_ERROR_TIMEOUT、btLeDeviceCancel() / btLeDeviceShutdown() は AKS_ERROR_CANCELED
+/*---------------------------------------------------------------------------*/
+int btLeDeviceSendAttPduAndWaitForResponseUntil(
+								BtGattDeviceContext *ctx,
+								const uint8_t *pdu,
+								const size_t len,
+								const uint8_t expectedResponse,
+								const uint64_t deadline_ns)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (pdu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+
+	//J 送信前に待ち状態を登録しておかないと、速い Response を取りこぼす
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+
+	//J 切れたリンクに送っても Response は来ない
+	if (ctx->link_lost) {
+		pthread_mutex_unlock(&ctx->blockWaitMutex);
+		return AKS_ERROR_IO;
+	}
+	if (ctx->closing) {
+		pthread_mutex_unlock(&ctx->blockWaitMutex);
+		return AKS_ERROR_CANCELED;
+	}
+
+	uint64_t deadline = deadline_ns;
+	if ((deadline == 0) && (ctx->request_timeout_ms != 0)) {
+		deadline = start_ns + (uint64_t)ctx->request_timeout_ms * 1000000ULL;
+	}
+	uint32_t seq = ctx->cancel_seq;
+	if (ctx->procedure_active) {
+		seq = ctx->procedure_seq;
+		if ((ctx->procedure_deadline_ns != 0) && ((deadline == 0) || (ctx->procedure_deadline_ns < deadline))) {
+			deadline = ctx->procedure_deadline_ns;
+		}
+	}
+
+	//J btLeDeviceDestroy() はこの呼び出しが抜けるまで Mutex を壊さない
+	ctx->waiters++;
+
+	//J ATT の Request は 1つずつ。打ち切った Request の Response が来るまでは次を送れない
+	int ret = AKS_OK;
+	while ((ret == AKS_OK) && ctx->orphaned) {
+		ret = _wait_response(ctx, deadline, seq);
+	}
+
+	bool sent = false;
+	if (ret == AKS_OK) {
+		ctx->requestedOpcode        = pdu[0];
+		ctx->expectedResponseOpcode = expectedResponse;
+		ctx->responseReady          = false;
+
+		ret = btLeDeviceSendAttPdu(ctx, pdu, len);
+		sent = (ret == AKS_OK);
+	}
+	while ((ret == AKS_OK) && (!ctx->responseReady)) {
+		ret = _wait_response(ctx, deadline, seq);
+	}
+
+	if (ret != AKS_OK) {
+		//J 送った Request の Response は後から来るので、次の Request で読み捨てる
+		if (sent && (ctx->expectedResponseOpcode != 0) && (!ctx->link_lost)) {
+			ctx->orphaned = true;
+		}
+		ctx->expectedResponseOpcode = 0;
+
+		if (ret == (int)AKS_ERROR_TIMEOUT) {
+			__atomic_fetch_add(&ctx->stats.timeouts, 1, __ATOMIC_RELAXED);
+		}
+		else if (ret == (int)AKS_ERROR_CANCELED) {
+			__atomic_fetch_add(&ctx->stats.cancellations, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	ctx->waiters--;
+	if (ctx->closing && (ctx->waiters == 0)) {
+		(void)pthread_cond_broadcast(&ctx->blockWaitCv);
+	}
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	__atomic_fetch_add(&ctx->stats.round_trips, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx->stats.wait_ns, btUtilGetMonotonicTimeNs() - start_ns, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J blockWaitMutex を持って呼ぶ。1回起こされるまで待ち、待てない理由があればそれを返す
+/*---------------------------------------------------------------------------*/
+static int _wait_response(BtGattDeviceContext *ctx, const uint64_t deadline_ns, const uint32_t seq)
+{
+	if (ctx->link_lost) {
+		return AKS_ERROR_IO;
+	}
+	if (ctx->closing || (ctx->cancel_seq != seq)) {
+		return AKS_ERROR_CANCELED;
+	}
+
+	if (deadline_ns == 0) {
+		(void)pthread_cond_wait(&ctx->blockWaitCv, &ctx->blockWaitMutex);
+		return AKS_OK;
+	}
+	if (btUtilGetMonotonicTimeNs() >= deadline_ns) {
+		return AKS_ERROR_TIMEOUT;
+	}
+
+	//J ETIMEDOUT でも Response が同時に届いているかもしれないので、呼び出し側で確かめ直す
+	struct timespec deadline;
+	deadline.tv_sec  = (time_t)(deadline_ns / 1000000000ULL);
+	deadline.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+	(void)pthread_cond_timedwait(&ctx->blockWaitCv, &ctx->blockWaitMutex, &deadline);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 続けて送る Request (GATT の Procedure) 全体に budget_ms の期限を付ける (0 なら期限は付けない)。
+//J btLeDeviceEndProcedure() までの Request は全てこの期限で打ち切られ、
+//J btLeDeviceCancel() で残りも含めて取り消される。Procedure は ctx に 1つだけ。
+//J 入れ子にすると (bt_gatt の Procedure を自分の Procedure の中で呼ぶ等) 外側の期限がそのまま使われる
+/*---------------------------------------------------------------------------*/
+int btLeDeviceBeginProcedure(BtGattDeviceContext *ctx, const uint32_t budget_ms)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->initialized) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	if (ctx->procedure_active) {
+		ctx->procedure_depth++;
+		pthread_mutex_unlock(&ctx->blockWaitMutex);
+		return AKS_OK;
+	}
+	ctx->procedure_active      = true;
+	ctx->procedure_seq         = ctx->cancel_seq;
+	ctx->procedure_deadline_ns = 0;
+	if (budget_ms != 0) {
+		ctx->procedure_deadline_ns = btUtilGetMonotonicTimeNs() + (uint64_t)budget_ms * 1000000ULL;
+	}
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceEndProcedure(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->initialized) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	if (ctx->procedure_depth > 0) {
+		ctx->procedure_depth--;
+	}
+	else {
+		ctx->procedure_active      = false;
+		ctx->procedure_deadline_ns = 0;
+	}
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Response を待っている Request と、実行中の Procedure の残りの Request を
+//J AKS_ERROR_CANCELED で打ち切る。別のスレッドから呼ぶ。後から始める Request には効かない
+/*---------------------------------------------------------------------------*/
+int btLeDeviceCancel(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->initialized) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+	ctx->cancel_seq++;
+	(void)pthread_cond_broadcast(&ctx->blockWaitCv);
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceGetStatistics(BtGattDeviceContext *ctx, BtLeDeviceStatistics *stats)
+{
+	if ((ctx == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	stats->tx_pdus     = __atomic_load_n(&ctx->stats.tx_pdus, __ATOMIC_RELAXED);
+	stats->tx_bytes    = __atomic_load_n(&ctx->stats.tx_bytes, __ATOMIC_RELAXED);
+	stats->rx_pdus     = __atomic_load_n(&ctx->stats.rx_pdus, __ATOMIC_RELAXED);
+	stats->rx_bytes    = __atomic_load_n(&ctx->stats.rx_bytes, __ATOMIC_RELAXED);
+	stats->round_trips = __atomic_load_n(&ctx->stats.round_trips, __ATOMIC_RELAXED);
+	stats->wait_ns     = __atomic_load_n(&ctx->stats.wait_ns, __ATOMIC_RELAXED);
+	stats->notifications = __atomic_load_n(&ctx->stats.notifications, __ATOMIC_RELAXED);
+	stats->indications   = __atomic_load_n(&ctx->stats.indications, __ATOMIC_RELAXED);
+	stats->confirmations = __atomic_load_n(&ctx->stats.confirmations, __ATOMIC_RELAXED);
+	stats->dropped_pdus  = __atomic_load_n(&ctx->stats.dropped_pdus, __ATOMIC_RELAXED);
+	stats->timeouts      = __atomic_load_n(&ctx->stats.timeouts, __ATOMIC_RELAXED);
+	stats->cancellations = __atomic_load_n(&ctx->stats.cancellations, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceResetStatistics(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	__atomic_store_n(&ctx->stats.tx_pdus, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.tx_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.rx_pdus, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.rx_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.round_trips, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.wait_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.notifications, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.indications, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.confirmations, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.dropped_pdus, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.timeouts, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.cancellations, 0, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceSetCsrk(BtGattDeviceContext *ctx, const uint8_t csrk[BT_CRYPTO_KEY_SIZE], const uint32_t sign_counter)
+{
+	if ((ctx == NULL) || (csrk == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	int ret = btCryptoSignKeyInit(&ctx->crypto, csrk, &ctx->csrk.key);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	memcpy(ctx->csrk.raw, csrk, sizeof(ctx->csrk.raw));
+
+	//J SignCounter は Bonding 情報と一緒に保存しておき、次の接続で続きから使う
+	__atomic_store_n(&ctx->csrk.counter, sign_counter, __ATOMIC_RELAXED);
+	ctx->csrk.valid = true;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceGetSignCounter(BtGattDeviceContext *ctx, uint32_t &sign_counter)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->csrk.valid) {
+		return AKS_ERROR_INVALID;
+	}
+
+	sign_counter = __atomic_load_n(&ctx->csrk.counter, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J num 個の連続した SignCounter をまとめて確保する
+int btLeDeviceReserveSignCounters(BtGattDeviceContext *ctx, const uint32_t num, uint32_t &first)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->csrk.valid) {
+		return AKS_ERROR_INVALID;
+	}
+	if (num == 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	uint32_t current = __atomic_load_n(&ctx->csrk.counter, __ATOMIC_RELAXED);
+	do {
+		//J SignCounter は巻き戻せないので 0xffffffff を越える確保は失敗させる
+		if ((uint64_t)current + num > 0xffffffffull) {
+			return AKS_ERROR_FULL;
+		}
+	} while (!__atomic_compare_exchange_n(&ctx->csrk.counter, &current, current + num, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	first = current;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceRegistNotificationCallback(
+								BtGattDeviceContext *ctx,
+								BtAttHandle config_handle,
+								BtAttHandle value_handle,
+								BtGattNotificationCb cb)
+{
+	return _regist_notification(ctx, config_handle, value_handle, cb, NULL, NULL, false, BtLeDeviceIndicationConfirm::cAutomatic);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceRegistNotificationCallbackWithArg(
+								BtGattDeviceContext *ctx,
+								BtAttHandle config_handle,
+								BtAttHandle value_handle,
+								BtGattNotificationArgCb cb,
+								void *arg)
+{
+	return _regist_notification(ctx, config_handle, value_handle, NULL, cb, arg, false, BtLeDeviceIndicationConfirm::cAutomatic);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceRegistIndicationCallback(
+								BtGattDeviceContext *ctx,
+								BtAttHandle config_handle,
+								BtAttHandle value_handle,
+								BtGattNotificationCb cb)
+{
+	return _regist_notification(ctx, config_handle, value_handle, cb, NULL, NULL, true, BtLeDeviceIndicationConfirm::cAutomatic);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J cDeferred の場合、Callback の中か後で btLeDeviceConfirmIndication() を呼ぶまで次の Indication は来ない
+int btLeDeviceRegistIndicationCallbackWithArg(
+								BtGattDeviceContext *ctx,
+								BtAttHandle config_handle,
+								BtAttHandle value_handle,
+								BtGattNotificationArgCb cb,
+								void *arg,
+								const uint8_t confirm)
+{
+	if ((confirm != BtLeDeviceIndicationConfirm::cAutomatic) && (confirm != BtLeDeviceIndicationConfirm::cDeferred)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	return _regist_notification(ctx, config_handle, value_handle, NULL, cb, arg, true, confirm);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceConfirmIndication(BtGattDeviceContext *ctx)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J 保留中の Indication が無ければ Confirmation を送ってはいけない
+	if (!__atomic_exchange_n(&ctx->indicationPending, false, __ATOMIC_ACQ_REL)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	return _send_confirmation(ctx);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J btLeDeviceAttach() で引き継いだ登録に Callback を付け直す (CCCD は書かない)
+/*---------------------------------------------------------------------------*/
+static int _bind_notification(
+								BtGattDeviceContext *ctx,
+								BtAttHandle value_handle,
+								BtGattNotificationCb cb,
+								BtGattNotificationArgCb arg_cb,
+								void *arg)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((cb == NULL) && (arg_cb == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	//J 受信スレッドが Callback を読んでいる最中には書き換えない
+	if (!ctx->parking) {
+		return AKS_ERROR_INVALID;
+	}
+
+	bool found = false;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if (notification->value_handle == value_handle) {
+			notification->cb     = cb;
+			notification->arg_cb = arg_cb;
+			notification->arg    = arg;
+			found = true;
+		}
+	}
+
+	return found ? AKS_OK : AKS_ERROR_INVALID;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceBindNotificationCallback(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationCb cb)
+{
+	return _bind_notification(ctx, value_handle, cb, NULL, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceBindNotificationCallbackWithArg(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationArgCb cb, void *arg)
+{
+	return _bind_notification(ctx, value_handle, NULL, cb, arg);
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static int _regist_notification(
+								BtGattDeviceContext *ctx,
+								BtAttHandle config_handle,
+								BtAttHandle value_handle,
+								BtGattNotificationCb cb,
+								BtGattNotificationArgCb arg_cb,
+								void *arg,
+								bool indication,
+								uint8_t confirm)
+{
+	if (ctx == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!ctx->initialized) {
+		return AKS_ERROR_INVALID;
+	}
+	
+	pthread_mutex_lock(&ctx->notificationMutex);
+
+	//J 同じ登録が既にあれば CCCD を書き直すだけにする
+	int index = ctx->num_notification;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if ((notification->value_handle == value_handle) &&
+			(notification->cb == cb) &&
+			(notification->arg_cb == arg_cb) &&
+			(notification->arg == arg) &&
+			(notification->indication == indication)) {
+			index = i;
+			break;
+		}
+	}
+
+	if (index >= BT_LE_DEVICE_MAX_NOTIFICATION) {
+		pthread_mutex_unlock(&ctx->notificationMutex);
+		return AKS_ERROR_FULL;
 	}
 
-	ret = pthread_create(&ctx->receiveThread, NULL, _ble_receive_thread_func, (void *)ctx);
-	if (ret != 0) {
-		return ret;
+	//J 同じ CCCD に Notification と Indication の両方が登録されていれば両方のビットを立てる
+	uint16_t config = indication ? BtAttClientCharacteristicConfiguration::cIndication : BtAttClientCharacteristicConfiguration::cNotification;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if (notification->config_handle == config_handle) {
+			config |= notification->indication ? BtAttClientCharacteristicConfiguration::cIndication : BtAttClientCharacteristicConfiguration::cNotification;
+		}
 	}
 
-	ret = pthread_cond_init(&ctx->blockWaitCv, NULL);
-	if (ret != 0) {
+	int ret = BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(*ctx, config_handle, &config, sizeof(config));
+	if (ret != AKS_OK) {
+		pthread_mutex_unlock(&ctx->notificationMutex);
 		return ret;
 	}
 
-	ret = pthread_mutex_init(&ctx->blockWaitMutex, NULL);
-	if (ret != 0) {
-		return ret;
+	BtGattNotificationContext *notification = &ctx->notification_list[index];
+	notification->config_handle = config_handle;
+	notification->value_handle  = value_handle;
+	notification->cb            = cb;
+	notification->arg_cb        = arg_cb;
+	notification->arg           = arg;
+	notification->indication    = indication;
+	notification->confirm       = confirm;
+
+	if (index == ctx->num_notification) {
+		ctx->num_notification++;
 	}
 
-	ctx->connected = true;
+	pthread_mutex_unlock(&ctx->notificationMutex);
 
 	return AKS_OK;
 }
 
+
 /*---------------------------------------------------------------------------*/
-int btLeDeviceDestroy(BtGattDeviceContext *ctx)
+//J 戻った後は Callback は呼ばれない (呼び出し中なら終わるまで待つ)。Callback の中からも呼べる。
+//J 同じ CCCD に残る登録が無くなったビットは CCCD から下ろす。
+//J 接続が切れていて CCCD を書けなくても登録は外す
+/*---------------------------------------------------------------------------*/
+static int _unregist_notification(
+								BtGattDeviceContext *ctx,
+								BtAttHandle value_handle,
+								BtGattNotificationCb cb,
+								BtGattNotificationArgCb arg_cb,
+								void *arg)
 {
 	if (ctx == NULL) {
 		return AKS_ERROR_NULL;
 	}
+	if (!ctx->initialized) {
+		return AKS_ERROR_INVALID;
+	}
 
-	close (ctx->btdevice);
+	pthread_mutex_lock(&ctx->notificationMutex);
 
-	//J Thread終了
-	
-	//J 同期オブジェクト破壊
-	pthread_cond_destroy(&ctx->blockWaitCv);
-	pthread_mutex_destroy(&ctx->blockWaitMutex);
+	bool found = false;
+	BtAttHandle config_handle = 0;
+	int num = 0;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if ((notification->value_handle == value_handle) &&
+			(notification->cb == cb) &&
+			(notification->arg_cb == arg_cb) &&
+			(notification->arg == arg)) {
+			config_handle = notification->config_handle;
+			found = true;
+			continue;
+		}
+		if (num != i) {
+			ctx->notification_list[num] = *notification;
+		}
+		num++;
+	}
+	ctx->num_notification = num;
 
-	ctx->connected = false;
+	if (!found) {
+		pthread_mutex_unlock(&ctx->notificationMutex);
+		return AKS_ERROR_INVALID;
+	}
 
-	return AKS_OK;
+	uint16_t config = 0;
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if (notification->config_handle == config_handle) {
+			config |= notification->indication ? BtAttClientCharacteristicConfiguration::cIndication : BtAttClientCharacteristicConfiguration::cNotification;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->notificationMutex);
+
+	if (!__atomic_load_n(&ctx->connected, __ATOMIC_ACQUIRE)) {
+		return AKS_OK;
+	}
+
+	return BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(*ctx, config_handle, &config, sizeof(config));
 }
 
 /*---------------------------------------------------------------------------*/
-int btLeDeviceSendAttPdu(
-								BtGattDeviceContext *ctx,
-								const uint8_t *pdu,
-								const size_t len)
+int btLeDeviceUnregistNotificationCallback(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationCb cb)
 {
-	if (ctx == NULL) {
-		return AKS_ERROR_NULL;
-	}
-	if (pdu == NULL) {
-		return AKS_ERROR_NULL;
-	}
-	if (len == 0) {
-		return AKS_ERROR_NOBUF;
-	}
-
-	size_t ret = write (ctx->btdevice, pdu, len);
-	if (ret != len) {
-		return AKS_ERROR_IO;
-	}
+	return _unregist_notification(ctx, value_handle, cb, NULL, NULL);
+}
 
-	return AKS_OK;
+/*---------------------------------------------------------------------------*/
+int btLeDeviceUnregistNotificationCallbackWithArg(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationArgCb cb, void *arg)
+{
+	return _unregist_notification(ctx, value_handle, NULL, cb, arg);
 }
 
 
 /*---------------------------------------------------------------------------*/
-int btLeDeviceSendAttPduAndWaitForResponse(
+static bool _dispatch_notification(
 								BtGattDeviceContext *ctx,
-								const uint8_t *pdu,
-								const size_t len,
-								const uint8_t expectedResponse,
-								const uint32_t timeout_ns)
+								BtAttHandle handle,
+								uint8_t *value,
+								size_t value_len,
+								bool indication)
 {
-	if (ctx == NULL) {
-		return AKS_ERROR_NULL;
+	bool delivered = false;
+	pthread_mutex_lock(&ctx->notificationMutex);
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if ((notification->value_handle != handle) || (notification->indication != indication)) {
+			continue;
+		}
+
+		BtGattNotificationContext called = *notification;
+		if (called.cb != NULL) {
+			called.cb(value, value_len);
+		}
+		else if (called.arg_cb != NULL) {
+			called.arg_cb(called.arg, handle, value, value_len);
+		}
+		delivered = true;
+
+		//J Callback の中で解除されて後ろが詰められたら、同じ位置をもう一度見る
+		if ((i < ctx->num_notification) &&
+			((notification->value_handle != called.value_handle) ||
+			 (notification->cb != called.cb) ||
+			 (notification->arg_cb != called.arg_cb) ||
+			 (notification->arg != called.arg))) {
+			--i;
+		}
 	}
+	pthread_mutex_unlock(&ctx->notificationMutex);
 
-	int ret = btLeDeviceSendAttPdu(ctx, pdu, len);
-	if (ret != AKS_OK) {
-		return ret;
+	if (delivered) {
+		__atomic_fetch_add(indication ? &ctx->stats.indications : &ctx->stats.notifications, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_fetch_add(&ctx->stats.dropped_pdus, 1, __ATOMIC_RELAXED);
 	}
 
-	BtAttPdu *_pdu = (BtAttPdu *)pdu;
+	return delivered;
+}
 
-	ctx->requestedOpcode        = _pdu->pdu.opcode;
-	ctx->expectedResponseOpcode = expectedResponse;
-	if (timeout_ns != 0) {
-		struct timespec timeout;
-		memset (&timeout, 0x00, sizeof(timeout));
-		timeout.tv_nsec = (long)timeout_ns;
 
-		int ret = pthread_cond_timedwait(&ctx->blockWaitCv, &ctx->blockWaitMutex, &timeout);
-		if (ret != 0) {
-			ctx->expectedResponseOpcode = 0;
-			return ret;
-		}
-	}
-	else {
-		int ret = pthread_cond_wait(&ctx->blockWaitCv, &ctx->blockWaitMutex);
-		if (ret != 0) {
-			ctx->expectedResponseOpcode = 0;
-			return ret;
+/*---------------------------------------------------------------------------*/
+//J 1つでも cDeferred の登録があれば Confirmation はアプリに任せる
+static uint8_t _indication_confirm_mode(BtGattDeviceContext *ctx, BtAttHandle handle)
+{
+	uint8_t confirm = BtLeDeviceIndicationConfirm::cAutomatic;
+
+	pthread_mutex_lock(&ctx->notificationMutex);
+	for (int i=0 ; i<ctx->num_notification ; ++i) {
+		BtGattNotificationContext *notification = &ctx->notification_list[i];
+		if ((notification->value_handle == handle) &&
+			(notification->indication) &&
+			(notification->confirm == BtLeDeviceIndicationConfirm::cDeferred)) {
+			confirm = BtLeDeviceIndicationConfirm::cDeferred;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&ctx->notificationMutex);
 
-	return AKS_OK;
+	return confirm;
 }
 
 
 /*---------------------------------------------------------------------------*/
-int btLeDeviceRegistNotificationCallback(
-								BtGattDeviceContext *ctx,
-								BtAttHandle config_handle,
-								BtAttHandle value_handle,
-								BtGattNotificationCb cb)
+static int _send_confirmation(BtGattDeviceContext *ctx)
 {
-	if (ctx == NULL) {
-		return AKS_ERROR_NULL;
-	}
-	
-	if (ctx->num_notification >= BT_LE_DEVICE_MAX_NOTIFICATION) {
-		return AKS_ERROR_FULL;
-	}
+	uint8_t pdu[sizeof(BtAttPdu::Pdu::opcode)];
 
-	uint16_t config = BtAttClientCharacteristicConfiguration::cNotification;
-	int ret = BtGattCharacteristicValueWrite::btGattWriteWithoutResponse(*ctx, config_handle, &config, sizeof(config));
-	if (ret != AKS_OK) {
+	int ret = btAttBuildPduHandleValueConfirmation(pdu, sizeof(pdu));
+	if (ret < AKS_OK) {
 		return ret;
 	}
 
-	ctx->notification_list[ctx->num_notification].value_handle = value_handle;
-	ctx->notification_list[ctx->num_notification].cb = cb;
-
-	ctx->num_notification++;
+	ret = btLeDeviceSendAttPdu(ctx, pdu, (size_t)ret);
+	if (ret == AKS_OK) {
+		__atomic_fetch_add(&ctx->stats.confirmations, 1, __ATOMIC_RELAXED);
+	}
 
-	return AKS_OK;
+	return ret;
 }
 
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-static int _create_ble_socket(const char *btaddr)
+static int _create_ble_socket(const char *btaddr, const BtLeDeviceOptions *options, const bool nonblocking)
 {
 	int ret = 0;
 	bdaddr_t host_bt_addr;
@@ -213,19 +1373,21 @@ static int _create_ble_socket(const char *btaddr)
 	memset(&host_bt_addr, 0, sizeof(host_bt_addr));
 	memset(&target_bt_addr, 0, sizeof(target_bt_addr));
 
-	ret = hci_devba(0, &host_bt_addr);
+	//J どの Controller から繋ぐか (hciN の N)
+	ret = hci_devba(options->adapter, &host_bt_addr);
 	if (ret != 0) {
 //		printf ("hci_devba(). ret = %d,  errno = %d\n", ret, errno);
-		return ret;
+		return AKS_ERROR_IO;
 	}
 
 	ret = str2ba(btaddr, &target_bt_addr);
 	if (ret != 0) {
 //		printf ("str2ba(). ret = %d,  errno = %d\n", ret, errno);
-		return ret;
+		return AKS_ERROR_INVALID;
 	}
 
-	int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	//J connect() は常に Non-Blocking で始め、同期で待つ時は poll() で待つ
+	int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
 	if (sock < 0) {
 //		printf ("socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP) was failed. errno = %d\n", errno);
 		return -errno;
@@ -244,7 +1406,7 @@ static int _create_ble_socket(const char *btaddr)
 	ret = bind(sock, (struct sockaddr *)&host_addr, sizeof(host_addr));
 	if (ret < 0) {
 //		printf ("bind(sock, (struct sockaddr *)&addr, sizeof(addr)) was failed. errno = %d\n", errno);
-		return -errno;
+		return _close_with_errno(sock);
 	}
 
 	//J Socket にオプションを付与
@@ -252,14 +1414,22 @@ static int _create_ble_socket(const char *btaddr)
 		struct bt_security security_opt;
 		{
 			memset(&security_opt, 0, sizeof(security_opt));
-			security_opt.level = BT_SEC_LEVEL_LOW;
+			security_opt.level = (options->security_level != 0) ? options->security_level : BT_SEC_LEVEL_LOW;
 		}
 		ret = setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &security_opt, sizeof(security_opt));
 		if (ret < 0) {
 //			printf ("setsockopt(opt, SOL_BLUETOOTH, BT_SECURITY, &sec, sizeof(sec)) was failed. errno = %d\n", errno);
-			return -errno;
+			return _close_with_errno(sock);
 		}
 	}
+	if ((options->sndbuf > 0) &&
+		(setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &options->sndbuf, sizeof(options->sndbuf)) < 0)) {
+		return _close_with_errno(sock);
+	}
+	if ((options->rcvbuf > 0) &&
+		(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &options->rcvbuf, sizeof(options->rcvbuf)) < 0)) {
+		return _close_with_errno(sock);
+	}
 
 	//J Target 側の準備
 	struct sockaddr_l2 target_addr;
@@ -268,43 +1438,241 @@ static int _create_ble_socket(const char *btaddr)
 		target_addr.l2_family      = AF_BLUETOOTH;
 		target_addr.l2_cid         = htobs(BT_ATT_L2CAP_CID);
 		target_addr.l2_psm         = 0;
-		target_addr.l2_bdaddr_type = BDADDR_LE_RANDOM; //J Device に依存するので、可変にしたほうが良いかも
+		target_addr.l2_bdaddr_type = _bdaddr_type(options->address_type);
 		bacpy(&target_addr.l2_bdaddr, &target_bt_addr);
 	}
 	ret = connect(sock, (struct sockaddr *) &target_addr, sizeof(target_addr));
-	if ((ret < 0) && (ret != EINPROGRESS)) {
+	if ((ret < 0) && (errno != EINPROGRESS)) {
 //		printf ("connect(sock, (struct sockaddr *) &target_addr, sizeof(target_addr)) was failed. errno = %d\n", errno);
+		return _close_with_errno(sock);
+	}
+	if (nonblocking) {
+		//J 完了は呼び出し側が POLLOUT と SO_ERROR で確かめる
+		return sock;
+	}
+
+	if (ret < 0) {
+		return _finish_connect(sock, options->connect_timeout_ms);
+	}
+
+	//J 以降の送受信は Blocking で行う
+	int flags = fcntl(sock, F_GETFL);
+	if ((flags < 0) || (fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+		return _close_with_errno(sock);
+	}
+
+	return sock;
+}
+
+/*---------------------------------------------------------------------------*/
+//J Non-Blocking で始めた connect() の完了を timeout_ms (0 なら待ち続ける) まで待ち、
+//J Blocking に戻した sock を返す。失敗したら sock を閉じてエラーを返す
+/*---------------------------------------------------------------------------*/
+static int _finish_connect(int sock, const uint32_t timeout_ms)
+{
+	//J Write が出来るようになるまで待つ
+	struct pollfd fds;
+	fds.fd      = sock;
+	fds.events  = POLLOUT;
+	fds.revents = 0;
+	int timeout = (timeout_ms != 0) ? (int)timeout_ms : -1;
+	int ret;
+	do {
+		ret = poll(&fds, 1, timeout);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0) {
+		return _close_with_errno(sock);
+	}
+	if (ret == 0) {
+		//J 閉じるとカーネルが LE Create Connection を取り消す
+		close(sock);
+		return AKS_ERROR_TIMEOUT;
+	}
+
+	int error = 0;
+	socklen_t len = sizeof(error);
+	ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *)&error, &len);
+	if (ret < 0) {
+		return _close_with_errno(sock);
+	}
+	if (error != 0) {
+		close(sock);
+		return -error;
+	}
+
+	//J 以降の送受信は Blocking で行う
+	int flags = fcntl(sock, F_GETFL);
+	if ((flags < 0) || (fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+		return _close_with_errno(sock);
+	}
+
+	return sock;
+}
+
+/*---------------------------------------------------------------------------*/
+//J ATT の L2CAP Socket を作って Non-Blocking の connect() を始める
+//J POLLOUT で SO_ERROR が 0 なら接続済み。btLeDeviceCreateWithSocket() に渡す前に
+//J O_NONBLOCK を外すこと
+/*---------------------------------------------------------------------------*/
+int btLeDeviceOpenAttSocket(const char *btaddr, const BtLeDeviceOptions *options)
+{
+	if (btaddr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	BtLeDeviceOptions default_options;
+	if (options == NULL) {
+		(void)btLeDeviceInitOptions(&default_options);
+		options = &default_options;
+	}
+
+	return _create_ble_socket(btaddr, options, true);
+}
+
+/*---------------------------------------------------------------------------*/
+//J Credit Based Flow Control の L2CAP Channel を張って Socket を返す (EATT, CoC 用)。
+//J options の adapter / address_type / security_level / connect_timeout_ms を使う (NULL なら既定値)
+int btLeDeviceOpenL2capChannel(
+								const char *btaddr,
+								const uint16_t psm,
+								const uint8_t mode,
+								const uint16_t mtu,
+								const BtLeDeviceOptions *options)
+{
+	if (btaddr == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (psm == 0) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((mode != BtLeDeviceL2capMode::cLeFlowControl) && (mode != BtLeDeviceL2capMode::cExtendedFlowControl)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	BtLeDeviceOptions default_options;
+	if (options == NULL) {
+		(void)btLeDeviceInitOptions(&default_options);
+		options = &default_options;
+	}
+
+	bdaddr_t host_bt_addr;
+	bdaddr_t target_bt_addr;
+	memset(&host_bt_addr, 0, sizeof(host_bt_addr));
+	memset(&target_bt_addr, 0, sizeof(target_bt_addr));
+
+	int ret = hci_devba(options->adapter, &host_bt_addr);
+	if (ret != 0) {
+		return AKS_ERROR_IO;
+	}
+	ret = str2ba(btaddr, &target_bt_addr);
+	if (ret != 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	//J connect_timeout_ms で待てるよう Non-Blocking で始める
+	int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP);
+	if (sock < 0) {
 		return -errno;
 	}
-	else if(ret == EINPROGRESS) {
-		//J select()を使って待つ
-		fd_set fds, fds_reserve;
-		FD_SET(sock, &fds_reserve);
 
-		memcpy(&fds, &fds_reserve, sizeof(fd_set));
+	//J Host 側の準備
+	struct sockaddr_l2 host_addr;
+	{
+		memset(&host_addr, 0, sizeof(host_addr));
+		host_addr.l2_family      = AF_BLUETOOTH;
+		host_addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+		bacpy(&host_addr.l2_bdaddr, &host_bt_addr);
+	}
+	if (bind(sock, (struct sockaddr *)&host_addr, sizeof(host_addr)) < 0) {
+		return _close_with_errno(sock);
+	}
 
-		//J Write が出来るようになるまで待つ
-		ret = select (sock+1, NULL, &fds, NULL, NULL);
-		if (ret < 0) {
-			return -errno;
+	//J Socket にオプションを付与
+	{
+		struct bt_security security_opt;
+		memset(&security_opt, 0, sizeof(security_opt));
+		security_opt.level = (options->security_level != 0) ? options->security_level : BT_SEC_LEVEL_LOW;
+		if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &security_opt, sizeof(security_opt)) < 0) {
+			return _close_with_errno(sock);
 		}
-		else if (ret == 0) {
-			return AKS_ERROR_IO;
+	}
+	{
+		//J BT_MODE の無い古いカーネルでも LE の Channel は LE Credit Based になる
+		uint8_t mode_opt = mode;
+		if ((setsockopt(sock, SOL_BLUETOOTH, BT_MODE, &mode_opt, sizeof(mode_opt)) < 0) &&
+			((mode != BtLeDeviceL2capMode::cLeFlowControl) || (errno != ENOPROTOOPT))) {
+			return _close_with_errno(sock);
 		}
-
-		int error = 0;
-		socklen_t len = 0;
-		ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *)&error, &len);
-		if (ret < 0) {
-			return -errno;
+	}
+	if (mtu != 0) {
+		uint16_t mtu_opt = mtu;
+		if (setsockopt(sock, SOL_BLUETOOTH, BT_RCVMTU, &mtu_opt, sizeof(mtu_opt)) < 0) {
+			return _close_with_errno(sock);
 		}
+	}
 
-		if (error != 0) {
-			return error;
-		}
+	//J Target 側の準備
+	struct sockaddr_l2 target_addr;
+	{
+		memset (&target_addr, 0x00, sizeof(target_addr));
+		target_addr.l2_family      = AF_BLUETOOTH;
+		target_addr.l2_psm         = htobs(psm);
+		target_addr.l2_bdaddr_type = _bdaddr_type(options->address_type);
+		bacpy(&target_addr.l2_bdaddr, &target_bt_addr);
 	}
 
-	return sock;
+	//J Channel が張れるか失敗するか connect_timeout_ms が過ぎるまで戻らない
+	if ((connect(sock, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0) && (errno != EINPROGRESS)) {
+		return _close_with_errno(sock);
+	}
+
+	return _finish_connect(sock, options->connect_timeout_ms);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _close_with_errno(int sock)
+{
+	int ret = -errno;
+	close(sock);
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+//J BtLeDeviceAddressType を sockaddr_l2 の l2_bdaddr_type にする
+//J (Identity Address はカーネルが IRK から接続先を探すので、種類だけを渡せばよい)
+/*---------------------------------------------------------------------------*/
+static uint8_t _bdaddr_type(const uint8_t address_type)
+{
+	if ((address_type == BtLeDeviceAddressType::cPublic) ||
+		(address_type == BtLeDeviceAddressType::cPublicIdentity)) {
+		return BDADDR_LE_PUBLIC;
+	}
+	return BDADDR_LE_RANDOM;
+}
+
+
+
+/*---------------------------------------------------------------------------*/
+static void _read_socket_mtu(BtGattDeviceContext *ctx)
+{
+	ctx->l2cap.sndmtu = BT_ATT_MAX_PDU_SIZE;
+	ctx->l2cap.rcvmtu = BT_ATT_MAX_PDU_SIZE;
+
+	//J L2CAP 以外の Socket (エミュレータ等) では取れないので最大値のまま
+	uint16_t mtu = 0;
+	socklen_t len = sizeof(mtu);
+	if ((getsockopt(ctx->btdevice, SOL_BLUETOOTH, BT_SNDMTU, &mtu, &len) == 0) &&
+		(mtu >= BT_ATT_MIN_LE_MTU) && (mtu < ctx->l2cap.sndmtu)) {
+		ctx->l2cap.sndmtu = mtu;
+	}
+
+	mtu = 0;
+	len = sizeof(mtu);
+	if ((getsockopt(ctx->btdevice, SOL_BLUETOOTH, BT_RCVMTU, &mtu, &len) == 0) &&
+		(mtu >= BT_ATT_MIN_LE_MTU) && (mtu < ctx->l2cap.rcvmtu)) {
+		ctx->l2cap.rcvmtu = mtu;
+	}
 }
 
 
@@ -314,34 +1682,117 @@ static void *_ble_receive_thread_func(void *arg)
 	BtGattDeviceContext *ctx = (BtGattDeviceContext*)arg;
 	uint8_t data[BT_ATT_MAX_PDU_SIZE];
 
+	struct pollfd pfds[2];
+	pfds[0].fd     = ctx->btdevice;
+	pfds[0].events = POLLIN;
+	pfds[1].fd     = ctx->wake_fd;
+	pfds[1].events = POLLIN;
+
 	while (1) {
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (__atomic_load_n(&ctx->parking, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if (pfds[0].revents == 0) {
+			continue;
+		}
+
 		ssize_t read_size = read (ctx->btdevice, data, sizeof(data));
 		if (read_size > 0) {
 			BtAttPdu *_pdu = (BtAttPdu *)data;
 
+			__atomic_fetch_add(&ctx->stats.rx_pdus, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&ctx->stats.rx_bytes, (uint64_t)read_size, __ATOMIC_RELAXED);
+
 			//J if notification, check the list of notification callback
 			if (BtAttPduOpcode::cAttOpcodeHandleValueNotification == data[0] ){
-				for (int i=0 ; i<ctx->num_notification ; ++i) {
-					if (ctx->notification_list[i].value_handle == 
-						_pdu->pdu.args.handleValueNotification.handle) {
-						ctx->notification_list[i].cb( _pdu->pdu.args.handleValueNotification.value, read_size - 3); //TODO
-					}
+				size_t header_size = sizeof(BtAttPdu::Pdu::opcode)
+								   + sizeof(BtAttPdu::Pdu::Args::HandleValueNotification);
+				if ((size_t)read_size < header_size) {
+					__atomic_fetch_add(&ctx->stats.dropped_pdus, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+
+				(void)_dispatch_notification(
+								ctx,
+								_pdu->pdu.args.handleValueNotification.handle,
+								_pdu->pdu.args.handleValueNotification.value,
+								(size_t)read_size - header_size,
+								false);
+				continue;
+			}
+			//J Indication は Callback より先に Confirmation を返し、次の Indication を待たせない
+			else if (BtAttPduOpcode::cAttOpcodeHandleValueIndication == data[0]) {
+				size_t header_size = sizeof(BtAttPdu::Pdu::opcode)
+								   + sizeof(BtAttPdu::Pdu::Args::HandleValueIndication);
+				if ((size_t)read_size < header_size) {
+					__atomic_fetch_add(&ctx->stats.dropped_pdus, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+
+				BtAttHandle handle = _pdu->pdu.args.handleValueIndication.handle;
+				if (_indication_confirm_mode(ctx, handle) == BtLeDeviceIndicationConfirm::cDeferred) {
+					__atomic_store_n(&ctx->indicationPending, true, __ATOMIC_RELEASE);
+				}
+				else {
+					(void)_send_confirmation(ctx);
 				}
+
+				(void)_dispatch_notification(
+								ctx,
+								handle,
+								_pdu->pdu.args.handleValueIndication.value,
+								(size_t)read_size - header_size,
+								true);
+				continue;
+			}
+			//J Multiple Handle Value Notification は Handle ごとにばらして渡す
+			else if (BtAttPduOpcode::cAttOpcodeMultipleHandleValueNotification == data[0]) {
+				BtAttValueSpan values[BT_ATT_MAX_PDU_SIZE / (sizeof(BtAttHandle) + sizeof(uint16_t))];
+				size_t num_values = 0;
+				int ret = btAttParsePduMultipleHandleValueNotification(
+								data,
+								(size_t)read_size,
+								values,
+								sizeof(values) / sizeof(values[0]),
+								num_values);
+				if (ret != AKS_OK) {
+					__atomic_fetch_add(&ctx->stats.dropped_pdus, 1, __ATOMIC_RELAXED);
+				}
+
+				//J 壊れた PDU でもそこまでの Tuple は正しいので渡す
+				for (size_t i=0 ; i<num_values ; ++i) {
+					(void)_dispatch_notification(
+								ctx,
+								values[i].handle,
+								(uint8_t *)values[i].value,
+								values[i].value_len,
+								false);
+				}
+				continue;
 			}
+
+			pthread_mutex_lock(&ctx->blockWaitMutex);
+
 			//J 現在待ちになっているOPコードを見つけたらCBする
-			else if (ctx->expectedResponseOpcode == data[0]) {
+			if ((ctx->expectedResponseOpcode != 0x00) && (ctx->expectedResponseOpcode == data[0])) {
 				memcpy (ctx->read_buf, data, read_size);
 				ctx->read_size = read_size;
 				ctx->expectedResponseOpcode = 0x00;
 				ctx->read_error = AKS_OK;
+				ctx->responseReady = true;
 
-				int ret = pthread_cond_signal(&ctx->blockWaitCv);
-				if (ret != 0) {
-					continue;
-				}
+				(void)pthread_cond_signal(&ctx->blockWaitCv);
 			}
 			//J 待っているレスポンスがエラーで帰ってきた場合
-			else if (BtAttPduOpcode::cAttOpcodeErrorResponse == data[0]) {
+			else if ((ctx->expectedResponseOpcode != 0x00) && (BtAttPduOpcode::cAttOpcodeErrorResponse == data[0])) {
 				BtAttPdu *pdu = (BtAttPdu *)data;
 				if (pdu->pdu.args.errorResponse.request_opcode == ctx->requestedOpcode) {
 					uint8_t  error_opcode = 0;
@@ -355,20 +1806,35 @@ static void *_ble_receive_thread_func(void *arg)
 								error_status);
 					ctx->expectedResponseOpcode = 0x00;
 					ctx->read_error = AKS_ERROR_BT_ATT_ERROR | error_status;
+					ctx->responseReady = true;
 
-					int ret = pthread_cond_signal(&ctx->blockWaitCv);
-					if (ret != 0) {
-						continue;
-					}
+					(void)pthread_cond_signal(&ctx->blockWaitCv);
 				}
 				else{
 				}
 			}
+			//J 打ち切った Request に遅れて届いた Response (Error Response も含む) は捨てて、次の Request を通す
+			//J (Response の Opcode は奇数で、Command Flag (bit 6) が立たない)
+			else if (ctx->orphaned && (ctx->expectedResponseOpcode == 0x00) &&
+					 ((data[0] & 0x01) != 0) && ((data[0] & 0x40) == 0)) {
+				ctx->orphaned = false;
+				__atomic_fetch_add(&ctx->stats.dropped_pdus, 1, __ATOMIC_RELAXED);
+
+				(void)pthread_cond_broadcast(&ctx->blockWaitCv);
+			}
 			//J それ以外は捨てる
 			else {
+				__atomic_fetch_add(&ctx->stats.dropped_pdus, 1, __ATOMIC_RELAXED);
 			}
+
+			pthread_mutex_unlock(&ctx->blockWaitMutex);
+		}
+		else if ((read_size < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+			continue;
 		}
-		else if (read_size != 0) {
+		//J 0 は Peer か Controller が切断した (POLLHUP)。読み続けると空回りする
+		else {
+			_link_lost(ctx, (read_size < 0) ? -errno : -ENOTCONN);
 			break;
 		}
 	}
@@ -377,3 +1843,25 @@ static void *_ble_receive_thread_func(void *arg)
 	return NULL;
 }
 
+
+/*---------------------------------------------------------------------------*/
+//J 受信スレッドから呼ぶ。Response 待ちを起こし、切断を知らせる
+/*---------------------------------------------------------------------------*/
+static void _link_lost(BtGattDeviceContext *ctx, int reason)
+{
+	pthread_mutex_lock(&ctx->blockWaitMutex);
+
+	ctx->disconnect_reason = reason;
+	__atomic_store_n(&ctx->link_lost, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&ctx->connected, false, __ATOMIC_RELEASE);
+	(void)pthread_cond_broadcast(&ctx->blockWaitCv);
+
+	BtLeDeviceDisconnectCb cb = ctx->disconnect_cb;
+	void *arg = ctx->disconnect_arg;
+
+	pthread_mutex_unlock(&ctx->blockWaitMutex);
+
+	if (cb != NULL) {
+		cb(arg, ctx, reason);
+	}
+}
@@ -7,14 +7,130 @@
 #ifndef BT_LE_DEVICE_H_
 #define BT_LE_DEVICE_H_
 
+#include "bt_crypto.h"
 
 #define BT_LE_DEVICE_MAX_NOTIFICATION				(16)
+#define BT_LE_DEVICE_DEFAULT_MTU					(BT_ATT_MAX_LE_MTU)
+#define BT_LE_DEVICE_MAX_BURST						(32)
+#define BT_LE_DEVICE_DESTROY_TIMEOUT_MS				(1000)	//J btLeDeviceDestroy() が受信スレッドと Response 待ちを待つ期限
+#define BT_LE_DEVICE_DEFAULT_REQUEST_TIMEOUT_MS		(30000)	//J ATT の Transaction Timeout
+#define BT_LE_DEVICE_DEFAULT_PROCEDURE_TIMEOUT_MS	(0)		//J GATT の Procedure 全体の期限 (既定は Request ごとの期限だけ)
+#define BT_LE_DEVICE_DEFAULT_SETUP_TIMEOUT_MS		(3000)	//J 接続直後の Exchange MTU と Client Supported Features の期限
 
 typedef int (*BtGattNotificationCb)(uint8_t *value, size_t value_len);
+typedef int (*BtGattNotificationArgCb)(void *arg, BtAttHandle handle, uint8_t *value, size_t value_len);
+
+struct BtGattDeviceContext;
+//J 受信スレッドがリンクの切断を見つけた時に呼ぶ (reason は -errno)。受信スレッドはこの後終わる
+typedef void (*BtLeDeviceDisconnectCb)(void *arg, BtGattDeviceContext *ctx, int reason);
+
+//J Indication の Confirmation を返すタイミング
+struct BtLeDeviceIndicationConfirm {
+	static const uint8_t cAutomatic			= 0;	//J Callback を呼ぶ前に受信スレッドが返す
+	static const uint8_t cDeferred			= 1;	//J btLeDeviceConfirmIndication() で返す
+};
 
 struct BtGattNotificationContext{
+	BtAttHandle config_handle;
 	BtAttHandle value_handle;
 	BtGattNotificationCb cb;
+	BtGattNotificationArgCb arg_cb;
+	void *arg;
+	bool    indication;			//J Indication の登録か
+	uint8_t confirm;			//J BtLeDeviceIndicationConfirm
+};
+
+//J 性能計測用の統計情報
+struct BtLeDeviceStatistics
+{
+	uint64_t tx_pdus;
+	uint64_t tx_bytes;
+	uint64_t rx_pdus;
+	uint64_t rx_bytes;
+	uint64_t round_trips;		//J Request/Response の往復回数
+	uint64_t wait_ns;			//J Response 待ちに費やした時間の合計
+	uint64_t notifications;		//J Callback に渡した Notification の数
+	uint64_t indications;		//J Callback に渡した Indication の数
+	uint64_t confirmations;		//J 返した Handle Value Confirmation の数
+	uint64_t dropped_pdus;		//J 受け手が無く捨てた PDU の数
+	uint64_t timeouts;			//J 期限切れで打ち切った Request の数
+	uint64_t cancellations;		//J btLeDeviceCancel() などで取り消した Request の数
+};
+
+//J btLeDeviceOpenL2capChannel() の mode (BT_MODE)
+struct BtLeDeviceL2capMode {
+	static const uint8_t cLeFlowControl			= 0x03;	//J LE Credit Based Flow Control
+	static const uint8_t cExtendedFlowControl	= 0x04;	//J Enhanced Credit Based Flow Control (EATT)
+};
+
+//J BT_SECURITY の level
+struct BtLeDeviceSecurityLevel {
+	static const uint8_t cLow					= 1;	//J 暗号化しない
+	static const uint8_t cMedium				= 2;	//J 暗号化する (EATT に必要)
+	static const uint8_t cHigh					= 3;	//J MITM 保護付きで暗号化する
+};
+
+//J 接続先の Address Type (LE Advertising Report の Address_Type と同じ値)
+struct BtLeDeviceAddressType {
+	static const uint8_t cPublic				= 0x00;
+	static const uint8_t cRandom				= 0x01;
+	static const uint8_t cPublicIdentity		= 0x02;	//J Controller が RPA を解決した Public Identity Address
+	static const uint8_t cRandomIdentity		= 0x03;	//J Controller が RPA を解決した Static Random Identity Address
+};
+
+//J まとめて送信する PDU
+struct BtLeDevicePdu
+{
+	const uint8_t *pdu;
+	size_t len;
+};
+
+//J 別プロセスへ接続を引き継ぐ時に渡す状態 (Socket は SCM_RIGHTS で別に渡す)
+#define BT_LE_DEVICE_HANDOFF_VERSION				(3)
+
+#pragma pack(1)
+struct BtLeDeviceHandoffState
+{
+	uint32_t version;
+	uint16_t client_mtu;
+	uint16_t server_mtu;
+	uint16_t l2cap_sndmtu;
+	uint16_t l2cap_rcvmtu;
+	uint8_t  indication_pending;
+
+	//J Callback は引き継げないので、受け取った側で btLeDeviceBindNotificationCallback() する
+	uint8_t  num_notification;
+	struct {
+		BtAttHandle config_handle;
+		BtAttHandle value_handle;
+		uint8_t     indication;
+		uint8_t     confirm;
+	} notifications[BT_LE_DEVICE_MAX_NOTIFICATION];
+
+	uint8_t  csrk_valid;
+	uint8_t  csrk[BT_CRYPTO_KEY_SIZE];
+	uint32_t sign_counter;
+
+	uint32_t request_timeout_ms;
+	uint32_t procedure_timeout_ms;
+
+	BtLeDeviceStatistics stats;
+};
+#pragma pack()
+
+struct BtLeDeviceOptions
+{
+	uint16_t mtu;				//J 接続時に Exchange MTU で要求する ATT_MTU (0 なら交換しない)
+	uint8_t  client_features;	//J 接続時に Client Supported Features へ書くビット (0 なら書かない)
+	int      adapter;			//J 接続に使う Controller の dev_id (hci0 なら 0)
+	uint8_t  address_type;		//J 接続先の BtLeDeviceAddressType (btLeDeviceTableResolveAddressType() で分かる)
+	uint8_t  security_level;	//J BtLeDeviceSecurityLevel
+	uint32_t connect_timeout_ms;//J 同期の接続で connect() を待つ期限 (0 なら待ち続ける)
+	int      sndbuf;			//J SO_SNDBUF (0 ならカーネルの既定値)
+	int      rcvbuf;			//J SO_RCVBUF (0 ならカーネルの既定値)
+	uint32_t request_timeout_ms;//J 期限を指定しない Request の期限 (0 なら待ち続ける)
+	uint32_t procedure_timeout_ms;//J bt_gatt の複数の Request からなる Procedure 全体の期限 (0 なら付けない)
+	uint32_t setup_timeout_ms;	//J Create の中の Exchange MTU と Client Supported Features 全体の期限 (0 なら付けない)
 };
 
 struct BtGattDeviceContext
@@ -30,32 +146,122 @@ struct BtGattDeviceContext
 		uint16_t mtu;
 	} server;
 
+	//J L2CAP Socket の MTU (BT_SNDMTU / BT_RCVMTU)
+	struct {
+		uint16_t sndmtu;
+		uint16_t rcvmtu;
+	} l2cap;
+
 	pthread_t receiveThread;
+	int  wake_fd;				//J 受信スレッドを起こす eventfd
+	bool parking;				//J 受信スレッドを止めている (Socket は閉じない)
+	bool thread_running;		//J receiveThread をまだ join していない
+	bool initialized;			//J 同期オブジェクトがある (Create / Attach から Destroy / Detach まで)
+	bool closing;				//J btLeDeviceShutdown() した。Request は受け付けない
+	int  waiters;				//J Response を待っている呼び出しの数
 	pthread_mutex_t blockWaitMutex;
-	pthread_cond_t  blockWaitCv;
+	pthread_cond_t  blockWaitCv;	//J CLOCK_MONOTONIC
 
 	uint8_t requestedOpcode;
 	uint8_t expectedResponseOpcode;
+	bool    responseReady;
 	uint8_t read_buf[BT_ATT_MAX_LE_MTU];
 	ssize_t read_size;
 	int     read_error;
 
+	//J Request の期限と取り消し (期限は CLOCK_MONOTONIC)
+	uint32_t request_timeout_ms;
+	uint32_t procedure_timeout_ms;	//J bt_gatt の Procedure が btLeDeviceBeginProcedure() に渡す budget
+	bool     procedure_active;		//J btLeDeviceBeginProcedure() から btLeDeviceEndProcedure() まで
+	uint32_t procedure_depth;		//J 入れ子になった btLeDeviceBeginProcedure() の数
+	uint64_t procedure_deadline_ns;	//J 0 なら無し
+	uint32_t procedure_seq;			//J Procedure を始めた時の cancel_seq
+	uint32_t cancel_seq;			//J btLeDeviceCancel() で進める
+	bool     orphaned;				//J 打ち切った Request の Response をまだ受けていない
+
 	int num_notification;
 	BtGattNotificationContext notification_list[BT_LE_DEVICE_MAX_NOTIFICATION];
+	pthread_mutex_t notificationMutex;	//J notification_list を守る (再帰。受信スレッドは持ったまま Callback を呼ぶ)
+	bool indicationPending;		//J Confirmation を保留している Indication がある
+
+	//J リンクの切断
+	bool link_lost;				//J 受信スレッドが切断を見つけて終わった
+	int  disconnect_reason;
+	BtLeDeviceDisconnectCb disconnect_cb;
+	void *disconnect_arg;
+
+	BtLeDeviceStatistics stats;
+
+	//J Signed Write 用の CSRK (Pairing で配布された Local CSRK)
+	struct bt_crypto crypto;
+	struct {
+		bool            valid;
+		BtCryptoCmacKey key;
+		uint8_t         raw[BT_CRYPTO_KEY_SIZE];	//J 引き継ぎ用
+		uint32_t        counter;	//J 次に使う SignCounter
+	} csrk;
 };
 
+int btLeDeviceInitOptions(BtLeDeviceOptions *options);
 int btLeDeviceCreate(BtGattDeviceContext *ctx, const char *btaddr);
+int btLeDeviceCreateWithOptions(BtGattDeviceContext *ctx, const char *btaddr, const BtLeDeviceOptions *options);
+int btLeDeviceCreateWithSocket(BtGattDeviceContext *ctx, int sock, const BtLeDeviceOptions *options);
 int btLeDeviceDestroy(BtGattDeviceContext *ctx);
+int btLeDeviceDestroyUntil(BtGattDeviceContext *ctx, const uint64_t deadline_ns);
+int btLeDeviceShutdown(BtGattDeviceContext *ctx);
+
+int btLeDeviceBeginProcedure(BtGattDeviceContext *ctx, const uint32_t budget_ms);
+int btLeDeviceEndProcedure(BtGattDeviceContext *ctx);
+int btLeDeviceCancel(BtGattDeviceContext *ctx);
+
+int btLeDeviceSetDisconnectCallback(BtGattDeviceContext *ctx, BtLeDeviceDisconnectCb cb, void *arg);
+bool btLeDeviceIsConnected(BtGattDeviceContext *ctx);
+
+int btLeDeviceDetach(BtGattDeviceContext *ctx, BtLeDeviceHandoffState *state, int &sock);
+int btLeDeviceAttach(BtGattDeviceContext *ctx, int sock, const BtLeDeviceHandoffState *state);
+int btLeDeviceResume(BtGattDeviceContext *ctx);
+
+int btLeDeviceOpenAttSocket(const char *btaddr, const BtLeDeviceOptions *options);
+int btLeDeviceOpenL2capChannel(
+								const char *btaddr,
+								const uint16_t psm,
+								const uint8_t mode,
+								const uint16_t mtu,
+								const BtLeDeviceOptions *options);
+
+uint16_t btLeDeviceGetMtu(BtGattDeviceContext *ctx);
+
+int btLeDeviceGetStatistics(BtGattDeviceContext *ctx, BtLeDeviceStatistics *stats);
+int btLeDeviceResetStatistics(BtGattDeviceContext *ctx);
+
+int btLeDeviceSetCsrk(BtGattDeviceContext *ctx, const uint8_t csrk[BT_CRYPTO_KEY_SIZE], const uint32_t sign_counter);
+int btLeDeviceGetSignCounter(BtGattDeviceContext *ctx, uint32_t &sign_counter);
+int btLeDeviceReserveSignCounters(BtGattDeviceContext *ctx, const uint32_t num, uint32_t &first);
 
 int btLeDeviceSendAttPdu(BtGattDeviceContext *ctx, const uint8_t *pdu, const size_t len);
+int btLeDeviceSendAttPduBurst(BtGattDeviceContext *ctx, const BtLeDevicePdu *pdus, const size_t num);
 int btLeDeviceSendAttPduAndWaitForResponse(
 								BtGattDeviceContext *ctx,
 								const uint8_t *pdu,
 								const size_t len,
 								const uint8_t expectedResponse,
 								const uint32_t timeout_ns);
+int btLeDeviceSendAttPduAndWaitForResponseUntil(
+								BtGattDeviceContext *ctx,
+								const uint8_t *pdu,
+								const size_t len,
+								const uint8_t expectedResponse,
+								const uint64_t deadline_ns);
 
 int btLeDeviceRegistNotificationCallback(BtGattDeviceContext *ctx, BtAttHandle config_handle, BtAttHandle value_handle, BtGattNotificationCb cb);
+int btLeDeviceRegistNotificationCallbackWithArg(BtGattDeviceContext *ctx, BtAttHandle config_handle, BtAttHandle value_handle, BtGattNotificationArgCb cb, void *arg);
+int btLeDeviceRegistIndicationCallback(BtGattDeviceContext *ctx, BtAttHandle config_handle, BtAttHandle value_handle, BtGattNotificationCb cb);
+int btLeDeviceRegistIndicationCallbackWithArg(BtGattDeviceContext *ctx, BtAttHandle config_handle, BtAttHandle value_handle, BtGattNotificationArgCb cb, void *arg, const uint8_t confirm);
+int btLeDeviceUnregistNotificationCallback(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationCb cb);
+int btLeDeviceUnregistNotificationCallbackWithArg(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationArgCb cb, void *arg);
+int btLeDeviceConfirmIndication(BtGattDeviceContext *ctx);
+int btLeDeviceBindNotificationCallback(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationCb cb);
+int btLeDeviceBindNotificationCallbackWithArg(BtGattDeviceContext *ctx, BtAttHandle value_handle, BtGattNotificationArgCb cb, void *arg);
 // int btDeviceSetClientMtu(BtGattDeviceContext &ctx, uint16_t mtu);
 
 
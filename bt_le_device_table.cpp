@@ -0,0 +1,480 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "aks_error.h"
+#include "bt_le_scanner.h"
+#include "bt_le_device_table.h"
+
+#define BT_LE_DEVICE_TABLE_MASK						(BT_LE_DEVICE_TABLE_CAPACITY - 1)
+#define BT_LE_DEVICE_TABLE_WHEEL_MASK				(BT_LE_DEVICE_TABLE_WHEEL_SLOTS - 1)
+#define BT_LE_DEVICE_TABLE_EXTENDED_SCAN_RSP		(0x0008)	//J Extended の Event_Type の Scan Response ビット
+
+
+/*---------------------------------------------------------------------------*/
+static uint16_t _table_home(const uint8_t address[6], uint8_t address_type)
+{
+	uint64_t key = address_type;
+	for (int i=0 ; i<6 ; ++i) {
+		key = (key << 8) | address[i];
+	}
+	//J Fibonacci Hashing で上位ビットを使う
+	return (uint16_t)(((key * 0x9E3779B97F4A7C15ULL) >> 48) & BT_LE_DEVICE_TABLE_MASK);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _table_payload_hash(const uint8_t *data, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i=0 ; i<len ; ++i) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint64_t _table_expiry_tick(const BtLeDeviceTable *table, const BtLeDeviceTableEntry *entry)
+{
+	return entry->last_seen_ns / table->tick_ns + table->timeout_ticks;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _table_wheel_link(BtLeDeviceTable *table, uint16_t index)
+{
+	BtLeDeviceTableEntry *entry = &table->entries[index];
+	uint16_t slot = (uint16_t)(_table_expiry_tick(table, entry) & BT_LE_DEVICE_TABLE_WHEEL_MASK);
+
+	entry->wheel_slot = slot;
+	entry->wheel_prev = BT_LE_DEVICE_TABLE_NONE;
+	entry->wheel_next = table->wheel[slot];
+	if (entry->wheel_next != BT_LE_DEVICE_TABLE_NONE) {
+		table->entries[entry->wheel_next].wheel_prev = index;
+	}
+	table->wheel[slot] = index;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _table_wheel_unlink(BtLeDeviceTable *table, uint16_t index)
+{
+	BtLeDeviceTableEntry *entry = &table->entries[index];
+
+	if (entry->wheel_prev != BT_LE_DEVICE_TABLE_NONE) {
+		table->entries[entry->wheel_prev].wheel_next = entry->wheel_next;
+	}
+	else {
+		table->wheel[entry->wheel_slot] = entry->wheel_next;
+	}
+	if (entry->wheel_next != BT_LE_DEVICE_TABLE_NONE) {
+		table->entries[entry->wheel_next].wheel_prev = entry->wheel_prev;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Entry を from から to に移し、Wheel のリンクを付け替える
+/*---------------------------------------------------------------------------*/
+static void _table_move(BtLeDeviceTable *table, uint16_t from, uint16_t to)
+{
+	BtLeDeviceTableEntry *entry = &table->entries[to];
+	*entry = table->entries[from];
+
+	if (entry->wheel_prev != BT_LE_DEVICE_TABLE_NONE) {
+		table->entries[entry->wheel_prev].wheel_next = to;
+	}
+	else {
+		table->wheel[entry->wheel_slot] = to;
+	}
+	if (entry->wheel_next != BT_LE_DEVICE_TABLE_NONE) {
+		table->entries[entry->wheel_next].wheel_prev = to;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Backward Shift Delete: 後ろに続く Entry のうち、本来の位置から見て
+//J 空いた場所を越えているものを詰める
+/*---------------------------------------------------------------------------*/
+static void _table_delete(BtLeDeviceTable *table, uint16_t index)
+{
+	if (table->evict_cb != NULL) {
+		table->evict_cb(table->arg, &table->entries[index]);
+	}
+	_table_wheel_unlink(table, index);
+
+	uint16_t hole = index;
+	uint16_t next = index;
+	while (1) {
+		next = (uint16_t)((next + 1) & BT_LE_DEVICE_TABLE_MASK);
+		if (!table->entries[next].used) {
+			break;
+		}
+
+		//J home が (hole, next] にあれば動かせない
+		uint16_t home = table->entries[next].home;
+		bool stays = (hole <= next) ? ((hole < home) && (home <= next))
+									: ((hole < home) || (home <= next));
+		if (stays) {
+			continue;
+		}
+
+		_table_move(table, next, hole);
+		hole = next;
+	}
+
+	table->entries[hole].used = false;
+	table->count--;
+	table->stats.evictions++;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool _table_find(
+								BtLeDeviceTable *table,
+								const uint8_t address[6],
+								uint8_t address_type,
+								uint16_t &index)
+{
+	uint16_t home = _table_home(address, address_type);
+	uint32_t probe = 0;
+
+	index = home;
+	while (table->entries[index].used) {
+		BtLeDeviceTableEntry *entry = &table->entries[index];
+		if ((entry->address_type == address_type) && (memcmp(entry->address, address, 6) == 0)) {
+			break;
+		}
+		index = (uint16_t)((index + 1) & BT_LE_DEVICE_TABLE_MASK);
+		probe++;
+	}
+
+	if (probe > table->stats.max_probe) {
+		table->stats.max_probe = probe;
+	}
+
+	return table->entries[index].used;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableInit(
+								BtLeDeviceTable *table,
+								const uint32_t idle_timeout_ms,
+								BtLeDeviceTableEvictCb evict_cb,
+								void *arg)
+{
+	if (table == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (idle_timeout_ms == 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(table, 0, sizeof(BtLeDeviceTable));
+
+	//J 期限が Wheel の半周に収まるように Tick を決める
+	table->timeout_ticks = BT_LE_DEVICE_TABLE_WHEEL_SLOTS / 2;
+	table->tick_ns = (uint64_t)idle_timeout_ms * 1000000ULL / table->timeout_ticks;
+	if (table->tick_ns == 0) {
+		table->tick_ns = 1;
+	}
+
+	for (int i=0 ; i<BT_LE_DEVICE_TABLE_WHEEL_SLOTS ; ++i) {
+		table->wheel[i] = BT_LE_DEVICE_TABLE_NONE;
+	}
+
+	table->evict_cb = evict_cb;
+	table->arg      = arg;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Report を表に反映する。新しい Advertiser か Payload が変わった時だけ changed
+//J 表が一杯なら追跡できないので changed にして AKS_ERROR_FULL を返す
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableUpdate(
+								BtLeDeviceTable *table,
+								const BtLeAdvertisingReport *report,
+								bool &changed,
+								const BtLeDeviceTableEntry **entry)
+{
+	changed = false;
+
+	if ((table == NULL) || (report == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((report->data == NULL) && (report->data_len != 0)) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint64_t now_ns = report->timestamp_ns;
+	if (!table->clock_started) {
+		table->wheel_tick    = now_ns / table->tick_ns;
+		table->clock_started = true;
+	}
+
+	table->stats.reports++;
+
+	bool scan_response = report->extended ? ((report->event_type & BT_LE_DEVICE_TABLE_EXTENDED_SCAN_RSP) != 0)
+										  : (report->event_type == BtLeAdvertisingEventType::cScanRsp);
+	uint32_t hash = _table_payload_hash(report->data, report->data_len);
+
+	uint16_t index;
+	if (!_table_find(table, report->address, report->address_type, index)) {
+		if (table->count >= BT_LE_DEVICE_TABLE_MAX_LOAD) {
+			table->stats.full++;
+			table->stats.passed++;
+			changed = true;
+			return AKS_ERROR_FULL;
+		}
+
+		BtLeDeviceTableEntry *e = &table->entries[index];
+		memset(e, 0, sizeof(BtLeDeviceTableEntry));
+		e->used          = true;
+		e->address_type  = report->address_type;
+		memcpy(e->address, report->address, sizeof(e->address));
+		e->home          = _table_home(report->address, report->address_type);
+		e->rssi_ema      = BT_LE_DEVICE_TABLE_RSSI_UNKNOWN * 256;
+		e->rssi_last     = BT_LE_DEVICE_TABLE_RSSI_UNKNOWN;
+		e->first_seen_ns = now_ns;
+		if (scan_response) {
+			e->rsp_hash = hash;
+		}
+		else {
+			e->adv_hash = hash;
+		}
+		table->count++;
+		table->stats.inserts++;
+		changed = true;
+	}
+	else {
+		BtLeDeviceTableEntry *e = &table->entries[index];
+		uint32_t *last = scan_response ? &e->rsp_hash : &e->adv_hash;
+		if (*last != hash) {
+			*last = hash;
+			changed = true;
+		}
+		_table_wheel_unlink(table, index);
+	}
+
+	//J 127 (不明) を平均に混ぜると -100 dBm 前後の値が大きく引き上げられる
+	BtLeDeviceTableEntry *e = &table->entries[index];
+	if (report->rssi != BT_LE_DEVICE_TABLE_RSSI_UNKNOWN) {
+		if (e->rssi_last == BT_LE_DEVICE_TABLE_RSSI_UNKNOWN) {
+			e->rssi_ema = (int32_t)report->rssi * 256;
+		}
+		else {
+			e->rssi_ema += (((int32_t)report->rssi * 256) - e->rssi_ema) >> BT_LE_DEVICE_TABLE_RSSI_SHIFT;
+		}
+		e->rssi_last = report->rssi;
+	}
+	e->last_seen_ns = now_ns;
+	e->reports++;
+	if (changed) {
+		e->changes++;
+		table->stats.passed++;
+	}
+	else {
+		table->stats.suppressed++;
+	}
+	_table_wheel_link(table, index);
+
+	if (entry != NULL) {
+		*entry = e;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J reports を表に反映し、通すものだけを前に詰める。最後の Report の時刻で追い出しも行う
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableFilter(
+								BtLeDeviceTable *table,
+								BtLeAdvertisingReport *reports,
+								const size_t num_reports,
+								size_t &num_passed)
+{
+	num_passed = 0;
+
+	if ((table == NULL) || (reports == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint64_t latest_ns = 0;
+	for (size_t i=0 ; i<num_reports ; ++i) {
+		bool changed = false;
+		int ret = btLeDeviceTableUpdate(table, &reports[i], changed, NULL);
+		if ((ret != AKS_OK) && (ret != (int)AKS_ERROR_FULL)) {
+			return ret;
+		}
+		if (changed) {
+			if (num_passed != i) {
+				reports[num_passed] = reports[i];
+			}
+			num_passed++;
+		}
+		if (reports[i].timestamp_ns > latest_ns) {
+			latest_ns = reports[i].timestamp_ns;
+		}
+	}
+
+	if (num_reports > 0) {
+		size_t num_evicted;
+		(void)btLeDeviceTableExpire(table, latest_ns, num_evicted);
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableLookup(
+								BtLeDeviceTable *table,
+								const uint8_t address[6],
+								const uint8_t address_type,
+								const BtLeDeviceTableEntry **entry)
+{
+	if ((table == NULL) || (address == NULL) || (entry == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint16_t index;
+	if (!_table_find(table, address, address_type, index)) {
+		*entry = NULL;
+		return AKS_ERROR_INVALID;
+	}
+
+	*entry = &table->entries[index];
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Advertising で見た Address Type を返す (接続の BtLeDeviceOptions::address_type 用)
+//J Address が同じで Type の違う Entry があれば、最後に見たものを選ぶ
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableResolveAddressType(
+								BtLeDeviceTable *table,
+								const uint8_t address[6],
+								uint8_t &address_type)
+{
+	if ((table == NULL) || (address == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J LE Advertising Report の Address_Type は 0 から 3
+	const BtLeDeviceTableEntry *found = NULL;
+	for (uint8_t type=0 ; type<=3 ; ++type) {
+		uint16_t index;
+		if (!_table_find(table, address, type, index)) {
+			continue;
+		}
+		if ((found == NULL) || (table->entries[index].last_seen_ns > found->last_seen_ns)) {
+			found = &table->entries[index];
+		}
+	}
+	if (found == NULL) {
+		return AKS_ERROR_INVALID;
+	}
+
+	address_type = found->address_type;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 前回から now_ns までに期限を迎えた Wheel のスロットを回って追い出す
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableExpire(BtLeDeviceTable *table, const uint64_t now_ns, size_t &num_evicted)
+{
+	num_evicted = 0;
+
+	if (table == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint64_t now_tick = now_ns / table->tick_ns;
+	if (!table->clock_started) {
+		table->wheel_tick    = now_tick;
+		table->clock_started = true;
+		return AKS_OK;
+	}
+	if (now_tick <= table->wheel_tick) {
+		return AKS_OK;
+	}
+
+	//J 1周以上空いたら全スロットを 1回ずつ見れば足りる
+	uint64_t num_ticks = now_tick - table->wheel_tick;
+	if (num_ticks > BT_LE_DEVICE_TABLE_WHEEL_SLOTS) {
+		num_ticks = BT_LE_DEVICE_TABLE_WHEEL_SLOTS;
+	}
+
+	for (uint64_t t=now_tick - num_ticks + 1 ; t<=now_tick ; ++t) {
+		uint16_t slot = (uint16_t)(t & BT_LE_DEVICE_TABLE_WHEEL_MASK);
+
+		//J 削除で Entry が詰められて添字が変わるので、消したら先頭から見直す
+		uint16_t index = table->wheel[slot];
+		while (index != BT_LE_DEVICE_TABLE_NONE) {
+			if (_table_expiry_tick(table, &table->entries[index]) <= now_tick) {
+				_table_delete(table, index);
+				num_evicted++;
+				index = table->wheel[slot];
+			}
+			else {
+				index = table->entries[index].wheel_next;
+			}
+		}
+	}
+	table->wheel_tick = now_tick;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int8_t btLeDeviceTableRssiAverage(const BtLeDeviceTableEntry *entry)
+{
+	if (entry == NULL) {
+		return BT_LE_DEVICE_TABLE_RSSI_UNKNOWN;
+	}
+
+	return (int8_t)((entry->rssi_ema + 128) >> 8);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeDeviceTableGetStatistics(BtLeDeviceTable *table, BtLeDeviceTableStatistics *stats)
+{
+	if ((table == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	*stats = table->stats;
+
+	return AKS_OK;
+}
@@ -0,0 +1,110 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_LE_DEVICE_TABLE_H_
+#define BT_LE_DEVICE_TABLE_H_
+
+/*
+ *J Advertiser ごとの状態を持つ固定長の表
+ *J
+ *J Address と Address Type をキーにした Open Addressing (Linear Probing) の表で、
+ *J 削除は Backward Shift で行うので Tombstone が溜まらない。
+ *J 同じ Payload の繰り返しは数えるだけで通さず、変わった時だけ通す。
+ *J Advertising と Scan Response は交互に届くので別々に Hash を持つ。
+ *J
+ *J しばらく見えない Entry は Timer Wheel で追い出す。Wheel の各スロットは
+ *J 期限の Tick ごとの Entry の双方向リスト (添字で繋ぐ) で、更新も削除も O(1)。
+ */
+
+#define BT_LE_DEVICE_TABLE_CAPACITY					(1024)	//J 2 のべき乗
+#define BT_LE_DEVICE_TABLE_MAX_LOAD					(BT_LE_DEVICE_TABLE_CAPACITY * 7 / 8)
+#define BT_LE_DEVICE_TABLE_WHEEL_SLOTS				(256)	//J 2 のべき乗
+#define BT_LE_DEVICE_TABLE_NONE						(0xFFFF)
+#define BT_LE_DEVICE_TABLE_RSSI_SHIFT				(3)		//J RSSI の移動平均の重み 1/8
+#define BT_LE_DEVICE_TABLE_RSSI_UNKNOWN				(127)	//J Report の RSSI が取れなかった
+
+struct BtLeDeviceTableEntry
+{
+	bool     used;
+	uint8_t  address_type;
+	uint8_t  address[6];			//J LE のバイト順
+	uint16_t home;					//J Hash から決まる本来の位置
+
+	uint32_t adv_hash;				//J 最後の Advertising Data の FNV-1a
+	uint32_t rsp_hash;				//J 最後の Scan Response Data の FNV-1a
+	int32_t  rssi_ema;				//J dBm * 256 の移動平均 (RSSI が不明な Report は入れない)
+	int8_t   rssi_last;				//J 最後に分かった RSSI (まだ無ければ BT_LE_DEVICE_TABLE_RSSI_UNKNOWN)
+
+	uint64_t first_seen_ns;
+	uint64_t last_seen_ns;
+	uint32_t reports;				//J 受けた Report の数
+	uint32_t changes;				//J Payload が変わって通した数
+
+	//J Timer Wheel
+	uint16_t wheel_slot;
+	uint16_t wheel_prev;
+	uint16_t wheel_next;
+};
+
+struct BtLeDeviceTableStatistics
+{
+	uint64_t reports;
+	uint64_t passed;				//J 新しい Advertiser か Payload が変わって通した数
+	uint64_t suppressed;			//J 同じ Payload なので止めた数
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t full;					//J 表が一杯で追加できなかった数
+	uint32_t max_probe;				//J 探索した最大の距離
+};
+
+typedef void (*BtLeDeviceTableEvictCb)(void *arg, const BtLeDeviceTableEntry *entry);
+
+struct BtLeDeviceTable
+{
+	uint32_t count;
+	uint64_t tick_ns;
+	uint64_t timeout_ticks;
+	bool     clock_started;
+	uint64_t wheel_tick;			//J 追い出しを済ませた Tick
+	uint16_t wheel[BT_LE_DEVICE_TABLE_WHEEL_SLOTS];
+
+	BtLeDeviceTableEvictCb evict_cb;
+	void *arg;
+
+	BtLeDeviceTableStatistics stats;
+
+	BtLeDeviceTableEntry entries[BT_LE_DEVICE_TABLE_CAPACITY];
+};
+
+int btLeDeviceTableInit(
+								BtLeDeviceTable *table,
+								const uint32_t idle_timeout_ms,
+								BtLeDeviceTableEvictCb evict_cb,
+								void *arg);
+int btLeDeviceTableUpdate(
+								BtLeDeviceTable *table,
+								const BtLeAdvertisingReport *report,
+								bool &changed,
+								const BtLeDeviceTableEntry **entry);
+int btLeDeviceTableFilter(
+								BtLeDeviceTable *table,
+								BtLeAdvertisingReport *reports,
+								const size_t num_reports,
+								size_t &num_passed);
+int btLeDeviceTableLookup(
+								BtLeDeviceTable *table,
+								const uint8_t address[6],
+								const uint8_t address_type,
+								const BtLeDeviceTableEntry **entry);
+int btLeDeviceTableResolveAddressType(
+								BtLeDeviceTable *table,
+								const uint8_t address[6],
+								uint8_t &address_type);
+int btLeDeviceTableExpire(BtLeDeviceTable *table, const uint64_t now_ns, size_t &num_evicted);
+int8_t btLeDeviceTableRssiAverage(const BtLeDeviceTableEntry *entry);
+int btLeDeviceTableGetStatistics(BtLeDeviceTable *table, BtLeDeviceTableStatistics *stats);
+
+#endif/*BT_LE_DEVICE_TABLE_H_*/
@@ -0,0 +1,1426 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_gatt.h"
+#include "bt_util.h"
+#include "bt_crypto.h"
+#include "bt_eatt.h"
+#include "bt_le_emulator.h"
+
+
+#define BT_LE_EMULATOR_L2CAP_HEADER_SIZE			(4)
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static void *_emulator_thread_func(void *arg);
+static void *_emulator_bearer_thread_func(void *arg);
+static int _emulator_serve_request(BtLeEmulatorContext *emu, BtLeEmulatorBearer *bearer);
+static void _emulator_send_notification(BtLeEmulatorContext *emu, uint64_t now_ns);
+static void _emulator_send_bulk_ack(BtLeEmulatorContext *emu, uint64_t now_ns);
+static void _emulator_bulk_write(BtLeEmulatorContext *emu, const uint8_t *value, size_t value_len);
+static void _emulator_sleep_until(uint64_t deadline_ns);
+static int _emulator_handle_request(BtLeEmulatorContext *emu, BtLeEmulatorBearer *bearer, const uint8_t *req, size_t req_len, uint8_t *rsp, size_t rsp_size);
+static uint64_t _emulator_schedule(BtLeEmulatorContext *emu, uint64_t now_ns, size_t req_len, size_t rsp_len);
+static BtLeEmulatorAttribute *_emulator_find_attribute(BtLeEmulatorContext *emu, BtAttHandle handle);
+static int _emulator_add_attribute(BtLeEmulatorContext *emu, BtAttUuid16 type, const void *value, size_t size, BtAttHandle &handle);
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorCreate(BtLeEmulatorContext *emu, const BtLeEmulatorLinkParameters *link)
+{
+	if ((emu == NULL) || (link == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((link->connection_interval_us == 0) || (link->packets_per_event == 0) || (link->ll_payload_size == 0)) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((link->mtu < BT_ATT_MIN_LE_MTU) || (link->mtu > BT_ATT_MAX_LE_MTU)) {
+		return AKS_ERROR_INVALID;
+	}
+	if (link->prepare_queue_size > BT_LE_EMULATOR_MAX_PREPARE_QUEUE) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(emu, 0x00, sizeof(BtLeEmulatorContext));
+	emu->link = *link;
+	emu->mtu  = BT_ATT_MIN_LE_MTU;
+	btCryptoInit(&emu->crypto);
+
+	int fds[2];
+	int ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+	if (ret < 0) {
+		return -errno;
+	}
+	emu->sock         = fds[0];
+	emu->central_sock = fds[1];
+
+	emu->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (emu->wake_fd < 0) {
+		ret = -errno;
+		close(emu->sock);
+		close(emu->central_sock);
+		return ret;
+	}
+
+	ret = pthread_mutex_init(&emu->mutex, NULL);
+	if (ret != 0) {
+		close(emu->wake_fd);
+		close(emu->sock);
+		close(emu->central_sock);
+		return ret;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&emu->indicationCv, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret != 0) {
+		pthread_mutex_destroy(&emu->mutex);
+		close(emu->wake_fd);
+		close(emu->sock);
+		close(emu->central_sock);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorDestroy(BtLeEmulatorContext *emu)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J read() で寝ているスレッドを起こす
+	shutdown(emu->sock, SHUT_RDWR);
+	for (uint32_t i=0 ; i<emu->num_bearers ; ++i) {
+		shutdown(emu->bearers[i].sock, SHUT_RDWR);
+	}
+	if (emu->running) {
+		pthread_join(emu->thread, NULL);
+		for (uint32_t i=0 ; i<emu->num_bearers ; ++i) {
+			pthread_join(emu->bearers[i].thread, NULL);
+		}
+		emu->running = false;
+	}
+
+	for (uint32_t i=0 ; i<emu->num_bearers ; ++i) {
+		close(emu->bearers[i].sock);
+	}
+	close(emu->sock);
+	close(emu->wake_fd);
+	pthread_cond_destroy(&emu->indicationCv);
+	pthread_mutex_destroy(&emu->mutex);
+
+	//J central_sock は btLeDeviceDestroy() で閉じられる
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorAddPrimaryService(
+								BtLeEmulatorContext *emu,
+								const BtAttUuid16 uuid,
+								BtAttHandle &handle)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	int ret = _emulator_add_attribute(emu, GattAttributeTypeUuid::cPrimaryService, &uuid, sizeof(uuid), handle);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	emu->attributes[emu->num_attributes - 1].endGroupHandle = handle;
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorAddCharacteristic(
+								BtLeEmulatorContext *emu,
+								const BtAttUuid16 uuid,
+								const uint8_t properties,
+								const void *value,
+								const size_t size,
+								BtAttHandle &value_handle)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J 直前の Service に属させる
+	BtLeEmulatorAttribute *service = NULL;
+	for (uint32_t i=emu->num_attributes ; i>0 ; --i) {
+		if (emu->attributes[i-1].type == GattAttributeTypeUuid::cPrimaryService) {
+			service = &emu->attributes[i-1];
+			break;
+		}
+	}
+	if (service == NULL) {
+		return AKS_ERROR_INVALID;
+	}
+
+	bool has_cccd = (properties & (BtAttCharacteristicProperties::cNotify | BtAttCharacteristicProperties::cIndicate)) != 0;
+	uint32_t required = has_cccd ? 3 : 2;
+	if (emu->num_attributes + required > BT_LE_EMULATOR_MAX_ATTRIBUTES) {
+		return AKS_ERROR_FULL;
+	}
+
+	//J 3.3.1 Characteristic Declaration
+	uint8_t declaration[5];
+	BtAttHandle decl_handle = 0;
+	BtAttHandle next_handle = emu->attributes[emu->num_attributes - 1].handle + 2;
+	declaration[0] = properties;
+	memcpy(&declaration[1], &next_handle, sizeof(next_handle));
+	memcpy(&declaration[3], &uuid, sizeof(uuid));
+
+	int ret = _emulator_add_attribute(emu, GattAttributeTypeUuid::cCharacteristic, declaration, sizeof(declaration), decl_handle);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	ret = _emulator_add_attribute(emu, uuid, value, size, value_handle);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	service->endGroupHandle = value_handle;
+
+	if (has_cccd) {
+		uint16_t config = 0;
+		BtAttHandle cccd_handle = 0;
+		ret = _emulator_add_attribute(emu, GattAttributeTypeUuid::cClientCharacteristicConfiguration, &config, sizeof(config), cccd_handle);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+		service->endGroupHandle = cccd_handle;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorSetValue(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle handle,
+								const void *value,
+								const size_t size)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if ((value == NULL) && (size != 0)) {
+		return AKS_ERROR_NULL;
+	}
+	if (size > BT_LE_EMULATOR_MAX_VALUE_SIZE) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	pthread_mutex_lock(&emu->mutex);
+	BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+	if (attr == NULL) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_INVALID;
+	}
+	if (size != 0) {
+		memcpy(attr->value, value, size);
+	}
+	attr->size = size;
+	pthread_mutex_unlock(&emu->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorGetValue(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle handle,
+								void *buf,
+								const size_t buf_size,
+								size_t &size)
+{
+	if ((emu == NULL) || (buf == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&emu->mutex);
+	BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+	if (attr == NULL) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_INVALID;
+	}
+	if (buf_size < attr->size) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_NOBUF;
+	}
+	memcpy(buf, attr->value, attr->size);
+	size = attr->size;
+	pthread_mutex_unlock(&emu->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorStartNotification(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle value_handle,
+								const uint32_t rate_hz,
+								const size_t size)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (rate_hz == 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&emu->mutex);
+	if (_emulator_find_attribute(emu, value_handle) == NULL) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_INVALID;
+	}
+	emu->notify.handle      = value_handle;
+	emu->notify.interval_ns = 1000000000ULL / rate_hz;
+	emu->notify.next_ns     = btUtilGetMonotonicTimeNs() + emu->notify.interval_ns;
+	emu->notify.size        = size;
+	pthread_mutex_unlock(&emu->mutex);
+
+	//J Request が来るまで寝ているスレッドに送信時刻を計り直させる
+	uint64_t one = 1;
+	(void)write(emu->wake_fd, &one, sizeof(one));
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorStopNotification(BtLeEmulatorContext *emu)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&emu->mutex);
+	emu->notify.handle = 0;
+	pthread_mutex_unlock(&emu->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 指定した Handle の今の値を Notification する。
+//J Central が Client Supported Features で許可していれば Multiple Handle Value Notification にまとめる
+int btLeEmulatorNotifyValues(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle *handles,
+								const size_t num_handles)
+{
+	if ((emu == NULL) || (handles == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((num_handles == 0) || (num_handles > BT_LE_EMULATOR_MAX_ATTRIBUTES)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	uint8_t  pdus[BT_LE_EMULATOR_MAX_ATTRIBUTES][BT_ATT_MAX_PDU_SIZE];
+	int      pdu_len[BT_LE_EMULATOR_MAX_ATTRIBUTES];
+	uint64_t deliver_ns[BT_LE_EMULATOR_MAX_ATTRIBUTES];
+	size_t   num_pdus = 0;
+
+	pthread_mutex_lock(&emu->mutex);
+
+	bool multiple = false;
+	for (uint32_t i=0 ; i<emu->num_attributes ; ++i) {
+		BtLeEmulatorAttribute *attr = &emu->attributes[i];
+		if ((attr->type == GattCharacteristicTypeUuid::cClientSupportedFeatures) && (attr->size > 0)) {
+			multiple = ((attr->value[0] & BtGattClientSupportedFeatures::cMultipleHandleValueNotifications) != 0);
+			break;
+		}
+	}
+
+	//J CCCD で Notification が有効な Handle だけ集める
+	BtAttValueSpan values[BT_LE_EMULATOR_MAX_ATTRIBUTES];
+	size_t num_values = 0;
+	for (size_t i=0 ; i<num_handles ; ++i) {
+		BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handles[i]);
+		BtLeEmulatorAttribute *cccd = _emulator_find_attribute(emu, handles[i] + 1);
+		if ((attr == NULL) ||
+			(cccd == NULL) ||
+			(cccd->type != GattAttributeTypeUuid::cClientCharacteristicConfiguration) ||
+			((cccd->value[0] & BtAttClientCharacteristicConfiguration::cNotification) == 0))
+		{
+			continue;
+		}
+		values[num_values].handle    = attr->handle;
+		values[num_values].value     = attr->value;
+		values[num_values].value_len = (uint16_t)attr->size;
+		values[num_values].length    = (uint16_t)attr->size;
+		num_values++;
+	}
+
+	uint64_t now_ns = btUtilGetMonotonicTimeNs();
+	size_t i = 0;
+	while (i < num_values) {
+		//J MTU に収まるだけ詰める。1つしか入らなければ普通の Notification で送る
+		size_t num_packed = 0;
+		if (multiple) {
+			size_t size = sizeof(uint8_t);
+			while ((i + num_packed < num_values) &&
+				   (size + sizeof(BtAttHandle) + sizeof(uint16_t) + values[i + num_packed].value_len <= emu->mtu)) {
+				size += sizeof(BtAttHandle) + sizeof(uint16_t) + values[i + num_packed].value_len;
+				num_packed++;
+			}
+		}
+
+		if (num_packed >= 2) {
+			pdu_len[num_pdus] = btAttBuildPduMultipleHandleValueNotification(pdus[num_pdus], emu->mtu, &values[i], num_packed);
+		}
+		else {
+			size_t value_len = values[i].value_len;
+			if (value_len > (size_t)emu->mtu - 3) {
+				value_len = (size_t)emu->mtu - 3;
+			}
+			pdu_len[num_pdus] = btAttBuildPduHandleValueNotification(pdus[num_pdus], emu->mtu, values[i].handle, (uint16_t)value_len, values[i].value);
+			num_packed = 1;
+		}
+		i += num_packed;
+
+		if (pdu_len[num_pdus] <= 0) {
+			continue;
+		}
+		deliver_ns[num_pdus] = _emulator_schedule(emu, now_ns, 0, (size_t)pdu_len[num_pdus]);
+		num_pdus++;
+	}
+	pthread_mutex_unlock(&emu->mutex);
+
+	for (size_t j=0 ; j<num_pdus ; ++j) {
+		_emulator_sleep_until(deliver_ns[j]);
+
+		ssize_t ret = send(emu->sock, pdus[j], (size_t)pdu_len[j], MSG_DONTWAIT);
+
+		pthread_mutex_lock(&emu->mutex);
+		if (ret == pdu_len[j]) {
+			emu->num_notifications++;
+		}
+		else {
+			emu->num_notifications_dropped++;
+		}
+		pthread_mutex_unlock(&emu->mutex);
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J Indication を送り、Confirmation が返るまで待つ
+int btLeEmulatorIndicateValue(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle handle,
+								const uint32_t timeout_ms)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	uint8_t pdu[BT_ATT_MAX_PDU_SIZE];
+
+	pthread_mutex_lock(&emu->mutex);
+
+	//J ATT では同時に 1つしか Indication を出せない
+	if (emu->indication.pending) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_FULL;
+	}
+
+	BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+	BtLeEmulatorAttribute *cccd = _emulator_find_attribute(emu, handle + 1);
+	if ((attr == NULL) ||
+		(cccd == NULL) ||
+		(cccd->type != GattAttributeTypeUuid::cClientCharacteristicConfiguration) ||
+		((cccd->value[0] & BtAttClientCharacteristicConfiguration::cIndication) == 0))
+	{
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_INVALID;
+	}
+
+	size_t value_len = attr->size;
+	if (value_len > (size_t)emu->mtu - 3) {
+		value_len = (size_t)emu->mtu - 3;
+	}
+	int pdu_len = btAttBuildPduHandleValueIndication(pdu, sizeof(pdu), handle, (uint16_t)value_len, attr->value);
+	if (pdu_len <= 0) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_INVALID;
+	}
+
+	uint64_t now_ns = btUtilGetMonotonicTimeNs();
+	uint64_t deliver_ns = _emulator_schedule(emu, now_ns, 0, (size_t)pdu_len);
+	emu->indication.pending = true;
+	pthread_mutex_unlock(&emu->mutex);
+
+	_emulator_sleep_until(deliver_ns);
+
+	if (send(emu->sock, pdu, (size_t)pdu_len, 0) != pdu_len) {
+		pthread_mutex_lock(&emu->mutex);
+		emu->indication.pending = false;
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_IO;
+	}
+
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + (uint64_t)timeout_ms * 1000000ULL;
+	struct timespec deadline;
+	deadline.tv_sec  = (time_t)(deadline_ns / 1000000000ULL);
+	deadline.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+
+	int ret = AKS_OK;
+	pthread_mutex_lock(&emu->mutex);
+	emu->indication.num_indications++;
+	while (emu->indication.pending) {
+		if (pthread_cond_timedwait(&emu->indicationCv, &emu->mutex, &deadline) == ETIMEDOUT) {
+			//J Confirmation が来なかった。実機ならここで ATT Bearer が使えなくなる
+			emu->indication.pending = false;
+			ret = AKS_ERROR_TIMEOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&emu->mutex);
+
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorSetBulkSink(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle data_handle,
+								const BtAttHandle ack_handle,
+								const bool framed,
+								const uint32_t ack_interval)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (ack_interval == 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&emu->mutex);
+	BtLeEmulatorAttribute *ack = _emulator_find_attribute(emu, ack_handle);
+	if ((_emulator_find_attribute(emu, data_handle) == NULL) || (ack == NULL)) {
+		pthread_mutex_unlock(&emu->mutex);
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(&emu->bulk, 0x00, sizeof(emu->bulk));
+	emu->bulk.data_handle  = data_handle;
+	emu->bulk.ack_handle   = ack_handle;
+	emu->bulk.framed       = framed;
+	emu->bulk.ack_interval = ack_interval;
+	emu->bulk.hash         = 2166136261u;
+
+	memset(ack->value, 0x00, sizeof(uint32_t));
+	ack->size = sizeof(uint32_t);
+	pthread_mutex_unlock(&emu->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorSetCsrk(
+								BtLeEmulatorContext *emu,
+								const uint8_t csrk[BT_CRYPTO_KEY_SIZE])
+{
+	if ((emu == NULL) || (csrk == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&emu->mutex);
+	memset(&emu->csrk, 0x00, sizeof(emu->csrk));
+	int ret = btCryptoSignKeyInit(&emu->crypto, csrk, &emu->csrk.key);
+	emu->csrk.valid = (ret == AKS_OK);
+	pthread_mutex_unlock(&emu->mutex);
+
+	return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorStart(BtLeEmulatorContext *emu)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	emu->anchor_ns    = btUtilGetMonotonicTimeNs();
+	emu->running      = true;
+
+	int ret = pthread_create(&emu->thread, NULL, _emulator_thread_func, (void *)emu);
+	if (ret != 0) {
+		emu->running = false;
+		return ret;
+	}
+
+	for (uint32_t i=0 ; i<emu->num_bearers ; ++i) {
+		ret = pthread_create(&emu->bearers[i].thread, NULL, _emulator_bearer_thread_func, (void *)&emu->bearers[i]);
+		if (ret != 0) {
+			//J 起動できなかった Bearer は使えないようにする
+			shutdown(emu->bearers[i].sock, SHUT_RDWR);
+			close(emu->bearers[i].sock);
+			emu->num_bearers = i;
+			return ret;
+		}
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+//J EATT の Bearer (L2CAP Credit Based Channel) の代わりの socketpair を足す。btLeEmulatorStart() の前に呼ぶ
+int btLeEmulatorAddBearer(BtLeEmulatorContext *emu, const uint16_t mtu, int &central_sock)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (emu->running) {
+		return AKS_ERROR_INVALID;
+	}
+	if ((mtu < BT_EATT_MIN_MTU) || (mtu > BT_ATT_MAX_LE_MTU)) {
+		return AKS_ERROR_INVALID;
+	}
+	if (emu->num_bearers >= BT_LE_EMULATOR_MAX_BEARERS) {
+		return AKS_ERROR_FULL;
+	}
+
+	int fds[2];
+	int ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+	if (ret < 0) {
+		return -errno;
+	}
+
+	BtLeEmulatorBearer *bearer = &emu->bearers[emu->num_bearers];
+	memset(bearer, 0x00, sizeof(BtLeEmulatorBearer));
+	bearer->emu  = emu;
+	bearer->sock = fds[0];
+	bearer->mtu  = mtu;
+	emu->num_bearers++;
+
+	//J central_sock は btLeDeviceDestroy() で閉じられる
+	central_sock = fds[1];
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btLeEmulatorGetCentralSocket(BtLeEmulatorContext *emu)
+{
+	if (emu == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	return emu->central_sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static void *_emulator_thread_func(void *arg)
+{
+	BtLeEmulatorContext *emu = (BtLeEmulatorContext *)arg;
+
+	while (1) {
+		struct pollfd fds[2];
+		fds[0].fd      = emu->sock;
+		fds[0].events  = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd      = emu->wake_fd;
+		fds[1].events  = POLLIN;
+		fds[1].revents = 0;
+
+		//J Notification を流している間は次の送信時刻までしか寝ない
+		struct timespec timeout;
+		struct timespec *timeout_ptr = NULL;
+		pthread_mutex_lock(&emu->mutex);
+		if (emu->notify.handle != 0) {
+			uint64_t now_ns = btUtilGetMonotonicTimeNs();
+			uint64_t wait_ns = (emu->notify.next_ns > now_ns) ? (emu->notify.next_ns - now_ns) : 0;
+			timeout.tv_sec  = (time_t)(wait_ns / 1000000000ULL);
+			timeout.tv_nsec = (long)(wait_ns % 1000000000ULL);
+			timeout_ptr = &timeout;
+		}
+		pthread_mutex_unlock(&emu->mutex);
+
+		int ret = ppoll(fds, 2, timeout_ptr, NULL);
+		if ((ret < 0) && (errno != EINTR)) {
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			(void)read(emu->wake_fd, &count, sizeof(count));
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (_emulator_serve_request(emu, NULL) != AKS_OK) {
+				break;
+			}
+		}
+
+		uint64_t now_ns = btUtilGetMonotonicTimeNs();
+		pthread_mutex_lock(&emu->mutex);
+		bool notify_due = (emu->notify.handle != 0) && (now_ns >= emu->notify.next_ns);
+		pthread_mutex_unlock(&emu->mutex);
+		if (notify_due) {
+			_emulator_send_notification(emu, now_ns);
+		}
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+//J bearer が NULL なら固定 CID の ATT Bearer
+static int _emulator_serve_request(BtLeEmulatorContext *emu, BtLeEmulatorBearer *bearer)
+{
+	uint8_t req[BT_ATT_MAX_PDU_SIZE];
+	uint8_t rsp[BT_ATT_MAX_PDU_SIZE];
+
+	int sock = (bearer != NULL) ? bearer->sock : emu->sock;
+	ssize_t req_len = read(sock, req, sizeof(req));
+	if (req_len <= 0) {
+		return AKS_ERROR_IO;
+	}
+	uint64_t now_ns = btUtilGetMonotonicTimeNs();
+
+	//J Attribute と Link は全ての Bearer で共有する
+	pthread_mutex_lock(&emu->mutex);
+	int rsp_len = _emulator_handle_request(emu, bearer, req, (size_t)req_len, rsp, sizeof(rsp));
+	uint64_t deliver_ns = _emulator_schedule(emu, now_ns, (size_t)req_len, (rsp_len > 0) ? (size_t)rsp_len : 0);
+	emu->num_requests++;
+	if (bearer != NULL) {
+		bearer->num_requests++;
+	}
+	if (rsp_len > 0) {
+		emu->num_outstanding++;
+		if (emu->num_outstanding > emu->max_outstanding) {
+			emu->max_outstanding = emu->num_outstanding;
+		}
+	}
+	pthread_mutex_unlock(&emu->mutex);
+
+	if (bearer == NULL) {
+		_emulator_send_bulk_ack(emu, now_ns);
+	}
+
+	if (rsp_len <= 0) {
+		return AKS_OK;
+	}
+
+	//J Response を運ぶ Connection Event の終わりまで待つ
+	_emulator_sleep_until(deliver_ns);
+
+	ssize_t ret = write(sock, rsp, (size_t)rsp_len);
+
+	pthread_mutex_lock(&emu->mutex);
+	emu->num_outstanding--;
+	pthread_mutex_unlock(&emu->mutex);
+
+	if (ret != rsp_len) {
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *_emulator_bearer_thread_func(void *arg)
+{
+	BtLeEmulatorBearer *bearer = (BtLeEmulatorBearer *)arg;
+
+	while (_emulator_serve_request(bearer->emu, bearer) == AKS_OK) {
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void _emulator_send_notification(BtLeEmulatorContext *emu, uint64_t now_ns)
+{
+	uint8_t pdu[BT_ATT_MAX_PDU_SIZE];
+	uint8_t value[BT_ATT_MAX_PDU_SIZE];
+
+	pthread_mutex_lock(&emu->mutex);
+	emu->notify.next_ns += emu->notify.interval_ns;
+
+	//J CCCD で Notification が有効になっていなければ送らない
+	BtLeEmulatorAttribute *cccd = _emulator_find_attribute(emu, emu->notify.handle + 1);
+	if ((cccd == NULL) ||
+		(cccd->type != GattAttributeTypeUuid::cClientCharacteristicConfiguration) ||
+		((cccd->value[0] & BtAttClientCharacteristicConfiguration::cNotification) == 0))
+	{
+		pthread_mutex_unlock(&emu->mutex);
+		return;
+	}
+
+	size_t value_len = emu->notify.size;
+	if (value_len < sizeof(BtLeEmulatorNotificationStamp)) {
+		value_len = sizeof(BtLeEmulatorNotificationStamp);
+	}
+	if (value_len > (size_t)emu->mtu - 3) {
+		value_len = (size_t)emu->mtu - 3;
+	}
+	memset(value, 0x00, value_len);
+
+	uint64_t deliver_ns = _emulator_schedule(emu, now_ns, 0, value_len + 3);
+
+	BtLeEmulatorNotificationStamp stamp;
+	stamp.sequence     = emu->notify.sequence++;
+	stamp.timestamp_ns = deliver_ns;
+	memcpy(value, &stamp, sizeof(stamp));
+
+	int pdu_len = btAttBuildPduHandleValueNotification(pdu, sizeof(pdu), emu->notify.handle, (uint16_t)value_len, value);
+	pthread_mutex_unlock(&emu->mutex);
+	if (pdu_len <= 0) {
+		return;
+	}
+
+	_emulator_sleep_until(deliver_ns);
+
+	//J Central が読めていない場合は Controller のバッファ溢れとして捨てる
+	ssize_t ret = send(emu->sock, pdu, (size_t)pdu_len, MSG_DONTWAIT);
+
+	pthread_mutex_lock(&emu->mutex);
+	if (ret == pdu_len) {
+		emu->num_notifications++;
+	}
+	else {
+		emu->num_notifications_dropped++;
+	}
+	pthread_mutex_unlock(&emu->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void _emulator_bulk_write(BtLeEmulatorContext *emu, const uint8_t *value, size_t value_len)
+{
+	if (emu->bulk.framed) {
+		uint32_t offset = 0;
+		if (value_len < sizeof(offset)) {
+			emu->bulk.num_discarded++;
+			return;
+		}
+		memcpy(&offset, value, sizeof(offset));
+		if (offset != emu->bulk.received) {
+			//J 抜けがあったので現在の位置を知らせて再送させる
+			emu->bulk.num_discarded++;
+			emu->bulk.ack_due = true;
+			return;
+		}
+		value     += sizeof(offset);
+		value_len -= sizeof(offset);
+	}
+
+	for (size_t i=0 ; i<value_len ; ++i) {
+		emu->bulk.hash = (emu->bulk.hash ^ value[i]) * 16777619u;
+	}
+	emu->bulk.received += (uint32_t)value_len;
+	if ((emu->bulk.received - emu->bulk.acked) > emu->bulk.max_unacked) {
+		emu->bulk.max_unacked = emu->bulk.received - emu->bulk.acked;
+	}
+
+	BtLeEmulatorAttribute *ack = _emulator_find_attribute(emu, emu->bulk.ack_handle);
+	memcpy(ack->value, &emu->bulk.received, sizeof(uint32_t));
+	ack->size = sizeof(uint32_t);
+}
+
+/*---------------------------------------------------------------------------*/
+//J ACK の間隔に達したか、受信キューが空になった (Connection Event の終わり) 時に ACK を送る
+static void _emulator_send_bulk_ack(BtLeEmulatorContext *emu, uint64_t now_ns)
+{
+	uint8_t pdu[BT_ATT_MAX_PDU_SIZE];
+
+	pthread_mutex_lock(&emu->mutex);
+	if (emu->bulk.data_handle == 0) {
+		pthread_mutex_unlock(&emu->mutex);
+		return;
+	}
+
+	bool due = emu->bulk.ack_due || ((emu->bulk.received - emu->bulk.notified) >= emu->bulk.ack_interval);
+	if (!due && (emu->bulk.received != emu->bulk.notified)) {
+		struct pollfd fds;
+		fds.fd      = emu->sock;
+		fds.events  = POLLIN;
+		fds.revents = 0;
+		due = (poll(&fds, 1, 0) == 0);
+	}
+
+	BtLeEmulatorAttribute *cccd = _emulator_find_attribute(emu, emu->bulk.ack_handle + 1);
+	if (!due ||
+		(cccd == NULL) ||
+		(cccd->type != GattAttributeTypeUuid::cClientCharacteristicConfiguration) ||
+		((cccd->value[0] & BtAttClientCharacteristicConfiguration::cNotification) == 0))
+	{
+		pthread_mutex_unlock(&emu->mutex);
+		return;
+	}
+
+	emu->bulk.ack_due  = false;
+	emu->bulk.notified = emu->bulk.received;
+	emu->bulk.acked    = emu->bulk.received;
+
+	int pdu_len = btAttBuildPduHandleValueNotification(
+								pdu,
+								sizeof(pdu),
+								emu->bulk.ack_handle,
+								sizeof(uint32_t),
+								(const uint8_t *)&emu->bulk.received);
+	uint64_t deliver_ns = _emulator_schedule(emu, now_ns, 0, (pdu_len > 0) ? (size_t)pdu_len : 0);
+	pthread_mutex_unlock(&emu->mutex);
+	if (pdu_len <= 0) {
+		return;
+	}
+
+	_emulator_sleep_until(deliver_ns);
+
+	ssize_t ret = send(emu->sock, pdu, (size_t)pdu_len, MSG_DONTWAIT);
+
+	pthread_mutex_lock(&emu->mutex);
+	if (ret == pdu_len) {
+		emu->num_notifications++;
+	}
+	else {
+		emu->num_notifications_dropped++;
+	}
+	pthread_mutex_unlock(&emu->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void _emulator_sleep_until(uint64_t deadline_ns)
+{
+	struct timespec deadline;
+	deadline.tv_sec  = (time_t)(deadline_ns / 1000000000ULL);
+	deadline.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static uint64_t _emulator_fragments_for_pdu(BtLeEmulatorContext *emu, size_t pdu_len)
+{
+	if (pdu_len == 0) {
+		return 0;
+	}
+
+	return (pdu_len + BT_LE_EMULATOR_L2CAP_HEADER_SIZE + emu->link.ll_payload_size - 1) / emu->link.ll_payload_size;
+}
+
+/*---------------------------------------------------------------------------*/
+//J earliest_ns 以降の Connection Event の空きに fragments 個の LL パケットを詰め、最後のパケットが乗るイベントの時刻を返す
+static uint64_t _emulator_pack(BtLeEmulatorContext *emu, uint64_t earliest_ns, uint64_t fragments)
+{
+	uint64_t interval_ns = (uint64_t)emu->link.connection_interval_us * 1000ULL;
+
+	//J anchor_ns からのイベント番号 (0 は未使用の印にするので 1 から数える)
+	uint64_t index = (earliest_ns - emu->anchor_ns + interval_ns - 1) / interval_ns + 1;
+
+	while (1) {
+		BtLeEmulatorContext::Event *event = &emu->events[index % BT_LE_EMULATOR_EVENT_WINDOW];
+		if (event->index != index) {
+			event->index = index;
+			event->used  = 0;
+			emu->num_connection_events++;
+		}
+
+		uint64_t available = emu->link.packets_per_event - event->used;
+		if (fragments <= available) {
+			event->used += (uint16_t)fragments;
+			break;
+		}
+		event->used  = emu->link.packets_per_event;
+		fragments   -= available;
+		index++;
+	}
+
+	return emu->anchor_ns + (index - 1) * interval_ns;
+}
+
+/*---------------------------------------------------------------------------*/
+//J PDU を運ぶ Connection Event を決め、相手に届く時刻を返す。
+//J 片方向の PDU (Write Command, Notification) も別の Bearer の Request/Response も
+//J 他の PDU が使い残したイベントの空きに詰める
+static uint64_t _emulator_schedule(BtLeEmulatorContext *emu, uint64_t now_ns, size_t req_len, size_t rsp_len)
+{
+	uint64_t interval_ns = (uint64_t)emu->link.connection_interval_us * 1000ULL;
+
+	uint64_t req_fragments = _emulator_fragments_for_pdu(emu, req_len);
+	uint64_t rsp_fragments = _emulator_fragments_for_pdu(emu, rsp_len);
+
+	if ((req_fragments == 0) || (rsp_fragments == 0)) {
+		return _emulator_pack(emu, now_ns, req_fragments + rsp_fragments);
+	}
+
+	//J Request を受け取ったイベントの次のイベントから Response を返す
+	uint64_t req_done_ns = _emulator_pack(emu, now_ns, req_fragments);
+	return _emulator_pack(emu, req_done_ns + interval_ns, rsp_fragments);
+}
+
+/*---------------------------------------------------------------------------*/
+static BtLeEmulatorAttribute *_emulator_find_attribute(BtLeEmulatorContext *emu, BtAttHandle handle)
+{
+	for (uint32_t i=0 ; i<emu->num_attributes ; ++i) {
+		if (emu->attributes[i].handle == handle) {
+			return &emu->attributes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static int _emulator_add_attribute(BtLeEmulatorContext *emu, BtAttUuid16 type, const void *value, size_t size, BtAttHandle &handle)
+{
+	if (emu->num_attributes >= BT_LE_EMULATOR_MAX_ATTRIBUTES) {
+		return AKS_ERROR_FULL;
+	}
+	if (size > BT_LE_EMULATOR_MAX_VALUE_SIZE) {
+		return AKS_ERROR_NOBUF;
+	}
+	if ((value == NULL) && (size != 0)) {
+		return AKS_ERROR_NULL;
+	}
+
+	BtLeEmulatorAttribute *attr = &emu->attributes[emu->num_attributes];
+	memset(attr, 0x00, sizeof(BtLeEmulatorAttribute));
+	attr->handle = (BtAttHandle)(emu->num_attributes + 1);
+	attr->type   = type;
+	attr->size   = size;
+	if (size != 0) {
+		memcpy(attr->value, value, size);
+	}
+
+	handle = attr->handle;
+	emu->num_attributes++;
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+static int _emulator_error(uint8_t *rsp, size_t rsp_size, uint8_t opcode, BtAttHandle handle, uint8_t status)
+{
+	return btAttBuildPduErrorResponse(rsp, rsp_size, opcode, handle, status);
+}
+
+/*---------------------------------------------------------------------------*/
+static int _emulator_handle_request(BtLeEmulatorContext *emu, BtLeEmulatorBearer *bearer, const uint8_t *req, size_t req_len, uint8_t *rsp, size_t rsp_size)
+{
+	BtAttPdu *_req = (BtAttPdu *)req;
+	uint8_t opcode = _req->pdu.opcode;
+	size_t mtu = (bearer != NULL) ? bearer->mtu : emu->mtu;
+	if (rsp_size > mtu) {
+		rsp_size = mtu;
+	}
+
+	switch (opcode) {
+	case BtAttPduOpcode::cAttOpcodeExchangeMtuRequest:
+	{
+		//J EATT の Bearer の MTU は L2CAP で決まるので Exchange MTU は使えない
+		if (bearer != NULL) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeRequestNotSupported);
+		}
+
+		uint16_t client_mtu = 0;
+		if (btAttParsePduExchangeMtuRequest(req, req_len, client_mtu) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		emu->mtu = (client_mtu < emu->link.mtu) ? client_mtu : emu->link.mtu;
+		if (emu->mtu < BT_ATT_MIN_LE_MTU) {
+			emu->mtu = BT_ATT_MIN_LE_MTU;
+		}
+		return btAttBuildPduExchangeMtuResponse(rsp, rsp_size, emu->link.mtu);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeReadByGroupTypeRequest:
+	{
+		BtAttHandleRange range;
+		BtUuid uuid;
+		if (btAttParsePduReadByGroupTypeRequest(req, req_len, range, uuid) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		if ((uuid.format != BtUuid::cBtUuid16) || (uuid.value.uuid16 != GattAttributeTypeUuid::cPrimaryService)) {
+			return _emulator_error(rsp, rsp_size, opcode, range.start, BtAttErrorCode::cAttErrorCodeUnsupportedGroupType);
+		}
+
+		uint8_t list[BT_ATT_MAX_PDU_SIZE];
+		uint16_t item_len = sizeof(BtAttHandleRange) + sizeof(BtAttUuid16);
+		uint16_t num_items = 0;
+		for (uint32_t i=0 ; i<emu->num_attributes ; ++i) {
+			BtLeEmulatorAttribute *attr = &emu->attributes[i];
+			if ((attr->handle < range.start) || (attr->handle > range.end) || (attr->type != GattAttributeTypeUuid::cPrimaryService)) {
+				continue;
+			}
+			if ((size_t)(2 + (num_items + 1) * item_len) > mtu) {
+				break;
+			}
+			uint8_t *item = &list[num_items * item_len];
+			memcpy(&item[0], &attr->handle, sizeof(BtAttHandle));
+			memcpy(&item[2], &attr->endGroupHandle, sizeof(BtAttHandle));
+			memcpy(&item[4], attr->value, sizeof(BtAttUuid16));
+			num_items++;
+		}
+		if (num_items == 0) {
+			return _emulator_error(rsp, rsp_size, opcode, range.start, BtAttErrorCode::cAttErrorCodeAttributeNotFound);
+		}
+		return btAttBuildPduReadByGroupTypeResponse(rsp, rsp_size, num_items, item_len, list);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeFindByTypeValueRequest:
+	{
+		BtAttHandleRange range;
+		uint16_t type = 0;
+		uint8_t value[BT_ATT_MAX_PDU_SIZE];
+		uint16_t value_len = 0;
+		if (btAttParsePduFindByTypeValueRequest(req, req_len, range, type, value, sizeof(value), value_len) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+
+		BtAttHandleRange found[BT_LE_EMULATOR_MAX_ATTRIBUTES];
+		uint16_t num_found = 0;
+		for (uint32_t i=0 ; i<emu->num_attributes ; ++i) {
+			BtLeEmulatorAttribute *attr = &emu->attributes[i];
+			if ((attr->handle < range.start) || (attr->handle > range.end) || (attr->type != type)) {
+				continue;
+			}
+			if ((attr->size != value_len) || (0 != memcmp(attr->value, value, value_len))) {
+				continue;
+			}
+			if ((size_t)(1 + (num_found + 1) * sizeof(BtAttHandleRange)) > mtu) {
+				break;
+			}
+			found[num_found].start = attr->handle;
+			found[num_found].end   = (type == GattAttributeTypeUuid::cPrimaryService) ? attr->endGroupHandle : attr->handle;
+			num_found++;
+		}
+		if (num_found == 0) {
+			return _emulator_error(rsp, rsp_size, opcode, range.start, BtAttErrorCode::cAttErrorCodeAttributeNotFound);
+		}
+		return btAttBuildPduFindByTypeValueResponse(rsp, rsp_size, found, num_found);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeReadByTypeRequest:
+	{
+		BtAttHandleRange range;
+		BtUuid uuid;
+		if (btAttParsePduReadByTypeRequest(req, req_len, range, uuid) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		if (uuid.format != BtUuid::cBtUuid16) {
+			return _emulator_error(rsp, rsp_size, opcode, range.start, BtAttErrorCode::cAttErrorCodeAttributeNotFound);
+		}
+
+		//J 全ての要素は最初に見つかった要素と同じ長さでなければならない
+		uint8_t list[BT_ATT_MAX_PDU_SIZE];
+		uint8_t item_len = 0;
+		uint8_t num_items = 0;
+		for (uint32_t i=0 ; i<emu->num_attributes ; ++i) {
+			BtLeEmulatorAttribute *attr = &emu->attributes[i];
+			if ((attr->handle < range.start) || (attr->handle > range.end) || (attr->type != uuid.value.uuid16)) {
+				continue;
+			}
+			size_t value_len = attr->size;
+			if (value_len > mtu - 4) {
+				value_len = mtu - 4;
+			}
+			if (value_len > 253) {
+				value_len = 253;
+			}
+			if (num_items == 0) {
+				item_len = (uint8_t)(sizeof(BtAttHandle) + value_len);
+			}
+			else if (item_len != sizeof(BtAttHandle) + value_len) {
+				break;
+			}
+			if ((size_t)(2 + (num_items + 1) * item_len) > mtu) {
+				break;
+			}
+			uint8_t *item = &list[num_items * item_len];
+			memcpy(&item[0], &attr->handle, sizeof(BtAttHandle));
+			memcpy(&item[2], attr->value, value_len);
+			num_items++;
+		}
+		if (num_items == 0) {
+			return _emulator_error(rsp, rsp_size, opcode, range.start, BtAttErrorCode::cAttErrorCodeAttributeNotFound);
+		}
+		return btAttBuildPduReadByTypeResponse(rsp, rsp_size, num_items, item_len, list);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeFindInformationRequest:
+	{
+		BtAttHandleRange range;
+		if (btAttParsePduFindInformationRequest(req, req_len, range) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+
+		BtAttHandleUuid16Pair pairs[BT_LE_EMULATOR_MAX_ATTRIBUTES];
+		uint16_t num_pairs = 0;
+		for (uint32_t i=0 ; i<emu->num_attributes ; ++i) {
+			BtLeEmulatorAttribute *attr = &emu->attributes[i];
+			if ((attr->handle < range.start) || (attr->handle > range.end)) {
+				continue;
+			}
+			if ((size_t)(2 + (num_pairs + 1) * sizeof(BtAttHandleUuid16Pair)) > mtu) {
+				break;
+			}
+			pairs[num_pairs].handle = attr->handle;
+			pairs[num_pairs].uuid   = attr->type;
+			num_pairs++;
+		}
+		if (num_pairs == 0) {
+			return _emulator_error(rsp, rsp_size, opcode, range.start, BtAttErrorCode::cAttErrorCodeAttributeNotFound);
+		}
+		return btAttBuildPduFindInformationResponse(rsp, rsp_size, 0x01, num_pairs, pairs);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeReadRequest:
+	{
+		uint16_t handle = 0;
+		if (btAttParsePduReadRequest(req, req_len, handle) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+		if (attr == NULL) {
+			return _emulator_error(rsp, rsp_size, opcode, handle, BtAttErrorCode::cAttErrorCodeInvalidHandle);
+		}
+		if ((emu->bulk.data_handle != 0) && (handle == emu->bulk.ack_handle)) {
+			emu->bulk.acked = emu->bulk.received;
+		}
+		size_t value_len = (attr->size < mtu - 1) ? attr->size : mtu - 1;
+		if (value_len == 0) {
+			rsp[0] = BtAttPduOpcode::cAttOpcodeReadResponse;
+			return 1;
+		}
+		return btAttBuildPduReadResponse(rsp, rsp_size, attr->value, (uint16_t)value_len);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeReadBlobRequest:
+	{
+		uint16_t handle = 0;
+		uint16_t offset = 0;
+		if (btAttParsePduReadBlobRequest(req, req_len, handle, offset) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+		if (attr == NULL) {
+			return _emulator_error(rsp, rsp_size, opcode, handle, BtAttErrorCode::cAttErrorCodeInvalidHandle);
+		}
+		if (offset > attr->size) {
+			return _emulator_error(rsp, rsp_size, opcode, handle, BtAttErrorCode::cAttErrorCodeInvalidOffset);
+		}
+		size_t value_len = attr->size - offset;
+		if (value_len > mtu - 1) {
+			value_len = mtu - 1;
+		}
+		return btAttBuildPduReadBlobResponse(rsp, rsp_size, &attr->value[offset], (uint16_t)value_len);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeReadMultipleRequest:
+	{
+		BtAttHandle handles[BT_ATT_MAX_PDU_SIZE / sizeof(BtAttHandle)];
+		size_t num_handles = 0;
+		if (btAttParsePduReadMultipleRequest((uint8_t *)req, req_len, handles, sizeof(handles), &num_handles) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+
+		uint8_t values[BT_ATT_MAX_PDU_SIZE];
+		size_t values_len = 0;
+		for (size_t i=0 ; i<num_handles ; ++i) {
+			BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handles[i]);
+			if (attr == NULL) {
+				return _emulator_error(rsp, rsp_size, opcode, handles[i], BtAttErrorCode::cAttErrorCodeInvalidHandle);
+			}
+			size_t copy_len = attr->size;
+			if (values_len + copy_len > mtu - 1) {
+				copy_len = mtu - 1 - values_len;
+			}
+			memcpy(&values[values_len], attr->value, copy_len);
+			values_len += copy_len;
+		}
+		if (values_len == 0) {
+			rsp[0] = BtAttPduOpcode::cAttOpcodeReadMultipleResponse;
+			return 1;
+		}
+		return btAttBuildPduReadMultipleResponse(rsp, rsp_size, values, values_len);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeReadMultipleVariableRequest:
+	{
+		BtAttHandle handles[BT_ATT_MAX_PDU_SIZE / sizeof(BtAttHandle)];
+		size_t num_handles = 0;
+		if ((btAttParsePduReadMultipleVariableRequest(req, req_len, handles, sizeof(handles), num_handles) != AKS_OK) || (num_handles < 2)) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+
+		BtAttValueSpan values[BT_ATT_MAX_PDU_SIZE / sizeof(BtAttHandle)];
+		for (size_t i=0 ; i<num_handles ; ++i) {
+			BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handles[i]);
+			if (attr == NULL) {
+				return _emulator_error(rsp, rsp_size, opcode, handles[i], BtAttErrorCode::cAttErrorCodeInvalidHandle);
+			}
+			values[i].handle    = handles[i];
+			values[i].value     = attr->value;
+			values[i].value_len = (uint16_t)attr->size;
+			values[i].length    = (uint16_t)attr->size;
+		}
+		return btAttBuildPduReadMultipleVariableResponse(rsp, (rsp_size < mtu) ? rsp_size : mtu, values, num_handles);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeWriteRequest:
+	case BtAttPduOpcode::cAttOpcodeWriteCommand:
+	{
+		if (req_len < sizeof(BtAttPdu::Pdu::opcode) + sizeof(BtAttHandle)) {
+			if (opcode == BtAttPduOpcode::cAttOpcodeWriteCommand) {
+				return 0;
+			}
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		BtAttHandle handle = _req->pdu.args.writeRequest.handle;
+		size_t value_len = req_len - sizeof(BtAttPdu::Pdu::opcode) - sizeof(BtAttHandle);
+		BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+		if (attr == NULL) {
+			if (opcode == BtAttPduOpcode::cAttOpcodeWriteCommand) {
+				return 0;
+			}
+			return _emulator_error(rsp, rsp_size, opcode, handle, BtAttErrorCode::cAttErrorCodeInvalidHandle);
+		}
+		if ((opcode == BtAttPduOpcode::cAttOpcodeWriteCommand) && (handle == emu->bulk.data_handle)) {
+			_emulator_bulk_write(emu, _req->pdu.args.writeCommand.value, value_len);
+			return 0;
+		}
+		memcpy(attr->value, _req->pdu.args.writeRequest.value, value_len);
+		attr->size = value_len;
+
+		if (opcode == BtAttPduOpcode::cAttOpcodeWriteCommand) {
+			return 0;
+		}
+		return btAttBuildPduWriteResponse(rsp, rsp_size);
+	}
+
+	case BtAttPduOpcode::cAttOpcodePrepareWriteRequest:
+	{
+		BtAttHandle handle = 0;
+		uint16_t offset = 0;
+		uint16_t value_len = 0;
+		uint8_t value[BT_ATT_MAX_PDU_SIZE];
+		if (btAttParsePduPrepareWriteRequest(req, req_len, handle, offset, value_len, value, sizeof(value)) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+		if (_emulator_find_attribute(emu, handle) == NULL) {
+			return _emulator_error(rsp, rsp_size, opcode, handle, BtAttErrorCode::cAttErrorCodeInvalidHandle);
+		}
+		if (emu->num_prepared >= emu->link.prepare_queue_size) {
+			return _emulator_error(rsp, rsp_size, opcode, handle, BtAttErrorCode::cAttErrorCodePrepareQueueFull);
+		}
+
+		BtLeEmulatorPreparedWrite *prepared = &emu->prepared[emu->num_prepared++];
+		prepared->handle = handle;
+		prepared->offset = offset;
+		prepared->size   = value_len;
+		memcpy(prepared->value, value, value_len);
+
+		return btAttBuildPduPrepareWriteResponse(rsp, rsp_size, handle, offset, value_len, value);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeExecuteWriteRequest:
+	{
+		uint16_t flags = 0;
+		if (btAttParsePduExecuteWriteRequest(req, req_len, flags) != AKS_OK) {
+			return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeInvalidPdu);
+		}
+
+		if (flags == BtAttExecuteWriteFlag::cImmediatelyWriteAllPendingPreparedValues) {
+			//J 全て検証してから書き込む
+			for (uint32_t i=0 ; i<emu->num_prepared ; ++i) {
+				BtLeEmulatorPreparedWrite *prepared = &emu->prepared[i];
+				if ((size_t)prepared->offset + prepared->size > BT_LE_EMULATOR_MAX_VALUE_SIZE) {
+					emu->num_prepared = 0;
+					return _emulator_error(rsp, rsp_size, opcode, prepared->handle, BtAttErrorCode::cAttErrorCodeINvalidAttributeValueLength);
+				}
+			}
+			for (uint32_t i=0 ; i<emu->num_prepared ; ++i) {
+				BtLeEmulatorPreparedWrite *prepared = &emu->prepared[i];
+				BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, prepared->handle);
+				memcpy(&attr->value[prepared->offset], prepared->value, prepared->size);
+				if (attr->size < (size_t)prepared->offset + prepared->size) {
+					attr->size = (size_t)prepared->offset + prepared->size;
+				}
+			}
+		}
+		emu->num_prepared = 0;
+
+		return btAttBuildPduExecuteWriteResponse(rsp, rsp_size);
+	}
+
+	case BtAttPduOpcode::cAttOpcodeSignedWriteCommand:
+	{
+		//J 署名が正しく、SignCounter が前回より進んでいるものだけ書き込む
+		uint32_t sign_count = 0;
+		if (!emu->csrk.valid ||
+			(btAttVerifyPduSignedWriteCommand(req, req_len, &emu->crypto, &emu->csrk.key, sign_count) != AKS_OK) ||
+			(emu->csrk.received && (sign_count <= emu->csrk.last_counter)))
+		{
+			emu->csrk.num_rejected++;
+			return 0;
+		}
+		emu->csrk.received     = true;
+		emu->csrk.last_counter = sign_count;
+		emu->csrk.num_signed_writes++;
+
+		BtAttHandle handle = _req->pdu.args.signedWriteCommand.handle;
+		BtLeEmulatorAttribute *attr = _emulator_find_attribute(emu, handle);
+		if (attr == NULL) {
+			return 0;
+		}
+		size_t value_len = req_len - sizeof(BtAttPdu::Pdu::opcode) - sizeof(BtAttHandle) - BT_ATT_SIGNATURE_SIZE;
+		memcpy(attr->value, _req->pdu.args.signedWriteCommand.value, value_len);
+		attr->size = value_len;
+		return 0;
+	}
+
+	case BtAttPduOpcode::cAttOpcodeHandleValueConfirmation:
+	{
+		//J 出していない Indication への Confirmation は数えるだけ
+		if (emu->indication.pending) {
+			emu->indication.pending = false;
+			(void)pthread_cond_signal(&emu->indicationCv);
+		}
+		else {
+			emu->indication.num_unexpected_confirmations++;
+		}
+		emu->indication.num_confirmations++;
+		return 0;
+	}
+
+	default:
+		//J Command はエラーを返さない
+		if (opcode & 0x40) {
+			return 0;
+		}
+		return _emulator_error(rsp, rsp_size, opcode, 0, BtAttErrorCode::cAttErrorCodeRequestNotSupported);
+	}
+}
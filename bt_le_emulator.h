@@ -0,0 +1,209 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_LE_EMULATOR_H_
+#define BT_LE_EMULATOR_H_
+
+/*
+ *J プロセス内で動作する Peripheral のエミュレータ
+ *J socketpair() の片側を btLeDeviceCreateWithSocket() に渡して使う。
+ *J Connection Interval と 1イベントあたりのパケット数をモデル化して
+ *J Response の送出タイミングを遅らせる。
+ */
+
+#define BT_LE_EMULATOR_MAX_ATTRIBUTES				(32)
+#define BT_LE_EMULATOR_MAX_VALUE_SIZE				(512)	//J ATT の Attribute Value 最大長
+#define BT_LE_EMULATOR_MAX_PREPARE_QUEUE			(32)
+#define BT_LE_EMULATOR_MAX_BEARERS					(8)		//J 追加の EATT Bearer の数
+#define BT_LE_EMULATOR_EVENT_WINDOW					(256)	//J 予約を覚えておく Connection Event の数
+
+#define BT_LE_EMULATOR_LL_PAYLOAD_DEFAULT			(27)	//J Data Length Extension 無し
+#define BT_LE_EMULATOR_LL_PAYLOAD_DLE				(251)	//J Data Length Extension 有り
+
+struct BtLeEmulatorLinkParameters
+{
+	uint32_t connection_interval_us;	//J 7500 - 4000000
+	uint16_t packets_per_event;			//J 1 Connection Event あたりの片方向 LL パケット数
+	uint16_t ll_payload_size;			//J LL Data PDU のペイロード長
+	uint16_t mtu;						//J Peripheral 側の ATT_MTU
+	uint16_t prepare_queue_size;		//J Prepare Write キューのエントリ数
+};
+
+struct BtLeEmulatorAttribute
+{
+	BtAttHandle handle;
+	BtAttUuid16 type;
+	BtAttHandle endGroupHandle;			//J Service 宣言の時のみ有効
+	size_t      size;
+	uint8_t     value[BT_LE_EMULATOR_MAX_VALUE_SIZE];
+};
+
+struct BtLeEmulatorPreparedWrite
+{
+	BtAttHandle handle;
+	uint16_t    offset;
+	uint16_t    size;
+	uint8_t     value[BT_ATT_MAX_LE_MTU];
+};
+
+//J Notification の先頭に埋め込む送信情報
+#pragma pack(1)
+struct BtLeEmulatorNotificationStamp
+{
+	uint32_t sequence;
+	uint64_t timestamp_ns;				//J CLOCK_MONOTONIC で Central に届く時刻
+};
+#pragma pack()
+
+struct BtLeEmulatorContext;
+
+//J EATT の Bearer。各 Bearer は自分のスレッドで Request を処理する
+struct BtLeEmulatorBearer
+{
+	BtLeEmulatorContext *emu;
+	int       sock;
+	uint16_t  mtu;						//J L2CAP の MTU がそのまま ATT_MTU になる
+	pthread_t thread;
+	uint64_t  num_requests;
+};
+
+struct BtLeEmulatorContext
+{
+	bool running;
+
+	int sock;							//J Peripheral 側
+	int central_sock;					//J btLeDeviceCreateWithSocket() に渡す側
+	int wake_fd;						//J btLeEmulatorStartNotification() でスレッドを起こす eventfd
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t  indicationCv;		//J Confirmation の到着を知らせる
+
+	BtLeEmulatorLinkParameters link;
+	uint16_t mtu;						//J ネゴシエーション後の ATT_MTU
+	uint64_t anchor_ns;					//J 最初の Connection Event の時刻
+
+	//J これから来る Connection Event ごとに予約済みの LL パケット数
+	struct Event {
+		uint64_t index;					//J anchor_ns から数えたイベント番号 + 1
+		uint16_t used;
+	} events[BT_LE_EMULATOR_EVENT_WINDOW];
+
+	uint32_t num_attributes;
+	BtLeEmulatorAttribute attributes[BT_LE_EMULATOR_MAX_ATTRIBUTES];
+
+	uint32_t num_bearers;
+	BtLeEmulatorBearer bearers[BT_LE_EMULATOR_MAX_BEARERS];
+
+	uint32_t num_prepared;
+	BtLeEmulatorPreparedWrite prepared[BT_LE_EMULATOR_MAX_PREPARE_QUEUE];
+
+	struct {
+		BtAttHandle handle;
+		uint64_t interval_ns;
+		uint64_t next_ns;
+		size_t   size;
+		uint32_t sequence;
+	} notify;
+
+	//J 大容量転送の受信側 (bt_bulk_transfer の相手)
+	struct {
+		BtAttHandle data_handle;
+		BtAttHandle ack_handle;
+		bool        framed;
+		uint32_t    ack_interval;		//J このバイト数ごとに ACK を Notification する
+		uint32_t    received;			//J 受信済みの連続したバイト数
+		uint32_t    notified;			//J 最後に Notification した received
+		uint32_t    acked;				//J Central に知らせた received (Notification か Read)
+		uint32_t    max_unacked;		//J acked より先に受け取ったバイト数の最大
+		uint32_t    hash;				//J 受信データの FNV-1a
+		uint64_t    num_discarded;		//J オフセット不一致で捨てた PDU の数
+		bool        ack_due;
+	} bulk;
+
+	//J Signed Write Command の検証
+	struct bt_crypto crypto;
+	struct {
+		bool            valid;
+		BtCryptoCmacKey key;
+		bool            received;		//J 一度でも受け付けたか
+		uint32_t        last_counter;	//J 最後に受け付けた SignCounter
+		uint64_t        num_signed_writes;
+		uint64_t        num_rejected;	//J 署名不一致か SignCounter の巻き戻り
+	} csrk;
+
+	struct {
+		bool     pending;				//J Confirmation 待ちの Indication がある
+		uint64_t num_indications;
+		uint64_t num_confirmations;
+		uint64_t num_unexpected_confirmations;
+	} indication;
+
+	uint64_t num_requests;
+	uint32_t num_outstanding;			//J Response をまだ返していない Request の数 (全ての Bearer)
+	uint32_t max_outstanding;			//J num_outstanding の最大
+	uint64_t num_connection_events;
+	uint64_t num_notifications;
+	uint64_t num_notifications_dropped;	//J Central が読まずに溢れた数
+};
+
+int btLeEmulatorCreate(BtLeEmulatorContext *emu, const BtLeEmulatorLinkParameters *link);
+int btLeEmulatorDestroy(BtLeEmulatorContext *emu);
+
+int btLeEmulatorAddPrimaryService(
+								BtLeEmulatorContext *emu,
+								const BtAttUuid16 uuid,
+								BtAttHandle &handle);
+int btLeEmulatorAddCharacteristic(
+								BtLeEmulatorContext *emu,
+								const BtAttUuid16 uuid,
+								const uint8_t properties,
+								const void *value,
+								const size_t size,
+								BtAttHandle &value_handle);
+int btLeEmulatorSetValue(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle handle,
+								const void *value,
+								const size_t size);
+int btLeEmulatorGetValue(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle handle,
+								void *buf,
+								const size_t buf_size,
+								size_t &size);
+
+int btLeEmulatorStartNotification(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle value_handle,
+								const uint32_t rate_hz,
+								const size_t size);
+int btLeEmulatorStopNotification(BtLeEmulatorContext *emu);
+int btLeEmulatorNotifyValues(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle *handles,
+								const size_t num_handles);
+int btLeEmulatorIndicateValue(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle handle,
+								const uint32_t timeout_ms);
+
+int btLeEmulatorSetBulkSink(
+								BtLeEmulatorContext *emu,
+								const BtAttHandle data_handle,
+								const BtAttHandle ack_handle,
+								const bool framed,
+								const uint32_t ack_interval);
+
+int btLeEmulatorSetCsrk(
+								BtLeEmulatorContext *emu,
+								const uint8_t csrk[BT_CRYPTO_KEY_SIZE]);
+
+int btLeEmulatorAddBearer(BtLeEmulatorContext *emu, const uint16_t mtu, int &central_sock);
+
+int btLeEmulatorStart(BtLeEmulatorContext *emu);
+int btLeEmulatorGetCentralSocket(BtLeEmulatorContext *emu);
+
+#endif/*BT_LE_EMULATOR_H_*/
@@ -0,0 +1,649 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_gatt.h"
+#include "bt_le_device.h"
+#include "bt_util.h"
+#include "bt_le_managed_device.h"
+
+//J 切断前の登録 (張り直した後で戻す)
+struct BtLeManagedDeviceSnapshot
+{
+	int num_notification;
+	BtGattNotificationContext notification_list[BT_LE_DEVICE_MAX_NOTIFICATION];
+
+	bool     csrk_valid;
+	uint8_t  csrk[BT_CRYPTO_KEY_SIZE];
+	uint32_t sign_counter;
+};
+
+static void *_managed_thread_func(void *arg);
+static void _managed_destroy_ctx(BtLeManagedDevice *dev);
+
+
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceInitOptions(BtLeManagedDeviceOptions *options)
+{
+	if (options == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(options, 0x00, sizeof(BtLeManagedDeviceOptions));
+	options->backoff_initial_ms   = BT_LE_MANAGED_DEVICE_DEFAULT_BACKOFF_MS;
+	options->backoff_max_ms       = BT_LE_MANAGED_DEVICE_DEFAULT_BACKOFF_MAX_MS;
+	options->connect_timeout_ms   = BT_LE_MANAGED_DEVICE_DEFAULT_TIMEOUT_MS;
+	options->verify_database_hash = true;
+
+	return btLeDeviceInitOptions(&options->device);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceStart(BtLeManagedDevice *dev, const char *btaddr, const BtLeManagedDeviceOptions *options)
+{
+	if ((dev == NULL) || (btaddr == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (strlen(btaddr) >= sizeof(dev->btaddr)) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(dev, 0x00, sizeof(BtLeManagedDevice));
+	strcpy(dev->btaddr, btaddr);
+	if (options != NULL) {
+		dev->options = *options;
+	}
+	else {
+		(void)btLeManagedDeviceInitOptions(&dev->options);
+	}
+	if (dev->options.backoff_initial_ms == 0) {
+		return AKS_ERROR_INVALID;
+	}
+	if (dev->options.backoff_max_ms < dev->options.backoff_initial_ms) {
+		dev->options.backoff_max_ms = dev->options.backoff_initial_ms;
+	}
+
+	//J Jitter が Peripheral ごとに別の系列になるように Address を混ぜる
+	dev->rng = btUtilGetMonotonicTimeNs();
+	for (const char *p=btaddr ; *p != '\0' ; ++p) {
+		dev->rng = (dev->rng ^ (uint8_t)*p) * 0x100000001B3ULL;
+	}
+	dev->rng |= 1;
+
+	(void)btUtilHistogramReset(&dev->stats.recovery_us);
+
+	dev->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (dev->wake_fd < 0) {
+		return -errno;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dev->cv, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_rwlock_init(&dev->ctxLock, NULL);
+
+	dev->state   = BtLeManagedDeviceState::cConnecting;
+	dev->running = true;
+
+	int ret = pthread_create(&dev->thread, NULL, _managed_thread_func, (void *)dev);
+	if (ret != 0) {
+		dev->running = false;
+		dev->state   = BtLeManagedDeviceState::cStopped;
+		pthread_rwlock_destroy(&dev->ctxLock);
+		pthread_mutex_destroy(&dev->mutex);
+		pthread_cond_destroy(&dev->cv);
+		close(dev->wake_fd);
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceStop(BtLeManagedDevice *dev)
+{
+	if (dev == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!dev->running) {
+		return AKS_ERROR_INVALID;
+	}
+
+	uint64_t one = 1;
+	pthread_mutex_lock(&dev->mutex);
+	dev->stopping = true;
+	pthread_cond_broadcast(&dev->cv);
+	pthread_mutex_unlock(&dev->mutex);
+	(void)write(dev->wake_fd, &one, sizeof(one));
+
+	pthread_join(dev->thread, NULL);
+	dev->running = false;
+
+	pthread_rwlock_wrlock(&dev->ctxLock);
+	_managed_destroy_ctx(dev);
+	pthread_rwlock_unlock(&dev->ctxLock);
+
+	pthread_rwlock_destroy(&dev->ctxLock);
+	pthread_mutex_destroy(&dev->mutex);
+	pthread_cond_destroy(&dev->cv);
+	close(dev->wake_fd);
+	dev->wake_fd = -1;
+	dev->state   = BtLeManagedDeviceState::cStopped;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool _managed_usable(uint8_t state)
+{
+	return (state == BtLeManagedDeviceState::cConnected) || (state == BtLeManagedDeviceState::cDatabaseChanged);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J ctxLock を Write で持って呼ぶ。受信スレッドの Callback が btLeManagedDeviceAcquire() で
+//J 待っていると btLeDeviceDestroy() は AKS_ERROR_TIMEOUT で何も壊さずに戻るので、
+//J 一度 ctxLock を放して Callback を通してから (Shutdown 済みなので AKS_ERROR_IO で戻る) 呼び直す
+/*---------------------------------------------------------------------------*/
+static void _managed_destroy_ctx(BtLeManagedDevice *dev)
+{
+	while (btLeDeviceDestroy(&dev->ctx) == (int)AKS_ERROR_TIMEOUT) {
+		pthread_rwlock_unlock(&dev->ctxLock);
+		sched_yield();
+		pthread_rwlock_wrlock(&dev->ctxLock);
+	}
+	memset(&dev->ctx, 0x00, sizeof(dev->ctx));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _managed_deadline(struct timespec &deadline, uint32_t timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceWaitConnected(BtLeManagedDevice *dev, const uint32_t timeout_ms)
+{
+	if (dev == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!dev->running) {
+		return AKS_ERROR_INVALID;
+	}
+
+	struct timespec deadline;
+	_managed_deadline(deadline, timeout_ms);
+
+	int ret = AKS_OK;
+	pthread_mutex_lock(&dev->mutex);
+	while (!_managed_usable(dev->state)) {
+		if (dev->state == BtLeManagedDeviceState::cStopped) {
+			ret = AKS_ERROR_INVALID;
+			break;
+		}
+		if (pthread_cond_timedwait(&dev->cv, &dev->mutex, &deadline) == ETIMEDOUT) {
+			ret = AKS_ERROR_TIMEOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 使える時だけ ctx を返す。AKS_OK の時は必ず btLeManagedDeviceRelease() する
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceAcquire(BtLeManagedDevice *dev, BtGattDeviceContext **ctx)
+{
+	if ((dev == NULL) || (ctx == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (!dev->running) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_rwlock_rdlock(&dev->ctxLock);
+	if ((!_managed_usable(__atomic_load_n(&dev->state, __ATOMIC_ACQUIRE))) || (!btLeDeviceIsConnected(&dev->ctx))) {
+		pthread_rwlock_unlock(&dev->ctxLock);
+		return AKS_ERROR_IO;
+	}
+
+	*ctx = &dev->ctx;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceRelease(BtLeManagedDevice *dev)
+{
+	if (dev == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_rwlock_unlock(&dev->ctxLock);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+uint8_t btLeManagedDeviceGetState(BtLeManagedDevice *dev)
+{
+	if (dev == NULL) {
+		return BtLeManagedDeviceState::cStopped;
+	}
+
+	return __atomic_load_n(&dev->state, __ATOMIC_ACQUIRE);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeManagedDeviceGetStatistics(BtLeManagedDevice *dev, BtLeManagedDeviceStatistics *stats)
+{
+	if ((dev == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	*stats = dev->stats;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _managed_set_state(BtLeManagedDevice *dev, uint8_t state, int reason)
+{
+	pthread_mutex_lock(&dev->mutex);
+	__atomic_store_n(&dev->state, state, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&dev->cv);
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (dev->options.state_cb != NULL) {
+		dev->options.state_cb(dev->options.arg, state, reason);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 受信スレッドから呼ばれる
+/*---------------------------------------------------------------------------*/
+static void _managed_disconnect_cb(void *arg, BtGattDeviceContext *ctx, int reason)
+{
+	BtLeManagedDevice *dev = (BtLeManagedDevice *)arg;
+	(void)ctx;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->link_down         = true;
+	dev->disconnect_reason = reason;
+	pthread_cond_broadcast(&dev->cv);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Equal Jitter の指数 Backoff (ms)
+/*---------------------------------------------------------------------------*/
+static uint32_t _managed_backoff_ms(BtLeManagedDevice *dev, uint32_t attempt)
+{
+	uint64_t base = dev->options.backoff_initial_ms;
+	while ((attempt > 0) && (base < dev->options.backoff_max_ms)) {
+		base <<= 1;
+		attempt--;
+	}
+	if (base > dev->options.backoff_max_ms) {
+		base = dev->options.backoff_max_ms;
+	}
+
+	dev->rng ^= dev->rng << 13;
+	dev->rng ^= dev->rng >> 7;
+	dev->rng ^= dev->rng << 17;
+
+	uint64_t half = base / 2;
+	return (uint32_t)(half + dev->rng % (base - half + 1));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Backoff の間待つ。Stop されたら false
+/*---------------------------------------------------------------------------*/
+static bool _managed_sleep(BtLeManagedDevice *dev, uint32_t delay_ms)
+{
+	struct timespec deadline;
+	_managed_deadline(deadline, delay_ms);
+
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->stopping) {
+		if (pthread_cond_timedwait(&dev->cv, &dev->mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	bool stopping = dev->stopping;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return !stopping;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Non-Blocking で connect() して connect_timeout_ms まで待つ
+/*---------------------------------------------------------------------------*/
+static int _managed_open_socket(BtLeManagedDevice *dev)
+{
+	int sock;
+	if (dev->options.open != NULL) {
+		sock = dev->options.open(dev->options.open_arg, dev->btaddr, &dev->options.device);
+	}
+	else {
+		sock = btLeDeviceOpenAttSocket(dev->btaddr, &dev->options.device);
+	}
+	if (sock < 0) {
+		return sock;
+	}
+
+	struct pollfd pfds[2];
+	pfds[0].fd     = sock;
+	pfds[0].events = POLLOUT;
+	pfds[1].fd     = dev->wake_fd;
+	pfds[1].events = POLLIN;
+
+	int timeout_ms = (dev->options.connect_timeout_ms == 0) ? -1 : (int)dev->options.connect_timeout_ms;
+	int ret;
+	do {
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		ret = poll(pfds, 2, timeout_ms);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret <= 0) {
+		ret = (ret == 0) ? AKS_ERROR_TIMEOUT : -errno;
+		close(sock);
+		return ret;
+	}
+	if (pfds[1].revents != 0) {
+		close(sock);
+		return AKS_ERROR_CANCELED;
+	}
+
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (void *)&error, &len) < 0) {
+		error = errno;
+	}
+	if (error != 0) {
+		close(sock);
+		return -error;
+	}
+
+	int flags = fcntl(sock, F_GETFL);
+	if ((flags < 0) || (fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+		ret = -errno;
+		close(sock);
+		return ret;
+	}
+
+	return sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Database Hash を読んで前回と比べる。読めない Server では比べない
+/*---------------------------------------------------------------------------*/
+static bool _managed_database_changed(BtLeManagedDevice *dev)
+{
+	BtUuid uuid;
+	memset(&uuid, 0x00, sizeof(uuid));
+	uuid.format       = BtUuid::cBtUuid16;
+	uuid.value.uuid16 = GattCharacteristicTypeUuid::cDatabaseHash;
+
+	BtAttHandle handle;
+	uint8_t hash[BT_ATT_MAX_LE_MTU];
+	size_t hash_len = 0;
+	int ret = BtGattCharacteristicValueRead::btGattReadUsingCharacteristicUuid(dev->ctx, uuid, handle, hash, sizeof(hash), hash_len);
+	if ((ret != AKS_OK) || (dev->ctx.read_error != AKS_OK) || (hash_len != BT_LE_MANAGED_DEVICE_DATABASE_HASH_SIZE)) {
+		dev->have_database_hash = false;
+		return false;
+	}
+
+	bool changed = dev->have_database_hash && (memcmp(dev->database_hash, hash, BT_LE_MANAGED_DEVICE_DATABASE_HASH_SIZE) != 0);
+	memcpy(dev->database_hash, hash, BT_LE_MANAGED_DEVICE_DATABASE_HASH_SIZE);
+	dev->have_database_hash = true;
+
+	return changed;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _managed_restore(BtLeManagedDevice *dev, const BtLeManagedDeviceSnapshot *snapshot, bool database_changed)
+{
+	BtGattDeviceContext *ctx = &dev->ctx;
+
+	if (snapshot->csrk_valid) {
+		int ret = btLeDeviceSetCsrk(ctx, snapshot->csrk, snapshot->sign_counter);
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	//J Handle が変わっているかもしれないので CCCD は書かない
+	if (database_changed) {
+		return AKS_OK;
+	}
+
+	for (int i=0 ; i<snapshot->num_notification ; ++i) {
+		const BtGattNotificationContext *n = &snapshot->notification_list[i];
+		int ret;
+		if (n->indication) {
+			if (n->cb != NULL) {
+				ret = btLeDeviceRegistIndicationCallback(ctx, n->config_handle, n->value_handle, n->cb);
+			}
+			else {
+				ret = btLeDeviceRegistIndicationCallbackWithArg(ctx, n->config_handle, n->value_handle, n->arg_cb, n->arg, n->confirm);
+			}
+		}
+		else {
+			if (n->cb != NULL) {
+				ret = btLeDeviceRegistNotificationCallback(ctx, n->config_handle, n->value_handle, n->cb);
+			}
+			else {
+				ret = btLeDeviceRegistNotificationCallbackWithArg(ctx, n->config_handle, n->value_handle, n->arg_cb, n->arg);
+			}
+		}
+		if (ret != AKS_OK) {
+			return ret;
+		}
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 接続して BtGattDeviceContext を作り、snapshot があれば登録を戻す
+/*---------------------------------------------------------------------------*/
+static int _managed_connect(BtLeManagedDevice *dev, const BtLeManagedDeviceSnapshot *snapshot, bool &database_changed)
+{
+	database_changed = false;
+
+	int sock = _managed_open_socket(dev);
+	if (sock < 0) {
+		return sock;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->link_down = false;
+	pthread_mutex_unlock(&dev->mutex);
+
+	pthread_rwlock_wrlock(&dev->ctxLock);
+
+	int ret = btLeDeviceCreateWithSocket(&dev->ctx, sock, &dev->options.device);
+	if (ret != AKS_OK) {
+		pthread_rwlock_unlock(&dev->ctxLock);
+		close(sock);
+		return ret;
+	}
+	(void)btLeDeviceSetDisconnectCallback(&dev->ctx, _managed_disconnect_cb, dev);
+
+	if (dev->options.verify_database_hash) {
+		database_changed = _managed_database_changed(dev);
+	}
+	if (snapshot != NULL) {
+		ret = _managed_restore(dev, snapshot, database_changed);
+		if (ret != AKS_OK) {
+			_managed_destroy_ctx(dev);
+			pthread_rwlock_unlock(&dev->ctxLock);
+
+			pthread_mutex_lock(&dev->mutex);
+			dev->stats.restore_failures++;
+			pthread_mutex_unlock(&dev->mutex);
+			return ret;
+		}
+	}
+
+	pthread_rwlock_unlock(&dev->ctxLock);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 切れた BtGattDeviceContext から登録を写し取ってから片付ける
+/*---------------------------------------------------------------------------*/
+static void _managed_teardown(BtLeManagedDevice *dev, BtLeManagedDeviceSnapshot *snapshot)
+{
+	pthread_rwlock_wrlock(&dev->ctxLock);
+
+	BtGattDeviceContext *ctx = &dev->ctx;
+	snapshot->num_notification = ctx->num_notification;
+	memcpy(snapshot->notification_list, ctx->notification_list, sizeof(snapshot->notification_list));
+	snapshot->csrk_valid = ctx->csrk.valid;
+	if (ctx->csrk.valid) {
+		memcpy(snapshot->csrk, ctx->csrk.raw, sizeof(snapshot->csrk));
+		snapshot->sign_counter = __atomic_load_n(&ctx->csrk.counter, __ATOMIC_RELAXED);
+	}
+
+	_managed_destroy_ctx(dev);
+
+	pthread_rwlock_unlock(&dev->ctxLock);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void *_managed_thread_func(void *arg)
+{
+	BtLeManagedDevice *dev = (BtLeManagedDevice *)arg;
+	BtLeManagedDeviceSnapshot snapshot;
+	bool     have_snapshot = false;
+	uint32_t attempt = 0;
+	uint64_t lost_ns = 0;
+
+	memset(&snapshot, 0x00, sizeof(snapshot));
+
+	while (1) {
+		//J 最初の接続だけはすぐに試す
+		if ((have_snapshot || (attempt > 0)) && (!_managed_sleep(dev, _managed_backoff_ms(dev, attempt)))) {
+			break;
+		}
+		if (__atomic_load_n(&dev->stopping, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		bool database_changed = false;
+		int ret = _managed_connect(dev, have_snapshot ? &snapshot : NULL, database_changed);
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.attempts++;
+		if (ret != AKS_OK) {
+			dev->stats.failed_attempts++;
+		}
+		pthread_mutex_unlock(&dev->mutex);
+
+		if (ret != AKS_OK) {
+			attempt++;
+			if ((dev->options.max_attempts != 0) && (attempt >= dev->options.max_attempts)) {
+				_managed_set_state(dev, BtLeManagedDeviceState::cStopped, ret);
+				break;
+			}
+			continue;
+		}
+		attempt = 0;
+
+		if (have_snapshot) {
+			uint64_t recovery_ns = btUtilGetMonotonicTimeNs() - lost_ns;
+			pthread_mutex_lock(&dev->mutex);
+			dev->stats.reconnects++;
+			dev->stats.last_recovery_ns = recovery_ns;
+			(void)btUtilHistogramRecord(&dev->stats.recovery_us, recovery_ns / 1000);
+			if (database_changed) {
+				dev->stats.database_changes++;
+			}
+			pthread_mutex_unlock(&dev->mutex);
+		}
+
+		_managed_set_state(dev, database_changed ? BtLeManagedDeviceState::cDatabaseChanged : BtLeManagedDeviceState::cConnected, AKS_OK);
+
+		//J 切断か Stop を待つ
+		pthread_mutex_lock(&dev->mutex);
+		while ((!dev->link_down) && (!dev->stopping)) {
+			pthread_cond_wait(&dev->cv, &dev->mutex);
+		}
+		bool stopping = dev->stopping;
+		int  reason   = dev->disconnect_reason;
+		if (!stopping) {
+			dev->link_down = false;
+			dev->stats.disconnects++;
+		}
+		pthread_mutex_unlock(&dev->mutex);
+
+		if (stopping) {
+			break;
+		}
+
+		lost_ns = btUtilGetMonotonicTimeNs();
+		_managed_set_state(dev, BtLeManagedDeviceState::cConnecting, reason);
+		_managed_teardown(dev, &snapshot);
+		have_snapshot = true;
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
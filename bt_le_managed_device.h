@@ -0,0 +1,107 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_LE_MANAGED_DEVICE_H_
+#define BT_LE_MANAGED_DEVICE_H_
+
+/*
+ *J 切断されたら自動で張り直す BtGattDeviceContext
+ *J
+ *J 監視スレッドが btLeDeviceSetDisconnectCallback() で切断を知り、
+ *J Jitter 付きの指数 Backoff で張り直す (Equal Jitter: 待ち時間は
+ *J base/2 + rand(0, base/2)。同時に切れた多数の Peripheral が同じ瞬間に
+ *J 張り直しに来ないようにする)。
+ *J
+ *J 張り直した後で、切れる前の ATT_MTU の要求、CSRK と SignCounter、
+ *J Notification / Indication の登録 (CCCD の書き込み) を戻す。
+ *J verify_database_hash なら Database Hash を比べ、変わっていれば
+ *J アプリが持っている Handle は使えないので登録は戻さず cDatabaseChanged にする。
+ *J
+ *J BtGattDeviceContext は張り直す時に作り直すので、使う間は
+ *J btLeManagedDeviceAcquire() / btLeManagedDeviceRelease() で挟む。
+ */
+
+#define BT_LE_MANAGED_DEVICE_DEFAULT_BACKOFF_MS		(250)
+#define BT_LE_MANAGED_DEVICE_DEFAULT_BACKOFF_MAX_MS	(30000)
+#define BT_LE_MANAGED_DEVICE_DEFAULT_TIMEOUT_MS		(10000)
+#define BT_LE_MANAGED_DEVICE_DATABASE_HASH_SIZE		(16)
+
+struct BtLeManagedDeviceState {
+	static const uint8_t cStopped					= 0x00;
+	static const uint8_t cConnecting				= 0x01;	//J Backoff で待っている間も含む
+	static const uint8_t cConnected					= 0x02;
+	static const uint8_t cDatabaseChanged			= 0x03;	//J 接続しているが登録は戻していない
+};
+
+typedef void (*BtLeManagedDeviceStateCb)(void *arg, uint8_t state, int reason);
+
+//J btLeDeviceOpenAttSocket() の代わりに接続を始める。Non-Blocking の Socket か -errno を返す
+typedef int (*BtLeManagedDeviceOpenCb)(void *arg, const char *btaddr, const BtLeDeviceOptions *options);
+
+struct BtLeManagedDeviceOptions
+{
+	BtLeDeviceOptions device;
+	uint32_t backoff_initial_ms;
+	uint32_t backoff_max_ms;
+	uint32_t connect_timeout_ms;	//J 1回の connect() の期限
+	uint32_t max_attempts;			//J 0 なら諦めない
+	bool     verify_database_hash;
+
+	BtLeManagedDeviceStateCb state_cb;	//J 監視スレッドから呼ぶ
+	void *arg;
+
+	BtLeManagedDeviceOpenCb open;		//J NULL なら btLeDeviceOpenAttSocket()
+	void *open_arg;
+};
+
+struct BtLeManagedDeviceStatistics
+{
+	uint64_t disconnects;
+	uint64_t reconnects;			//J 張り直して登録まで戻せた回数
+	uint64_t attempts;				//J connect() を試した回数
+	uint64_t failed_attempts;
+	uint64_t restore_failures;		//J 接続できたが戻せずに切った回数
+	uint64_t database_changes;
+	uint64_t last_recovery_ns;		//J 切断を知ってから戻し終えるまで
+	BtUtilHistogram recovery_us;	//J 同じく us 単位の分布
+};
+
+struct BtLeManagedDevice
+{
+	char btaddr[18];
+	BtLeManagedDeviceOptions options;
+
+	BtGattDeviceContext ctx;
+	pthread_rwlock_t ctxLock;		//J アプリは Read、監視スレッドは作り直す時に Write
+
+	pthread_t       thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cv;				//J CLOCK_MONOTONIC
+	int      wake_fd;				//J 接続待ちの poll() を止める eventfd
+	bool     running;
+	bool     stopping;
+	bool     link_down;				//J Callback が立て、監視スレッドが下ろす
+	int      disconnect_reason;
+	uint8_t  state;					//J BtLeManagedDeviceState
+	uint64_t rng;					//J Jitter 用 (xorshift64)
+
+	//J 張り直した時に戻すもの
+	bool     have_database_hash;
+	uint8_t  database_hash[BT_LE_MANAGED_DEVICE_DATABASE_HASH_SIZE];
+
+	BtLeManagedDeviceStatistics stats;
+};
+
+int btLeManagedDeviceInitOptions(BtLeManagedDeviceOptions *options);
+int btLeManagedDeviceStart(BtLeManagedDevice *dev, const char *btaddr, const BtLeManagedDeviceOptions *options);
+int btLeManagedDeviceStop(BtLeManagedDevice *dev);
+int btLeManagedDeviceWaitConnected(BtLeManagedDevice *dev, const uint32_t timeout_ms);
+int btLeManagedDeviceAcquire(BtLeManagedDevice *dev, BtGattDeviceContext **ctx);
+int btLeManagedDeviceRelease(BtLeManagedDevice *dev);
+uint8_t btLeManagedDeviceGetState(BtLeManagedDevice *dev);
+int btLeManagedDeviceGetStatistics(BtLeManagedDevice *dev, BtLeManagedDeviceStatistics *stats);
+
+#endif/*BT_LE_MANAGED_DEVICE_H_*/
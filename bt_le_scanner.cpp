@@ -0,0 +1,688 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_le_scanner.h"
+
+#define BT_LE_SCANNER_RING_MASK						(BT_LE_SCANNER_RING_SLOTS - 1)
+#define BT_LE_SCANNER_H4_HEADER_SIZE				(HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE)
+#define BT_LE_SCANNER_REPLAY_BUFFER					(16 * 1024)
+
+//J LE Meta Event の Subevent
+#define BT_LE_SCANNER_SUBEVENT_ADVERTISING_REPORT			(0x02)
+#define BT_LE_SCANNER_SUBEVENT_EXTENDED_ADVERTISING_REPORT	(0x0D)
+
+//J 1 Report の固定長部分
+#define BT_LE_SCANNER_LEGACY_REPORT_SIZE			(1 + 1 + 6 + 1 + 1)		//J + data + RSSI
+#define BT_LE_SCANNER_EXTENDED_REPORT_SIZE			(2 + 1 + 6 + 1 + 1 + 1 + 1 + 1 + 2 + 1 + 6 + 1)
+
+
+static void *_scanner_thread_func(void *arg);
+static void *_scanner_replay_thread_func(void *arg);
+
+
+/*---------------------------------------------------------------------------*/
+int btLeScannerInitOptions(BtLeScannerOptions *options)
+{
+	if (options == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(options, 0, sizeof(BtLeScannerOptions));
+	options->dev_id            = 0;
+	options->scan_type         = BtLeScanType::cPassive;
+	options->interval          = 0x0010;	//J 10ms
+	options->window            = 0x0010;	//J 常に受信する
+	options->own_address_type  = 0x00;
+	options->filter_duplicates = 0x00;		//J RSSI を追うので重複も受ける
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _scanner_init(BtLeScannerContext *scanner, int dd, bool replay)
+{
+	//J リングは大きいのでヘッダ部分だけ初期化する
+	memset(scanner, 0, offsetof(BtLeScannerContext, ring));
+	scanner->dd     = dd;
+	scanner->replay = replay;
+
+	scanner->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (scanner->wake_fd < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	//J btLeScannerPoll() の timeout を CLOCK_MONOTONIC で測る
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&scanner->mutex, NULL);
+	pthread_cond_init(&scanner->cv, &attr);
+	pthread_condattr_destroy(&attr);
+
+	scanner->running = true;
+	int ret = pthread_create(
+						&scanner->thread,
+						NULL,
+						replay ? _scanner_replay_thread_func : _scanner_thread_func,
+						scanner);
+	if (ret != 0) {
+		scanner->running = false;
+		pthread_cond_destroy(&scanner->cv);
+		pthread_mutex_destroy(&scanner->mutex);
+		close(scanner->wake_fd);
+		return AKS_ERROR_IO;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeScannerCreate(BtLeScannerContext *scanner, const BtLeScannerOptions *options)
+{
+	if (scanner == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	BtLeScannerOptions default_options;
+	if (options == NULL) {
+		btLeScannerInitOptions(&default_options);
+		options = &default_options;
+	}
+
+	int dd = hci_open_dev(options->dev_id);
+	if (dd < 0) {
+		return AKS_ERROR_IO;
+	}
+
+	//J 受信スレッドが遅れた時にカーネルで捨てられないよう大きくしておく
+	int rcvbuf = BT_LE_SCANNER_RCVBUF;
+	(void)setsockopt(dd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if ((hci_le_set_scan_parameters(dd, options->scan_type, htobs(options->interval), htobs(options->window), options->own_address_type, 0x00, 1000) < 0) ||
+		(hci_le_set_scan_enable(dd, 0x01, options->filter_duplicates, 1000) < 0)) {
+		hci_close_dev(dd);
+		return AKS_ERROR_IO;
+	}
+
+	//J hci_send_req() が Filter を戻すので、コマンドを送り終えてから設定する
+	struct hci_filter filter;
+	hci_filter_clear(&filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+	hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0) {
+		(void)hci_le_set_scan_enable(dd, 0x00, 0x00, 1000);
+		hci_close_dev(dd);
+		return AKS_ERROR_IO;
+	}
+
+	int ret = _scanner_init(scanner, dd, false);
+	if (ret != AKS_OK) {
+		(void)hci_le_set_scan_enable(dd, 0x00, 0x00, 1000);
+		hci_close_dev(dd);
+		return ret;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J fd は btLeScannerDestroy() では閉じない
+/*---------------------------------------------------------------------------*/
+int btLeScannerCreateReplay(BtLeScannerContext *scanner, int fd)
+{
+	if (scanner == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (fd < 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	return _scanner_init(scanner, fd, true);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeScannerDestroy(BtLeScannerContext *scanner)
+{
+	if (scanner == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (!scanner->running) {
+		return AKS_ERROR_INVALID;
+	}
+
+	uint64_t one = 1;
+	__atomic_store_n(&scanner->running, false, __ATOMIC_RELEASE);
+	(void)write(scanner->wake_fd, &one, sizeof(one));
+
+	//J リングが空くのを待っている Replay スレッドも起こす
+	pthread_mutex_lock(&scanner->mutex);
+	pthread_cond_broadcast(&scanner->cv);
+	pthread_mutex_unlock(&scanner->mutex);
+
+	pthread_join(scanner->thread, NULL);
+
+	if (!scanner->replay) {
+		(void)hci_le_set_scan_enable(scanner->dd, 0x00, 0x00, 1000);
+		hci_close_dev(scanner->dd);
+	}
+	scanner->dd = -1;
+
+	close(scanner->wake_fd);
+	scanner->wake_fd = -1;
+	pthread_cond_destroy(&scanner->cv);
+	pthread_mutex_destroy(&scanner->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 受信スレッドから呼ぶ。待っている btLeScannerPoll() がいれば起こす
+/*---------------------------------------------------------------------------*/
+static void _scanner_publish(BtLeScannerContext *scanner, uint64_t head)
+{
+	__atomic_store_n(&scanner->head, head, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&scanner->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&scanner->mutex);
+		pthread_cond_signal(&scanner->cv);
+		pthread_mutex_unlock(&scanner->mutex);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _scanner_finish(BtLeScannerContext *scanner)
+{
+	pthread_mutex_lock(&scanner->mutex);
+	__atomic_store_n(&scanner->finished, true, __ATOMIC_RELEASE);
+	pthread_cond_signal(&scanner->cv);
+	pthread_mutex_unlock(&scanner->mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J HCI Socket から空いているスロットに直接読み込む。解析はしない
+/*---------------------------------------------------------------------------*/
+static void *_scanner_thread_func(void *arg)
+{
+	BtLeScannerContext *scanner = (BtLeScannerContext *)arg;
+
+	struct pollfd pfds[2];
+	pfds[0].fd     = scanner->dd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd     = scanner->wake_fd;
+	pfds[1].events = POLLIN;
+
+	struct mmsghdr msgs[BT_LE_SCANNER_MAX_BATCH];
+	struct iovec   iov[BT_LE_SCANNER_MAX_BATCH];
+	uint8_t        discard[BT_LE_SCANNER_SLOT_SIZE];
+
+	uint64_t head = scanner->head;
+	while (__atomic_load_n(&scanner->running, __ATOMIC_ACQUIRE)) {
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		int ret = poll(pfds, 2, -1);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pfds[1].revents != 0) {
+			break;
+		}
+		if (pfds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			break;
+		}
+
+		uint64_t tail = __atomic_load_n(&scanner->tail, __ATOMIC_ACQUIRE);
+		uint32_t space = BT_LE_SCANNER_RING_SLOTS - (uint32_t)(head - tail);
+		uint32_t index = (uint32_t)(head & BT_LE_SCANNER_RING_MASK);
+		uint32_t num = space;
+		if (num > BT_LE_SCANNER_RING_SLOTS - index) {
+			num = BT_LE_SCANNER_RING_SLOTS - index;
+		}
+		if (num > BT_LE_SCANNER_MAX_BATCH) {
+			num = BT_LE_SCANNER_MAX_BATCH;
+		}
+
+		memset(msgs, 0, sizeof(msgs));
+		if (num == 0) {
+			//J リングが一杯なので読み捨てる (カーネルに溜めると古い Report ばかりになる)
+			num = BT_LE_SCANNER_MAX_BATCH;
+			for (uint32_t i=0 ; i<num ; ++i) {
+				iov[i].iov_base = discard;
+				iov[i].iov_len  = sizeof(discard);
+				msgs[i].msg_hdr.msg_iov    = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			ret = recvmmsg(scanner->dd, msgs, num, MSG_DONTWAIT, NULL);
+			__atomic_fetch_add(&scanner->stats.syscalls, 1, __ATOMIC_RELAXED);
+			if (ret > 0) {
+				__atomic_fetch_add(&scanner->stats.dropped, (uint64_t)ret, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+
+		for (uint32_t i=0 ; i<num ; ++i) {
+			iov[i].iov_base = scanner->ring[index + i].data;
+			iov[i].iov_len  = BT_LE_SCANNER_SLOT_SIZE;
+			msgs[i].msg_hdr.msg_iov    = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = recvmmsg(scanner->dd, msgs, num, MSG_DONTWAIT, NULL);
+		__atomic_fetch_add(&scanner->stats.syscalls, 1, __ATOMIC_RELAXED);
+		if (ret < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				continue;
+			}
+			break;
+		}
+
+		uint64_t now_ns = btUtilGetMonotonicTimeNs();
+		for (int i=0 ; i<ret ; ++i) {
+			scanner->ring[index + i].timestamp_ns = now_ns;
+			scanner->ring[index + i].len          = (uint16_t)msgs[i].msg_len;
+		}
+		head += (uint64_t)ret;
+
+		__atomic_fetch_add(&scanner->stats.events, (uint64_t)ret, __ATOMIC_RELAXED);
+		if ((uint32_t)ret > scanner->stats.max_batch) {
+			__atomic_store_n(&scanner->stats.max_batch, (uint32_t)ret, __ATOMIC_RELAXED);
+		}
+
+		_scanner_publish(scanner, head);
+	}
+
+	_scanner_finish(scanner);
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 記録された H4 の Event 列を読んでリングに流す
+//J 再現性のため、リングが一杯なら捨てずに空くのを待つ
+//J pipe や FIFO は書き手が止まると read() が戻らないので、wake_fd と一緒に poll してから読む
+/*---------------------------------------------------------------------------*/
+static void *_scanner_replay_thread_func(void *arg)
+{
+	BtLeScannerContext *scanner = (BtLeScannerContext *)arg;
+
+	struct pollfd pfds[2];
+	pfds[0].fd     = scanner->dd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd     = scanner->wake_fd;
+	pfds[1].events = POLLIN;
+
+	uint8_t buf[BT_LE_SCANNER_REPLAY_BUFFER];
+	size_t  filled = 0;
+	bool    eof = false;
+	bool    ring_full = false;
+
+	uint64_t head = scanner->head;
+	while (__atomic_load_n(&scanner->running, __ATOMIC_ACQUIRE)) {
+		if (!eof && (filled < sizeof(buf))) {
+			//J リングが空くのを待っている間は、読めるものが無くても buf に残った Event を流しに戻る
+			pfds[0].revents = 0;
+			pfds[1].revents = 0;
+			int ret = poll(pfds, 2, ring_full ? 0 : -1);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if (pfds[1].revents != 0) {
+				break;
+			}
+			//J POLLHUP は書き手が閉じただけなので、残りを read() して EOF を見る
+			if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+				break;
+			}
+
+			if (pfds[0].revents != 0) {
+				ssize_t size = read(scanner->dd, buf + filled, sizeof(buf) - filled);
+				__atomic_fetch_add(&scanner->stats.syscalls, 1, __ATOMIC_RELAXED);
+				if (size < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					break;
+				}
+				if (size == 0) {
+					eof = true;
+				}
+				filled += (size_t)size;
+			}
+		}
+
+		uint64_t now_ns = btUtilGetMonotonicTimeNs();
+		uint64_t start = head;
+		size_t offset = 0;
+		bool malformed = false;
+		ring_full = false;
+		while (filled - offset >= BT_LE_SCANNER_H4_HEADER_SIZE) {
+			const uint8_t *packet = buf + offset;
+			if (packet[0] != HCI_EVENT_PKT) {
+				malformed = true;
+				break;
+			}
+			size_t len = BT_LE_SCANNER_H4_HEADER_SIZE + packet[2];
+			if (filled - offset < len) {
+				break;
+			}
+
+			uint64_t tail = __atomic_load_n(&scanner->tail, __ATOMIC_ACQUIRE);
+			if (head - tail >= BT_LE_SCANNER_RING_SLOTS) {
+				ring_full = true;
+				break;
+			}
+
+			BtLeScannerSlot *slot = &scanner->ring[head & BT_LE_SCANNER_RING_MASK];
+			memcpy(slot->data, packet, len);
+			slot->len          = (uint16_t)len;
+			slot->timestamp_ns = now_ns;
+			head++;
+			offset += len;
+		}
+
+		if (head != start) {
+			__atomic_fetch_add(&scanner->stats.events, head - start, __ATOMIC_RELAXED);
+			_scanner_publish(scanner, head);
+		}
+
+		memmove(buf, buf + offset, filled - offset);
+		filled -= offset;
+
+		if (malformed) {
+			__atomic_fetch_add(&scanner->stats.malformed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if (eof && ((filled < BT_LE_SCANNER_H4_HEADER_SIZE) ||
+					(filled < BT_LE_SCANNER_H4_HEADER_SIZE + (size_t)buf[2]))) {
+			break;
+		}
+		//J リングが空くのを待つ (btLeScannerPoll() がスロットを返すと起こされる)
+		if ((offset == 0) && (eof || ring_full || (filled == sizeof(buf)))) {
+			pthread_mutex_lock(&scanner->mutex);
+			__atomic_store_n(&scanner->ring_waiting, true, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&scanner->running, __ATOMIC_ACQUIRE) &&
+				   ((head - __atomic_load_n(&scanner->tail, __ATOMIC_SEQ_CST)) >= BT_LE_SCANNER_RING_SLOTS)) {
+				pthread_cond_wait(&scanner->cv, &scanner->mutex);
+			}
+			__atomic_store_n(&scanner->ring_waiting, false, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&scanner->mutex);
+		}
+	}
+
+	_scanner_finish(scanner);
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J LE Meta Event に含まれる Advertising Report の数 (それ以外の Event は 0)
+/*---------------------------------------------------------------------------*/
+static size_t _scanner_count_reports(const uint8_t *event, const size_t len)
+{
+	if ((len < BT_LE_SCANNER_H4_HEADER_SIZE + 2) ||
+		(event[0] != HCI_EVENT_PKT) || (event[1] != EVT_LE_META_EVENT)) {
+		return 0;
+	}
+
+	uint8_t subevent = event[3];
+	if ((subevent != BT_LE_SCANNER_SUBEVENT_ADVERTISING_REPORT) &&
+		(subevent != BT_LE_SCANNER_SUBEVENT_EXTENDED_ADVERTISING_REPORT)) {
+		return 0;
+	}
+
+	return event[4];
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J H4 の HCI Event 1つから Advertising Report を取り出す (data は event を指す)
+/*---------------------------------------------------------------------------*/
+int btLeScannerParseEvent(
+								const uint8_t *event,
+								const size_t len,
+								const uint64_t timestamp_ns,
+								BtLeAdvertisingReport *reports,
+								const size_t reports_size,
+								size_t &num_reports)
+{
+	num_reports = 0;
+
+	if ((event == NULL) || (reports == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if ((len < BT_LE_SCANNER_H4_HEADER_SIZE) ||
+		(len != BT_LE_SCANNER_H4_HEADER_SIZE + (size_t)event[2])) {
+		return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+	}
+
+	size_t num = _scanner_count_reports(event, len);
+	if (num == 0) {
+		return AKS_OK;
+	}
+
+	bool extended = (event[3] == BT_LE_SCANNER_SUBEVENT_EXTENDED_ADVERTISING_REPORT);
+	const uint8_t *p   = event + 5;
+	const uint8_t *end = event + len;
+	for (size_t i=0 ; i<num ; ++i) {
+		if (num_reports >= reports_size) {
+			return AKS_ERROR_NOBUF;
+		}
+
+		BtLeAdvertisingReport *report = &reports[num_reports];
+		report->extended     = extended;
+		report->timestamp_ns = timestamp_ns;
+
+		if (!extended) {
+			//J Event_Type, Address_Type, Address, Data_Length, Data, RSSI
+			if ((size_t)(end - p) < BT_LE_SCANNER_LEGACY_REPORT_SIZE) {
+				return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+			}
+			uint8_t data_len = p[8];
+			if ((size_t)(end - p) < (size_t)BT_LE_SCANNER_LEGACY_REPORT_SIZE + data_len) {
+				return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+			}
+			report->event_type   = p[0];
+			report->address_type = p[1];
+			memcpy(report->address, &p[2], sizeof(report->address));
+			report->data_len     = data_len;
+			report->data         = &p[9];
+			report->rssi         = (int8_t)p[9 + data_len];
+			p += BT_LE_SCANNER_LEGACY_REPORT_SIZE + data_len;
+		}
+		else {
+			//J Event_Type(2), Address_Type, Address, Primary_PHY, Secondary_PHY, Advertising_SID,
+			//J TX_Power, RSSI, Periodic_Advertising_Interval(2), Direct_Address_Type, Direct_Address, Data_Length, Data
+			if ((size_t)(end - p) < BT_LE_SCANNER_EXTENDED_REPORT_SIZE) {
+				return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+			}
+			uint8_t data_len = p[BT_LE_SCANNER_EXTENDED_REPORT_SIZE - 1];
+			if ((size_t)(end - p) < (size_t)BT_LE_SCANNER_EXTENDED_REPORT_SIZE + data_len) {
+				return AKS_ERROR_BT_INCORRECT_PDU_SIZE;
+			}
+			report->event_type   = (uint16_t)(p[0] | (p[1] << 8));
+			report->address_type = p[2];
+			memcpy(report->address, &p[3], sizeof(report->address));
+			report->rssi         = (int8_t)p[13];
+			report->data_len     = data_len;
+			report->data         = &p[BT_LE_SCANNER_EXTENDED_REPORT_SIZE];
+			p += BT_LE_SCANNER_EXTENDED_REPORT_SIZE + data_len;
+		}
+
+		num_reports++;
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J リングに溜まった Event をまとめて解析して返す
+//J 返した Report の data は次の btLeScannerPoll() まで有効。
+//J Replay の入力が終わって何も残っていなければ num_reports = 0 で AKS_OK を返す
+/*---------------------------------------------------------------------------*/
+int btLeScannerPoll(
+								BtLeScannerContext *scanner,
+								BtLeAdvertisingReport *reports,
+								const size_t reports_size,
+								size_t &num_reports,
+								const int timeout_ms)
+{
+	num_reports = 0;
+
+	if ((scanner == NULL) || (reports == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (reports_size == 0) {
+		return AKS_ERROR_NOBUF;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout_ms > 0) {
+		deadline.tv_sec  += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec  += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	uint64_t malformed = 0;
+	uint64_t truncated = 0;
+	while (num_reports == 0) {
+		//J 前回返したスロット (と Report の無かった Event) を受信スレッドに返す
+		uint64_t tail = scanner->tail + scanner->held;
+		__atomic_store_n(&scanner->tail, tail, __ATOMIC_SEQ_CST);
+		if ((scanner->held != 0) && __atomic_load_n(&scanner->ring_waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&scanner->mutex);
+			pthread_cond_broadcast(&scanner->cv);
+			pthread_mutex_unlock(&scanner->mutex);
+		}
+		scanner->held = 0;
+
+		uint64_t head = __atomic_load_n(&scanner->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			pthread_mutex_lock(&scanner->mutex);
+			__atomic_store_n(&scanner->sleeping, true, __ATOMIC_SEQ_CST);
+			int ret = 0;
+			while (((head = __atomic_load_n(&scanner->head, __ATOMIC_SEQ_CST)) == tail) &&
+				   (!__atomic_load_n(&scanner->finished, __ATOMIC_ACQUIRE)) &&
+				   (ret != ETIMEDOUT)) {
+				if (timeout_ms < 0) {
+					ret = pthread_cond_wait(&scanner->cv, &scanner->mutex);
+				}
+				else {
+					ret = pthread_cond_timedwait(&scanner->cv, &scanner->mutex, &deadline);
+				}
+			}
+			__atomic_store_n(&scanner->sleeping, false, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&scanner->mutex);
+
+			if (head == tail) {
+				return __atomic_load_n(&scanner->finished, __ATOMIC_ACQUIRE) ? AKS_OK : AKS_ERROR_TIMEOUT;
+			}
+		}
+
+		uint32_t used = 0;
+		while (tail + used != head) {
+			const BtLeScannerSlot *slot = &scanner->ring[(tail + used) & BT_LE_SCANNER_RING_MASK];
+
+			//J 次の Event の Report が入りきらなければ次回に回す
+			size_t count = _scanner_count_reports(slot->data, slot->len);
+			if ((num_reports > 0) && (num_reports + count > reports_size)) {
+				break;
+			}
+
+			size_t parsed = 0;
+			int ret = btLeScannerParseEvent(
+									slot->data,
+									slot->len,
+									slot->timestamp_ns,
+									&reports[num_reports],
+									reports_size - num_reports,
+									parsed);
+			if (ret == (int)AKS_ERROR_NOBUF) {
+				truncated += count - parsed;
+			}
+			else if (ret != AKS_OK) {
+				malformed++;
+			}
+			num_reports += parsed;
+			used++;
+
+			if (num_reports >= reports_size) {
+				break;
+			}
+		}
+		scanner->held = used;
+	}
+
+	__atomic_fetch_add(&scanner->stats.reports, (uint64_t)num_reports, __ATOMIC_RELAXED);
+	if (malformed != 0) {
+		__atomic_fetch_add(&scanner->stats.malformed, malformed, __ATOMIC_RELAXED);
+	}
+	if (truncated != 0) {
+		__atomic_fetch_add(&scanner->stats.truncated, truncated, __ATOMIC_RELAXED);
+	}
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btLeScannerGetStatistics(BtLeScannerContext *scanner, BtLeScannerStatistics *stats)
+{
+	if ((scanner == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	stats->events    = __atomic_load_n(&scanner->stats.events, __ATOMIC_RELAXED);
+	stats->reports   = __atomic_load_n(&scanner->stats.reports, __ATOMIC_RELAXED);
+	stats->dropped   = __atomic_load_n(&scanner->stats.dropped, __ATOMIC_RELAXED);
+	stats->malformed = __atomic_load_n(&scanner->stats.malformed, __ATOMIC_RELAXED);
+	stats->truncated = __atomic_load_n(&scanner->stats.truncated, __ATOMIC_RELAXED);
+	stats->syscalls  = __atomic_load_n(&scanner->stats.syscalls, __ATOMIC_RELAXED);
+	stats->max_batch = __atomic_load_n(&scanner->stats.max_batch, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
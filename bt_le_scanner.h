@@ -0,0 +1,128 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_LE_SCANNER_H_
+#define BT_LE_SCANNER_H_
+
+/*
+ *J Raw HCI Socket で LE Advertising Report を受ける Scanner
+ *J
+ *J 受信スレッドは HCI Event を recvmmsg() でリングのスロットに直接読み込むだけで、
+ *J 解析はしない。btLeScannerPoll() がリングに溜まった Event をまとめて解析する。
+ *J リングが一杯なら Event を捨てて dropped に数える (受信スレッドは待たない)。
+ *J
+ *J btLeScannerCreateReplay() は記録した HCI Event の列 (H4 形式: 0x04, Event Code,
+ *J Parameter Length, Parameters の繰り返し) を fd から読んで同じ経路に流す。
+ */
+
+#define BT_LE_SCANNER_RING_SLOTS					(1024)	//J 2 のべき乗
+#define BT_LE_SCANNER_SLOT_SIZE						(HCI_MAX_EVENT_SIZE)
+#define BT_LE_SCANNER_MAX_BATCH						(32)	//J 1回の recvmmsg() で読む Event の数
+#define BT_LE_SCANNER_RCVBUF						(1024 * 1024)
+
+//J LE Scan Type
+struct BtLeScanType {
+	static const uint8_t cPassive				= 0x00;
+	static const uint8_t cActive				= 0x01;
+};
+
+//J HCI_LE_Advertising_Report の Event_Type (Extended の時は Extended の値)
+struct BtLeAdvertisingEventType {
+	static const uint8_t cAdvInd				= 0x00;
+	static const uint8_t cAdvDirectInd			= 0x01;
+	static const uint8_t cAdvScanInd			= 0x02;
+	static const uint8_t cAdvNonconnInd			= 0x03;
+	static const uint8_t cScanRsp				= 0x04;
+};
+
+struct BtLeScannerOptions
+{
+	int      dev_id;				//J hci0 なら 0
+	uint8_t  scan_type;				//J BtLeScanType
+	uint16_t interval;				//J 0.625ms 単位
+	uint16_t window;				//J 0.625ms 単位
+	uint8_t  own_address_type;
+	uint8_t  filter_duplicates;
+};
+
+//J 解析済みの Report (data は次の btLeScannerPoll() までリングを指す)
+struct BtLeAdvertisingReport
+{
+	uint16_t       event_type;
+	uint8_t        address_type;
+	uint8_t        address[6];		//J LE のバイト順 (bdaddr_t と同じ)
+	int8_t         rssi;			//J 127 なら不明
+	bool           extended;		//J LE Extended Advertising Report から取り出した
+	uint16_t       data_len;
+	const uint8_t *data;
+	uint64_t       timestamp_ns;	//J CLOCK_MONOTONIC で受信スレッドが読んだ時刻
+};
+
+struct BtLeScannerStatistics
+{
+	uint64_t events;				//J リングに入れた Event の数
+	uint64_t reports;				//J 解析して返した Report の数
+	uint64_t dropped;				//J リングが一杯で捨てた Event の数
+	uint64_t malformed;				//J 長さが合わず解析をやめた Event の数
+	uint64_t truncated;				//J reports が足りず返せなかった Report の数
+	uint64_t syscalls;				//J 受信スレッドの recvmmsg() / read() の回数
+	uint32_t max_batch;				//J 1回の recvmmsg() で読めた最大の Event 数
+};
+
+struct BtLeScannerSlot
+{
+	uint64_t timestamp_ns;
+	uint16_t len;
+	uint8_t  data[BT_LE_SCANNER_SLOT_SIZE];
+};
+
+struct BtLeScannerContext
+{
+	bool running;
+	bool replay;
+	bool finished;					//J Replay の入力が終わった / Socket が壊れた
+
+	int dd;							//J HCI Socket か Replay の fd
+	int wake_fd;
+	pthread_t thread;
+
+	//J 受信スレッドが head、btLeScannerPoll() が tail を進める
+	uint64_t head;
+	uint64_t tail;
+	uint32_t held;					//J 前回の btLeScannerPoll() で返したスロットの数
+	bool     sleeping;				//J btLeScannerPoll() が Event を待っている
+	bool     ring_waiting;			//J Replay スレッドがリングが空くのを待っている
+	pthread_mutex_t mutex;
+	pthread_cond_t  cv;
+
+	BtLeScannerStatistics stats;
+
+	BtLeScannerSlot ring[BT_LE_SCANNER_RING_SLOTS];
+};
+
+int btLeScannerInitOptions(BtLeScannerOptions *options);
+int btLeScannerCreate(BtLeScannerContext *scanner, const BtLeScannerOptions *options);
+int btLeScannerCreateReplay(BtLeScannerContext *scanner, int fd);
+int btLeScannerDestroy(BtLeScannerContext *scanner);
+
+int btLeScannerPoll(
+								BtLeScannerContext *scanner,
+								BtLeAdvertisingReport *reports,
+								const size_t reports_size,
+								size_t &num_reports,
+								const int timeout_ms);
+
+int btLeScannerParseEvent(
+								const uint8_t *event,
+								const size_t len,
+								const uint64_t timestamp_ns,
+								BtLeAdvertisingReport *reports,
+								const size_t reports_size,
+								size_t &num_reports);
+
+int btLeScannerGetStatistics(BtLeScannerContext *scanner, BtLeScannerStatistics *stats);
+
+#endif/*BT_LE_SCANNER_H_*/
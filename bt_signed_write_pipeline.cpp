@@ -0,0 +1,395 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_gatt.h"
+#include "bt_util.h"
+#include "bt_crypto.h"
+#include "bt_le_device.h"
+#include "bt_signed_write_pipeline.h"
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static void _pipeline_sign(BtSignedWritePipeline *pipe, BtSignedWriteRequest *requests, size_t index)
+{
+	BtSignedWriteRequest *request = &requests[index];
+	if (request->result != AKS_OK) {
+		return;
+	}
+
+	BtGattDeviceContext *ctx = request->ctx;
+	size_t mtu = btLeDeviceGetMtu(ctx);
+	if (mtu > BT_ATT_MAX_LE_MTU) {
+		mtu = BT_ATT_MAX_LE_MTU;
+	}
+
+	int ret = btAttBuildPduSignedWriteCommandWithKey(
+								pipe->pdus[index],
+								mtu,
+								request->handle,
+								request->value_len,
+								request->value,
+								&ctx->crypto,
+								&ctx->csrk.key,
+								request->sign_counter);
+	if (ret < AKS_OK) {
+		request->result = ret;
+		return;
+	}
+
+	pipe->pdu_len[index] = (uint16_t)ret;
+}
+
+/*---------------------------------------------------------------------------*/
+//J 残っている要求を CHUNK 個ずつ取って署名する
+//J requests / num_requests / generation は pipe->mutex を持って写し取ったもの。
+//J 遅れて起きたワーカーが次のバッチの要求を取らないように、next の generation が違えば何もしない
+static void _pipeline_work(
+								BtSignedWritePipeline *pipe,
+								BtSignedWriteRequest *requests,
+								size_t num_requests,
+								uint64_t generation)
+{
+	uint64_t tag = (generation & 0xFFFFFFFFull) << 32;
+
+	while (1) {
+		uint64_t next = __atomic_load_n(&pipe->next, __ATOMIC_RELAXED);
+		size_t start;
+		do {
+			start = (size_t)(next & 0xFFFFFFFFull);
+			if (((next & ~0xFFFFFFFFull) != tag) || (start >= num_requests)) {
+				return;
+			}
+		} while (!__atomic_compare_exchange_n(&pipe->next, &next, next + BT_SIGNED_WRITE_PIPELINE_CHUNK, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		size_t end = start + BT_SIGNED_WRITE_PIPELINE_CHUNK;
+		if (end > num_requests) {
+			end = num_requests;
+		}
+		for (size_t i=start ; i<end ; ++i) {
+			_pipeline_sign(pipe, requests, i);
+		}
+
+		//J 取った範囲が終わるまで Submit はこのバッチを手放さないので、finished はこのバッチのもの
+		pthread_mutex_lock(&pipe->mutex);
+		pipe->finished += end - start;
+		if (pipe->finished == num_requests) {
+			pthread_cond_broadcast(&pipe->doneCv);
+		}
+		pthread_mutex_unlock(&pipe->mutex);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void *_pipeline_worker_func(void *arg)
+{
+	BtSignedWritePipeline *pipe = (BtSignedWritePipeline *)arg;
+
+	pthread_mutex_lock(&pipe->mutex);
+	uint64_t seen = pipe->generation;
+	while (1) {
+		while (pipe->running && (pipe->generation == seen)) {
+			pthread_cond_wait(&pipe->workCv, &pipe->mutex);
+		}
+		if (!pipe->running) {
+			break;
+		}
+		seen = pipe->generation;
+		BtSignedWriteRequest *requests = pipe->requests;
+		size_t num_requests = pipe->num_requests;
+
+		//J Submit は busy_workers が 0 になるまでバッチを手放さない
+		pipe->busy_workers++;
+		pthread_mutex_unlock(&pipe->mutex);
+
+		_pipeline_work(pipe, requests, num_requests, seen);
+
+		pthread_mutex_lock(&pipe->mutex);
+		pipe->busy_workers--;
+		if (pipe->busy_workers == 0) {
+			pthread_cond_broadcast(&pipe->doneCv);
+		}
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+//J デバイスごとに必要な数の SignCounter をまとめて確保し、バッチ内の順に割り当てる
+static size_t _pipeline_reserve_counters(
+								BtSignedWriteRequest *requests,
+								size_t num_requests,
+								BtGattDeviceContext **devices)
+{
+	uint32_t next_counter[BT_SIGNED_WRITE_PIPELINE_MAX_BATCH];
+	int      device_result[BT_SIGNED_WRITE_PIPELINE_MAX_BATCH];
+	size_t   num_devices = 0;
+
+	for (size_t i=0 ; i<num_requests ; ++i) {
+		BtSignedWriteRequest *request = &requests[i];
+		request->sign_counter = 0;
+
+		if (request->ctx == NULL) {
+			request->result = AKS_ERROR_NULL;
+			continue;
+		}
+		if ((request->value == NULL) && (request->value_len != 0)) {
+			request->result = AKS_ERROR_NOBUF;
+			continue;
+		}
+
+		size_t d = 0;
+		while ((d < num_devices) && (devices[d] != request->ctx)) {
+			d++;
+		}
+
+		if (d == num_devices) {
+			uint32_t count = 0;
+			for (size_t j=i ; j<num_requests ; ++j) {
+				if ((requests[j].ctx == request->ctx) &&
+					((requests[j].value != NULL) || (requests[j].value_len == 0)))
+				{
+					count++;
+				}
+			}
+
+			devices[d] = request->ctx;
+			device_result[d] = btLeDeviceReserveSignCounters(request->ctx, count, next_counter[d]);
+			num_devices++;
+		}
+
+		request->result = device_result[d];
+		if (request->result == AKS_OK) {
+			request->sign_counter = next_counter[d]++;
+		}
+	}
+
+	return num_devices;
+}
+
+/*---------------------------------------------------------------------------*/
+//J デバイスごとに SignCounter の順で送る
+static void _pipeline_send(
+								BtSignedWritePipeline *pipe,
+								BtGattDeviceContext **devices,
+								size_t num_devices)
+{
+	BtLeDevicePdu pdus[BT_LE_DEVICE_MAX_BURST];
+	size_t        indexes[BT_LE_DEVICE_MAX_BURST];
+
+	for (size_t d=0 ; d<num_devices ; ++d) {
+		int device_error = AKS_OK;
+		size_t num = 0;
+
+		for (size_t i=0 ; i<=pipe->num_requests ; ++i) {
+			bool last = (i == pipe->num_requests);
+			if (!last) {
+				BtSignedWriteRequest *request = &pipe->requests[i];
+				if ((request->ctx != devices[d]) || (request->result != AKS_OK)) {
+					continue;
+				}
+				if (device_error != AKS_OK) {
+					//J 前の送信に失敗したら後ろは送らない (SignCounter が飛ぶだけで済む)
+					request->result = device_error;
+					continue;
+				}
+
+				pdus[num].pdu = pipe->pdus[i];
+				pdus[num].len = pipe->pdu_len[i];
+				indexes[num]  = i;
+				num++;
+			}
+
+			if ((num == BT_LE_DEVICE_MAX_BURST) || (last && (num != 0))) {
+				int ret = btLeDeviceSendAttPduBurst(devices[d], pdus, num);
+				if (ret != AKS_OK) {
+					device_error = ret;
+					for (size_t k=0 ; k<num ; ++k) {
+						pipe->requests[indexes[k]].result = ret;
+					}
+				}
+				num = 0;
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static int _pipeline_submit_batch(
+								BtSignedWritePipeline *pipe,
+								BtSignedWriteRequest *requests,
+								size_t num_requests)
+{
+	BtGattDeviceContext *devices[BT_SIGNED_WRITE_PIPELINE_MAX_BATCH];
+	size_t num_devices = _pipeline_reserve_counters(requests, num_requests, devices);
+
+	uint64_t sign_start_ns = btUtilGetMonotonicTimeNs();
+
+	//J 並列にしないバッチでも generation を進め、前のバッチのワーカーが取れないようにする
+	pthread_mutex_lock(&pipe->mutex);
+	uint64_t generation = ++pipe->generation;
+	pipe->requests     = requests;
+	pipe->num_requests = num_requests;
+	pipe->finished     = 0;
+	__atomic_store_n(&pipe->next, (generation & 0xFFFFFFFFull) << 32, __ATOMIC_RELAXED);
+	bool parallel = (pipe->num_workers != 0) && (num_requests >= BT_SIGNED_WRITE_PIPELINE_PARALLEL_MIN);
+	if (parallel) {
+		pthread_cond_broadcast(&pipe->workCv);
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+
+	//J 呼び出し元も署名を手伝う
+	_pipeline_work(pipe, requests, num_requests, generation);
+
+	pthread_mutex_lock(&pipe->mutex);
+	while ((pipe->finished != num_requests) || (pipe->busy_workers != 0)) {
+		pthread_cond_wait(&pipe->doneCv, &pipe->mutex);
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+
+	uint64_t send_start_ns = btUtilGetMonotonicTimeNs();
+	_pipeline_send(pipe, devices, num_devices);
+	uint64_t end_ns = btUtilGetMonotonicTimeNs();
+
+	uint64_t signed_pdus = 0;
+	int result = AKS_OK;
+	for (size_t i=0 ; i<num_requests ; ++i) {
+		if (requests[i].result == AKS_OK) {
+			signed_pdus++;
+		}
+		else if (result == AKS_OK) {
+			result = requests[i].result;
+		}
+	}
+
+	__atomic_fetch_add(&pipe->stats.batches, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pipe->stats.signed_pdus, signed_pdus, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pipe->stats.sign_ns, send_start_ns - sign_start_ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pipe->stats.send_ns, end_ns - send_start_ns, __ATOMIC_RELAXED);
+
+	return result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+int btSignedWritePipelineCreate(BtSignedWritePipeline *pipe, const uint32_t num_workers)
+{
+	if (pipe == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (num_workers > BT_SIGNED_WRITE_PIPELINE_MAX_WORKERS) {
+		return AKS_ERROR_INVALID;
+	}
+
+	memset(pipe, 0x00, sizeof(BtSignedWritePipeline));
+
+	pthread_mutex_init(&pipe->mutex, NULL);
+	pthread_mutex_init(&pipe->submitMutex, NULL);
+	pthread_cond_init(&pipe->workCv, NULL);
+	pthread_cond_init(&pipe->doneCv, NULL);
+
+	pipe->running = true;
+
+	for (uint32_t i=0 ; i<num_workers ; ++i) {
+		int ret = pthread_create(&pipe->workers[i], NULL, _pipeline_worker_func, (void *)pipe);
+		if (ret != 0) {
+			btSignedWritePipelineDestroy(pipe);
+			return ret;
+		}
+		pipe->num_workers++;
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btSignedWritePipelineDestroy(BtSignedWritePipeline *pipe)
+{
+	if (pipe == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&pipe->mutex);
+	pipe->running = false;
+	pthread_cond_broadcast(&pipe->workCv);
+	pthread_mutex_unlock(&pipe->mutex);
+
+	for (uint32_t i=0 ; i<pipe->num_workers ; ++i) {
+		pthread_join(pipe->workers[i], NULL);
+	}
+	pipe->num_workers = 0;
+
+	pthread_cond_destroy(&pipe->doneCv);
+	pthread_cond_destroy(&pipe->workCv);
+	pthread_mutex_destroy(&pipe->submitMutex);
+	pthread_mutex_destroy(&pipe->mutex);
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btSignedWritePipelineSubmit(
+								BtSignedWritePipeline *pipe,
+								BtSignedWriteRequest *requests,
+								const size_t num_requests)
+{
+	if ((pipe == NULL) || (requests == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (num_requests == 0) {
+		return AKS_ERROR_INVALID;
+	}
+
+	pthread_mutex_lock(&pipe->submitMutex);
+
+	//J MAX_BATCH ずつ処理する
+	int result = AKS_OK;
+	for (size_t offset=0 ; offset<num_requests ; offset+=BT_SIGNED_WRITE_PIPELINE_MAX_BATCH) {
+		size_t num = num_requests - offset;
+		if (num > BT_SIGNED_WRITE_PIPELINE_MAX_BATCH) {
+			num = BT_SIGNED_WRITE_PIPELINE_MAX_BATCH;
+		}
+
+		int ret = _pipeline_submit_batch(pipe, &requests[offset], num);
+		if ((ret != AKS_OK) && (result == AKS_OK)) {
+			result = ret;
+		}
+	}
+
+	pthread_mutex_unlock(&pipe->submitMutex);
+
+	return result;
+}
+
+/*---------------------------------------------------------------------------*/
+int btSignedWritePipelineGetStatistics(BtSignedWritePipeline *pipe, BtSignedWritePipelineStatistics *stats)
+{
+	if ((pipe == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	stats->batches     = __atomic_load_n(&pipe->stats.batches, __ATOMIC_RELAXED);
+	stats->signed_pdus = __atomic_load_n(&pipe->stats.signed_pdus, __ATOMIC_RELAXED);
+	stats->sign_ns     = __atomic_load_n(&pipe->stats.sign_ns, __ATOMIC_RELAXED);
+	stats->send_ns     = __atomic_load_n(&pipe->stats.send_ns, __ATOMIC_RELAXED);
+
+	return AKS_OK;
+}
@@ -0,0 +1,82 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_SIGNED_WRITE_PIPELINE_H_
+#define BT_SIGNED_WRITE_PIPELINE_H_
+
+/*
+ *J Signed Write Command をまとめて署名して送る
+ *J
+ *J 1. バッチ内のデバイスごとに SignCounter を連続した範囲でまとめて確保する
+ *J    (バッチ内の順に割り当てる)
+ *J 2. 署名をワーカースレッドと呼び出し元スレッドで分担して計算する
+ *J 3. デバイスごとに SignCounter の順で btLeDeviceSendAttPduBurst() に渡す
+ *J
+ *J Peripheral は前回より小さい SignCounter を拒否するので、同じデバイスへの
+ *J Signed Write は同時に 1つのパイプライン (か呼び出し元) からだけ行うこと。
+ */
+
+#define BT_SIGNED_WRITE_PIPELINE_MAX_WORKERS		(16)
+#define BT_SIGNED_WRITE_PIPELINE_MAX_BATCH			(256)
+#define BT_SIGNED_WRITE_PIPELINE_CHUNK				(16)	//J ワーカーが一度に取る要求数
+#define BT_SIGNED_WRITE_PIPELINE_PARALLEL_MIN		(64)	//J これ未満のバッチは呼び出し元だけで署名する
+
+struct BtSignedWriteRequest
+{
+	BtGattDeviceContext *ctx;
+	BtAttHandle          handle;
+	const uint8_t       *value;
+	uint16_t             value_len;
+
+	int                  result;		//J 結果
+	uint32_t             sign_counter;	//J 使った SignCounter
+};
+
+struct BtSignedWritePipelineStatistics
+{
+	uint64_t batches;
+	uint64_t signed_pdus;
+	uint64_t sign_ns;				//J 署名にかかった時間 (バッチ単位の経過時間の合計)
+	uint64_t send_ns;
+};
+
+struct BtSignedWritePipeline
+{
+	bool running;
+
+	uint32_t  num_workers;
+	pthread_t workers[BT_SIGNED_WRITE_PIPELINE_MAX_WORKERS];
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  workCv;
+	pthread_cond_t  doneCv;
+	pthread_mutex_t submitMutex;	//J Submit は 1つずつ
+
+	//J 実行中のバッチ
+	uint64_t              generation;
+	BtSignedWriteRequest *requests;
+	size_t                num_requests;
+	uint64_t              next;			//J 上位 32bit は generation、下位 32bit は次に取る要求 (atomic)
+	size_t                finished;		//J 署名し終えた要求の数
+	uint32_t              busy_workers;
+
+	uint16_t pdu_len[BT_SIGNED_WRITE_PIPELINE_MAX_BATCH];
+	uint8_t  pdus[BT_SIGNED_WRITE_PIPELINE_MAX_BATCH][BT_ATT_MAX_LE_MTU];
+
+	BtSignedWritePipelineStatistics stats;
+};
+
+int btSignedWritePipelineCreate(BtSignedWritePipeline *pipe, const uint32_t num_workers);
+int btSignedWritePipelineDestroy(BtSignedWritePipeline *pipe);
+
+int btSignedWritePipelineSubmit(
+								BtSignedWritePipeline *pipe,
+								BtSignedWriteRequest *requests,
+								const size_t num_requests);
+
+int btSignedWritePipelineGetStatistics(BtSignedWritePipeline *pipe, BtSignedWritePipelineStatistics *stats);
+
+#endif/*BT_SIGNED_WRITE_PIPELINE_H_*/
@@ -0,0 +1,522 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <error.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_ad.h"
+#include "bt_le_scanner.h"
+#include "bt_telemetry.h"
+
+#define BT_TELEMETRY_STORE_MASK						(BT_TELEMETRY_STORE_CAPACITY - 1)
+#define BT_TELEMETRY_SERIES_MASK					(BT_TELEMETRY_SERIES_SIZE - 1)
+
+
+/*---------------------------------------------------------------------------*/
+static bool _telemetry_uuid_equal(const BtUuid &a, const BtUuid &b)
+{
+	if (a.format != b.format) {
+		return false;
+	}
+	if (a.format == BtUuid::cBtUuid16) {
+		return a.value.uuid16 == b.value.uuid16;
+	}
+
+	return memcmp(a.value.uuid128.data, b.value.uuid128.data, sizeof(a.value.uuid128.data)) == 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J AD Structure に合う Decoder を探す (無ければ NULL)
+/*---------------------------------------------------------------------------*/
+static BtTelemetryDecoder *_telemetry_find_decoder(
+								BtTelemetryContext *tel,
+								const BtAdStructure *ad,
+								const uint8_t *&data,
+								size_t &data_len)
+{
+	if (ad->type == BtAdType::cManufacturerSpecificData) {
+		uint16_t company_id;
+		if (btAdDecodeManufacturerData(ad, company_id, data, data_len) != AKS_OK) {
+			return NULL;
+		}
+		for (uint32_t i=0 ; i<tel->num_decoders ; ++i) {
+			BtTelemetryDecoder *dec = &tel->decoders[i];
+			if ((dec->match == BtTelemetryMatch::cCompanyId) && (dec->company_id == company_id)) {
+				return dec;
+			}
+		}
+	}
+	else {
+		BtUuid uuid;
+		if (btAdDecodeServiceData(ad, uuid, data, data_len) != AKS_OK) {
+			return NULL;
+		}
+		for (uint32_t i=0 ; i<tel->num_decoders ; ++i) {
+			BtTelemetryDecoder *dec = &tel->decoders[i];
+			if ((dec->match == BtTelemetryMatch::cServiceUuid) && _telemetry_uuid_equal(dec->uuid, uuid)) {
+				return dec;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryInit(BtTelemetryContext *tel)
+{
+	if (tel == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(tel, 0, sizeof(BtTelemetryContext));
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _telemetry_regist(BtTelemetryContext *tel, BtTelemetryDecoder **dec, BtTelemetryDecodeCb cb, uint8_t &decoder)
+{
+	if ((tel == NULL) || (cb == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (tel->num_decoders >= BT_TELEMETRY_MAX_DECODERS) {
+		return AKS_ERROR_FULL;
+	}
+
+	decoder = (uint8_t)tel->num_decoders;
+	*dec = &tel->decoders[tel->num_decoders++];
+	memset(*dec, 0, sizeof(BtTelemetryDecoder));
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryRegistCompanyDecoder(
+								BtTelemetryContext *tel,
+								const uint16_t company_id,
+								BtTelemetryDecodeCb cb,
+								void *arg,
+								uint8_t &decoder)
+{
+	BtTelemetryDecoder *dec;
+	int ret = _telemetry_regist(tel, &dec, cb, decoder);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	dec->match      = BtTelemetryMatch::cCompanyId;
+	dec->company_id = company_id;
+	dec->cb         = cb;
+	dec->arg        = arg;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryRegistServiceDecoder(
+								BtTelemetryContext *tel,
+								const BtUuid &uuid,
+								BtTelemetryDecodeCb cb,
+								void *arg,
+								uint8_t &decoder)
+{
+	if ((uuid.format != BtUuid::cBtUuid16) && (uuid.format != BtUuid::cBtUuid128)) {
+		return AKS_ERROR_BT_INVALID_UUID;
+	}
+
+	BtTelemetryDecoder *dec;
+	int ret = _telemetry_regist(tel, &dec, cb, decoder);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	dec->match = BtTelemetryMatch::cServiceUuid;
+	dec->uuid  = uuid;
+	dec->cb    = cb;
+	dec->arg   = arg;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryAddSink(BtTelemetryContext *tel, BtTelemetrySinkCb cb, void *arg)
+{
+	if ((tel == NULL) || (cb == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+	if (tel->num_sinks >= BT_TELEMETRY_MAX_SINKS) {
+		return AKS_ERROR_FULL;
+	}
+
+	tel->sinks[tel->num_sinks].cb  = cb;
+	tel->sinks[tel->num_sinks].arg = arg;
+	tel->num_sinks++;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 溜めた Sample を全ての Sink に渡す
+/*---------------------------------------------------------------------------*/
+int btTelemetryFlush(BtTelemetryContext *tel)
+{
+	if (tel == NULL) {
+		return AKS_ERROR_NULL;
+	}
+	if (tel->num_pending == 0) {
+		return AKS_OK;
+	}
+
+	int result = AKS_OK;
+	for (uint32_t i=0 ; i<tel->num_sinks ; ++i) {
+		int ret = tel->sinks[i].cb(tel->sinks[i].arg, tel->pending, tel->num_pending);
+		if (ret != AKS_OK) {
+			tel->stats.sink_errors++;
+			result = ret;
+		}
+	}
+	tel->stats.flushes++;
+	tel->num_pending = 0;
+
+	return result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _telemetry_decode(
+								BtTelemetryContext *tel,
+								const BtLeAdvertisingReport *report,
+								BtTelemetryDecoder *dec,
+								const uint8_t *data,
+								size_t data_len,
+								size_t &num_samples)
+{
+	BtTelemetrySample samples[BT_TELEMETRY_MAX_SAMPLES];
+	size_t num = 0;
+
+	tel->stats.matched++;
+	dec->hits++;
+
+	memset(samples, 0, sizeof(samples));
+	if ((dec->cb(dec->arg, data, data_len, samples, BT_TELEMETRY_MAX_SAMPLES, num) != AKS_OK) ||
+		(num > BT_TELEMETRY_MAX_SAMPLES)) {
+		tel->stats.decode_errors++;
+		return;
+	}
+
+	uint8_t decoder = (uint8_t)(dec - tel->decoders);
+	for (size_t i=0 ; i<num ; ++i) {
+		if (tel->num_pending >= BT_TELEMETRY_BATCH_SIZE) {
+			(void)btTelemetryFlush(tel);
+		}
+
+		BtTelemetrySample *sample = &tel->pending[tel->num_pending++];
+		*sample = samples[i];
+		sample->address_type = report->address_type;
+		memcpy(sample->address, report->address, sizeof(sample->address));
+		sample->decoder      = decoder;
+		sample->rssi         = report->rssi;
+		sample->timestamp_ns = report->timestamp_ns;
+	}
+	tel->stats.samples += num;
+	num_samples += num;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Report の Manufacturer Specific Data と Service Data を Decoder に通し、
+//J できた Sample を Sink に渡す (戻る前に Flush する)
+/*---------------------------------------------------------------------------*/
+int btTelemetryProcess(
+								BtTelemetryContext *tel,
+								const BtLeAdvertisingReport *reports,
+								const size_t num_reports,
+								size_t &num_samples)
+{
+	num_samples = 0;
+
+	if ((tel == NULL) || (reports == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	for (size_t i=0 ; i<num_reports ; ++i) {
+		const BtLeAdvertisingReport *report = &reports[i];
+		tel->stats.reports++;
+
+		BtAdIterator it;
+		BtAdStructure ad;
+		if (btAdIteratorInit(&it, report->data, report->data_len) != AKS_OK) {
+			continue;
+		}
+		while (btAdIteratorNext(&it, &ad)) {
+			if ((ad.type != BtAdType::cManufacturerSpecificData) &&
+				(ad.type != BtAdType::cServiceData16) &&
+				(ad.type != BtAdType::cServiceData32) &&
+				(ad.type != BtAdType::cServiceData128)) {
+				continue;
+			}
+
+			const uint8_t *data;
+			size_t data_len;
+			BtTelemetryDecoder *dec = _telemetry_find_decoder(tel, &ad, data, data_len);
+			if (dec == NULL) {
+				tel->stats.unmatched++;
+				continue;
+			}
+			_telemetry_decode(tel, report, dec, data, data_len, num_samples);
+		}
+	}
+
+	return btTelemetryFlush(tel);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryGetStatistics(BtTelemetryContext *tel, BtTelemetryStatistics *stats)
+{
+	if ((tel == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	*stats = tel->stats;
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryStoreInit(BtTelemetryStore *store)
+{
+	if (store == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(store, 0, sizeof(BtTelemetryStore));
+	pthread_mutex_init(&store->mutex, NULL);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryStoreDestroy(BtTelemetryStore *store)
+{
+	if (store == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_destroy(&store->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint16_t _telemetry_store_home(
+								const uint8_t address[6],
+								uint8_t address_type,
+								uint8_t decoder,
+								uint16_t channel)
+{
+	uint64_t key = ((uint64_t)decoder << 8) | address_type;
+	for (int i=0 ; i<6 ; ++i) {
+		key = (key << 8) | address[i];
+	}
+
+	uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+	hash = (hash ^ channel) * 0x9E3779B97F4A7C15ULL;
+
+	return (uint16_t)((hash >> 40) & BT_TELEMETRY_STORE_MASK);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool _telemetry_store_key_equal(
+								const BtTelemetrySample *sample,
+								const uint8_t address[6],
+								uint8_t address_type,
+								uint8_t decoder,
+								uint16_t channel)
+{
+	return (sample->address_type == address_type) &&
+		   (sample->decoder      == decoder) &&
+		   (sample->channel      == channel) &&
+		   (memcmp(sample->address, address, 6) == 0);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 最新値の表を探す。無ければ入れるべき空きの位置を返す
+/*---------------------------------------------------------------------------*/
+static bool _telemetry_store_find(
+								BtTelemetryStore *store,
+								const uint8_t address[6],
+								uint8_t address_type,
+								uint8_t decoder,
+								uint16_t channel,
+								uint16_t &index)
+{
+	index = _telemetry_store_home(address, address_type, decoder, channel);
+	while (store->latest[index].used) {
+		if (_telemetry_store_key_equal(&store->latest[index].sample, address, address_type, decoder, channel)) {
+			return true;
+		}
+		index = (uint16_t)((index + 1) & BT_TELEMETRY_STORE_MASK);
+	}
+
+	return false;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J BtTelemetrySinkCb として btTelemetryAddSink() に渡す (arg は BtTelemetryStore)
+/*---------------------------------------------------------------------------*/
+int btTelemetryStoreSink(void *arg, const BtTelemetrySample *samples, size_t num_samples)
+{
+	BtTelemetryStore *store = (BtTelemetryStore *)arg;
+
+	if ((store == NULL) || (samples == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&store->mutex);
+
+	for (size_t i=0 ; i<num_samples ; ++i) {
+		const BtTelemetrySample *sample = &samples[i];
+
+		uint16_t index;
+		if (_telemetry_store_find(store, sample->address, sample->address_type, sample->decoder, sample->channel, index)) {
+			store->latest[index].sample = *sample;
+			store->latest[index].updates++;
+		}
+		else if (store->count < BT_TELEMETRY_STORE_MAX_LOAD) {
+			BtTelemetryLatest *latest = &store->latest[index];
+			latest->used    = true;
+			latest->updates = 1;
+			latest->sample  = *sample;
+			store->count++;
+		}
+		else {
+			store->stats.full++;
+		}
+
+		if (store->series_head >= BT_TELEMETRY_SERIES_SIZE) {
+			store->stats.overwritten++;
+		}
+		store->series[store->series_head & BT_TELEMETRY_SERIES_MASK] = *sample;
+		store->series_head++;
+	}
+	store->stats.samples += num_samples;
+
+	pthread_mutex_unlock(&store->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryStoreGetLatest(
+								BtTelemetryStore *store,
+								const uint8_t address[6],
+								const uint8_t address_type,
+								const uint8_t decoder,
+								const uint16_t channel,
+								BtTelemetrySample *sample)
+{
+	if ((store == NULL) || (address == NULL) || (sample == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	int ret = AKS_ERROR_INVALID;
+
+	pthread_mutex_lock(&store->mutex);
+	uint16_t index;
+	if (_telemetry_store_find(store, address, address_type, decoder, channel, index)) {
+		*sample = store->latest[index].sample;
+		ret = AKS_OK;
+	}
+	pthread_mutex_unlock(&store->mutex);
+
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J cursor (最初は 0) の位置から時系列を読み、cursor を進める
+//J 書き込みに追い越されて読めなかった数を lost に返す
+/*---------------------------------------------------------------------------*/
+int btTelemetryStoreReadSeries(
+								BtTelemetryStore *store,
+								uint64_t &cursor,
+								BtTelemetrySample *samples,
+								const size_t samples_size,
+								size_t &num_samples,
+								uint64_t &lost)
+{
+	num_samples = 0;
+	lost        = 0;
+
+	if ((store == NULL) || (samples == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&store->mutex);
+
+	uint64_t head = store->series_head;
+	if (cursor > head) {
+		cursor = head;
+	}
+	if (head - cursor > BT_TELEMETRY_SERIES_SIZE) {
+		lost   = head - cursor - BT_TELEMETRY_SERIES_SIZE;
+		cursor = head - BT_TELEMETRY_SERIES_SIZE;
+	}
+
+	while ((cursor < head) && (num_samples < samples_size)) {
+		samples[num_samples++] = store->series[cursor & BT_TELEMETRY_SERIES_MASK];
+		cursor++;
+	}
+
+	pthread_mutex_unlock(&store->mutex);
+
+	return AKS_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int btTelemetryStoreGetStatistics(BtTelemetryStore *store, BtTelemetryStoreStatistics *stats)
+{
+	if ((store == NULL) || (stats == NULL)) {
+		return AKS_ERROR_NULL;
+	}
+
+	pthread_mutex_lock(&store->mutex);
+	*stats = store->stats;
+	pthread_mutex_unlock(&store->mutex);
+
+	return AKS_OK;
+}
@@ -0,0 +1,181 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef BT_TELEMETRY_H_
+#define BT_TELEMETRY_H_
+
+/*
+ *J 接続せずに Advertising の Payload からセンサーの値を集める
+ *J
+ *J btLeScannerPoll() (必要なら btLeDeviceTableFilter() で重複を除いた後) の
+ *J Report を btTelemetryProcess() に渡すと、Manufacturer Specific Data の
+ *J Company ID か Service Data の UUID で登録済みの Decoder を選んで呼び、
+ *J 型付きの Sample にして Sink に渡す。
+ *J
+ *J Sink には BtTelemetryStore (最新値の表と時系列のリング) を付けられる。
+ *J Sample は Address と Channel で区別するので、GATT の Notification を
+ *J Decoder で Sample にしたものも同じ Store に入れられる。
+ */
+
+#define BT_TELEMETRY_MAX_DECODERS					(32)
+#define BT_TELEMETRY_MAX_SINKS						(4)
+#define BT_TELEMETRY_MAX_SAMPLES					(16)	//J 1つの Payload から取り出せる数
+#define BT_TELEMETRY_BATCH_SIZE						(256)	//J Sink にまとめて渡す数
+#define BT_TELEMETRY_STORE_CAPACITY					(4096)	//J 最新値の表の大きさ (2 のべき乗)
+#define BT_TELEMETRY_STORE_MAX_LOAD					(BT_TELEMETRY_STORE_CAPACITY * 7 / 8)
+#define BT_TELEMETRY_SERIES_SIZE					(8192)	//J 時系列のリングの大きさ (2 のべき乗)
+
+//J Decoder を選ぶ条件
+struct BtTelemetryMatch {
+	static const uint8_t cCompanyId				= 0x01;	//J Manufacturer Specific Data の Company ID
+	static const uint8_t cServiceUuid			= 0x02;	//J Service Data の UUID (32bit は 128bit で登録する)
+};
+
+//J Sample の量 (値は value * 10^exponent)
+struct BtTelemetryQuantity {
+	static const uint16_t cRaw					= 0x0000;	//J 単位なし
+	static const uint16_t cTemperature			= 0x0001;	//J ℃
+	static const uint16_t cHumidity				= 0x0002;	//J %
+	static const uint16_t cPressure				= 0x0003;	//J Pa
+	static const uint16_t cBattery				= 0x0004;	//J %
+	static const uint16_t cVoltage				= 0x0005;	//J V
+	static const uint16_t cIlluminance			= 0x0006;	//J lx
+	static const uint16_t cCount				= 0x0007;
+	static const uint16_t cAcceleration			= 0x0008;	//J m/s^2
+};
+
+struct BtTelemetrySample
+{
+	uint8_t  address_type;
+	uint8_t  address[6];			//J LE のバイト順
+	uint8_t  decoder;				//J 登録した Decoder の番号
+	uint16_t channel;				//J Decoder が決める (同じ Payload の中の値を区別する)
+	uint16_t quantity;				//J BtTelemetryQuantity
+	int8_t   exponent;
+	int8_t   rssi;
+	int32_t  value;
+	uint64_t timestamp_ns;			//J Report を受けた時刻
+};
+
+//J Decoder は channel / quantity / exponent / value だけを埋める
+typedef int (*BtTelemetryDecodeCb)(
+								void *arg,
+								const uint8_t *data,
+								size_t data_len,
+								BtTelemetrySample *samples,
+								size_t samples_size,
+								size_t &num_samples);
+typedef int (*BtTelemetrySinkCb)(void *arg, const BtTelemetrySample *samples, size_t num_samples);
+
+struct BtTelemetryDecoder
+{
+	uint8_t  match;					//J BtTelemetryMatch
+	uint16_t company_id;
+	BtUuid   uuid;
+	BtTelemetryDecodeCb cb;
+	void    *arg;
+	uint64_t hits;
+};
+
+struct BtTelemetryStatistics
+{
+	uint64_t reports;
+	uint64_t matched;				//J Decoder に渡した Payload の数
+	uint64_t unmatched;				//J Decoder の無い Manufacturer / Service Data の数
+	uint64_t decode_errors;
+	uint64_t samples;
+	uint64_t flushes;				//J Sink を呼んだ回数
+	uint64_t sink_errors;
+};
+
+struct BtTelemetryContext
+{
+	uint32_t num_decoders;
+	BtTelemetryDecoder decoders[BT_TELEMETRY_MAX_DECODERS];
+
+	uint32_t num_sinks;
+	struct {
+		BtTelemetrySinkCb cb;
+		void *arg;
+	} sinks[BT_TELEMETRY_MAX_SINKS];
+
+	size_t num_pending;
+	BtTelemetrySample pending[BT_TELEMETRY_BATCH_SIZE];
+
+	BtTelemetryStatistics stats;
+};
+
+//J 最新値の表の 1 Entry
+struct BtTelemetryLatest
+{
+	bool     used;
+	uint64_t updates;
+	BtTelemetrySample sample;
+};
+
+struct BtTelemetryStoreStatistics
+{
+	uint64_t samples;
+	uint64_t full;					//J 表が一杯で最新値を持てなかった数
+	uint64_t overwritten;			//J 時系列のリングで上書きした数
+};
+
+//J 最新値と時系列 (読む側は別スレッドでよい)
+struct BtTelemetryStore
+{
+	pthread_mutex_t mutex;
+
+	uint32_t count;
+	BtTelemetryLatest latest[BT_TELEMETRY_STORE_CAPACITY];
+
+	uint64_t series_head;			//J 書き込んだ累積の Sample 数
+	BtTelemetrySample series[BT_TELEMETRY_SERIES_SIZE];
+
+	BtTelemetryStoreStatistics stats;
+};
+
+int btTelemetryInit(BtTelemetryContext *tel);
+int btTelemetryRegistCompanyDecoder(
+								BtTelemetryContext *tel,
+								const uint16_t company_id,
+								BtTelemetryDecodeCb cb,
+								void *arg,
+								uint8_t &decoder);
+int btTelemetryRegistServiceDecoder(
+								BtTelemetryContext *tel,
+								const BtUuid &uuid,
+								BtTelemetryDecodeCb cb,
+								void *arg,
+								uint8_t &decoder);
+int btTelemetryAddSink(BtTelemetryContext *tel, BtTelemetrySinkCb cb, void *arg);
+int btTelemetryProcess(
+								BtTelemetryContext *tel,
+								const BtLeAdvertisingReport *reports,
+								const size_t num_reports,
+								size_t &num_samples);
+int btTelemetryFlush(BtTelemetryContext *tel);
+int btTelemetryGetStatistics(BtTelemetryContext *tel, BtTelemetryStatistics *stats);
+
+int btTelemetryStoreInit(BtTelemetryStore *store);
+int btTelemetryStoreDestroy(BtTelemetryStore *store);
+int btTelemetryStoreSink(void *arg, const BtTelemetrySample *samples, size_t num_samples);
+int btTelemetryStoreGetLatest(
+								BtTelemetryStore *store,
+								const uint8_t address[6],
+								const uint8_t address_type,
+								const uint8_t decoder,
+								const uint16_t channel,
+								BtTelemetrySample *sample);
+int btTelemetryStoreReadSeries(
+								BtTelemetryStore *store,
+								uint64_t &cursor,
+								BtTelemetrySample *samples,
+								const size_t samples_size,
+								size_t &num_samples,
+								uint64_t &lost);
+int btTelemetryStoreGetStatistics(BtTelemetryStore *store, BtTelemetryStoreStatistics *stats);
+
+#endif/*BT_TELEMETRY_H_*/
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include <error.h>
 #include <errno.h>
@@ -15,28 +17,166 @@
 
 #include "bt_att.h"
 #include "bt_gatt.h"
+#include "bt_crypto.h"
 #include "aks_error.h"
 #include "bt_util.h"
 
 /*---------------------------------------------------------------------------*/
 int btUtilCryptoSignAtt(
-					struct bt_crypto *ctx,
-					uint8_t *csrk,
+					const struct bt_crypto *ctx,
+					const uint8_t *csrk,
 					const uint8_t *data,
 					const size_t size,
-					const int sign_count,
+					const uint32_t sign_count,
 					uint8_t *signature)
 {
-	(void)ctx;
-	(void)csrk;
-	(void)data;
-	(void)size;
-	(void)sign_count;
-	(void)signature;
+	//J 毎回鍵を展開する。連続して署名する時は btCryptoSignKeyInit() の結果を使い回すこと
+	BtCryptoCmacKey cmac;
+	int ret = btCryptoSignKeyInit(ctx, csrk, &cmac);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+
+	return btCryptoSignAtt(ctx, &cmac, data, size, sign_count, signature);
+}
+
+
+/*---------------------------------------------------------------------------*/
+uint64_t btUtilGetMonotonicTimeNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static size_t _histogram_index(uint64_t value)
+{
+	if (value < BT_UTIL_HISTOGRAM_SUB_BUCKETS) {
+		return (size_t)value;
+	}
+
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - 4;
+	size_t sub = (size_t)((value >> shift) & (BT_UTIL_HISTOGRAM_SUB_BUCKETS - 1));
+
+	return BT_UTIL_HISTOGRAM_SUB_BUCKETS * (size_t)(shift + 1) + sub;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint64_t _histogram_upper_bound(size_t index)
+{
+	if (index < BT_UTIL_HISTOGRAM_SUB_BUCKETS) {
+		return (uint64_t)index;
+	}
+
+	int shift = (int)(index / BT_UTIL_HISTOGRAM_SUB_BUCKETS) - 1;
+	uint64_t sub = (uint64_t)(index % BT_UTIL_HISTOGRAM_SUB_BUCKETS);
+	uint64_t lower = (BT_UTIL_HISTOGRAM_SUB_BUCKETS + sub) << shift;
+
+	return lower + ((1ULL << shift) - 1);
+}
+
+/*---------------------------------------------------------------------------*/
+int btUtilHistogramReset(BtUtilHistogram *hist)
+{
+	if (hist == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(hist, 0x00, sizeof(BtUtilHistogram));
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+int btUtilHistogramRecord(BtUtilHistogram *hist, uint64_t value)
+{
+	if (hist == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	//J 複数の受信スレッドから同時に記録される
+	__atomic_fetch_add(&hist->buckets[_histogram_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while ((value > max) &&
+		   !__atomic_compare_exchange_n(&hist->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+
+	return AKS_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+uint64_t btUtilHistogramPercentile(const BtUtilHistogram *hist, double percentile)
+{
+	if ((hist == NULL) || (hist->count == 0)) {
+		return 0;
+	}
+
+	uint64_t target = (uint64_t)((double)hist->count * percentile / 100.0);
+	if (target >= hist->count) {
+		return hist->max;
+	}
+
+	uint64_t seen = 0;
+	for (size_t i=0 ; i<BT_UTIL_HISTOGRAM_BUCKETS ; ++i) {
+		seen += hist->buckets[i];
+		if (seen > target) {
+			uint64_t upper = _histogram_upper_bound(i);
+			return (upper < hist->max) ? upper : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/*---------------------------------------------------------------------------*/
+int btUtilGetProcessUsage(BtUtilProcessUsage *usage)
+{
+	if (usage == NULL) {
+		return AKS_ERROR_NULL;
+	}
+
+	memset(usage, 0x00, sizeof(BtUtilProcessUsage));
+	usage->wall_ns = btUtilGetMonotonicTimeNs();
+
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		return -errno;
+	}
+	usage->cpu_ns = ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL
+				  + ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ULL;
+
+	//J ru_maxrss はピーク値なので、現在値は /proc から取る
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL) {
+		return -errno;
+	}
+	unsigned long pages_total = 0;
+	unsigned long pages_resident = 0;
+	int num = fscanf(fp, "%lu %lu", &pages_total, &pages_resident);
+	fclose(fp);
+	if (num != 2) {
+		return AKS_ERROR_IO;
+	}
+	usage->rss_bytes = (uint64_t)pages_resident * (uint64_t)sysconf(_SC_PAGESIZE);
 
 	return AKS_OK;
 }
 
+/*---------------------------------------------------------------------------*/
+double btUtilProcessCpuPercent(const BtUtilProcessUsage *begin, const BtUtilProcessUsage *end)
+{
+	if ((begin == NULL) || (end == NULL) || (end->wall_ns <= begin->wall_ns)) {
+		return 0.0;
+	}
+
+	return 100.0 * (double)(end->cpu_ns - begin->cpu_ns) / (double)(end->wall_ns - begin->wall_ns);
+}
 
 /*---------------------------------------------------------------------------*/
 const char *btUtilGattUuidToString(BtAttUuid16 uuid)
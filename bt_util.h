@@ -15,20 +15,47 @@
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-struct bt_crypto
+struct bt_crypto;		//J bt_crypto.h
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+//J 遅延計測用のヒストグラム (2のべき乗ごとに16分割、相対誤差 1/16 以下)
+#define BT_UTIL_HISTOGRAM_SUB_BUCKETS			(16)
+#define BT_UTIL_HISTOGRAM_BUCKETS				(BT_UTIL_HISTOGRAM_SUB_BUCKETS * 61)
+
+struct BtUtilHistogram
+{
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[BT_UTIL_HISTOGRAM_BUCKETS];
+};
+
+struct BtUtilProcessUsage
 {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;			//J user + system
+	uint64_t rss_bytes;
 };
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 int btUtilCryptoSignAtt(
-					struct bt_crypto *ctx,
-					uint8_t *csrk,
+					const struct bt_crypto *ctx,
+					const uint8_t *csrk,
 					const uint8_t *data,
 					const size_t size,
-					const int sign_count,
+					const uint32_t sign_count,
 					uint8_t *signature);
 
+uint64_t btUtilGetMonotonicTimeNs(void);
+
+int btUtilHistogramReset(BtUtilHistogram *hist);
+int btUtilHistogramRecord(BtUtilHistogram *hist, uint64_t value);
+uint64_t btUtilHistogramPercentile(const BtUtilHistogram *hist, double percentile);
+
+int btUtilGetProcessUsage(BtUtilProcessUsage *usage);
+double btUtilProcessCpuPercent(const BtUtilProcessUsage *begin, const BtUtilProcessUsage *end);
+
 const char *btUtilGattUuidToString(BtAttUuid16 uuid);
 const char *btUtilAttCharacteristicProperiesToString(uint8_t properties);
 
@@ -0,0 +1,289 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_bulk_transfer を bt_le_emulator の受信側 (btLeEmulatorSetBulkSink()) に繋いで確かめる
+ *J
+ *J - ACK を Notification で受ける時も Read で取る時も、Peripheral が Central に知らせた ACK より
+ *J   先に受け取るバイト数が window_size を超えず、ウィンドウが埋まって待つこと
+ *J - 全てのバイトが抜けも重複も無く届くこと (Peripheral 側の FNV-1a が一致する)
+ *J - 転送の途中で切断すると ACK が途絶えて AKS_ERROR_TIMEOUT で戻り、チェックポイントは
+ *J   Peripheral が受け取った位置を越えないこと
+ *J - 新しい接続で同じ Context を btBulkTransferRun() し直しても、チェックポイントを
+ *J   btBulkTransferSetCheckpoint() した新しい Context で Run しても、Peripheral の受信済みの
+ *J   位置から続きを送り (オフセット不一致で捨てられる PDU が無い)、最後まで届くこと
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_device.h"
+#include "bt_le_emulator.h"
+#include "bt_bulk_transfer.h"
+#include "test_util.h"
+
+#define TEST_MTU									(247)
+#define TEST_SIZE									(64 * 1024)
+#define TEST_WINDOW									(2048)
+#define TEST_BURST									(4)
+#define TEST_ACK_INTERVAL							(480)		//J 2 PDU ごと
+#define TEST_ACK_TIMEOUT_MS							(200)
+
+static BtLeEmulatorContext s_emu;
+static BtGattDeviceContext s_dev;
+static BtAttHandle s_data_handle;
+static BtAttHandle s_ack_handle;
+
+static uint8_t  s_data[TEST_SIZE];
+
+//J 切断を起こす位置 (0 なら起こさない) と、各 Run で最初に報告されたチェックポイント
+static uint64_t s_disconnect_at = 0;
+static bool     s_disconnected  = false;
+static bool     s_first_progress;
+static uint64_t s_first_acked;
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_fnv1a(const uint8_t *data, const size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i=0 ; i<size ; ++i) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _test_progress(void *arg, const BtBulkTransferProgress *progress)
+{
+	(void)arg;
+
+	if (s_first_progress) {
+		s_first_progress = false;
+		s_first_acked    = progress->acked;
+	}
+
+	//J 受信スレッドを止めて Link が切れたことにする (ACK が届かなくなる)
+	if ((s_disconnect_at != 0) && !s_disconnected && (progress->acked >= s_disconnect_at)) {
+		s_disconnected = true;
+		(void)btLeDeviceShutdown(&s_dev);
+	}
+
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_create_emulator(void)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 6;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = TEST_MTU;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu, &link));
+
+	uint32_t zero = 0;
+	BtAttHandle service;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddPrimaryService(&s_emu, 0xFFF0, service));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, 0xFFF1,
+								BtAttCharacteristicProperties::cWriteWithoutResponse,
+								&zero, sizeof(zero), s_data_handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, 0xFFF2,
+								BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cNotify,
+								&zero, sizeof(zero), s_ack_handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorSetBulkSink(&s_emu, s_data_handle, s_ack_handle, true, TEST_ACK_INTERVAL));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 同じ Peripheral に繋ぎ直す (Peripheral は受信済みのバイト数を覚えている)
+/*---------------------------------------------------------------------------*/
+static void _test_connect(void)
+{
+	int sock = dup(btLeEmulatorGetCentralSocket(&s_emu));
+	TEST_CHECK(sock >= 0);
+	(void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_dev, sock, NULL));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_init_parameters(BtBulkTransferParameters *params, const bool use_notification)
+{
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferInitParameters(params));
+	params->data_handle          = s_data_handle;
+	params->ack_handle           = s_ack_handle;
+	params->ack_config_handle    = use_notification ? (BtAttHandle)(s_ack_handle + 1) : 0;
+	params->framed               = true;
+	params->window_size          = TEST_WINDOW;
+	params->burst_pdus           = TEST_BURST;
+	params->ack_timeout_ms       = TEST_ACK_TIMEOUT_MS;
+	params->ack_poll_interval_ms = 5;
+	params->max_retries          = 1;
+	params->progress_interval_ms = 0;
+	params->progress             = _test_progress;
+	params->progress_arg         = NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_get_sink(uint32_t &received, uint32_t &hash, uint64_t &num_discarded, uint32_t &max_unacked)
+{
+	pthread_mutex_lock(&s_emu.mutex);
+	received      = s_emu.bulk.received;
+	hash          = s_emu.bulk.hash;
+	num_discarded = s_emu.bulk.num_discarded;
+	max_unacked   = s_emu.bulk.max_unacked;
+	pthread_mutex_unlock(&s_emu.mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J ACK を待ちながら window_size まで先に送る
+/*---------------------------------------------------------------------------*/
+static void _test_window(const bool use_notification)
+{
+	_test_create_emulator();
+	_test_connect();
+
+	BtBulkTransferParameters params;
+	_test_init_parameters(&params, use_notification);
+	s_disconnect_at = 0;
+
+	BtBulkTransferContext xfer;
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferCreate(&xfer, &params, s_data, sizeof(s_data)));
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferRun(&xfer, &s_dev));
+	TEST_CHECK_EQ(TEST_SIZE, btBulkTransferGetCheckpoint(&xfer));
+
+	BtBulkTransferProgress progress;
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferGetProgress(&xfer, &progress));
+	TEST_CHECK_EQ(TEST_SIZE, progress.acked);
+	TEST_CHECK(progress.stalls > 0);
+	TEST_CHECK_EQ(0, progress.retransmitted_bytes);
+
+	uint32_t received, hash, max_unacked;
+	uint64_t num_discarded;
+	_test_get_sink(received, hash, num_discarded, max_unacked);
+	TEST_CHECK_EQ(TEST_SIZE, received);
+	TEST_CHECK_EQ(_test_fnv1a(s_data, sizeof(s_data)), hash);
+	TEST_CHECK_EQ(0, num_discarded);
+
+	//J ウィンドウは越えないが、ACK 1回分より先まで使っている
+	TEST_CHECK(max_unacked <= TEST_WINDOW);
+	TEST_CHECK(max_unacked > TEST_ACK_INTERVAL);
+
+	printf("  %s: max unacked %u / %u, %llu stalls\n",
+								use_notification ? "notification" : "read",
+								max_unacked, TEST_WINDOW, (unsigned long long)progress.stalls);
+
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferDestroy(&xfer));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J at を ACK された後で切断する。切断前のチェックポイントを返す
+/*---------------------------------------------------------------------------*/
+static uint64_t _test_run_until_disconnect(BtBulkTransferContext *xfer, const uint64_t at)
+{
+	s_disconnect_at  = at;
+	s_disconnected   = false;
+	s_first_progress = true;
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, btBulkTransferRun(xfer, &s_dev));
+	TEST_CHECK(s_disconnected);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev));
+
+	uint64_t checkpoint = btBulkTransferGetCheckpoint(xfer);
+	TEST_CHECK(checkpoint >= at);
+	TEST_CHECK(checkpoint < TEST_SIZE);
+
+	return checkpoint;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_resume(void)
+{
+	_test_create_emulator();
+	_test_connect();
+
+	BtBulkTransferParameters params;
+	_test_init_parameters(&params, true);
+
+	uint32_t received, hash, max_unacked;
+	uint64_t num_discarded, discarded_before;
+
+	//J 1/3 で切断し、同じ Context を新しい接続で Run し直す
+	BtBulkTransferContext xfer;
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferCreate(&xfer, &params, s_data, sizeof(s_data)));
+	uint64_t checkpoint = _test_run_until_disconnect(&xfer, TEST_SIZE / 3);
+
+	//J 切れた後も送った分は Peripheral に届いている (ACK はチェックポイントにならない)
+	_test_get_sink(received, hash, discarded_before, max_unacked);
+	TEST_CHECK(received >= checkpoint);
+
+	_test_connect();
+	checkpoint = _test_run_until_disconnect(&xfer, TEST_SIZE * 2 / 3);
+	TEST_CHECK(s_first_acked >= received);
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferDestroy(&xfer));
+
+	_test_get_sink(received, hash, num_discarded, max_unacked);
+	TEST_CHECK(received >= checkpoint);
+
+	//J 保存しておいたチェックポイントで新しい Context を作って再開する
+	_test_connect();
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferCreate(&xfer, &params, s_data, sizeof(s_data)));
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferSetCheckpoint(&xfer, checkpoint));
+	s_disconnect_at  = 0;
+	s_first_progress = true;
+	_test_get_sink(received, hash, discarded_before, max_unacked);
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferRun(&xfer, &s_dev));
+	TEST_CHECK(s_first_acked >= received);
+	TEST_CHECK_EQ(TEST_SIZE, btBulkTransferGetCheckpoint(&xfer));
+
+	//J 再開した Run は Peripheral の位置から送るので、捨てられる PDU は無い
+	_test_get_sink(received, hash, num_discarded, max_unacked);
+	TEST_CHECK_EQ(TEST_SIZE, received);
+	TEST_CHECK_EQ(_test_fnv1a(s_data, sizeof(s_data)), hash);
+	TEST_CHECK_EQ(discarded_before, num_discarded);
+	TEST_CHECK(max_unacked <= TEST_WINDOW);
+
+	TEST_CHECK_EQ(AKS_OK, btBulkTransferDestroy(&xfer));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	uint32_t x = 0x12345678;
+	for (size_t i=0 ; i<sizeof(s_data) ; ++i) {
+		x = x * 1103515245u + 12345u;
+		s_data[i] = (uint8_t)(x >> 16);
+	}
+
+	_test_window(true);
+	_test_window(false);
+	_test_resume();
+
+	return test_result("bulk_transfer");
+}
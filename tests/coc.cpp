@@ -0,0 +1,337 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_le_coc を SOCK_SEQPACKET の socketpair() で btLeCocOpenWithSocket() して確かめる
+ *J (L2CAP の代わりに socketpair() の反対側が Peer になる)
+ *J
+ *J - 受信スロットのリングが折り返しても SDU の中身と順番が保たれ、全て使用中なら AKS_ERROR_FULL
+ *J - btLeCocRead() の途中 (rx_offset) では btLeCocReceive() できず、btLeCocReceive() で
+ *J   借りている間 (rx_held) は btLeCocRead() できないこと。返した後は SDU を跨いで読めること
+ *J - スロットより大きい SDU は切り詰めて rx_truncated に数えること
+ *J - btLeCocWrite() が sndmtu ごとの SDU に区切り、Credit の見積もりを数えること
+ *J - Peer が読まない (Credit が戻らない) と credit_timeout_ms で AKS_ERROR_TIMEOUT になり、
+ *J   途中で読み始めれば待った後で送り終えること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_le_device.h"
+#include "bt_le_coc.h"
+#include "test_util.h"
+
+#define TEST_MTU									(256)
+#define TEST_MPS									(64)
+#define TEST_NUM_SLOTS								(4)
+#define TEST_CREDIT_TIMEOUT_MS						(200)
+
+static uint8_t s_rx_buf[TEST_NUM_SLOTS * TEST_MTU + TEST_MTU / 2];	//J 端数はスロットにならない
+static int     s_peer;
+static uint32_t s_drain_delay_ms;
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_fill(uint8_t *buf, const size_t len, const uint8_t seq)
+{
+	for (size_t i=0 ; i<len ; ++i) {
+		buf[i] = (uint8_t)(seq + i * 3);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool _test_match(const uint8_t *buf, const size_t len, const uint8_t seq)
+{
+	for (size_t i=0 ; i<len ; ++i) {
+		if (buf[i] != (uint8_t)(seq + i * 3)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Peer から seq の SDU を len バイト送る
+/*---------------------------------------------------------------------------*/
+static void _test_peer_send(const size_t len, const uint8_t seq)
+{
+	uint8_t buf[TEST_MTU * 2];
+	_test_fill(buf, len, seq);
+	TEST_CHECK_EQ(len, send(s_peer, buf, len, 0));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_open(BtLeCocContext *coc)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+	s_peer = fds[1];
+
+	BtLeCocOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeCocInitOptions(&options));
+	options.mtu               = TEST_MTU;
+	options.mps               = TEST_MPS;
+	options.credit_timeout_ms = TEST_CREDIT_TIMEOUT_MS;
+	TEST_CHECK_EQ(AKS_OK, btLeCocOpenWithSocket(coc, fds[0], &options, s_rx_buf, sizeof(s_rx_buf)));
+	TEST_CHECK_EQ(TEST_MTU, coc->sndmtu);
+	TEST_CHECK_EQ(TEST_MTU, coc->rcvmtu);
+	TEST_CHECK_EQ(TEST_NUM_SLOTS, coc->num_slots);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_close(BtLeCocContext *coc)
+{
+	TEST_CHECK_EQ(AKS_OK, btLeCocClose(coc));
+	TEST_CHECK_EQ(-1, coc->sock);
+	close(s_peer);
+	s_peer = -1;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J スロットのリングを折り返させる
+/*---------------------------------------------------------------------------*/
+static void _test_slots(void)
+{
+	static BtLeCocContext coc;
+	_test_open(&coc);
+
+	BtLeCocSdu sdus[TEST_NUM_SLOTS];
+	size_t num = 0;
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 0));
+
+	for (uint8_t seq=0 ; seq<3 ; ++seq) {
+		_test_peer_send(10 + seq, seq);
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 1000));
+	TEST_CHECK_EQ(3, num);
+	for (uint8_t seq=0 ; (seq<3) && (seq<num) ; ++seq) {
+		TEST_CHECK_EQ(s_rx_buf + (size_t)seq * TEST_MTU, sdus[seq].data);
+		TEST_CHECK_EQ(10 + seq, sdus[seq].len);
+		TEST_CHECK(_test_match(sdus[seq].data, sdus[seq].len, seq));
+	}
+	TEST_CHECK_EQ(3, coc.rx_held);
+
+	//J 古い 2つだけ返すと、空きは末尾の 1つと先頭の 2つ
+	TEST_CHECK_EQ((int)AKS_ERROR_INVALID, btLeCocRelease(&coc, 4));
+	TEST_CHECK_EQ(AKS_OK, btLeCocRelease(&coc, 2));
+	TEST_CHECK_EQ(2, coc.rx_head);
+	TEST_CHECK_EQ(1, coc.rx_held);
+
+	for (uint8_t seq=3 ; seq<6 ; ++seq) {
+		_test_peer_send(10 + seq, seq);
+	}
+	usleep(10000);
+
+	//J 末尾のスロットまでしか一度には受けない
+	TEST_CHECK_EQ(AKS_OK, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 1000));
+	TEST_CHECK_EQ(1, num);
+	if (num == 1) {
+		TEST_CHECK_EQ(s_rx_buf + 3 * TEST_MTU, sdus[0].data);
+		TEST_CHECK(_test_match(sdus[0].data, sdus[0].len, 3));
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 1000));
+	TEST_CHECK_EQ(2, num);
+	for (uint8_t i=0 ; (i<2) && (i<num) ; ++i) {
+		TEST_CHECK_EQ(s_rx_buf + (size_t)i * TEST_MTU, sdus[i].data);
+		TEST_CHECK_EQ(14 + i, sdus[i].len);
+		TEST_CHECK(_test_match(sdus[i].data, sdus[i].len, (uint8_t)(4 + i)));
+	}
+
+	//J 全スロットを借りている
+	TEST_CHECK_EQ(TEST_NUM_SLOTS, coc.rx_held);
+	_test_peer_send(20, 6);
+	TEST_CHECK_EQ((int)AKS_ERROR_FULL, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 0));
+	TEST_CHECK_EQ(0, num);
+
+	TEST_CHECK_EQ(AKS_OK, btLeCocRelease(&coc, TEST_NUM_SLOTS));
+	TEST_CHECK_EQ(0, coc.rx_count);
+	TEST_CHECK_EQ(AKS_OK, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 1000));
+	TEST_CHECK_EQ(1, num);
+	if (num == 1) {
+		TEST_CHECK(_test_match(sdus[0].data, sdus[0].len, 6));
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeCocRelease(&coc, 1));
+
+	BtLeCocStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeCocGetStatistics(&coc, &stats));
+	TEST_CHECK_EQ(7, stats.rx_sdus);
+	TEST_CHECK_EQ(10 + 11 + 12 + 13 + 14 + 15 + 20, stats.rx_bytes);
+	TEST_CHECK_EQ(0, stats.rx_truncated);
+
+	//J Peer が閉じたら AKS_ERROR_IO
+	close(s_peer);
+	s_peer = -1;
+	TEST_CHECK_EQ((int)AKS_ERROR_IO, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 1000));
+	TEST_CHECK_EQ(AKS_OK, btLeCocClose(&coc));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J btLeCocReceive() と btLeCocRead() を混ぜる
+/*---------------------------------------------------------------------------*/
+static void _test_read(void)
+{
+	static BtLeCocContext coc;
+	_test_open(&coc);
+
+	_test_peer_send(100, 0x10);
+	_test_peer_send(50, 0x20);
+
+	//J 先頭の SDU を途中まで読む
+	uint8_t buf[TEST_MTU * 2];
+	size_t read_size = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeCocRead(&coc, buf, 30, read_size, 1000));
+	TEST_CHECK_EQ(30, read_size);
+	TEST_CHECK(_test_match(buf, 30, 0x10));
+	TEST_CHECK_EQ(30, coc.rx_offset);
+
+	BtLeCocSdu sdus[TEST_NUM_SLOTS];
+	size_t num = 0;
+	TEST_CHECK_EQ((int)AKS_ERROR_INVALID, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 0));
+
+	//J 残りの 70 バイトで止まらずに次の SDU も読む
+	TEST_CHECK_EQ(AKS_OK, btLeCocRead(&coc, buf, 100, read_size, 1000));
+	TEST_CHECK_EQ(100, read_size);
+	TEST_CHECK(_test_match(buf, 70, (uint8_t)(0x10 + 30 * 3)));
+	TEST_CHECK(_test_match(buf + 70, 30, 0x20));
+	TEST_CHECK_EQ(30, coc.rx_offset);
+	TEST_CHECK_EQ(AKS_OK, btLeCocRead(&coc, buf, sizeof(buf), read_size, 1000));
+	TEST_CHECK_EQ(20, read_size);
+	TEST_CHECK(_test_match(buf, 20, (uint8_t)(0x20 + 30 * 3)));
+	TEST_CHECK_EQ(0, coc.rx_offset);
+	TEST_CHECK_EQ(0, coc.rx_count);
+
+	//J 借りている間は読めない。返せば借りていない分から読む
+	_test_peer_send(40, 0x30);
+	_test_peer_send(60, 0x40);
+	usleep(10000);
+	TEST_CHECK_EQ(AKS_OK, btLeCocReceive(&coc, sdus, 1, num, 1000));
+	TEST_CHECK_EQ(1, num);
+	TEST_CHECK_EQ(2, coc.rx_count);
+	TEST_CHECK_EQ((int)AKS_ERROR_INVALID, btLeCocRead(&coc, buf, sizeof(buf), read_size, 0));
+	if (num == 1) {
+		TEST_CHECK(_test_match(sdus[0].data, sdus[0].len, 0x30));
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeCocRelease(&coc, 1));
+	TEST_CHECK_EQ(AKS_OK, btLeCocRead(&coc, buf, sizeof(buf), read_size, 0));
+	TEST_CHECK_EQ(60, read_size);
+	TEST_CHECK(_test_match(buf, 60, 0x40));
+
+	//J スロットより大きい SDU
+	_test_peer_send(TEST_MTU + 40, 0x50);
+	TEST_CHECK_EQ(AKS_OK, btLeCocReceive(&coc, sdus, TEST_NUM_SLOTS, num, 1000));
+	TEST_CHECK_EQ(1, num);
+	if (num == 1) {
+		TEST_CHECK_EQ(TEST_MTU, sdus[0].len);
+		TEST_CHECK(_test_match(sdus[0].data, sdus[0].len, 0x50));
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeCocRelease(&coc, num));
+
+	BtLeCocStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeCocGetStatistics(&coc, &stats));
+	TEST_CHECK_EQ(1, stats.rx_truncated);
+	TEST_CHECK_EQ(5, stats.rx_sdus);
+	TEST_CHECK_EQ(100 + 50 + 40 + 60 + TEST_MTU, stats.rx_bytes);
+
+	_test_close(&coc);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void *_test_drain_func(void *arg)
+{
+	(void)arg;
+
+	usleep(s_drain_delay_ms * 1000);
+
+	uint8_t buf[TEST_MTU];
+	while (recv(s_peer, buf, sizeof(buf), 0) > 0) {
+	}
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Peer が読まないと Socket に書けなくなる (Credit が尽きた時と同じ)
+/*---------------------------------------------------------------------------*/
+static void _test_credits(void)
+{
+	static BtLeCocContext coc;
+	_test_open(&coc);
+
+	int sndbuf = 4096;
+	TEST_CHECK_EQ(0, setsockopt(coc.sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)));
+
+	//J btLeCocWrite() は sndmtu ごとに区切る
+	static uint8_t data[64 * 1024];
+	_test_fill(data, sizeof(data), 0x60);
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, btLeCocWrite(&coc, data, sizeof(data)));
+	uint64_t elapsed_ms = (btUtilGetMonotonicTimeNs() - start_ns) / 1000000ULL;
+	TEST_CHECK(elapsed_ms >= TEST_CREDIT_TIMEOUT_MS);
+
+	BtLeCocStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeCocGetStatistics(&coc, &stats));
+	TEST_CHECK_EQ(1, stats.credit_stalls);
+	TEST_CHECK(stats.credit_wait_ns >= (uint64_t)TEST_CREDIT_TIMEOUT_MS * 1000000ULL);
+	TEST_CHECK(stats.tx_sdus > 0);
+	TEST_CHECK(stats.tx_sdus < sizeof(data) / TEST_MTU);
+	TEST_CHECK_EQ(stats.tx_sdus * TEST_MTU, stats.tx_bytes);
+	//J 256 + 2 バイトは MPS 64 で 5 K-frame
+	TEST_CHECK_EQ(stats.tx_sdus * 5, stats.tx_credits_estimated);
+
+	//J 途中で Peer が読み始めれば、待った後で送り終える
+	TEST_CHECK_EQ(AKS_OK, btLeCocResetStatistics(&coc));
+	s_drain_delay_ms = TEST_CREDIT_TIMEOUT_MS / 4;
+	pthread_t thread;
+	TEST_CHECK_EQ(0, pthread_create(&thread, NULL, _test_drain_func, NULL));
+	TEST_CHECK_EQ(AKS_OK, btLeCocWrite(&coc, data, sizeof(data) - 10));
+	TEST_CHECK_EQ(AKS_OK, btLeCocGetStatistics(&coc, &stats));
+	TEST_CHECK(stats.credit_stalls >= 1);
+	TEST_CHECK(stats.credit_wait_ns > 0);
+	TEST_CHECK_EQ((sizeof(data) - 10 + TEST_MTU - 1) / TEST_MTU, stats.tx_sdus);
+	TEST_CHECK_EQ(sizeof(data) - 10, stats.tx_bytes);
+
+	//J 大きすぎる SDU は送らない
+	BtLeCocSdu sdu;
+	sdu.data = data;
+	sdu.len  = TEST_MTU + 1;
+	TEST_CHECK_EQ((int)AKS_ERROR_NOBUF, btLeCocSendSdus(&coc, &sdu, 1));
+
+	TEST_CHECK_EQ(AKS_OK, btLeCocClose(&coc));
+	shutdown(s_peer, SHUT_RDWR);
+	pthread_join(thread, NULL);
+	close(s_peer);
+	s_peer = -1;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_slots();
+	_test_read();
+	_test_credits();
+
+	return test_result("coc");
+}
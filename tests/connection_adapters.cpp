@@ -0,0 +1,230 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_le_connection_manager の Adapter の振り分けを、Controller の代わりの
+ *J BtLeConnectionManagerOpenCb と bt_le_emulator で確かめる
+ *J
+ *J - hci5 (最大 4)、hci6 (最大 8)、hci9 (ENODEV を返す) に 12 台を張ると、
+ *J   hci9 は落とされ、hci5 と hci6 がそれぞれ上限まで埋まること
+ *J - hci6 の接続だけに通信させると、hci6 の推定 Airtime だけが増えること
+ *J - hci5 の接続を切って hci5 を ENODEV にすると、hci5 は落とされ、
+ *J   切れた接続は試し直した hci9 に張り直されること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+#include "bt_le_connection_manager.h"
+#include "test_util.h"
+
+#define TEST_NUM_DEVICES							(12)
+#define TEST_ADDRESS_FORMAT							"AA:BB:CC:DD:EE:%02X"
+#define TEST_RUN_TIMEOUT_MS							(3000)
+#define TEST_RELOCATE_TIMEOUT_MS					(10000)	//J 落とした Adapter を試し直すまで待つ
+
+static BtLeEmulatorContext   s_emu[TEST_NUM_DEVICES];
+static BtGattDeviceContext   s_dev[TEST_NUM_DEVICES];
+static BtLeConnectionManager s_mgr;
+static int                   s_placed[TEST_NUM_DEVICES];	//J 最後に張った Adapter の dev_id
+static int                   s_broken = 9;				//J ENODEV を返す Adapter の dev_id
+static BtAttHandle           s_handle;
+
+
+/*---------------------------------------------------------------------------*/
+//J アドレスの最後のバイトの番号の Emulator に繋ぐ
+/*---------------------------------------------------------------------------*/
+static int _test_open(void *arg, const char *btaddr, const BtLeDeviceOptions *options)
+{
+	(void)arg;
+
+	unsigned int i = 0;
+	if ((sscanf(btaddr + 15, "%x", &i) != 1) || (i >= TEST_NUM_DEVICES)) {
+		return -EINVAL;
+	}
+	if (options->adapter == s_broken) {
+		return -ENODEV;
+	}
+
+	//J Device が閉じるのは dup() した方。元の central_sock はこのテストが閉じる
+	int sock = dup(btLeEmulatorGetCentralSocket(&s_emu[i]));
+	if (sock < 0) {
+		return -errno;
+	}
+	(void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	s_placed[i] = options->adapter;
+	return sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_start_emulator(const uint32_t i)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 4;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = 185;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu[i], &link));
+
+	BtAttHandle service;
+	uint8_t value[4] = { 0 };
+	(void)btLeEmulatorAddPrimaryService(&s_emu[i], 0x1801, service);
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu[i], 0x2A00,
+								BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cNotify,
+								value, sizeof(value), s_handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu[i]));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static const BtLeConnectionManagerAdapter *_test_adapter(const uint32_t index)
+{
+	const BtLeConnectionManagerAdapter *adapter = NULL;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerGetAdapter(&s_mgr, index, &adapter));
+	return adapter;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_dump(const char *name)
+{
+	printf("  %s:", name);
+	for (uint32_t a=0 ; a<s_mgr.num_adapters ; ++a) {
+		const BtLeConnectionManagerAdapter *adapter = _test_adapter(a);
+		printf(" hci%d %s conn %u airtime %llu us/s;",
+				adapter->dev_id, adapter->up ? "up" : "down", adapter->connections,
+				(unsigned long long)adapter->airtime_us);
+	}
+	printf(" placed");
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		printf(" %d", s_placed[i]);
+	}
+	printf("\n");
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_count_placed(const int dev_id)
+{
+	uint32_t count = 0;
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		if (s_placed[i] == dev_id) {
+			count++;
+		}
+	}
+	return count;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		_test_start_emulator(i);
+		s_placed[i] = -1;
+	}
+
+	BtLeConnectionManagerOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerInitOptions(&options));
+	options.max_pending        = 2;
+	options.attempt_timeout_ms = 500;
+	options.open               = _test_open;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerCreate(&s_mgr, &options));
+
+	uint32_t index;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerAddAdapter(&s_mgr, 5, 4, index));
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerAddAdapter(&s_mgr, 6, 8, index));
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerAddAdapter(&s_mgr, 9, 8, index));
+	TEST_CHECK(btLeConnectionManagerAddAdapter(&s_mgr, 6, 8, index) != AKS_OK);
+
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		char btaddr[18];
+		snprintf(btaddr, sizeof(btaddr), TEST_ADDRESS_FORMAT, i);
+		TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerAdd(&s_mgr, &s_dev[i], btaddr, index));
+	}
+
+	//J hci9 は落とされ、残りの 2 つが上限まで埋まる
+	uint32_t num_connected = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerRun(&s_mgr, TEST_RUN_TIMEOUT_MS, num_connected));
+	_test_dump("connect");
+	TEST_CHECK_EQ(TEST_NUM_DEVICES, num_connected);
+	TEST_CHECK_EQ(4, _test_adapter(0)->connections);
+	TEST_CHECK_EQ(8, _test_adapter(1)->connections);
+	TEST_CHECK(!_test_adapter(2)->up);
+	TEST_CHECK_EQ(0, _test_count_placed(9));
+
+	//J hci6 の接続だけで Read を続け、Run() に Airtime を見積もらせる
+	for (uint32_t round=0 ; round<2 ; ++round) {
+		for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+			if (s_placed[i] != 6) {
+				continue;
+			}
+			for (uint32_t k=0 ; k<20 ; ++k) {
+				uint8_t value[4];
+				size_t read_size = 0;
+				TEST_CHECK_EQ(AKS_OK, BtGattCharacteristicValueRead::btGattReadCharacteristicValue(s_dev[i], s_handle, value, sizeof(value), read_size));
+			}
+		}
+		usleep(600 * 1000);
+		TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerRun(&s_mgr, 10, num_connected));
+	}
+	_test_dump("traffic");
+	TEST_CHECK(_test_adapter(1)->airtime_us > 0);
+	TEST_CHECK_EQ(0, _test_adapter(0)->airtime_us);
+
+	//J hci5 の接続を切り、hci5 を壊す。切れた接続は試し直した hci9 に移る
+	uint32_t moved = 0;
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		if (s_placed[i] == 5) {
+			close(btLeEmulatorGetCentralSocket(&s_emu[i]));
+			TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu[i]));
+			moved++;
+		}
+	}
+	usleep(100 * 1000);
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		if (s_placed[i] == 5) {
+			_test_start_emulator(i);
+		}
+	}
+	s_broken = 5;
+
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerRun(&s_mgr, TEST_RELOCATE_TIMEOUT_MS, num_connected));
+	_test_dump("relocate");
+	TEST_CHECK_EQ(TEST_NUM_DEVICES, num_connected);
+	TEST_CHECK(!_test_adapter(0)->up);
+	TEST_CHECK(_test_adapter(2)->up);
+	TEST_CHECK_EQ(0, _test_count_placed(5));
+	TEST_CHECK_EQ(moved, _test_count_placed(9));
+
+	BtLeConnectionManagerStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerGetStatistics(&s_mgr, &stats));
+	TEST_CHECK_EQ(moved, stats.relocations);
+	TEST_CHECK_EQ(2, stats.adapter_failures);
+	TEST_CHECK_EQ(0, stats.failed);
+
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerDestroy(&s_mgr));
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev[i]));
+		close(btLeEmulatorGetCentralSocket(&s_emu[i]));
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu[i]));
+	}
+
+	return test_result("connection_adapters");
+}
@@ -0,0 +1,327 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_le_connection_manager の connect() から ATT の準備までを、Controller の代わりの
+ *J BtLeConnectionManagerOpenCb で確かめる
+ *J
+ *J - 0 番は connect() がすぐには終わらない (送信バッファを埋めた socketpair で
+ *J   POLLOUT にならない)。終わるまで他の connect() は EBUSY になり、待ち行列に戻ること
+ *J - 1 番は Exchange MTU に答えない。準備に setup_timeout_ms かかっても、後から
+ *J   接続した bt_le_emulator の 2〜4 番はそれを待たずに接続済みになること
+ *J - 5 番は connect() が終わらない。attempt_timeout_ms で取り消して張り直し、
+ *J   max_attempts を使い切ったら AKS_ERROR_TIMEOUT で cFailed になること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+#include "bt_le_connection_manager.h"
+#include "test_util.h"
+
+#define TEST_NUM_DEVICES							(6)
+#define TEST_SLOW_DEVICE							(0)
+#define TEST_SILENT_DEVICE							(1)
+#define TEST_FIRST_EMULATOR							(2)
+#define TEST_DEAD_DEVICE							(5)
+#define TEST_ADDRESS_FORMAT							"AA:BB:CC:DD:EE:%02X"
+
+#define TEST_SLOW_CONNECT_MS						(200)	//J 0 番の connect() が終わるまで
+#define TEST_SETUP_TIMEOUT_MS						(600)
+#define TEST_ATTEMPT_TIMEOUT_MS						(500)
+#define TEST_MAX_ATTEMPTS							(2)
+#define TEST_RUN_TIMEOUT_MS							(5000)
+#define TEST_SLOW_MTU								(185)	//J 0 番が Exchange MTU に返す値
+
+static BtLeEmulatorContext   s_emu[TEST_NUM_DEVICES];
+static BtGattDeviceContext   s_dev[TEST_NUM_DEVICES];
+static BtLeConnectionManager s_mgr;
+
+static int       s_slow_sock = -1;			//J 0 番の Central 側 (Device が閉じる)
+static int       s_slow_peer = -1;
+static uint32_t  s_slow_filled;				//J 送信バッファを埋めた PDU の数
+static uint32_t  s_slow_requests;			//J 0 番が答えた Request の数
+static pthread_t s_slow_thread;
+static int       s_silent_peer = -1;
+static int       s_dead_peers[TEST_MAX_ATTEMPTS];
+static uint32_t  s_num_dead_peers;
+
+
+/*---------------------------------------------------------------------------*/
+//J POLLOUT にならなくなるまで送信バッファを埋めた socketpair を作る。埋めた PDU の数を返す
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_stalled_pair(int &sock, int &peer)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+	int sndbuf = 4096;
+	(void)setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	(void)fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	uint8_t filler[256];
+	memset(filler, 0x00, sizeof(filler));
+	uint32_t filled = 0;
+	while (send(fds[0], filler, sizeof(filler), 0) == (ssize_t)sizeof(filler)) {
+		filled++;
+	}
+
+	struct pollfd pfd;
+	pfd.fd      = fds[0];
+	pfd.events  = POLLOUT;
+	pfd.revents = 0;
+	TEST_CHECK_EQ(0, poll(&pfd, 1, 0));
+
+	sock = fds[0];
+	peer = fds[1];
+	return filled;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 0 番の Peripheral。TEST_SLOW_CONNECT_MS 後に送信バッファを空けて connect() を終わらせ、
+//J その後は Exchange MTU と Write Request に答え、他の Request は Attribute Not Found にする
+/*---------------------------------------------------------------------------*/
+static void *_test_slow_peer(void *arg)
+{
+	(void)arg;
+	usleep(TEST_SLOW_CONNECT_MS * 1000);
+
+	uint8_t pdu[BT_ATT_MAX_LE_MTU];
+	for (uint32_t i=0 ; i<s_slow_filled ; ++i) {
+		(void)recv(s_slow_peer, pdu, sizeof(pdu), 0);
+	}
+
+	while (1) {
+		ssize_t len = recv(s_slow_peer, pdu, sizeof(pdu), 0);
+		if (len <= 0) {
+			break;
+		}
+
+		uint8_t rsp[5];
+		size_t rsp_len;
+		if (pdu[0] == BtAttPduOpcode::cAttOpcodeExchangeMtuRequest) {
+			rsp[0] = BtAttPduOpcode::cAttOpcodeExchangeMtuResponse;
+			rsp[1] = (uint8_t)(TEST_SLOW_MTU & 0xFF);
+			rsp[2] = (uint8_t)(TEST_SLOW_MTU >> 8);
+			rsp_len = 3;
+		}
+		else if (pdu[0] == BtAttPduOpcode::cAttOpcodeWriteRequest) {
+			rsp[0] = BtAttPduOpcode::cAttOpcodeWriteResponse;
+			rsp_len = 1;
+		}
+		else if ((pdu[0] & 0x40) == 0) {
+			rsp[0] = BtAttPduOpcode::cAttOpcodeErrorResponse;
+			rsp[1] = pdu[0];
+			rsp[2] = (len >= 3) ? pdu[1] : 0;
+			rsp[3] = (len >= 3) ? pdu[2] : 0;
+			rsp[4] = BtAttErrorCode::cAttErrorCodeAttributeNotFound;
+			rsp_len = 5;
+		}
+		else {
+			continue;
+		}
+		s_slow_requests++;
+		if (send(s_slow_peer, rsp, rsp_len, 0) != (ssize_t)rsp_len) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J アドレスの最後のバイトの番号で振り分ける
+/*---------------------------------------------------------------------------*/
+static int _test_open(void *arg, const char *btaddr, const BtLeDeviceOptions *options)
+{
+	(void)arg;
+	(void)options;
+
+	unsigned int i = 0;
+	if ((sscanf(btaddr + 15, "%x", &i) != 1) || (i >= TEST_NUM_DEVICES)) {
+		return -EINVAL;
+	}
+
+	//J Controller は LE Create Connection を 1つずつしか受け付けない
+	if ((s_slow_sock >= 0) && (i != TEST_SLOW_DEVICE)) {
+		struct pollfd pfd;
+		pfd.fd      = s_slow_sock;
+		pfd.events  = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) == 0) {
+			return -EBUSY;
+		}
+	}
+
+	int sock;
+	if (i == TEST_SLOW_DEVICE) {
+		s_slow_filled = _test_stalled_pair(s_slow_sock, s_slow_peer);
+		TEST_CHECK_EQ(0, pthread_create(&s_slow_thread, NULL, _test_slow_peer, NULL));
+		return s_slow_sock;
+	}
+	if (i == TEST_SILENT_DEVICE) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+			return -errno;
+		}
+		s_silent_peer = fds[1];
+		(void)fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+		return fds[0];
+	}
+	if (i == TEST_DEAD_DEVICE) {
+		//J 期限切れで Manager が sock を閉じる。peer はこのテストが閉じる
+		int peer = -1;
+		(void)_test_stalled_pair(sock, peer);
+		TEST_CHECK(s_num_dead_peers < TEST_MAX_ATTEMPTS);
+		if (s_num_dead_peers < TEST_MAX_ATTEMPTS) {
+			s_dead_peers[s_num_dead_peers++] = peer;
+		}
+		return sock;
+	}
+
+	//J Device が閉じるのは dup() した方。元の central_sock はこのテストが閉じる
+	sock = dup(btLeEmulatorGetCentralSocket(&s_emu[i]));
+	if (sock < 0) {
+		return -errno;
+	}
+	(void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	return sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_start_emulator(const uint32_t i)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 4;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = 185;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu[i], &link));
+
+	BtAttHandle service;
+	BtAttHandle handle;
+	uint8_t value[4] = { 0 };
+	(void)btLeEmulatorAddPrimaryService(&s_emu[i], 0x1801, service);
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu[i], 0x2A00,
+								BtAttCharacteristicProperties::cRead, value, sizeof(value), handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu[i]));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static const BtLeConnectionManagerEntry *_test_entry(const uint32_t index)
+{
+	const BtLeConnectionManagerEntry *entry = NULL;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerGetEntry(&s_mgr, index, &entry));
+	return entry;
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	for (uint32_t i=TEST_FIRST_EMULATOR ; i<TEST_DEAD_DEVICE ; ++i) {
+		_test_start_emulator(i);
+	}
+
+	BtLeConnectionManagerOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerInitOptions(&options));
+	options.max_pending             = 3;
+	options.attempt_timeout_ms      = TEST_ATTEMPT_TIMEOUT_MS;
+	options.max_attempts            = TEST_MAX_ATTEMPTS;
+	options.device.setup_timeout_ms = TEST_SETUP_TIMEOUT_MS;
+	options.open                    = _test_open;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerCreate(&s_mgr, &options));
+
+	uint32_t index;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerAddAdapter(&s_mgr, 0, TEST_NUM_DEVICES, index));
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		char btaddr[18];
+		snprintf(btaddr, sizeof(btaddr), TEST_ADDRESS_FORMAT, i);
+		TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerAdd(&s_mgr, &s_dev[i], btaddr, index));
+	}
+
+	uint32_t num_connected = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerRun(&s_mgr, TEST_RUN_TIMEOUT_MS, num_connected));
+	TEST_CHECK_EQ(TEST_NUM_DEVICES - 1, num_connected);
+
+	BtLeConnectionManagerStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerGetStatistics(&s_mgr, &stats));
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		const BtLeConnectionManagerEntry *entry = _test_entry(i);
+		printf("  %u: state %u, attempts %u, result %d, connected %.0f ms\n",
+				i, entry->state, entry->attempts, entry->result, entry->connected_ns / 1e6);
+	}
+	printf("  attempts %llu, busy %llu, timeouts %llu, failed %llu\n",
+			(unsigned long long)stats.attempts, (unsigned long long)stats.busy,
+			(unsigned long long)stats.timeouts, (unsigned long long)stats.failed);
+
+	//J 0 番: connect() が終わるまで他は EBUSY で待ち行列に戻る
+	const BtLeConnectionManagerEntry *slow = _test_entry(TEST_SLOW_DEVICE);
+	TEST_CHECK_EQ(BtLeConnectionState::cConnected, slow->state);
+	TEST_CHECK_EQ(1, slow->attempts);
+	TEST_CHECK(slow->connected_ns >= TEST_SLOW_CONNECT_MS * 1000000ULL);
+	TEST_CHECK(slow->connected_ns < (TEST_SLOW_CONNECT_MS + TEST_SETUP_TIMEOUT_MS) * 1000000ULL);
+	TEST_CHECK(stats.busy > 0);
+	TEST_CHECK(s_slow_requests >= 1);
+	TEST_CHECK_EQ(TEST_SLOW_MTU, btLeDeviceGetMtu(&s_dev[TEST_SLOW_DEVICE]));
+
+	//J 1 番の準備を待たずに 2〜4 番が接続済みになる
+	const BtLeConnectionManagerEntry *silent = _test_entry(TEST_SILENT_DEVICE);
+	TEST_CHECK_EQ(BtLeConnectionState::cConnected, silent->state);
+	TEST_CHECK(silent->connected_ns >= (TEST_SLOW_CONNECT_MS + TEST_SETUP_TIMEOUT_MS) * 1000000ULL);
+	for (uint32_t i=TEST_FIRST_EMULATOR ; i<TEST_DEAD_DEVICE ; ++i) {
+		const BtLeConnectionManagerEntry *entry = _test_entry(i);
+		TEST_CHECK_EQ(BtLeConnectionState::cConnected, entry->state);
+		TEST_CHECK(entry->connected_ns < silent->connected_ns);
+	}
+
+	//J 5 番は期限切れを max_attempts 回繰り返して諦める
+	const BtLeConnectionManagerEntry *dead = _test_entry(TEST_DEAD_DEVICE);
+	TEST_CHECK_EQ(BtLeConnectionState::cFailed, dead->state);
+	TEST_CHECK_EQ(TEST_MAX_ATTEMPTS, dead->attempts);
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, dead->result);
+	TEST_CHECK_EQ(TEST_MAX_ATTEMPTS, stats.timeouts);
+	TEST_CHECK_EQ(1, stats.failed);
+
+	TEST_CHECK_EQ(AKS_OK, btLeConnectionManagerDestroy(&s_mgr));
+	for (uint32_t i=0 ; i<TEST_NUM_DEVICES ; ++i) {
+		TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev[i]));
+	}
+	for (uint32_t i=TEST_FIRST_EMULATOR ; i<TEST_DEAD_DEVICE ; ++i) {
+		close(btLeEmulatorGetCentralSocket(&s_emu[i]));
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu[i]));
+	}
+	if (s_slow_peer >= 0) {
+		pthread_join(s_slow_thread, NULL);
+		close(s_slow_peer);
+	}
+	if (s_silent_peer >= 0) {
+		close(s_silent_peer);
+	}
+	for (uint32_t i=0 ; i<s_num_dead_peers ; ++i) {
+		close(s_dead_peers[i]);
+	}
+
+	return test_result("connection_setup");
+}
@@ -0,0 +1,223 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_crypto の AES-128 / AES-CMAC と ATT の署名を、使える Backend ごとに確かめる
+ *J
+ *J - RFC 4493 4.  Test Vectors (AES-128(K, 0)、K1 / K2、長さ 0 / 16 / 40 / 64 の MAC)
+ *J - Signed Write Command の PDU の期待値 (openssl mac -cipher AES-128-CBC CMAC で計算)。
+ *J   btAttVerifyPduSignedWriteCommand() が SignCounter を返し、壊した PDU を拒むこと
+ *J - AES-NI / ARMv8 が使えれば、乱数の鍵とメッセージで Portable と同じ結果になること
+ *J
+ *J btCryptoInitWithBackend() で Backend を 1つずつ強制する。CPU に無い Backend は飛ばす。
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_crypto.h"
+#include "test_util.h"
+
+#define TEST_RANDOM_KEYS							(64)
+#define TEST_RANDOM_MESSAGES						(32)	//J 鍵ごと
+
+struct TestCmacVector
+{
+	size_t  len;
+	uint8_t mac[BT_CRYPTO_BLOCK_SIZE];
+};
+
+//J RFC 4493 の K (AES の鍵なので先頭が最上位バイト)
+static const uint8_t s_key[BT_CRYPTO_KEY_SIZE] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t s_aes_zero[BT_CRYPTO_BLOCK_SIZE] = {
+	0x7d, 0xf7, 0x6b, 0x0c, 0x1a, 0xb8, 0x99, 0xb3, 0x3e, 0x42, 0xf0, 0x47, 0xb9, 0x1b, 0x54, 0x6f,
+};
+static const uint8_t s_k1[BT_CRYPTO_BLOCK_SIZE] = {
+	0xfb, 0xee, 0xd6, 0x18, 0x35, 0x71, 0x33, 0x66, 0x7c, 0x85, 0xe0, 0x8f, 0x72, 0x36, 0xa8, 0xde,
+};
+static const uint8_t s_k2[BT_CRYPTO_BLOCK_SIZE] = {
+	0xf7, 0xdd, 0xac, 0x30, 0x6a, 0xe2, 0x66, 0xcc, 0xf9, 0x0b, 0xc1, 0x1e, 0xe4, 0x6d, 0x51, 0x3b,
+};
+
+static const uint8_t s_message[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const TestCmacVector s_vectors[] = {
+	{  0, { 0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46 } },
+	{ 16, { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c } },
+	{ 40, { 0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27 } },
+	{ 64, { 0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe } },
+};
+
+//J CSRK は LE なので RFC 4493 の K を反転したもの
+static const uint8_t s_csrk[BT_CRYPTO_KEY_SIZE] = {
+	0x3c, 0x4f, 0xcf, 0x09, 0x88, 0x15, 0xf7, 0xab, 0xa6, 0xd2, 0xae, 0x28, 0x16, 0x15, 0x7e, 0x2b,
+};
+
+//J Handle 0x002A に 01 02 03 04 を SignCounter 1 で書く Signed Write Command
+//J (CMAC は 00000001 || 04 03 02 01 00 2a d2 に対して 2880e0a219e5549c...)
+#define TEST_SIGNED_HANDLE							(0x002A)
+#define TEST_SIGNED_COUNTER							(1)
+static const uint8_t s_signed_value[] = { 0x01, 0x02, 0x03, 0x04 };
+static const uint8_t s_signed_pdu[] = {
+	0xd2, 0x2a, 0x00, 0x01, 0x02, 0x03, 0x04,
+	0x01, 0x00, 0x00, 0x00,								//J SignCounter
+	0x9c, 0x54, 0xe5, 0x19, 0xa2, 0xe0, 0x80, 0x28,		//J MAC の上位 64bit (LE)
+};
+
+static uint32_t s_random = 0x12345678;
+
+
+/*---------------------------------------------------------------------------*/
+static uint8_t _test_random_byte(void)
+{
+	//J xorshift32 (毎回同じ列にする)
+	s_random ^= s_random << 13;
+	s_random ^= s_random >> 17;
+	s_random ^= s_random << 5;
+	return (uint8_t)s_random;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_vectors(const struct bt_crypto *crypto)
+{
+	BtCryptoAesKey aes;
+	uint8_t zero[BT_CRYPTO_BLOCK_SIZE] = { 0 };
+	uint8_t out[BT_CRYPTO_BLOCK_SIZE];
+	TEST_CHECK_EQ(AKS_OK, btCryptoAesExpandKey(s_key, &aes));
+	TEST_CHECK_EQ(AKS_OK, btCryptoAesEncrypt(crypto, &aes, zero, out));
+	TEST_CHECK(memcmp(out, s_aes_zero, sizeof(out)) == 0);
+
+	BtCryptoCmacKey cmac;
+	TEST_CHECK_EQ(AKS_OK, btCryptoCmacInit(crypto, s_key, &cmac));
+	TEST_CHECK(memcmp(cmac.k1, s_k1, sizeof(s_k1)) == 0);
+	TEST_CHECK(memcmp(cmac.k2, s_k2, sizeof(s_k2)) == 0);
+
+	for (size_t i=0 ; i<sizeof(s_vectors) / sizeof(s_vectors[0]) ; ++i) {
+		uint8_t mac[BT_CRYPTO_BLOCK_SIZE];
+		TEST_CHECK_EQ(AKS_OK, btCryptoCmac(crypto, &cmac, s_message, s_vectors[i].len, mac));
+		if (memcmp(mac, s_vectors[i].mac, sizeof(mac)) != 0) {
+			fprintf(stderr, "  %s: CMAC of %zu bytes differs\n", btCryptoBackendToString(crypto->backend), s_vectors[i].len);
+			s_test_failures++;
+		}
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_signed_write(const struct bt_crypto *crypto)
+{
+	uint8_t pdu[64];
+	int len = btAttBuildPduSignedWriteCommand(pdu, sizeof(pdu), TEST_SIGNED_HANDLE,
+								sizeof(s_signed_value), s_signed_value, crypto, s_csrk, TEST_SIGNED_COUNTER);
+	TEST_CHECK_EQ(sizeof(s_signed_pdu), len);
+	TEST_CHECK(memcmp(pdu, s_signed_pdu, sizeof(s_signed_pdu)) == 0);
+
+	BtCryptoCmacKey key;
+	TEST_CHECK_EQ(AKS_OK, btCryptoSignKeyInit(crypto, s_csrk, &key));
+	uint32_t sign_count = 0;
+	TEST_CHECK_EQ(AKS_OK, btAttVerifyPduSignedWriteCommand(s_signed_pdu, sizeof(s_signed_pdu), crypto, &key, sign_count));
+	TEST_CHECK_EQ(TEST_SIGNED_COUNTER, sign_count);
+
+	//J Value を 1 ビット変えると署名が合わない
+	memcpy(pdu, s_signed_pdu, sizeof(s_signed_pdu));
+	pdu[3] ^= 0x01;
+	TEST_CHECK_EQ((int)AKS_ERROR_BT_INVALID_SIGNATURE, btAttVerifyPduSignedWriteCommand(pdu, sizeof(s_signed_pdu), crypto, &key, sign_count));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Portable と同じ MAC と署名になるか
+/*---------------------------------------------------------------------------*/
+static void _test_compare(const struct bt_crypto *portable, const struct bt_crypto *crypto)
+{
+	static uint8_t msg[BT_CRYPTO_MAX_SIGN_MESSAGE];
+	uint32_t mismatches = 0;
+
+	for (uint32_t k=0 ; k<TEST_RANDOM_KEYS ; ++k) {
+		uint8_t key[BT_CRYPTO_KEY_SIZE];
+		for (size_t i=0 ; i<sizeof(key) ; ++i) {
+			key[i] = _test_random_byte();
+		}
+
+		BtCryptoCmacKey expected_key;
+		BtCryptoCmacKey actual_key;
+		TEST_CHECK_EQ(AKS_OK, btCryptoSignKeyInit(portable, key, &expected_key));
+		TEST_CHECK_EQ(AKS_OK, btCryptoSignKeyInit(crypto, key, &actual_key));
+
+		for (uint32_t m=0 ; m<TEST_RANDOM_MESSAGES ; ++m) {
+			//J ブロック境界の前後と長いものを混ぜる
+			size_t len = (m < 2 * BT_CRYPTO_BLOCK_SIZE) ? m : (size_t)_test_random_byte() * 3;
+			for (size_t i=0 ; i<len ; ++i) {
+				msg[i] = _test_random_byte();
+			}
+
+			uint8_t expected[BT_CRYPTO_BLOCK_SIZE];
+			uint8_t actual[BT_CRYPTO_BLOCK_SIZE];
+			(void)btCryptoCmac(portable, &expected_key, msg, len, expected);
+			(void)btCryptoCmac(crypto, &actual_key, msg, len, actual);
+			if (memcmp(expected, actual, sizeof(expected)) != 0) {
+				mismatches++;
+			}
+
+			uint8_t expected_sig[BT_CRYPTO_SIGNATURE_SIZE];
+			uint8_t actual_sig[BT_CRYPTO_SIGNATURE_SIZE];
+			(void)btCryptoSignAtt(portable, &expected_key, msg, len, k * TEST_RANDOM_MESSAGES + m, expected_sig);
+			(void)btCryptoSignAtt(crypto, &actual_key, msg, len, k * TEST_RANDOM_MESSAGES + m, actual_sig);
+			if (memcmp(expected_sig, actual_sig, sizeof(expected_sig)) != 0) {
+				mismatches++;
+			}
+		}
+	}
+
+	printf("  %s vs portable: %u keys x %u messages, %u mismatch(es)\n",
+			btCryptoBackendToString(crypto->backend), TEST_RANDOM_KEYS, TEST_RANDOM_MESSAGES, mismatches);
+	TEST_CHECK_EQ(0, mismatches);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	static const uint8_t backends[] = {
+		BtCryptoBackend::cPortable,
+		BtCryptoBackend::cAesNi,
+		BtCryptoBackend::cArmv8,
+	};
+
+	struct bt_crypto portable;
+	TEST_CHECK_EQ(AKS_OK, btCryptoInitWithBackend(&portable, BtCryptoBackend::cPortable));
+
+	for (size_t i=0 ; i<sizeof(backends) / sizeof(backends[0]) ; ++i) {
+		struct bt_crypto crypto;
+		if (btCryptoInitWithBackend(&crypto, backends[i]) != AKS_OK) {
+			printf("  %s: not supported, skipped\n", btCryptoBackendToString(backends[i]));
+			continue;
+		}
+
+		_test_vectors(&crypto);
+		_test_signed_write(&crypto);
+		if (backends[i] != BtCryptoBackend::cPortable) {
+			_test_compare(&portable, &crypto);
+		}
+		else {
+			printf("  %s: vectors checked\n", btCryptoBackendToString(backends[i]));
+		}
+	}
+
+	return test_result("crypto");
+}
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+#
+# Copyright 2016 Kiyotaka Akasaka
+#
+# Released under the MIT license
+# http://opensource.org/licenses/mit-license.php
+#
+# tests/data/le_adv_reports.h4 を作る
+#
+# 8 台の Peripheral が ADV_IND と SCAN_RSP を出し続けている所を
+# Active Scan した時の HCI Event 列 (H4 形式) を決まった順で並べる。
+#   - LE Advertising Report (1 か 2 Report)
+#   - 50 Event ごとに LE Extended Advertising Report
+#   - 先頭と途中に Command Complete (LE Set Scan Enable)
+#   - Report の途中で切れた LE Advertising Report を 1 つ
+#
+# tests/scanner_replay.cpp の期待値 (Event 数、Report 数、FNV-1a) も表示する
+#
+#   python3 tests/data/gen_le_adv_capture.py tests/data/le_adv_reports.h4
+#
+import struct
+import sys
+
+NUM_EVENTS = 1500
+NUM_DEVICES = 8
+
+events = []
+reports = []
+
+
+def event(code, params):
+    events.append(bytes([0x04, code, len(params)]) + params)
+
+
+def address(n):
+    return bytes([0x10 + n, 0x32, 0x54, 0x76, 0x98, 0xC0 | n])
+
+
+def legacy(event_type, n, data, rssi):
+    reports.append((event_type, 0x01, address(n), rssi, 0, data))
+    return bytes([event_type, 0x01]) + address(n) + bytes([len(data)]) + data + struct.pack('<b', rssi)
+
+
+def extended(n, data, rssi):
+    reports.append((0x0000, 0x01, address(n), rssi, 1, data))
+    return (struct.pack('<H', 0x0000) + bytes([0x01]) + address(n) +
+            bytes([0x01, 0x02, 0x00, 0x7F]) + struct.pack('<b', rssi) +
+            struct.pack('<H', 0) + bytes([0x00]) + bytes(6) + bytes([len(data)]) + data)
+
+
+def adv_data(n, seq):
+    name = ('sensor-%d' % n).encode()
+    return (bytes([0x02, 0x01, 0x06]) +
+            bytes([len(name) + 1, 0x09]) + name +
+            bytes([0x05, 0xFF, 0x59, 0x00, seq & 0xFF, (seq >> 8) & 0xFF]))
+
+
+def scan_rsp(n):
+    return bytes([0x02, 0x0A, (0x100 - 4 - n) & 0xFF, 0x03, 0x03, 0x0F, 0x18])
+
+
+def command_complete():
+    # Num_HCI_Command_Packets, Opcode (LE Set Scan Enable), Status
+    event(0x0E, bytes([0x01]) + struct.pack('<H', 0x200C) + bytes([0x00]))
+
+
+command_complete()
+for k in range(NUM_EVENTS):
+    n = k % NUM_DEVICES
+    rssi = -40 - ((k * 7) % 50)
+    if k == 700:
+        command_complete()
+    if k == 900:
+        # Data_Length の分だけ Data が無い
+        body = legacy(0x00, n, adv_data(n, k), rssi)[:-4]
+        reports.pop()
+        event(0x3E, bytes([0x02, 1]) + body)
+    elif k % 50 == 49:
+        data = adv_data(n, k) + bytes([0x21, 0xFF]) + bytes(range(32))
+        event(0x3E, bytes([0x0D, 1]) + extended(n, data, rssi))
+    elif k % 5 == 4:
+        body = legacy(0x00, n, adv_data(n, k), rssi) + legacy(0x04, n, scan_rsp(n), rssi - 1)
+        event(0x3E, bytes([0x02, 2]) + body)
+    else:
+        event(0x3E, bytes([0x02, 1]) + legacy(0x00, n, adv_data(n, k), rssi))
+
+h = 0x811C9DC5
+for event_type, address_type, addr, rssi, ext, data in reports:
+    b = (struct.pack('<H', event_type) + bytes([address_type]) + addr +
+         struct.pack('<b', rssi) + bytes([ext]) + struct.pack('<H', len(data)) + data)
+    for c in b:
+        h = ((h ^ c) * 0x01000193) & 0xFFFFFFFF
+
+with open(sys.argv[1], 'wb') as f:
+    for e in events:
+        f.write(e)
+
+print('events %d, reports %d, extended %d, hash 0x%08x, %d bytes' %
+      (len(events), len(reports), sum(r[4] for r in reports), h, sum(len(e) for e in events)))
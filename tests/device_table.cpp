@@ -0,0 +1,397 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_le_device_table の Backward Shift Delete、Timer Wheel と RSSI の平均を確かめる
+ *J
+ *J - 同じ home に集まる Address (表の末尾で折り返す列も含む) を入れ、列の先頭や折り返しの
+ *J   位置にある Entry を狙って消した後と、ばらばらに期限切れで消した後で、
+ *J   残っている全ての Address が見つかり、消えたものは見つからず、
+ *J   どの Entry も home から自分の位置まで空きが無いこと
+ *J - Entry は最後に見た時刻から idle_timeout_ms (Tick 単位) で追い出され、その前には
+ *J   追い出されないこと。Wheel 1周より長く空いても追い出されること
+ *J - RSSI 127 (不明) の Report は平均にも rssi_last にも入れないこと
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "aks_error.h"
+#include "bt_le_scanner.h"
+#include "bt_le_device_table.h"
+#include "test_util.h"
+
+#define TEST_IDLE_TIMEOUT_MS						(1000)
+#define TEST_CHAIN_LENGTH							(12)		//J 1つの home に集める Address の数
+#define TEST_NUM_HOMES								(6)			//J 2つの塊 × 3つの隣り合う home
+#define TEST_NUM_KEYS								(TEST_CHAIN_LENGTH * TEST_NUM_HOMES)
+#define TEST_NUM_ROUNDS								(40)
+#define TEST_ROUND_MS								(150)
+
+static BtLeDeviceTable s_table;
+
+static uint8_t  s_keys[TEST_NUM_KEYS][6];
+static bool     s_alive[TEST_NUM_KEYS];
+static uint64_t s_last_ns[TEST_NUM_KEYS];
+static uint32_t s_evicted = 0;
+static uint64_t s_rng = 0x2545F4914F6CDD1DULL;
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_random(void)
+{
+	s_rng ^= s_rng << 13;
+	s_rng ^= s_rng >> 7;
+	s_rng ^= s_rng << 17;
+	return (uint32_t)(s_rng >> 32);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J bt_le_device_table.cpp と同じ Hash
+/*---------------------------------------------------------------------------*/
+static uint16_t _test_home(const uint8_t address[6], const uint8_t address_type)
+{
+	uint64_t key = address_type;
+	for (int i=0 ; i<6 ; ++i) {
+		key = (key << 8) | address[i];
+	}
+	return (uint16_t)(((key * 0x9E3779B97F4A7C15ULL) >> 48) & (BT_LE_DEVICE_TABLE_CAPACITY - 1));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_evict_cb(void *arg, const BtLeDeviceTableEntry *entry)
+{
+	(void)arg;
+	(void)entry;
+
+	s_evicted++;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _test_update(const uint8_t address[6], const int8_t rssi, const uint64_t now_ns, bool &changed)
+{
+	static const uint8_t payload[] = { 0x02, 0x01, 0x06 };
+
+	BtLeAdvertisingReport report;
+	memset(&report, 0x00, sizeof(report));
+	report.event_type   = BtLeAdvertisingEventType::cAdvInd;
+	report.address_type = 0;
+	memcpy(report.address, address, 6);
+	report.rssi         = rssi;
+	report.data_len     = sizeof(payload);
+	report.data         = payload;
+	report.timestamp_ns = now_ns;
+
+	return btLeDeviceTableUpdate(&s_table, &report, changed, NULL);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 0x100 から 0x102 と、表の末尾を跨ぐ CAPACITY-2 から 0 に home がある Address を集める
+/*---------------------------------------------------------------------------*/
+static void _test_make_keys(void)
+{
+	static const uint16_t homes[TEST_NUM_HOMES] = {
+		0x100, 0x101, 0x102,
+		BT_LE_DEVICE_TABLE_CAPACITY - 2, BT_LE_DEVICE_TABLE_CAPACITY - 1, 0,
+	};
+	uint32_t counts[TEST_NUM_HOMES];
+	memset(counts, 0x00, sizeof(counts));
+
+	uint32_t num_keys = 0;
+	for (uint32_t n=0 ; num_keys<TEST_NUM_KEYS ; ++n) {
+		uint8_t address[6] = { (uint8_t)n, (uint8_t)(n >> 8), (uint8_t)(n >> 16), 0x34, 0x12, 0xC0 };
+		uint16_t home = _test_home(address, 0);
+		for (uint32_t h=0 ; h<TEST_NUM_HOMES ; ++h) {
+			if ((home == homes[h]) && (counts[h] < TEST_CHAIN_LENGTH)) {
+				memcpy(s_keys[num_keys++], address, 6);
+				counts[h]++;
+				break;
+			}
+		}
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 全ての Entry について home から自分の位置まで空きが無く、見つかる Address が覚えている通りか
+/*---------------------------------------------------------------------------*/
+static void _test_check_table(void)
+{
+	uint32_t used = 0;
+	for (uint32_t i=0 ; i<BT_LE_DEVICE_TABLE_CAPACITY ; ++i) {
+		const BtLeDeviceTableEntry *entry = &s_table.entries[i];
+		if (!entry->used) {
+			continue;
+		}
+		used++;
+		TEST_CHECK_EQ(_test_home(entry->address, entry->address_type), entry->home);
+
+		bool gap = false;
+		for (uint32_t j=entry->home ; j!=i ; j=(j + 1) & (BT_LE_DEVICE_TABLE_CAPACITY - 1)) {
+			gap = gap || (!s_table.entries[j].used);
+		}
+		TEST_CHECK(!gap);
+	}
+	TEST_CHECK_EQ(s_table.count, used);
+
+	uint32_t alive = 0;
+	for (uint32_t k=0 ; k<TEST_NUM_KEYS ; ++k) {
+		const BtLeDeviceTableEntry *entry = NULL;
+		int ret = btLeDeviceTableLookup(&s_table, s_keys[k], 0, &entry);
+		if (s_alive[k]) {
+			alive++;
+			TEST_CHECK_EQ(AKS_OK, ret);
+			TEST_CHECK((entry != NULL) && (memcmp(entry->address, s_keys[k], 6) == 0));
+			TEST_CHECK((entry != NULL) && (entry->last_seen_ns == s_last_ns[k]));
+		}
+		else {
+			TEST_CHECK_EQ((int)AKS_ERROR_INVALID, ret);
+		}
+	}
+	TEST_CHECK_EQ(alive, s_table.count);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 表の position にある Entry だけを見えなくして、期限切れで消す
+/*---------------------------------------------------------------------------*/
+static void _test_delete_at(const uint16_t position, const uint64_t now_ns)
+{
+	const BtLeDeviceTableEntry *victim = &s_table.entries[position];
+	TEST_CHECK(victim->used);
+
+	uint32_t victim_key = TEST_NUM_KEYS;
+	for (uint32_t k=0 ; k<TEST_NUM_KEYS ; ++k) {
+		if (!s_alive[k]) {
+			continue;
+		}
+		if (memcmp(s_keys[k], victim->address, 6) == 0) {
+			victim_key = k;
+			continue;
+		}
+		bool changed = true;
+		TEST_CHECK_EQ(AKS_OK, _test_update(s_keys[k], -60, now_ns, changed));
+		TEST_CHECK(!changed);
+		s_last_ns[k] = now_ns;
+	}
+	TEST_CHECK(victim_key < TEST_NUM_KEYS);
+	if (victim_key >= TEST_NUM_KEYS) {
+		return;
+	}
+
+	//J victim の期限は過ぎ、他の Entry の期限は来ていない時刻
+	uint64_t expire_ns = now_ns + (uint64_t)TEST_IDLE_TIMEOUT_MS * 1000000ULL / 2;
+	TEST_CHECK(s_last_ns[victim_key] + (uint64_t)TEST_IDLE_TIMEOUT_MS * 1000000ULL <= expire_ns);
+
+	size_t num_evicted = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, expire_ns, num_evicted));
+	TEST_CHECK_EQ(1, num_evicted);
+	s_alive[victim_key] = false;
+
+	_test_check_table();
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 詰まった Probe の列から、列の先頭と折り返しの位置、次にばらばらの順で Entry を消していく
+/*---------------------------------------------------------------------------*/
+static void _test_backward_shift(void)
+{
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableInit(&s_table, TEST_IDLE_TIMEOUT_MS, _test_evict_cb, NULL));
+	_test_make_keys();
+	memset(s_alive, 0x00, sizeof(s_alive));
+	s_evicted = 0;
+
+	//J 全部入れる
+	for (uint32_t k=0 ; k<TEST_NUM_KEYS ; ++k) {
+		bool changed = false;
+		TEST_CHECK_EQ(AKS_OK, _test_update(s_keys[k], -60, 0, changed));
+		TEST_CHECK(changed);
+		s_alive[k]   = true;
+		s_last_ns[k] = 0;
+	}
+	_test_check_table();
+	TEST_CHECK(s_table.stats.max_probe >= TEST_CHAIN_LENGTH * 2);
+
+	//J 消した穴には後ろの Entry が詰められるので、同じ位置を何度も消せる
+	static const uint16_t positions[] = {
+		BT_LE_DEVICE_TABLE_CAPACITY - 2, BT_LE_DEVICE_TABLE_CAPACITY - 1, 0,
+		BT_LE_DEVICE_TABLE_CAPACITY - 2, BT_LE_DEVICE_TABLE_CAPACITY - 1, 0, 3,
+		0x100, 0x101, 0x100, 0x108, 0x110,
+	};
+	uint64_t now_ns = 0;
+	for (uint32_t i=0 ; i<sizeof(positions) / sizeof(positions[0]) ; ++i) {
+		now_ns += (uint64_t)TEST_IDLE_TIMEOUT_MS * 1000000ULL * 3 / 4;
+		_test_delete_at(positions[i], now_ns);
+	}
+	uint64_t evictions = sizeof(positions) / sizeof(positions[0]);
+	TEST_CHECK_EQ(evictions, s_evicted);
+
+	//J 次のばらばらの削除の前に全部を消す
+	size_t num_evicted = 0;
+	now_ns += (uint64_t)TEST_IDLE_TIMEOUT_MS * 1000000ULL * 2;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, now_ns, num_evicted));
+	TEST_CHECK_EQ(TEST_NUM_KEYS - evictions, num_evicted);
+	TEST_CHECK_EQ(0, s_table.count);
+	memset(s_alive, 0x00, sizeof(s_alive));
+	evictions += num_evicted;
+
+	uint64_t base_ns = now_ns;
+	uint32_t max_probe = 0;
+	for (uint32_t round=1 ; round<=TEST_NUM_ROUNDS ; ++round) {
+		now_ns = base_ns + (uint64_t)round * TEST_ROUND_MS * 1000000ULL;
+
+		//J 1/4 ほどを見たことにする (無い Address は入り、ある Address は期限が延びる)
+		for (uint32_t k=0 ; k<TEST_NUM_KEYS ; ++k) {
+			if ((_test_random() & 3) != 0) {
+				continue;
+			}
+			bool changed = false;
+			TEST_CHECK_EQ(AKS_OK, _test_update(s_keys[k], -60, now_ns, changed));
+			TEST_CHECK_EQ(!s_alive[k], changed);
+			s_alive[k]   = true;
+			s_last_ns[k] = now_ns;
+		}
+
+		//J 少し後で期限切れを追い出す
+		now_ns += TEST_ROUND_MS * 1000000ULL / 2;
+		uint64_t now_tick = now_ns / s_table.tick_ns;
+		uint32_t expected = 0;
+		for (uint32_t k=0 ; k<TEST_NUM_KEYS ; ++k) {
+			if (s_alive[k] && (s_last_ns[k] / s_table.tick_ns + s_table.timeout_ticks <= now_tick)) {
+				s_alive[k] = false;
+				expected++;
+			}
+		}
+		TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, now_ns, num_evicted));
+		TEST_CHECK_EQ(expected, num_evicted);
+		evictions += num_evicted;
+
+		_test_check_table();
+		if (s_table.stats.max_probe > max_probe) {
+			max_probe = s_table.stats.max_probe;
+		}
+	}
+
+	//J 列が本当に長くなり、消す時に詰めていたこと
+	TEST_CHECK(max_probe >= TEST_CHAIN_LENGTH);
+	TEST_CHECK(evictions > TEST_NUM_KEYS * 2);
+	TEST_CHECK_EQ(evictions, s_evicted);
+	TEST_CHECK_EQ(evictions, s_table.stats.evictions);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static uint64_t _test_expiry_ns(const uint64_t last_ns)
+{
+	return (last_ns / s_table.tick_ns + s_table.timeout_ticks) * s_table.tick_ns;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_wheel(void)
+{
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableInit(&s_table, TEST_IDLE_TIMEOUT_MS, _test_evict_cb, NULL));
+	s_evicted = 0;
+
+	static const uint8_t a[6] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0xC0 };
+	static const uint8_t b[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0xC0 };
+	const BtLeDeviceTableEntry *entry;
+	bool changed;
+	size_t num_evicted;
+
+	uint64_t base_ns = 5000000000ULL;
+	TEST_CHECK_EQ(AKS_OK, _test_update(a, -50, base_ns, changed));
+	TEST_CHECK_EQ(AKS_OK, _test_update(b, -50, base_ns + 600000000ULL, changed));
+
+	//J a は期限の直前までは残り、期限の Tick で追い出される
+	uint64_t a_expiry_ns = _test_expiry_ns(base_ns);
+	TEST_CHECK(a_expiry_ns - base_ns <= (uint64_t)TEST_IDLE_TIMEOUT_MS * 1000000ULL);
+	TEST_CHECK(a_expiry_ns - base_ns > (uint64_t)TEST_IDLE_TIMEOUT_MS * 1000000ULL - s_table.tick_ns);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, a_expiry_ns - 1, num_evicted));
+	TEST_CHECK_EQ(0, num_evicted);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, a_expiry_ns, num_evicted));
+	TEST_CHECK_EQ(1, num_evicted);
+	TEST_CHECK_EQ((int)AKS_ERROR_INVALID, btLeDeviceTableLookup(&s_table, a, 0, &entry));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableLookup(&s_table, b, 0, &entry));
+
+	//J 見えれば b の期限は延びる
+	uint64_t b_seen_ns = base_ns + 900000000ULL;
+	TEST_CHECK_EQ(AKS_OK, _test_update(b, -50, b_seen_ns, changed));
+	TEST_CHECK(!changed);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, _test_expiry_ns(base_ns + 600000000ULL), num_evicted));
+	TEST_CHECK_EQ(0, num_evicted);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, _test_expiry_ns(b_seen_ns) - 1, num_evicted));
+	TEST_CHECK_EQ(0, num_evicted);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, _test_expiry_ns(b_seen_ns), num_evicted));
+	TEST_CHECK_EQ(1, num_evicted);
+	TEST_CHECK_EQ(0, s_table.count);
+
+	//J Wheel の何周分も Expire() が呼ばれなくても追い出す
+	uint64_t c_seen_ns = base_ns + 3000000000ULL;
+	TEST_CHECK_EQ(AKS_OK, _test_update(a, -50, c_seen_ns, changed));
+	TEST_CHECK(changed);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableExpire(&s_table, c_seen_ns + 10ULL * TEST_IDLE_TIMEOUT_MS * 1000000ULL, num_evicted));
+	TEST_CHECK_EQ(1, num_evicted);
+	TEST_CHECK_EQ(0, s_table.count);
+	TEST_CHECK_EQ(3, s_evicted);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_rssi(void)
+{
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableInit(&s_table, TEST_IDLE_TIMEOUT_MS, NULL, NULL));
+
+	static const uint8_t a[6] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0xC0 };
+	const BtLeDeviceTableEntry *entry = NULL;
+	bool changed;
+	uint64_t now_ns = 1000000ULL;
+
+	//J 最初の Report が不明なら平均もまだ無い
+	TEST_CHECK_EQ(AKS_OK, _test_update(a, BT_LE_DEVICE_TABLE_RSSI_UNKNOWN, now_ns++, changed));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceTableLookup(&s_table, a, 0, &entry));
+	TEST_CHECK_EQ(BT_LE_DEVICE_TABLE_RSSI_UNKNOWN, btLeDeviceTableRssiAverage(entry));
+	TEST_CHECK_EQ(BT_LE_DEVICE_TABLE_RSSI_UNKNOWN, entry->rssi_last);
+
+	//J 最初に分かった値から平均を始める
+	TEST_CHECK_EQ(AKS_OK, _test_update(a, -60, now_ns++, changed));
+	TEST_CHECK_EQ(-60, btLeDeviceTableRssiAverage(entry));
+	TEST_CHECK_EQ(-60, entry->rssi_last);
+
+	for (int i=0 ; i<8 ; ++i) {
+		TEST_CHECK_EQ(AKS_OK, _test_update(a, BT_LE_DEVICE_TABLE_RSSI_UNKNOWN, now_ns++, changed));
+	}
+	TEST_CHECK_EQ(-60, btLeDeviceTableRssiAverage(entry));
+	TEST_CHECK_EQ(-60, entry->rssi_last);
+	TEST_CHECK_EQ(10, entry->reports);
+
+	TEST_CHECK_EQ(AKS_OK, _test_update(a, -68, now_ns++, changed));
+	TEST_CHECK_EQ(-61, btLeDeviceTableRssiAverage(entry));
+	TEST_CHECK_EQ(-68, entry->rssi_last);
+
+	TEST_CHECK_EQ(BT_LE_DEVICE_TABLE_RSSI_UNKNOWN, btLeDeviceTableRssiAverage(NULL));
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_backward_shift();
+	_test_wheel();
+	_test_rssi();
+
+	return test_result("device_table");
+}
@@ -0,0 +1,142 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_eatt を bt_le_emulator の Bearer に繋ぎ、Read Request の並列実行を確かめる
+ *J
+ *J - Bearer 1 / 2 / 4 / 8 本で 200 個の Read を btEattSubmit() し、全て正しい値が返ること
+ *J - 全ての Bearer に Request が偏らずに振り分けられ (どの Bearer も均等な数の半分以上)、
+ *J   エミュレータが各 Bearer で受けた数と一致すること
+ *J - Bearer が 2 本以上なら、エミュレータで同時に処理中の Request が 1 を越え、
+ *J   Bearer の本数 (ATT は Bearer ごとに 1つずつ) を越えないこと
+ *J - btEattAcquireBearer() で借りた Bearer で btGatt*() が使え、Exchange MTU は送らないこと
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+#include "bt_eatt.h"
+#include "test_util.h"
+
+#define TEST_NUM_CHARACTERISTICS					(8)
+#define TEST_NUM_REQUESTS							(200)
+#define TEST_VALUE_SIZE								(20)
+#define TEST_MTU									(247)
+
+static BtLeEmulatorContext s_emu;
+static BtGattDeviceContext s_dev;
+static BtEattContext       s_eatt;
+
+static uint8_t       s_pdus[TEST_NUM_REQUESTS][8];
+static uint8_t       s_rsps[TEST_NUM_REQUESTS][TEST_MTU];
+static BtEattRequest s_requests[TEST_NUM_REQUESTS];
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_run(const uint32_t num_bearers)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 6;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = TEST_MTU;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu, &link));
+
+	BtAttHandle service;
+	BtAttHandle handles[TEST_NUM_CHARACTERISTICS];
+	(void)btLeEmulatorAddPrimaryService(&s_emu, 0x180A, service);
+	for (uint32_t i=0 ; i<TEST_NUM_CHARACTERISTICS ; ++i) {
+		uint8_t value[TEST_VALUE_SIZE];
+		memset(value, (int)i, sizeof(value));
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, (BtAttUuid16)(0x2A00 + i),
+								BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cWrite,
+								value, sizeof(value), handles[i]));
+	}
+
+	int socks[BT_EATT_MAX_BEARERS];
+	for (uint32_t i=0 ; i<num_bearers ; ++i) {
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddBearer(&s_emu, TEST_MTU, socks[i]));
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_dev, btLeEmulatorGetCentralSocket(&s_emu), NULL));
+	TEST_CHECK_EQ(AKS_OK, btEattCreateWithSockets(&s_eatt, socks, num_bearers, TEST_MTU));
+
+	for (uint32_t i=0 ; i<TEST_NUM_REQUESTS ; ++i) {
+		s_requests[i].pdu             = s_pdus[i];
+		s_requests[i].len             = (size_t)btAttBuildPduReadRequest(s_pdus[i], sizeof(s_pdus[i]), handles[i % TEST_NUM_CHARACTERISTICS]);
+		s_requests[i].expected_opcode = BtAttPduOpcode::cAttOpcodeReadResponse;
+		s_requests[i].rsp             = s_rsps[i];
+		s_requests[i].rsp_size        = sizeof(s_rsps[i]);
+	}
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, btEattSubmit(&s_eatt, s_requests, TEST_NUM_REQUESTS));
+	uint64_t elapsed_ns = btUtilGetMonotonicTimeNs() - start_ns;
+
+	for (uint32_t i=0 ; i<TEST_NUM_REQUESTS ; ++i) {
+		TEST_CHECK_EQ(AKS_OK, s_requests[i].result);
+		TEST_CHECK_EQ(1 + TEST_VALUE_SIZE, s_requests[i].rsp_len);
+		TEST_CHECK_EQ(i % TEST_NUM_CHARACTERISTICS, s_rsps[i][1]);
+	}
+
+	BtEattStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btEattGetStatistics(&s_eatt, &stats));
+	TEST_CHECK_EQ(TEST_NUM_REQUESTS, stats.requests);
+	TEST_CHECK_EQ(0, stats.errors);
+	for (uint32_t i=0 ; i<num_bearers ; ++i) {
+		TEST_CHECK(stats.bearer_requests[i] * num_bearers * 2 >= TEST_NUM_REQUESTS);
+		TEST_CHECK_EQ(stats.bearer_requests[i], s_emu.bearers[i].num_requests);
+	}
+
+	//J Bearer を跨いで Request が重なって処理されている
+	pthread_mutex_lock(&s_emu.mutex);
+	uint32_t max_outstanding = s_emu.max_outstanding;
+	pthread_mutex_unlock(&s_emu.mutex);
+	if (num_bearers > 1) {
+		TEST_CHECK(max_outstanding > 1);
+	}
+	TEST_CHECK(max_outstanding <= num_bearers);
+
+	//J 借りた Bearer は ATT_MTU が決まっているので Exchange MTU は Request Not Supported になる
+	BtGattDeviceContext *bearer = btEattAcquireBearer(&s_eatt);
+	TEST_CHECK(bearer != NULL);
+	if (bearer != NULL) {
+		uint8_t buf[TEST_VALUE_SIZE];
+		size_t read_size = 0;
+		TEST_CHECK_EQ(AKS_OK, BtGattCharacteristicValueRead::btGattReadCharacteristicValue(*bearer, handles[3], buf, sizeof(buf), read_size));
+		TEST_CHECK_EQ(TEST_VALUE_SIZE, read_size);
+		TEST_CHECK_EQ(3, buf[0]);
+		TEST_CHECK(BtGattServerConfiguration::btGattExchangeMtu(*bearer) != AKS_OK);
+		TEST_CHECK_EQ(AKS_OK, btEattReleaseBearer(&s_eatt, bearer));
+	}
+
+	printf("  %u bearer(s): %u reads in %.1f ms, max %u outstanding\n", num_bearers, TEST_NUM_REQUESTS, elapsed_ns / 1e6, max_outstanding);
+
+	TEST_CHECK_EQ(AKS_OK, btEattDestroy(&s_eatt));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_run(1);
+	_test_run(2);
+	_test_run(4);
+	_test_run(BT_EATT_MAX_BEARERS);
+
+	return test_result("eatt");
+}
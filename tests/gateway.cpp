@@ -0,0 +1,342 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_gateway のリングを bt_le_emulator の Notification で回して確かめる
+ *J
+ *J - 長さの違うレコードを混ぜて何周も書き、末尾に入らない時は詰め物をして先頭から書くこと、
+ *J   レコードがリングの端を跨がず、値、Handle、時刻が壊れていないこと
+ *J - 読まずに溢れさせると、入らない分を捨てて dropped (統計とリングの両方) に数え、
+ *J   入った分は順番通りに読め、読み終えればまた書けること
+ *J - tail を 1周より前に戻したクライアントと、上位だけ書きかけの tail のクライアントは切られ、
+ *J   他のクライアントには届き続けること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_device.h"
+#include "bt_le_emulator.h"
+#include "bt_gateway.h"
+#include "test_util.h"
+
+#define TEST_MTU									(185)
+#define TEST_RING_SIZE								(2048)
+#define TEST_NUM_CHARACTERISTICS					(4)
+#define TEST_NUM_ROUNDS								(40)
+#define TEST_NUM_FLOOD								(16)		//J 溢れさせる時に送る数 (最大のレコードで 2周分近く)
+
+static const size_t s_value_sizes[TEST_NUM_CHARACTERISTICS] = { 1, 20, 100, 180 };
+
+static BtLeEmulatorContext s_emu;
+static BtGattDeviceContext s_dev;
+static BtGatewayContext    s_gw;
+static BtAttHandle s_handles[TEST_NUM_CHARACTERISTICS];
+static uint8_t     s_device;
+static char        s_path[108];
+
+static uint64_t s_last_timestamp_ns = 0;
+
+
+/*---------------------------------------------------------------------------*/
+static size_t _test_record_size(const size_t value_len)
+{
+	size_t size = sizeof(BtGatewayRecord) + value_len;
+	return (size + BT_GATEWAY_RECORD_ALIGN - 1) & ~((size_t)BT_GATEWAY_RECORD_ALIGN - 1);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Characteristic c の値を seq から作って Peripheral に置き、Notification する
+/*---------------------------------------------------------------------------*/
+static void _test_notify(const uint32_t c, const uint8_t seq)
+{
+	uint8_t value[TEST_MTU];
+	for (size_t i=0 ; i<s_value_sizes[c] ; ++i) {
+		value[i] = (uint8_t)(seq + i * 7);
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorSetValue(&s_emu, s_handles[c], value, s_value_sizes[c]));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorNotifyValues(&s_emu, &s_handles[c], 1));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J ゲートウェイが notifications 個目の Notification を受けるまで待つ
+/*---------------------------------------------------------------------------*/
+static void _test_wait_gateway(const uint64_t notifications)
+{
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 2000000000ULL;
+	BtGatewayStatistics stats;
+	do {
+		(void)btGatewayGetStatistics(&s_gw, &stats);
+		if (stats.notifications >= notifications) {
+			return;
+		}
+		usleep(5000);
+	} while (btUtilGetMonotonicTimeNs() < deadline_ns);
+
+	TEST_CHECK(stats.notifications >= notifications);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 次のレコードが Characteristic c の seq の値か確かめて読み終える。
+//J offset はリング上の位置を返す
+/*---------------------------------------------------------------------------*/
+static bool _test_receive(BtGatewayClientContext *client, const uint32_t c, const uint8_t seq, size_t &offset)
+{
+	const BtGatewayRecord *rec = NULL;
+	int ret = btGatewayClientReceive(client, &rec, 1000);
+	TEST_CHECK_EQ(AKS_OK, ret);
+	if (ret != AKS_OK) {
+		return false;
+	}
+
+	offset = (size_t)((const uint8_t *)rec - client->ring->data);
+	TEST_CHECK_EQ(0, offset % BT_GATEWAY_RECORD_ALIGN);
+	TEST_CHECK(offset + _test_record_size(rec->len) <= client->ring->size);
+	TEST_CHECK_EQ(0, rec->flags);
+	TEST_CHECK_EQ(s_device, rec->device);
+	TEST_CHECK_EQ(s_handles[c], rec->handle);
+	TEST_CHECK_EQ(s_value_sizes[c], rec->len);
+	TEST_CHECK(rec->timestamp_ns >= s_last_timestamp_ns);
+	s_last_timestamp_ns = rec->timestamp_ns;
+
+	bool intact = (rec->len == s_value_sizes[c]);
+	for (size_t i=0 ; intact && (i<rec->len) ; ++i) {
+		intact = (rec->value[i] == (uint8_t)(seq + i * 7));
+	}
+	TEST_CHECK(intact);
+
+	TEST_CHECK_EQ(AKS_OK, btGatewayClientRelease(client));
+
+	return intact;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J CCCD は Write Command で書かれるので、Peripheral に届くまで待つ
+/*---------------------------------------------------------------------------*/
+static void _test_wait_config(const uint32_t c)
+{
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 1000000000ULL;
+	uint16_t config = 0;
+	do {
+		size_t size = 0;
+		if ((btLeEmulatorGetValue(&s_emu, s_handles[c] + 1, &config, sizeof(config), size) == AKS_OK) && (config != 0)) {
+			return;
+		}
+		usleep(5000);
+	} while (btUtilGetMonotonicTimeNs() < deadline_ns);
+
+	TEST_CHECK(config != 0);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_connect(BtGatewayClientContext *client, const uint32_t first, const uint32_t num)
+{
+	TEST_CHECK_EQ(AKS_OK, btGatewayClientConnect(client, s_path));
+	TEST_CHECK_EQ(1, client->num_devices);
+	TEST_CHECK_EQ(TEST_RING_SIZE, client->ring->size);
+	for (uint32_t c=first ; c<first + num ; ++c) {
+		TEST_CHECK_EQ(AKS_OK, btGatewayClientSubscribe(client, s_device, s_handles[c] + 1, s_handles[c]));
+		_test_wait_config(c);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_setup(void)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 6;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = TEST_MTU;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu, &link));
+
+	BtAttHandle service;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddPrimaryService(&s_emu, 0x180F, service));
+	for (uint32_t c=0 ; c<TEST_NUM_CHARACTERISTICS ; ++c) {
+		uint8_t value[TEST_MTU];
+		memset(value, 0x00, sizeof(value));
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, (BtAttUuid16)(0x2A19 + c), BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cNotify, value, s_value_sizes[c], s_handles[c]));
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu));
+
+	BtLeDeviceOptions options;
+	(void)btLeDeviceInitOptions(&options);
+	options.mtu             = TEST_MTU;
+	options.client_features = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_dev, dup(btLeEmulatorGetCentralSocket(&s_emu)), &options));
+
+	snprintf(s_path, sizeof(s_path), "/tmp/bt_gateway_test.%d", (int)getpid());
+	TEST_CHECK_EQ(AKS_OK, btGatewayCreate(&s_gw, s_path, TEST_RING_SIZE));
+	TEST_CHECK_EQ(AKS_OK, btGatewayAddDevice(&s_gw, &s_dev, s_device));
+	TEST_CHECK_EQ(AKS_OK, btGatewayStart(&s_gw));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 毎回順番を変えて 4種類の長さを書いては読み、リングを何周もさせる
+/*---------------------------------------------------------------------------*/
+static void _test_wrap(BtGatewayClientContext *client)
+{
+	uint32_t num_pads = 0;
+	size_t   next = 0;						//J 詰め物が無ければ次のレコードが来る位置
+	uint64_t total = 0;
+	uint8_t  seq = 0;
+	for (uint32_t round=0 ; round<TEST_NUM_ROUNDS ; ++round) {
+		//J 4つ全部を溜めてから読む
+		uint32_t order[TEST_NUM_CHARACTERISTICS];
+		for (uint32_t i=0 ; i<TEST_NUM_CHARACTERISTICS ; ++i) {
+			order[i] = (round + i * (1 + 2 * (round % 2))) % TEST_NUM_CHARACTERISTICS;
+			_test_notify(order[i], (uint8_t)(seq + i));
+		}
+
+		for (uint32_t i=0 ; i<TEST_NUM_CHARACTERISTICS ; ++i) {
+			uint32_t c = order[i];
+			size_t offset = 0;
+			if (!_test_receive(client, c, seq, offset)) {
+				return;
+			}
+			if (offset != next) {
+				//J 末尾に入らなかった時だけ先頭に飛ぶ
+				TEST_CHECK_EQ(0, offset);
+				TEST_CHECK(next + _test_record_size(s_value_sizes[c]) > TEST_RING_SIZE);
+				total += TEST_RING_SIZE - next;
+				num_pads++;
+			}
+			next  = (offset + _test_record_size(s_value_sizes[c])) % TEST_RING_SIZE;
+			total += _test_record_size(s_value_sizes[c]);
+			seq++;
+		}
+	}
+
+	TEST_CHECK(num_pads > 0);
+	TEST_CHECK(total > 4 * TEST_RING_SIZE);
+	TEST_CHECK_EQ(total, __atomic_load_n(&client->ring->head, __ATOMIC_ACQUIRE));
+	TEST_CHECK_EQ(total, client->tail->tail);
+
+	const BtGatewayRecord *rec;
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, btGatewayClientReceive(client, &rec, 0));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 読まずに溢れさせる
+/*---------------------------------------------------------------------------*/
+static void _test_full(BtGatewayClientContext *client)
+{
+	const uint32_t c = TEST_NUM_CHARACTERISTICS - 1;
+
+	BtGatewayStatistics before;
+	BtGatewayStatistics after;
+	TEST_CHECK_EQ(AKS_OK, btGatewayGetStatistics(&s_gw, &before));
+	for (uint32_t i=0 ; i<TEST_NUM_FLOOD ; ++i) {
+		_test_notify(c, (uint8_t)(0x80 + i));
+	}
+	_test_wait_gateway(before.notifications + TEST_NUM_FLOOD);
+	TEST_CHECK_EQ(AKS_OK, btGatewayGetStatistics(&s_gw, &after));
+
+	uint64_t published = after.published - before.published;
+	uint64_t dropped   = after.dropped - before.dropped;
+	TEST_CHECK_EQ(TEST_NUM_FLOOD, published + dropped);
+	TEST_CHECK(published <= TEST_RING_SIZE / _test_record_size(s_value_sizes[c]));
+	TEST_CHECK(dropped > 0);
+	TEST_CHECK_EQ(dropped, btGatewayClientGetDropped(client));
+
+	//J 入った分は先頭から順に残っている
+	for (uint64_t i=0 ; i<published ; ++i) {
+		size_t offset;
+		if (!_test_receive(client, c, (uint8_t)(0x80 + i), offset)) {
+			return;
+		}
+	}
+	const BtGatewayRecord *rec;
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, btGatewayClientReceive(client, &rec, 0));
+
+	//J 読み終えればまた入る
+	size_t offset;
+	_test_notify(c, 0x42);
+	(void)_test_receive(client, c, 0x42, offset);
+	TEST_CHECK_EQ(dropped, btGatewayClientGetDropped(client));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J おかしな tail を書いたクライアントだけ切られる
+/*---------------------------------------------------------------------------*/
+static void _test_fault(BtGatewayClientContext *rewound)
+{
+	const uint32_t c = 1;
+
+	static BtGatewayClientContext torn;
+	static BtGatewayClientContext good;
+	_test_connect(&torn, c, 1);
+	_test_connect(&good, c, 1);
+
+	size_t offset;
+	_test_notify(c, 0x10);
+	(void)_test_receive(rewound, c, 0x10, offset);
+	(void)_test_receive(&torn, c, 0x10, offset);
+	(void)_test_receive(&good, c, 0x10, offset);
+
+	//J rewound はリング何周分も先まで書かれているので 0 は 1周より前。
+	//J torn は 64bit の上位だけが書かれて head より先になった
+	__atomic_store_n(&rewound->tail->tail, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&torn.tail->tail, torn.tail->tail | (1ULL << 40), __ATOMIC_SEQ_CST);
+
+	_test_notify(c, 0x11);
+	(void)_test_receive(&good, c, 0x11, offset);
+
+	uint8_t value[TEST_MTU];
+	size_t read_size = 0;
+	TEST_CHECK_EQ((int)AKS_ERROR_IO, btGatewayClientRead(rewound, s_device, s_handles[c], value, sizeof(value), read_size));
+	TEST_CHECK_EQ((int)AKS_ERROR_IO, btGatewayClientRead(&torn, s_device, s_handles[c], value, sizeof(value), read_size));
+	TEST_CHECK_EQ(AKS_OK, btGatewayClientRead(&good, s_device, s_handles[c], value, sizeof(value), read_size));
+	TEST_CHECK_EQ(s_value_sizes[c], read_size);
+
+	_test_notify(c, 0x12);
+	(void)_test_receive(&good, c, 0x12, offset);
+
+	TEST_CHECK_EQ(AKS_OK, btGatewayClientDisconnect(&torn));
+	TEST_CHECK_EQ(AKS_OK, btGatewayClientDisconnect(&good));
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_setup();
+
+	static BtGatewayClientContext client;
+	_test_connect(&client, 0, TEST_NUM_CHARACTERISTICS);
+
+	_test_wrap(&client);
+	_test_full(&client);
+	_test_fault(&client);
+
+	TEST_CHECK_EQ(AKS_OK, btGatewayClientDisconnect(&client));
+	TEST_CHECK_EQ(AKS_OK, btGatewayDestroy(&s_gw));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_dev));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+
+	return test_result("gateway");
+}
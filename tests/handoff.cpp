@@ -0,0 +1,391 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_handoff を socketpair() の両端で動かし、bt_le_emulator に繋いだデバイスを引き継ぐ
+ *J
+ *J - btLeDeviceDetach() → SCM_RIGHTS → btLeDeviceAttach() で ATT_MTU と登録が引き継がれ、
+ *J   止めている間に届いた Notification も btLeDeviceResume() の後で受け取れること
+ *J - 相手が Ack でエラーを返すか、Ack を返さずに閉じたら、送った側で受信を再開し、
+ *J   Callback もそのまま使えること
+ *J - 書き込みを封じていない状態の memfd は AKS_ERROR_BT_INVALUD_FORMAT で断り、
+ *J   同じ状態でも封じてあれば受け取ること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+#include "bt_handoff.h"
+#include "test_util.h"
+
+#define TEST_MTU									(185)
+#define TEST_NUM_NOTIFICATIONS						(3)
+
+static BtLeEmulatorContext s_emu;
+static BtAttHandle         s_handle;
+static BtGattDeviceContext s_old;
+static BtGattDeviceContext s_new[2];
+
+static uint32_t s_old_notifications = 0;
+static uint32_t s_new_notifications = 0;
+
+//J 受け取る側のスレッド
+static int    s_receive_sock;
+static int    s_receive_ret;
+static size_t s_num_received;
+static int    s_fake_result;					//J 偽の受け手が Ack で返す値 (AKS_OK なら Ack せずに閉じる)
+
+
+/*---------------------------------------------------------------------------*/
+static int _test_notification_cb(void *arg, BtAttHandle handle, uint8_t *value, size_t size)
+{
+	(void)value;
+	(void)size;
+
+	if (handle == s_handle) {
+		__atomic_fetch_add((uint32_t *)arg, 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J *counter が expected 増えるまで待つ (1秒で諦める)。増えた数を返す
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_wait_notifications(uint32_t *counter, const uint32_t before, const uint32_t expected)
+{
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 1000000000ULL;
+	uint32_t received;
+	do {
+		usleep(10000);
+		received = __atomic_load_n(counter, __ATOMIC_RELAXED) - before;
+	} while ((received < expected) && (btUtilGetMonotonicTimeNs() < deadline_ns));
+
+	return received;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J CCCD は Write Command で書かれるので、Peripheral に届くまで待つ
+/*---------------------------------------------------------------------------*/
+static bool _test_wait_config(void)
+{
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 1000000000ULL;
+	do {
+		uint16_t config = 0;
+		size_t size = 0;
+		if ((btLeEmulatorGetValue(&s_emu, s_handle + 1, &config, sizeof(config), size) == AKS_OK) && (config != 0)) {
+			return true;
+		}
+		usleep(10000);
+	} while (btUtilGetMonotonicTimeNs() < deadline_ns);
+
+	return false;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Notification を送って *counter で受け取れるか、Read ができるか
+/*---------------------------------------------------------------------------*/
+static void _test_check_usable(BtGattDeviceContext *ctx, uint32_t *counter)
+{
+	uint32_t before = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	for (uint32_t i=0 ; i<TEST_NUM_NOTIFICATIONS ; ++i) {
+		(void)btLeEmulatorNotifyValues(&s_emu, &s_handle, 1);
+	}
+	TEST_CHECK_EQ(TEST_NUM_NOTIFICATIONS, _test_wait_notifications(counter, before, TEST_NUM_NOTIFICATIONS));
+
+	uint8_t value[20];
+	size_t read_size = 0;
+	TEST_CHECK_EQ(AKS_OK, BtGattCharacteristicValueRead::btGattReadCharacteristicValue(*ctx, s_handle, value, sizeof(value), read_size));
+	TEST_CHECK_EQ(sizeof(value), read_size);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void *_test_receive_func(void *arg)
+{
+	(void)arg;
+
+	s_receive_ret = btHandoffReceiveWithSocket(s_receive_sock, s_new, sizeof(s_new) / sizeof(s_new[0]), s_num_received);
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 1つ受け取って fd を閉じ、s_fake_result を Ack で返す偽の受け手
+/*---------------------------------------------------------------------------*/
+static void *_test_fake_receive_func(void *arg)
+{
+	(void)arg;
+
+	BtHandoffMessage message;
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len  = sizeof(message);
+
+	union {
+		struct cmsghdr align;
+		uint8_t        buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	s_receive_ret = AKS_ERROR_IO;
+	if (recvmsg(s_receive_sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(message)) {
+		return NULL;
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if ((cmsg == NULL) || (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))) {
+		return NULL;
+	}
+	int fds[2];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	close(fds[0]);
+	close(fds[1]);
+
+	if (s_fake_result != AKS_OK) {
+		BtHandoffAck ack;
+		ack.index  = message.index;
+		ack.result = s_fake_result;
+		(void)send(s_receive_sock, &ack, sizeof(ack), MSG_NOSIGNAL);
+	}
+	shutdown(s_receive_sock, SHUT_RDWR);
+	s_receive_ret = AKS_OK;
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_create_device(void)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 4;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = TEST_MTU;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu, &link));
+
+	uint8_t level[20];
+	memset(level, 0x5A, sizeof(level));
+	BtAttHandle service;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddPrimaryService(&s_emu, 0x180F, service));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, 0x2A19, BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cNotify, level, sizeof(level), s_handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu));
+
+	BtLeDeviceOptions options;
+	(void)btLeDeviceInitOptions(&options);
+	options.mtu             = TEST_MTU;
+	options.client_features = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_old, dup(btLeEmulatorGetCentralSocket(&s_emu)), &options));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceRegistNotificationCallbackWithArg(&s_old, s_handle + 1, s_handle, _test_notification_cb, &s_old_notifications));
+	TEST_CHECK(_test_wait_config());
+	_test_check_usable(&s_old, &s_old_notifications);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_handoff(void)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+	s_receive_sock = fds[1];
+	pthread_t thread;
+	TEST_CHECK_EQ(0, pthread_create(&thread, NULL, _test_receive_func, NULL));
+
+	uint16_t mtu = btLeDeviceGetMtu(&s_old);
+	BtGattDeviceContext *ctxs[1] = { &s_old };
+	size_t num_sent = 0;
+	TEST_CHECK_EQ(AKS_OK, btHandoffSendWithSocket(fds[0], ctxs, 1, num_sent));
+	TEST_CHECK_EQ(1, num_sent);
+	TEST_CHECK(!btLeDeviceIsConnected(&s_old));
+
+	//J 受け取った側が Resume する前に届いた分は Socket に溜まる
+	for (uint32_t i=0 ; i<TEST_NUM_NOTIFICATIONS ; ++i) {
+		(void)btLeEmulatorNotifyValues(&s_emu, &s_handle, 1);
+	}
+
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	close(fds[1]);
+	TEST_CHECK_EQ(AKS_OK, s_receive_ret);
+	TEST_CHECK_EQ(1, s_num_received);
+
+	BtGattDeviceContext *ctx = &s_new[0];
+	TEST_CHECK_EQ(mtu, btLeDeviceGetMtu(ctx));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceBindNotificationCallbackWithArg(ctx, s_handle, _test_notification_cb, &s_new_notifications));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceResume(ctx));
+	TEST_CHECK_EQ(TEST_NUM_NOTIFICATIONS, _test_wait_notifications(&s_new_notifications, 0, TEST_NUM_NOTIFICATIONS));
+	_test_check_usable(ctx, &s_new_notifications);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 受け手が断ったら送り手が使い続ける
+/*---------------------------------------------------------------------------*/
+static void _test_rollback(const int fake_result)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+	s_receive_sock = fds[1];
+	s_fake_result  = fake_result;
+	pthread_t thread;
+	TEST_CHECK_EQ(0, pthread_create(&thread, NULL, _test_fake_receive_func, NULL));
+
+	BtGattDeviceContext *ctx = &s_new[0];
+	uint16_t mtu = btLeDeviceGetMtu(ctx);
+	BtGattDeviceContext *ctxs[1] = { ctx };
+	size_t num_sent = 1;
+	int expected = (fake_result != AKS_OK) ? fake_result : (int)AKS_ERROR_IO;
+	TEST_CHECK_EQ(expected, btHandoffSendWithSocket(fds[0], ctxs, 1, num_sent));
+	TEST_CHECK_EQ(0, num_sent);
+
+	pthread_join(thread, NULL);
+	close(fds[0]);
+	close(fds[1]);
+	TEST_CHECK_EQ(AKS_OK, s_receive_ret);
+
+	TEST_CHECK(btLeDeviceIsConnected(ctx));
+	TEST_CHECK_EQ(mtu, btLeDeviceGetMtu(ctx));
+	_test_check_usable(ctx, &s_new_notifications);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J L2CAP Socket の代わりに socketpair() の片側を付け、seals で封じた memfd の状態を送る
+/*---------------------------------------------------------------------------*/
+static int _test_send_state(int sock, const uint32_t index, const int seals, int &peer)
+{
+	BtLeDeviceHandoffState state;
+	memset(&state, 0x00, sizeof(state));
+	state.version    = BT_LE_DEVICE_HANDOFF_VERSION;
+	state.client_mtu = BT_ATT_MIN_LE_MTU;
+	state.server_mtu = BT_ATT_MIN_LE_MTU;
+
+	int link[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, link));
+	peer = link[1];
+
+	int state_fd = memfd_create("test_handoff_state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	TEST_CHECK(state_fd >= 0);
+	TEST_CHECK_EQ(sizeof(state), write(state_fd, &state, sizeof(state)));
+	if (seals != 0) {
+		TEST_CHECK_EQ(0, fcntl(state_fd, F_ADD_SEALS, seals));
+	}
+
+	BtHandoffMessage message;
+	message.magic      = BT_HANDOFF_MAGIC;
+	message.index      = index;
+	message.state_size = sizeof(state);
+
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len  = sizeof(message);
+
+	int fds[2] = { link[0], state_fd };
+	union {
+		struct cmsghdr align;
+		uint8_t        buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	TEST_CHECK_EQ(sizeof(message), sendmsg(sock, &msg, MSG_NOSIGNAL));
+	close(link[0]);
+	close(state_fd);
+
+	BtHandoffAck ack;
+	memset(&ack, 0x00, sizeof(ack));
+	TEST_CHECK_EQ(sizeof(ack), recv(sock, &ack, sizeof(ack), 0));
+	TEST_CHECK_EQ(index, ack.index);
+
+	return ack.result;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_seals(void)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+	s_receive_sock = fds[1];
+	pthread_t thread;
+	TEST_CHECK_EQ(0, pthread_create(&thread, NULL, _test_receive_func, NULL));
+
+	//J 大きさは封じてあっても書き込めるなら断る
+	int writable_peer = -1;
+	int sealed_peer   = -1;
+	TEST_CHECK_EQ((int)AKS_ERROR_BT_INVALUD_FORMAT, _test_send_state(fds[0], 0, F_SEAL_SHRINK | F_SEAL_GROW, writable_peer));
+	TEST_CHECK_EQ(AKS_OK, _test_send_state(fds[0], 1, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE, sealed_peer));
+
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	close(fds[1]);
+	TEST_CHECK_EQ(AKS_OK, s_receive_ret);
+	TEST_CHECK_EQ(1, s_num_received);
+
+	//J 断った方の Socket は閉じられている
+	char c;
+	TEST_CHECK_EQ(0, recv(writable_peer, &c, sizeof(c), MSG_DONTWAIT));
+	close(writable_peer);
+
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceResume(&s_new[0]));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_new[0]));
+	close(sealed_peer);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_create_device();
+	_test_handoff();
+	_test_rollback(AKS_ERROR_FULL);
+	_test_rollback(AKS_OK);
+
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_new[0]));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+
+	_test_seals();
+
+	return test_result("handoff");
+}
@@ -0,0 +1,363 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_le_managed_device を bt_le_emulator に繋ぎ、Peripheral を壊して張り直しを確かめる
+ *J
+ *J - 状態が cConnected → cConnecting → cConnected → cConnecting → cDatabaseChanged と
+ *J   移り、それぞれ state_cb に届くこと
+ *J - 張り直しの connect() を 3回断ると、各回の間隔が Equal Jitter の範囲
+ *J   (base/2 〜 base、base は backoff_initial_ms から倍々で backoff_max_ms まで) に入ること
+ *J - 張り直した後、Database Hash が同じなら CCCD を書き直して Notification が届くこと
+ *J - Database Hash が変わっていれば CCCD は書かず cDatabaseChanged になること
+ *J - max_attempts を使い切ったら最後の理由で cStopped になること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+#include "bt_le_managed_device.h"
+#include "test_util.h"
+
+#define TEST_BTADDR									"AA:BB:CC:DD:EE:FF"
+#define TEST_BACKOFF_MS								(100)
+#define TEST_BACKOFF_MAX_MS							(400)
+#define TEST_NUM_REFUSED							(3)			//J 1回目の切断の後で断る connect() の数
+#define TEST_SLACK_MS								(150)		//J Backoff の上限に足す、スケジューラの遅れの分
+#define TEST_MAX_STATES								(16)
+#define TEST_MAX_OPENS								(16)
+#define TEST_NUM_NOTIFICATIONS						(5)
+
+static BtLeEmulatorContext s_emus[3];
+static int         s_current = 0;			//J open で繋ぐ s_emus の番号
+static BtAttHandle s_handle;				//J 0x2A19 の Value Handle (CCCD は +1)
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t s_refuse = 0;				//J この数だけ open を -ECONNREFUSED にする
+static uint32_t s_num_opens = 0;
+static uint64_t s_open_ns[TEST_MAX_OPENS];
+static uint32_t s_num_states = 0;
+static uint8_t  s_states[TEST_MAX_STATES];
+static int      s_reasons[TEST_MAX_STATES];
+static uint64_t s_state_ns[TEST_MAX_STATES];
+static uint32_t s_notifications = 0;
+
+
+/*---------------------------------------------------------------------------*/
+static int _test_open(void *arg, const char *btaddr, const BtLeDeviceOptions *options)
+{
+	(void)arg;
+	(void)btaddr;
+	(void)options;
+
+	pthread_mutex_lock(&s_mutex);
+	if (s_num_opens < TEST_MAX_OPENS) {
+		s_open_ns[s_num_opens] = btUtilGetMonotonicTimeNs();
+	}
+	s_num_opens++;
+	bool refuse = (s_refuse > 0);
+	if (refuse) {
+		s_refuse--;
+	}
+	int current = s_current;
+	pthread_mutex_unlock(&s_mutex);
+
+	if (refuse) {
+		return -ECONNREFUSED;
+	}
+
+	int sock = dup(btLeEmulatorGetCentralSocket(&s_emus[current]));
+	if (sock < 0) {
+		return -errno;
+	}
+	(void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	return sock;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _test_open_refused(void *arg, const char *btaddr, const BtLeDeviceOptions *options)
+{
+	(void)arg;
+	(void)btaddr;
+	(void)options;
+
+	return -ECONNREFUSED;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_state_cb(void *arg, uint8_t state, int reason)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&s_mutex);
+	if (s_num_states < TEST_MAX_STATES) {
+		s_states[s_num_states]   = state;
+		s_reasons[s_num_states]  = reason;
+		s_state_ns[s_num_states] = btUtilGetMonotonicTimeNs();
+	}
+	s_num_states++;
+	pthread_mutex_unlock(&s_mutex);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static int _test_notification_cb(void *arg, BtAttHandle handle, uint8_t *value, size_t size)
+{
+	(void)arg;
+	(void)value;
+	(void)size;
+
+	if (handle == s_handle) {
+		__atomic_fetch_add(&s_notifications, 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Database Hash の全バイトを hash_byte にした Peripheral を作る
+/*---------------------------------------------------------------------------*/
+static void _test_create_emulator(BtLeEmulatorContext *emu, const uint8_t hash_byte)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 4;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = 185;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(emu, &link));
+
+	uint8_t hash[BT_LE_MANAGED_DEVICE_DATABASE_HASH_SIZE];
+	memset(hash, hash_byte, sizeof(hash));
+	uint8_t level[20];
+	memset(level, 0x00, sizeof(level));
+
+	BtAttHandle service;
+	BtAttHandle hash_handle;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddPrimaryService(emu, 0x1801, service));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(emu, GattCharacteristicTypeUuid::cDatabaseHash, BtAttCharacteristicProperties::cRead, hash, sizeof(hash), hash_handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddPrimaryService(emu, 0x180F, service));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(emu, 0x2A19, BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cNotify, level, sizeof(level), s_handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J CCCD は Write Command で書かれるので、Peripheral に届くまで待って値を返す (1秒で諦める)
+/*---------------------------------------------------------------------------*/
+static uint16_t _test_wait_config(BtLeEmulatorContext *emu)
+{
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 1000000000ULL;
+	uint16_t config = 0;
+	do {
+		size_t size = 0;
+		if ((btLeEmulatorGetValue(emu, s_handle + 1, &config, sizeof(config), size) != AKS_OK) || (size != sizeof(config))) {
+			config = 0;
+		}
+		if (config != 0) {
+			break;
+		}
+		usleep(10000);
+	} while (btUtilGetMonotonicTimeNs() < deadline_ns);
+
+	return config;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Notification を送り、届いた数を返す (expected 個届くか 1秒で諦める)
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_notify(BtLeEmulatorContext *emu, const uint32_t expected)
+{
+	uint32_t before = __atomic_load_n(&s_notifications, __ATOMIC_RELAXED);
+	for (uint32_t i=0 ; i<TEST_NUM_NOTIFICATIONS ; ++i) {
+		(void)btLeEmulatorNotifyValues(emu, &s_handle, 1);
+	}
+
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 1000000000ULL;
+	uint32_t received;
+	do {
+		usleep(10000);
+		received = __atomic_load_n(&s_notifications, __ATOMIC_RELAXED) - before;
+	} while ((received < expected) && (btUtilGetMonotonicTimeNs() < deadline_ns));
+
+	return received;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 切断を知ってから各 connect() までの間隔が Equal Jitter の範囲に入っているか
+/*---------------------------------------------------------------------------*/
+static void _test_check_backoff(const uint64_t lost_ns, const uint32_t first_open)
+{
+	uint64_t prev_ns = lost_ns;
+	uint64_t base_ms = TEST_BACKOFF_MS;
+	for (uint32_t i=0 ; i<=TEST_NUM_REFUSED ; ++i) {
+		uint64_t gap_ms = (s_open_ns[first_open + i] - prev_ns) / 1000000ULL;
+		printf("  attempt %u: %llu ms (%llu - %llu)\n", i, (unsigned long long)gap_ms, (unsigned long long)(base_ms / 2), (unsigned long long)base_ms);
+		TEST_CHECK(gap_ms >= base_ms / 2);
+		TEST_CHECK(gap_ms <= base_ms + TEST_SLACK_MS);
+
+		prev_ns = s_open_ns[first_open + i];
+		base_ms = (base_ms * 2 > TEST_BACKOFF_MAX_MS) ? TEST_BACKOFF_MAX_MS : base_ms * 2;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_reconnect(void)
+{
+	static BtLeManagedDevice dev;
+	BtLeManagedDeviceOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceInitOptions(&options));
+	options.backoff_initial_ms = TEST_BACKOFF_MS;
+	options.backoff_max_ms     = TEST_BACKOFF_MAX_MS;
+	options.connect_timeout_ms = 1000;
+	options.state_cb           = _test_state_cb;
+	options.open               = _test_open;
+
+	_test_create_emulator(&s_emus[0], 0x01);
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceStart(&dev, TEST_BTADDR, &options));
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceWaitConnected(&dev, 2000));
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cConnected, btLeManagedDeviceGetState(&dev));
+
+	BtGattDeviceContext *ctx;
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceAcquire(&dev, &ctx));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceRegistNotificationCallbackWithArg(ctx, s_handle + 1, s_handle, _test_notification_cb, NULL));
+	(void)btLeManagedDeviceRelease(&dev);
+	TEST_CHECK_EQ(BtAttClientCharacteristicConfiguration::cNotification, _test_wait_config(&s_emus[0]));
+	TEST_CHECK_EQ(TEST_NUM_NOTIFICATIONS, _test_notify(&s_emus[0], TEST_NUM_NOTIFICATIONS));
+
+	//J 同じ Database Hash の Peripheral に替え、張り直しの connect() を断る
+	_test_create_emulator(&s_emus[1], 0x01);
+	pthread_mutex_lock(&s_mutex);
+	s_current = 1;
+	s_refuse  = TEST_NUM_REFUSED;
+	uint32_t first_open  = s_num_opens;
+	uint32_t first_state = s_num_states;
+	pthread_mutex_unlock(&s_mutex);
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emus[0]));
+
+	usleep(20000);
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cConnecting, btLeManagedDeviceGetState(&dev));
+	TEST_CHECK_EQ((int)AKS_ERROR_IO, btLeManagedDeviceAcquire(&dev, &ctx));
+
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceWaitConnected(&dev, 5000));
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cConnected, btLeManagedDeviceGetState(&dev));
+	TEST_CHECK_EQ(first_open + TEST_NUM_REFUSED + 1, s_num_opens);
+	if ((s_num_opens == first_open + TEST_NUM_REFUSED + 1) && (s_num_states > first_state)) {
+		_test_check_backoff(s_state_ns[first_state], first_open);
+	}
+
+	//J CCCD が書き直されていれば新しい Peripheral からも届く
+	TEST_CHECK_EQ(BtAttClientCharacteristicConfiguration::cNotification, _test_wait_config(&s_emus[1]));
+	TEST_CHECK_EQ(TEST_NUM_NOTIFICATIONS, _test_notify(&s_emus[1], TEST_NUM_NOTIFICATIONS));
+
+	BtLeManagedDeviceStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceGetStatistics(&dev, &stats));
+	TEST_CHECK_EQ(1, stats.disconnects);
+	TEST_CHECK_EQ(1, stats.reconnects);
+	TEST_CHECK_EQ(TEST_NUM_REFUSED, stats.failed_attempts);
+	TEST_CHECK_EQ(0, stats.database_changes);
+	TEST_CHECK(stats.last_recovery_ns >= (uint64_t)(TEST_BACKOFF_MS / 2 + TEST_BACKOFF_MS + 2 * (TEST_BACKOFF_MAX_MS / 2)) * 1000000ULL);
+
+	//J Database Hash の違う Peripheral に替える
+	_test_create_emulator(&s_emus[2], 0x02);
+	pthread_mutex_lock(&s_mutex);
+	s_current = 2;
+	pthread_mutex_unlock(&s_mutex);
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emus[1]));
+
+	usleep(20000);
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceWaitConnected(&dev, 5000));
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cDatabaseChanged, btLeManagedDeviceGetState(&dev));
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceGetStatistics(&dev, &stats));
+	TEST_CHECK_EQ(2, stats.disconnects);
+	TEST_CHECK_EQ(2, stats.reconnects);
+	TEST_CHECK_EQ(1, stats.database_changes);
+
+	//J Handle が変わったかもしれないので CCCD は書かれず、Notification も来ない
+	TEST_CHECK_EQ(0, _test_wait_config(&s_emus[2]));
+	TEST_CHECK_EQ(0, _test_notify(&s_emus[2], 1));
+
+	static const uint8_t expected[] = {
+		BtLeManagedDeviceState::cConnected,
+		BtLeManagedDeviceState::cConnecting,
+		BtLeManagedDeviceState::cConnected,
+		BtLeManagedDeviceState::cConnecting,
+		BtLeManagedDeviceState::cDatabaseChanged,
+	};
+	TEST_CHECK_EQ(sizeof(expected), s_num_states);
+	for (uint32_t i=0 ; (i<sizeof(expected)) && (i<s_num_states) ; ++i) {
+		TEST_CHECK_EQ(expected[i], s_states[i]);
+		if (expected[i] != BtLeManagedDeviceState::cConnecting) {
+			TEST_CHECK_EQ(AKS_OK, s_reasons[i]);
+		}
+	}
+
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceStop(&dev));
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cStopped, btLeManagedDeviceGetState(&dev));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emus[2]));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_give_up(void)
+{
+	static BtLeManagedDevice dev;
+	BtLeManagedDeviceOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceInitOptions(&options));
+	options.backoff_initial_ms = 20;
+	options.backoff_max_ms     = 40;
+	options.max_attempts       = 3;
+	options.state_cb           = _test_state_cb;
+	options.open               = _test_open_refused;
+
+	pthread_mutex_lock(&s_mutex);
+	s_num_states = 0;
+	pthread_mutex_unlock(&s_mutex);
+
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceStart(&dev, TEST_BTADDR, &options));
+	TEST_CHECK_EQ((int)AKS_ERROR_INVALID, btLeManagedDeviceWaitConnected(&dev, 2000));
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cStopped, btLeManagedDeviceGetState(&dev));
+
+	BtLeManagedDeviceStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceGetStatistics(&dev, &stats));
+	TEST_CHECK_EQ(3, stats.attempts);
+	TEST_CHECK_EQ(3, stats.failed_attempts);
+
+	TEST_CHECK_EQ(1, s_num_states);
+	TEST_CHECK_EQ(BtLeManagedDeviceState::cStopped, s_states[0]);
+	TEST_CHECK_EQ(-ECONNREFUSED, s_reasons[0]);
+
+	TEST_CHECK_EQ(AKS_OK, btLeManagedDeviceStop(&dev));
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_reconnect();
+	_test_give_up();
+
+	return test_result("managed_device");
+}
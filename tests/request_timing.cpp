@@ -0,0 +1,375 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J Request の期限、Procedure の budget、btLeDeviceCancel()、接続直後の setup の期限を確かめる
+ *J
+ *J - 相手が答えない Request は渡した期限 (か request_timeout_ms) で AKS_ERROR_TIMEOUT になり、
+ *J   遅れて来た Response を次の Request が自分の Response と取り違えないこと
+ *J - btLeDeviceBeginProcedure() の budget は複数の Request にまたがり、入れ子では外側の期限が残ること
+ *J - btLeDeviceCancel() は待っている Request と、Procedure の残りの Request を AKS_ERROR_CANCELED にすること
+ *J - bt_gatt の Read Long が procedure_timeout_ms で打ち切られること
+ *J - 答えない相手への btLeDeviceCreateWithSocket() が setup_timeout_ms で戻ること
+ *J
+ *J 経過時間は期限より短くなく、TEST_SLACK_MS 以上は遅れないことを確かめる。
+ *J 負荷の高いマシンでは環境変数 BT_TEST_SLACK_MS (か -DTEST_SLACK_MS=) で広げる。
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_le_emulator.h"
+#include "test_util.h"
+
+#ifndef TEST_SLACK_MS
+#define TEST_SLACK_MS								(250)		//J スケジューラの遅れの分
+#endif
+#define TEST_LONG_VALUE_SIZE						(400)
+
+//J Read Request に Handle の下位バイトだけの Read Response を返す相手
+struct TestPeer
+{
+	int          sock;
+	pthread_t    thread;
+	volatile int delay_ms;				//J Response を返すまでの時間
+	volatile int silent;				//J この数の Request には答えない
+};
+
+static TestPeer            s_peer;
+static BtGattDeviceContext s_ctx;
+static BtLeEmulatorContext s_emu;
+static uint32_t            s_slack_ms = TEST_SLACK_MS;
+
+
+/*---------------------------------------------------------------------------*/
+static void *_test_peer_thread(void *arg)
+{
+	TestPeer *peer = (TestPeer *)arg;
+	uint8_t req[BT_ATT_MAX_LE_MTU];
+
+	while (1) {
+		ssize_t len = read(peer->sock, req, sizeof(req));
+		if (len <= 0) {
+			break;
+		}
+		if (req[0] != BtAttPduOpcode::cAttOpcodeReadRequest) {
+			continue;
+		}
+		if (peer->silent > 0) {
+			peer->silent--;
+			continue;
+		}
+		usleep(peer->delay_ms * 1000);
+		uint8_t rsp[2] = { BtAttPduOpcode::cAttOpcodeReadResponse, req[1] };
+		if (write(peer->sock, rsp, sizeof(rsp)) != (ssize_t)sizeof(rsp)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 相手が遅れて Response を返したことにする
+/*---------------------------------------------------------------------------*/
+static void _test_late_response(const uint8_t handle)
+{
+	uint8_t rsp[2] = { BtAttPduOpcode::cAttOpcodeReadResponse, handle };
+	TEST_CHECK_EQ(sizeof(rsp), write(s_peer.sock, rsp, sizeof(rsp)));
+	usleep(10 * 1000);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 成功すれば 0x100 | Response の Handle、失敗すれば AKS_*
+/*---------------------------------------------------------------------------*/
+static int _test_read(const uint8_t handle, const uint32_t timeout_ms)
+{
+	uint8_t pdu[3] = { BtAttPduOpcode::cAttOpcodeReadRequest, handle, 0x00 };
+	int ret = btLeDeviceSendAttPduAndWaitForResponse(
+								&s_ctx, pdu, sizeof(pdu), BtAttPduOpcode::cAttOpcodeReadResponse, timeout_ms * 1000000U);
+	if (ret != AKS_OK) {
+		return ret;
+	}
+	return 0x100 | s_ctx.read_buf[1];
+}
+
+
+/*---------------------------------------------------------------------------*/
+static bool _test_within(const uint64_t start_ns, const uint32_t expected_ms)
+{
+	double elapsed_ms = (double)(btUtilGetMonotonicTimeNs() - start_ns) / 1e6;
+	if ((elapsed_ms + 1 < expected_ms) || (elapsed_ms > expected_ms + s_slack_ms)) {
+		printf("  elapsed %.1f ms, expected %u ms\n", elapsed_ms, expected_ms);
+		return false;
+	}
+	return true;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void *_test_canceller(void *arg)
+{
+	usleep(*(uint32_t *)arg * 1000);
+	(void)btLeDeviceCancel(&s_ctx);
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_request_deadlines(void)
+{
+	BtLeDeviceOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceInitOptions(&options));
+	TEST_CHECK_EQ(BT_LE_DEVICE_DEFAULT_REQUEST_TIMEOUT_MS, options.request_timeout_ms);
+	TEST_CHECK_EQ(BT_LE_DEVICE_DEFAULT_SETUP_TIMEOUT_MS, options.setup_timeout_ms);
+	options.mtu             = 0;
+	options.client_features = 0;
+
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+	memset(&s_peer, 0x00, sizeof(s_peer));
+	s_peer.sock = fds[1];
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_ctx, fds[0], &options));
+	TEST_CHECK_EQ(0, pthread_create(&s_peer.thread, NULL, _test_peer_thread, &s_peer));
+
+	//J 期限が来れば打ち切り、遅れた Response は捨てる
+	s_peer.silent = 1;
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, _test_read(1, 50));
+	TEST_CHECK(_test_within(start_ns, 50));
+	TEST_CHECK(s_ctx.orphaned);
+	_test_late_response(1);
+	TEST_CHECK(!s_ctx.orphaned);
+
+	//J 打ち切った Request の Response が来るまで次の Request は待ち、自分の Response を受ける
+	s_peer.delay_ms = 120;
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, _test_read(2, 50));
+	TEST_CHECK(_test_within(start_ns, 50));
+	s_peer.delay_ms = 10;
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(0x103, _test_read(3, 0));
+	TEST_CHECK(_test_within(start_ns, 120 - 50 + 10));
+	TEST_CHECK(!s_ctx.orphaned);
+
+	//J 期限の無い Request を別のスレッドから取り消す
+	s_peer.silent = 1;
+	uint32_t cancel_ms = 30;
+	pthread_t canceller;
+	TEST_CHECK_EQ(0, pthread_create(&canceller, NULL, _test_canceller, &cancel_ms));
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_CANCELED, _test_read(4, 0));
+	TEST_CHECK(_test_within(start_ns, cancel_ms));
+	pthread_join(canceller, NULL);
+
+	//J 取り消した Request の Response が来なくても、次の Request は自分の期限で戻る
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, _test_read(5, 40));
+	TEST_CHECK(_test_within(start_ns, 40));
+	_test_late_response(4);
+	TEST_CHECK(!s_ctx.orphaned);
+
+	//J Procedure の budget は複数の Request にまたがる
+	s_peer.delay_ms = 40;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceBeginProcedure(&s_ctx, 100));
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(0x106, _test_read(6, 0));
+	TEST_CHECK_EQ(0x107, _test_read(7, 0));
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, _test_read(8, 0));
+	TEST_CHECK(_test_within(start_ns, 100));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceEndProcedure(&s_ctx));
+	usleep(60 * 1000);
+
+	//J Procedure の中で取り消すと残りの Request も取り消され、End の後は元に戻る
+	s_peer.delay_ms = 20;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceBeginProcedure(&s_ctx, 0));
+	TEST_CHECK_EQ(0, pthread_create(&canceller, NULL, _test_canceller, &cancel_ms));
+	TEST_CHECK_EQ(0x109, _test_read(9, 0));
+	TEST_CHECK_EQ((int)AKS_ERROR_CANCELED, _test_read(10, 0));
+	TEST_CHECK_EQ((int)AKS_ERROR_CANCELED, _test_read(11, 0));
+	pthread_join(canceller, NULL);
+	TEST_CHECK_EQ((int)AKS_ERROR_CANCELED, _test_read(12, 0));
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceEndProcedure(&s_ctx));
+	usleep(60 * 1000);
+	TEST_CHECK_EQ(0x10D, _test_read(13, 0));
+
+	//J 期限を渡さない bt_gatt の Request は request_timeout_ms で打ち切る
+	s_ctx.request_timeout_ms = 80;
+	s_peer.silent = 1;
+	uint8_t value[8];
+	size_t read_size = 0;
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, BtGattCharacteristicValueRead::btGattReadCharacteristicValue(s_ctx, 3, value, sizeof(value), read_size));
+	TEST_CHECK(_test_within(start_ns, 80));
+
+	BtLeDeviceStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceGetStatistics(&s_ctx, &stats));
+	printf("  request deadlines: timeouts %llu, cancellations %llu, dropped %llu\n",
+			(unsigned long long)stats.timeouts,
+			(unsigned long long)stats.cancellations,
+			(unsigned long long)stats.dropped_pdus);
+	TEST_CHECK_EQ(5, stats.timeouts);
+	TEST_CHECK_EQ(4, stats.cancellations);
+
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_ctx));
+	TEST_CHECK(_test_within(start_ns, 0));
+	close(s_peer.sock);
+	pthread_join(s_peer.thread, NULL);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 30 ms 間隔、ATT_MTU 23 の Emulator で 400 バイトの Read Long は 1 秒以上かかる
+/*---------------------------------------------------------------------------*/
+static void _test_procedure_budget(void)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 30000;
+	link.packets_per_event      = 1;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DEFAULT;
+	link.mtu                    = BT_ATT_MIN_LE_MTU;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu, &link));
+
+	uint8_t value[TEST_LONG_VALUE_SIZE];
+	for (size_t i=0 ; i<sizeof(value) ; ++i) {
+		value[i] = (uint8_t)i;
+	}
+	BtAttHandle service;
+	BtAttHandle handle;
+	(void)btLeEmulatorAddPrimaryService(&s_emu, 0x180A, service);
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, 0x2A00, BtAttCharacteristicProperties::cRead, value, sizeof(value), handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu));
+
+	BtLeDeviceOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceInitOptions(&options));
+	options.mtu                  = 0;
+	options.client_features      = 0;
+	options.procedure_timeout_ms = 300;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_ctx, btLeEmulatorGetCentralSocket(&s_emu), &options));
+
+	uint8_t buf[TEST_LONG_VALUE_SIZE + 100];
+	size_t read_size = 0;
+
+	//J procedure_timeout_ms が Read Long 全体の期限になる
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues(s_ctx, handle, buf, sizeof(buf), read_size));
+	TEST_CHECK(_test_within(start_ns, 300));
+	TEST_CHECK(!s_ctx.procedure_active);
+	usleep(100 * 1000);
+
+	//J 外側の短い budget が残る
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceBeginProcedure(&s_ctx, 150));
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_TIMEOUT, BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues(s_ctx, handle, buf, sizeof(buf), read_size));
+	TEST_CHECK(_test_within(start_ns, 150));
+	TEST_CHECK(s_ctx.procedure_active);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceEndProcedure(&s_ctx));
+	TEST_CHECK(!s_ctx.procedure_active);
+	usleep(100 * 1000);
+
+	//J btLeDeviceCancel() は Read Long の残りを止める
+	s_ctx.procedure_timeout_ms = 0;
+	uint32_t cancel_ms = 100;
+	pthread_t canceller;
+	TEST_CHECK_EQ(0, pthread_create(&canceller, NULL, _test_canceller, &cancel_ms));
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ((int)AKS_ERROR_CANCELED, BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues(s_ctx, handle, buf, sizeof(buf), read_size));
+	TEST_CHECK(_test_within(start_ns, cancel_ms));
+	pthread_join(canceller, NULL);
+	usleep(100 * 1000);
+
+	//J budget が無ければ最後まで読める
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, BtGattCharacteristicValueRead::btGattReadLongCharacteristicValues(s_ctx, handle, buf, sizeof(buf), read_size));
+	double elapsed_ms = (double)(btUtilGetMonotonicTimeNs() - start_ns) / 1e6;
+	TEST_CHECK_EQ(TEST_LONG_VALUE_SIZE, read_size);
+	TEST_CHECK(memcmp(buf, value, sizeof(value)) == 0);
+	TEST_CHECK(elapsed_ms > 300);
+	printf("  procedure budget: unbounded Read Long of %u bytes took %.0f ms\n", TEST_LONG_VALUE_SIZE, elapsed_ms);
+
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_ctx));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_setup_budget(void)
+{
+	//J 答えない相手でも setup_timeout_ms で戻り、既定の ATT_MTU のまま使える
+	int fds[2];
+	TEST_CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+	BtLeDeviceOptions options;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceInitOptions(&options));
+	options.setup_timeout_ms = 200;
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_ctx, fds[0], &options));
+	TEST_CHECK(_test_within(start_ns, 200));
+	TEST_CHECK_EQ(BT_ATT_MIN_LE_MTU, btLeDeviceGetMtu(&s_ctx));
+	TEST_CHECK(!s_ctx.procedure_active);
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_ctx));
+	close(fds[1]);
+
+	//J 答える相手とは setup の往復が終わる
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 6;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = 247;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emu, &link));
+	BtAttHandle service;
+	BtAttHandle handle;
+	uint8_t features = 0;
+	(void)btLeEmulatorAddPrimaryService(&s_emu, 0x1801, service);
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emu, 0x2B29,
+								BtAttCharacteristicProperties::cRead | BtAttCharacteristicProperties::cWrite,
+								&features, sizeof(features), handle));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emu));
+
+	start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_ctx, btLeEmulatorGetCentralSocket(&s_emu), NULL));
+	double elapsed_ms = (double)(btUtilGetMonotonicTimeNs() - start_ns) / 1e6;
+	size_t size = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorGetValue(&s_emu, handle, &features, sizeof(features), size));
+	TEST_CHECK_EQ(247, btLeDeviceGetMtu(&s_ctx));
+	TEST_CHECK(features != 0);
+	TEST_CHECK(elapsed_ms < BT_LE_DEVICE_DEFAULT_SETUP_TIMEOUT_MS);
+	printf("  setup budget: silent peer returned after 200 ms, emulator setup took %.0f ms\n", elapsed_ms);
+
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_ctx));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emu));
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	const char *slack = getenv("BT_TEST_SLACK_MS");
+	if ((slack != NULL) && (atoi(slack) > 0)) {
+		s_slack_ms = (uint32_t)atoi(slack);
+	}
+
+	_test_request_deadlines();
+	_test_procedure_budget();
+	_test_setup_budget();
+
+	return test_result("request_timing");
+}
@@ -0,0 +1,287 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J btLeScannerCreateReplay() に記録した HCI Event 列を流し、解析結果を確かめる
+ *J
+ *J - tests/data/le_adv_reports.h4 をファイルから読んで、全ての Report が取りこぼし無く
+ *J   記録した順に返ること (Event 数、Report 数、中身の FNV-1a)
+ *J - 同じ内容を Event の途中で切れる大きさに分けて pipe に書いても同じ結果になること
+ *J - 書き手が pipe を開いたまま止まっていても btLeScannerDestroy() がすぐに戻ること
+ *J - 誰も btLeScannerPoll() せずリングが一杯のまま Replay スレッドが待っていても、
+ *J   btLeScannerDestroy() がすぐに戻ること
+ *J
+ *J 期待値は tests/data/gen_le_adv_capture.py が表示する値。make test はリポジトリの
+ *J 最上位で実行するので、キャプチャは相対パスで開く。
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_le_scanner.h"
+#include "test_util.h"
+
+#define TEST_CAPTURE_PATH							"tests/data/le_adv_reports.h4"
+#define TEST_CAPTURE_EVENTS							(1502)
+#define TEST_CAPTURE_REPORTS						(1769)
+#define TEST_CAPTURE_EXTENDED						(30)
+#define TEST_CAPTURE_MALFORMED						(1)
+#define TEST_CAPTURE_HASH							(0x16ce10abU)
+#define TEST_CAPTURE_MAX_SIZE						(64 * 1024)
+
+#define TEST_PIPE_CHUNK								(100)	//J Event の途中で切れる大きさ
+#define TEST_IDLE_EVENTS							(3000)	//J リング (BT_LE_SCANNER_RING_SLOTS) より多い
+#define TEST_DESTROY_LIMIT_MS						(500)
+
+struct TestReplayResult
+{
+	uint64_t reports;
+	uint64_t extended;
+	uint32_t hash;
+	bool     timed_out;
+};
+
+static BtLeScannerContext    s_scanner;
+static BtLeAdvertisingReport s_reports[64];
+static uint8_t               s_capture[TEST_CAPTURE_MAX_SIZE];
+static size_t                s_capture_size;
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_fnv1a(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	for (size_t i=0 ; i<len ; ++i) {
+		hash = (hash ^ p[i]) * 0x01000193U;
+	}
+	return hash;
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 入力が終わるまで btLeScannerPoll() を続ける
+/*---------------------------------------------------------------------------*/
+static void _test_drain(TestReplayResult *result, const int timeout_ms)
+{
+	memset(result, 0x00, sizeof(TestReplayResult));
+	result->hash = 0x811C9DC5U;
+
+	while (1) {
+		size_t num_reports = 0;
+		int ret = btLeScannerPoll(&s_scanner, s_reports, sizeof(s_reports) / sizeof(s_reports[0]), num_reports, timeout_ms);
+		if (ret == (int)AKS_ERROR_TIMEOUT) {
+			result->timed_out = true;
+			return;
+		}
+		TEST_CHECK_EQ(AKS_OK, ret);
+		if ((ret != AKS_OK) || (num_reports == 0)) {
+			return;
+		}
+
+		for (size_t i=0 ; i<num_reports ; ++i) {
+			const BtLeAdvertisingReport *report = &s_reports[i];
+			uint8_t fields[14];
+			fields[0]  = (uint8_t)(report->event_type & 0xFF);
+			fields[1]  = (uint8_t)(report->event_type >> 8);
+			fields[2]  = report->address_type;
+			memcpy(&fields[3], report->address, sizeof(report->address));
+			fields[9]  = (uint8_t)report->rssi;
+			fields[10] = report->extended ? 1 : 0;
+			fields[11] = (uint8_t)(report->data_len & 0xFF);
+			fields[12] = (uint8_t)(report->data_len >> 8);
+			result->hash = _test_fnv1a(result->hash, fields, 13);
+			result->hash = _test_fnv1a(result->hash, report->data, report->data_len);
+			if (report->extended) {
+				result->extended++;
+			}
+		}
+		result->reports += num_reports;
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_check_capture(const char *name, const TestReplayResult *result)
+{
+	BtLeScannerStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btLeScannerGetStatistics(&s_scanner, &stats));
+
+	printf("  %s: events %llu, reports %llu (extended %llu), malformed %llu, dropped %llu, hash 0x%08x\n",
+			name,
+			(unsigned long long)stats.events,
+			(unsigned long long)result->reports,
+			(unsigned long long)result->extended,
+			(unsigned long long)stats.malformed,
+			(unsigned long long)stats.dropped,
+			result->hash);
+
+	TEST_CHECK(!result->timed_out);
+	TEST_CHECK_EQ(TEST_CAPTURE_EVENTS, stats.events);
+	TEST_CHECK_EQ(TEST_CAPTURE_REPORTS, stats.reports);
+	TEST_CHECK_EQ(TEST_CAPTURE_REPORTS, result->reports);
+	TEST_CHECK_EQ(TEST_CAPTURE_EXTENDED, result->extended);
+	TEST_CHECK_EQ(TEST_CAPTURE_MALFORMED, stats.malformed);
+	TEST_CHECK_EQ(0, stats.dropped);
+	TEST_CHECK_EQ(0, stats.truncated);
+	TEST_CHECK_EQ(TEST_CAPTURE_HASH, result->hash);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_replay_file(void)
+{
+	int fd = open(TEST_CAPTURE_PATH, O_RDONLY | O_CLOEXEC);
+	TEST_CHECK(fd >= 0);
+	if (fd < 0) {
+		return;
+	}
+
+	//J pipe のテスト用に中身も読んでおく
+	ssize_t size = read(fd, s_capture, sizeof(s_capture));
+	TEST_CHECK((size > 0) && ((size_t)size < sizeof(s_capture)));
+	s_capture_size = (size > 0) ? (size_t)size : 0;
+	(void)lseek(fd, 0, SEEK_SET);
+
+	TEST_CHECK_EQ(AKS_OK, btLeScannerCreateReplay(&s_scanner, fd));
+	TestReplayResult result;
+	_test_drain(&result, 1000);
+	_test_check_capture("file", &result);
+	TEST_CHECK_EQ(AKS_OK, btLeScannerDestroy(&s_scanner));
+	close(fd);
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void *_test_chunk_writer(void *arg)
+{
+	int fd = *(int *)arg;
+	for (size_t offset=0 ; offset<s_capture_size ; offset+=TEST_PIPE_CHUNK) {
+		size_t len = s_capture_size - offset;
+		if (len > TEST_PIPE_CHUNK) {
+			len = TEST_PIPE_CHUNK;
+		}
+		if (write(fd, s_capture + offset, len) != (ssize_t)len) {
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_replay_pipe(void)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, pipe(fds));
+
+	TEST_CHECK_EQ(AKS_OK, btLeScannerCreateReplay(&s_scanner, fds[0]));
+	pthread_t writer;
+	TEST_CHECK_EQ(0, pthread_create(&writer, NULL, _test_chunk_writer, &fds[1]));
+
+	TestReplayResult result;
+	_test_drain(&result, 1000);
+	pthread_join(writer, NULL);
+	_test_check_capture("pipe", &result);
+	TEST_CHECK_EQ(AKS_OK, btLeScannerDestroy(&s_scanner));
+	close(fds[0]);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J 1つずつ Report の入った Event を TEST_IDLE_EVENTS 個書く
+/*---------------------------------------------------------------------------*/
+static void _test_write_events(int fd)
+{
+	for (uint32_t k=0 ; k<TEST_IDLE_EVENTS ; ++k) {
+		uint8_t event[] = {
+			HCI_EVENT_PKT, EVT_LE_META_EVENT, 0,
+			0x02, 1,									//J LE Advertising Report, Num_Reports
+			0x00, 0x01, 0, 1, 2, 3, 4, (uint8_t)k,		//J Event_Type, Address_Type, Address
+			3, 0x02, 0x01, 0x06,						//J Data_Length, Flags
+			(uint8_t)-50,								//J RSSI
+		};
+		event[2] = (uint8_t)(sizeof(event) - 3);
+		TEST_CHECK_EQ(sizeof(event), write(fd, event, sizeof(event)));
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J リングが一杯になるまで書いて、書き手は閉じずに止まる
+/*---------------------------------------------------------------------------*/
+static void _test_idle_writer(void)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, pipe(fds));
+	TEST_CHECK_EQ(AKS_OK, btLeScannerCreateReplay(&s_scanner, fds[0]));
+	_test_write_events(fds[1]);
+
+	TestReplayResult result;
+	_test_drain(&result, 300);
+	TEST_CHECK(result.timed_out);
+	TEST_CHECK_EQ(TEST_IDLE_EVENTS, result.reports);
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, btLeScannerDestroy(&s_scanner));
+	uint64_t elapsed_ms = (btUtilGetMonotonicTimeNs() - start_ns) / 1000000;
+	printf("  idle writer: %llu reports, destroy %llu ms\n",
+			(unsigned long long)result.reports, (unsigned long long)elapsed_ms);
+	TEST_CHECK(elapsed_ms < TEST_DESTROY_LIMIT_MS);
+
+	close(fds[1]);
+	close(fds[0]);
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J btLeScannerPoll() しないので、Replay スレッドはリングが空くのを待ったままになる
+/*---------------------------------------------------------------------------*/
+static void _test_full_ring(void)
+{
+	int fds[2];
+	TEST_CHECK_EQ(0, pipe(fds));
+	TEST_CHECK_EQ(AKS_OK, btLeScannerCreateReplay(&s_scanner, fds[0]));
+	_test_write_events(fds[1]);
+
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 1000000000ULL;
+	while (!__atomic_load_n(&s_scanner.ring_waiting, __ATOMIC_SEQ_CST) && (btUtilGetMonotonicTimeNs() < deadline_ns)) {
+		usleep(1000);
+	}
+	TEST_CHECK(__atomic_load_n(&s_scanner.ring_waiting, __ATOMIC_SEQ_CST));
+	TEST_CHECK_EQ(BT_LE_SCANNER_RING_SLOTS, __atomic_load_n(&s_scanner.head, __ATOMIC_SEQ_CST));
+
+	uint64_t start_ns = btUtilGetMonotonicTimeNs();
+	TEST_CHECK_EQ(AKS_OK, btLeScannerDestroy(&s_scanner));
+	uint64_t elapsed_ms = (btUtilGetMonotonicTimeNs() - start_ns) / 1000000;
+	printf("  full ring: destroy %llu ms\n", (unsigned long long)elapsed_ms);
+	TEST_CHECK(elapsed_ms < TEST_DESTROY_LIMIT_MS);
+
+	close(fds[1]);
+	close(fds[0]);
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	_test_replay_file();
+	_test_replay_pipe();
+	_test_idle_writer();
+	_test_full_ring();
+
+	return test_result("scanner_replay");
+}
@@ -0,0 +1,208 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+
+/*
+ *J bt_signed_write_pipeline で複数の bt_le_emulator に Signed Write Command を送って確かめる
+ *J
+ *J - ワーカースレッドで並列に署名したバッチ (MAX_BATCH を越えて分割されるものも含む) でも、
+ *J   デバイスごとの SignCounter がバッチ内の順に連続して割り当てられること
+ *J - 各 Peripheral が全ての Signed Write を受け付け (署名が正しく、SignCounter が巻き戻らない)、
+ *J   最後に受け付けた SignCounter が割り当てた最後の値であること
+ *J   (受け付けた数と範囲が一致するので、SignCounter の順に抜けなく届いている)
+ *J - 最後に書かれた値がデバイスごとの最後の要求の値であること
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+
+#include "aks_error.h"
+#include "bt_att.h"
+#include "bt_util.h"
+#include "bt_gatt.h"
+#include "bt_crypto.h"
+#include "bt_le_device.h"
+#include "bt_le_emulator.h"
+#include "bt_signed_write_pipeline.h"
+#include "test_util.h"
+
+#define TEST_NUM_DEVICES							(4)
+#define TEST_NUM_WORKERS							(4)
+#define TEST_MTU									(64)
+#define TEST_BATCH									(192)		//J PARALLEL_MIN 以上
+#define TEST_NUM_BATCHES							(6)
+#define TEST_LARGE_BATCH							(BT_SIGNED_WRITE_PIPELINE_MAX_BATCH + 100)
+#define TEST_MAX_REQUESTS							(TEST_LARGE_BATCH)
+
+static BtLeEmulatorContext s_emus[TEST_NUM_DEVICES];
+static BtGattDeviceContext s_devs[TEST_NUM_DEVICES];
+static BtAttHandle         s_handles[TEST_NUM_DEVICES];
+static uint32_t            s_first_counters[TEST_NUM_DEVICES];
+
+static BtSignedWritePipeline s_pipe;
+static BtSignedWriteRequest  s_requests[TEST_MAX_REQUESTS];
+static uint32_t              s_values[TEST_MAX_REQUESTS];
+
+//J デバイスごとの次に割り当てられるはずの SignCounter、送った数、最後の値
+static uint32_t s_next_counters[TEST_NUM_DEVICES];
+static uint32_t s_num_sent[TEST_NUM_DEVICES];
+static uint32_t s_last_values[TEST_NUM_DEVICES];
+static uint32_t s_sequence = 0;
+static uint32_t s_rng = 0x9E3779B9;
+
+
+/*---------------------------------------------------------------------------*/
+static uint32_t _test_random(void)
+{
+	s_rng ^= s_rng << 13;
+	s_rng ^= s_rng >> 17;
+	s_rng ^= s_rng << 5;
+	return s_rng;
+}
+
+
+/*---------------------------------------------------------------------------*/
+static void _test_create_device(const uint32_t d)
+{
+	BtLeEmulatorLinkParameters link;
+	link.connection_interval_us = 7500;
+	link.packets_per_event      = 6;
+	link.ll_payload_size        = BT_LE_EMULATOR_LL_PAYLOAD_DLE;
+	link.mtu                    = TEST_MTU;
+	link.prepare_queue_size     = 0;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorCreate(&s_emus[d], &link));
+
+	uint32_t zero = 0;
+	BtAttHandle service;
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddPrimaryService(&s_emus[d], 0xFFF0, service));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorAddCharacteristic(&s_emus[d], 0xFFF1,
+								BtAttCharacteristicProperties::cWrite | BtAttCharacteristicProperties::cAuthenticatedSignedWrites,
+								&zero, sizeof(zero), s_handles[d]));
+
+	//J デバイスごとに別の CSRK と SignCounter の初期値
+	uint8_t csrk[BT_CRYPTO_KEY_SIZE];
+	for (uint32_t i=0 ; i<BT_CRYPTO_KEY_SIZE ; ++i) {
+		csrk[i] = (uint8_t)((d + 1) * 0x11 + i);
+	}
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorSetCsrk(&s_emus[d], csrk));
+	TEST_CHECK_EQ(AKS_OK, btLeEmulatorStart(&s_emus[d]));
+
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceCreateWithSocket(&s_devs[d], btLeEmulatorGetCentralSocket(&s_emus[d]), NULL));
+	s_first_counters[d] = d * 100000;
+	TEST_CHECK_EQ(AKS_OK, btLeDeviceSetCsrk(&s_devs[d], csrk, s_first_counters[d]));
+	s_next_counters[d] = s_first_counters[d];
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J デバイスをばらばらに混ぜたバッチを Submit し、SignCounter がバッチ内の順に連続していること
+/*---------------------------------------------------------------------------*/
+static void _test_submit(const size_t num_requests)
+{
+	uint32_t devices[TEST_MAX_REQUESTS];
+	for (size_t i=0 ; i<num_requests ; ++i) {
+		uint32_t d = _test_random() % TEST_NUM_DEVICES;
+		devices[i]   = d;
+		s_values[i]  = ++s_sequence;
+
+		s_requests[i].ctx          = &s_devs[d];
+		s_requests[i].handle       = s_handles[d];
+		s_requests[i].value        = (const uint8_t *)&s_values[i];
+		s_requests[i].value_len    = sizeof(s_values[i]);
+		s_requests[i].result       = AKS_ERROR_INVALID;
+		s_requests[i].sign_counter = 0;
+	}
+
+	TEST_CHECK_EQ(AKS_OK, btSignedWritePipelineSubmit(&s_pipe, s_requests, num_requests));
+
+	for (size_t i=0 ; i<num_requests ; ++i) {
+		uint32_t d = devices[i];
+		TEST_CHECK_EQ(AKS_OK, s_requests[i].result);
+		TEST_CHECK_EQ(s_next_counters[d], s_requests[i].sign_counter);
+		s_next_counters[d]++;
+		s_num_sent[d]++;
+		s_last_values[d] = s_values[i];
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+//J Peripheral が送った数だけ受け付けるまで待つ (2秒で諦める)
+/*---------------------------------------------------------------------------*/
+static void _test_wait_for_writes(const uint32_t d)
+{
+	uint64_t deadline_ns = btUtilGetMonotonicTimeNs() + 2000000000ULL;
+	while (btUtilGetMonotonicTimeNs() < deadline_ns) {
+		pthread_mutex_lock(&s_emus[d].mutex);
+		uint64_t done = s_emus[d].csrk.num_signed_writes + s_emus[d].csrk.num_rejected;
+		pthread_mutex_unlock(&s_emus[d].mutex);
+		if (done >= s_num_sent[d]) {
+			break;
+		}
+		usleep(10000);
+	}
+}
+
+
+/*---------------------------------------------------------------------------*/
+int main(void)
+{
+	for (uint32_t d=0 ; d<TEST_NUM_DEVICES ; ++d) {
+		_test_create_device(d);
+	}
+	TEST_CHECK_EQ(AKS_OK, btSignedWritePipelineCreate(&s_pipe, TEST_NUM_WORKERS));
+
+	for (uint32_t b=0 ; b<TEST_NUM_BATCHES ; ++b) {
+		_test_submit(TEST_BATCH);
+	}
+	//J MAX_BATCH ずつに分けて続けて署名する
+	_test_submit(TEST_LARGE_BATCH);
+
+	BtSignedWritePipelineStatistics stats;
+	TEST_CHECK_EQ(AKS_OK, btSignedWritePipelineGetStatistics(&s_pipe, &stats));
+	TEST_CHECK_EQ(TEST_NUM_BATCHES + 2, stats.batches);
+	TEST_CHECK_EQ(TEST_NUM_BATCHES * TEST_BATCH + TEST_LARGE_BATCH, stats.signed_pdus);
+
+	for (uint32_t d=0 ; d<TEST_NUM_DEVICES ; ++d) {
+		_test_wait_for_writes(d);
+
+		uint32_t sign_counter = 0;
+		TEST_CHECK_EQ(AKS_OK, btLeDeviceGetSignCounter(&s_devs[d], sign_counter));
+		TEST_CHECK_EQ(s_next_counters[d], sign_counter);
+
+		pthread_mutex_lock(&s_emus[d].mutex);
+		uint64_t accepted     = s_emus[d].csrk.num_signed_writes;
+		uint64_t rejected     = s_emus[d].csrk.num_rejected;
+		uint32_t last_counter = s_emus[d].csrk.last_counter;
+		pthread_mutex_unlock(&s_emus[d].mutex);
+
+		//J 受け付けた SignCounter は増え続けるので、数と最後の値が合えば順に全部届いている
+		TEST_CHECK_EQ(0, rejected);
+		TEST_CHECK_EQ(s_num_sent[d], accepted);
+		TEST_CHECK_EQ(s_first_counters[d] + s_num_sent[d] - 1, last_counter);
+
+		uint32_t value = 0;
+		size_t size = 0;
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorGetValue(&s_emus[d], s_handles[d], &value, sizeof(value), size));
+		TEST_CHECK_EQ(sizeof(value), size);
+		TEST_CHECK_EQ(s_last_values[d], value);
+
+		printf("  device %u: %u signed writes, counters %u-%u\n",
+								d, s_num_sent[d], s_first_counters[d], last_counter);
+	}
+
+	TEST_CHECK_EQ(AKS_OK, btSignedWritePipelineDestroy(&s_pipe));
+	for (uint32_t d=0 ; d<TEST_NUM_DEVICES ; ++d) {
+		TEST_CHECK_EQ(AKS_OK, btLeDeviceDestroy(&s_devs[d]));
+		TEST_CHECK_EQ(AKS_OK, btLeEmulatorDestroy(&s_emus[d]));
+	}
+
+	return test_result("signed_write_pipeline");
+}
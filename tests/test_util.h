@@ -0,0 +1,49 @@
+﻿/*
+ * Copyright 2016 Kiyotaka Akasaka
+ *
+ * Released under the MIT license
+ * http://opensource.org/licenses/mit-license.php
+ */
+#ifndef TEST_UTIL_H_
+#define TEST_UTIL_H_
+
+/*
+ *J tests/ の各プログラムで使う確認用マクロ
+ *J
+ *J 失敗した確認は式と行番号を表示して数え、main() は test_result() を返す。
+ *J make test は終了コードが 0 でないプログラムがあれば止まる。
+ */
+#include <stdio.h>
+
+static int s_test_failures = 0;
+
+#define TEST_CHECK(expr)																\
+	do {																				\
+		if (!(expr)) {																	\
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr);	\
+			s_test_failures++;															\
+		}																				\
+	} while (0)
+
+#define TEST_CHECK_EQ(expected, actual)													\
+	do {																				\
+		long long _e = (long long)(expected);											\
+		long long _a = (long long)(actual);												\
+		if (_e != _a) {																	\
+			fprintf(stderr, "%s:%d: check failed: %s == %s (0x%llx != 0x%llx)\n",		\
+					__FILE__, __LINE__, #expected, #actual, _e, _a);					\
+			s_test_failures++;															\
+		}																				\
+	} while (0)
+
+static inline int test_result(const char *name)
+{
+	if (s_test_failures != 0) {
+		printf("%s: %d check(s) failed\n", name, s_test_failures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+#endif/*TEST_UTIL_H_*/